@@ -0,0 +1,830 @@
+/**
+ * fanotify.c from Lsyncd - Live (Mirror) Syncing Demon
+ *
+ * License: GPLv2 (see COPYING) or any later version
+ *
+ * Authors: Axel Kittenberger <axkibe@gmail.com>
+ *
+ * -----------------------------------------------------------------------
+ *
+ * Event interface for Lsyncd to Linux´ fanotify.
+ *
+ * Uses one filesystem wide mark per filesystem a sync root lies on.
+ * The kernel reports events with the file handle of the directory and
+ * the name of the entry (FAN_REPORT_DFID_NAME, Linux >= 5.9).
+ * Directory handles are resolved to paths by open_by_handle_at() and
+ * cached. Other than inotify no watch per directory is needed, thus
+ * there is no startup crawl and no max_user_watches limit.
+ *
+ * Filesystem marks need CAP_SYS_ADMIN, resolving handles needs
+ * CAP_DAC_READ_SEARCH.
+ */
+
+/* open_by_handle_at() and struct file_handle */
+#define _GNU_SOURCE 1
+
+#include "lsyncd.h"
+
+#ifndef HAVE_SYS_FANOTIFY_H
+#  error Missing <sys/fanotify.h>; supply kernel-headers and rerun configure.
+#endif
+
+#include <sys/fanotify.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+
+/*-----------------------------------------------------------------------------
+ * Event types.
+ */
+static const char * ATTRIB = "Attrib";
+static const char * MODIFY = "Modify";
+static const char * CREATE = "Create";
+static const char * DELETE = "Delete";
+static const char * MOVE   = "Move";
+
+/**
+ * The fanotify file descriptor.
+ */
+static int fanotify_fd = -1;
+
+/**
+ * errno of fanotify_init() if it failed.
+ */
+static int fanotify_errno = 0;
+
+/**
+ * Fanotify events every mark listens to.
+ * Directory entry events are always needed.
+ */
+static const uint64_t standard_event_mask =
+		FAN_CREATE | FAN_DELETE | FAN_ONDIR;
+
+/**
+ * True if the kernel reports renames as one event with the
+ * old and the new directory handle and name (Linux >= 5.17).
+ * Otherwise moves are reported as MOVED_FROM and MOVED_TO which
+ * cannot be paired, they become Deletes and Creates.
+ */
+static bool have_rename = true;
+
+/**
+ * A filesystem a sync root lies on.
+ */
+struct filesystem {
+	/* the filesystem id as reported in events */
+	int fsid[2];
+
+	/* file descriptor of the first sync root on it,
+	 * used to open handles */
+	int fd;
+
+	/* the events marked */
+	uint64_t mask;
+};
+
+static struct filesystem *filesystems = NULL;
+static int filesystems_count = 0;
+static int filesystems_size = 0;
+
+/**
+ * The sync roots, events no sync is concerned about are dropped
+ * before reaching the runner.
+ */
+static struct sync_root *sync_roots = NULL;
+static int sync_roots_count = 0;
+static int sync_roots_size = 0;
+
+/**
+ * A cached directory handle.
+ */
+struct dir_handle {
+	/* the filesystem id */
+	int fsid[2];
+
+	/* the kernels file handle of the directory */
+	struct file_handle *handle;
+
+	/* the absolute path with trailing slash */
+	char *path;
+
+	/* next in hash bucket */
+	struct dir_handle *next;
+};
+
+/**
+ * The directory handle cache, a hash table.
+ */
+static struct dir_handle **handles = NULL;
+static size_t handles_size = 0;
+static size_t handles_count = 0;
+
+/**
+ * The cache is cleared when growing beyond this.
+ */
+#define HANDLES_MAX 65536
+
+/**
+ * Statistics.
+ */
+static unsigned long handle_hits = 0;
+static unsigned long handle_misses = 0;
+static unsigned long handle_stale = 0;
+static unsigned long events_excluded = 0;
+static unsigned long events_foreign = 0;
+
+/**
+ * Buffers for the paths of an event.
+ */
+static char *pathbuf = NULL;
+static size_t pathbuf_size = 0;
+static char *pathbuf2 = NULL;
+static size_t pathbuf2_size = 0;
+
+/**
+ * Returns the hash of a directory handle.
+ */
+static size_t
+handle_hash(const int *fsid, const struct file_handle *fh)
+{
+	const unsigned char *c = fh->f_handle;
+	size_t h = 2166136261u ^ fsid[0] ^ ((size_t) fsid[1] << 7) ^
+		(size_t) fh->handle_type;
+	unsigned int i;
+	for (i = 0; i < fh->handle_bytes; i++) {
+		h = (h ^ c[i]) * 16777619u;
+	}
+	return h;
+}
+
+/**
+ * Returns true if the cached entry 'e' matches the handle.
+ */
+static bool
+handle_equals(const struct dir_handle *e,
+              const int *fsid,
+              const struct file_handle *fh)
+{
+	return e->fsid[0] == fsid[0] && e->fsid[1] == fsid[1] &&
+		e->handle->handle_type == fh->handle_type &&
+		e->handle->handle_bytes == fh->handle_bytes &&
+		!memcmp(e->handle->f_handle, fh->f_handle, fh->handle_bytes);
+}
+
+/**
+ * Empties the directory handle cache.
+ */
+static void
+clear_handles(void)
+{
+	size_t i;
+	for (i = 0; i < handles_size; i++) {
+		struct dir_handle *e = handles[i];
+		while (e) {
+			struct dir_handle *n = e->next;
+			free(e->handle);
+			free(e->path);
+			free(e);
+			e = n;
+		}
+		handles[i] = NULL;
+	}
+	handles_count = 0;
+}
+
+/**
+ * Puts a directory handle with its path into the cache.
+ */
+static void
+cache_handle(const int *fsid, const struct file_handle *fh, const char *path)
+{
+	struct dir_handle *e;
+	size_t hs = sizeof(struct file_handle) + fh->handle_bytes;
+	if (handles_count >= HANDLES_MAX) {
+		clear_handles();
+	}
+	if (handles_count >= handles_size) {
+		/* grows and rehashes */
+		size_t ns = handles_size ? handles_size * 2 : 256;
+		struct dir_handle **nh = s_calloc(ns, sizeof(struct dir_handle *));
+		size_t i;
+		for (i = 0; i < handles_size; i++) {
+			while (handles[i]) {
+				struct dir_handle *m = handles[i];
+				size_t b = handle_hash(m->fsid, m->handle) & (ns - 1);
+				handles[i] = m->next;
+				m->next = nh[b];
+				nh[b] = m;
+			}
+		}
+		free(handles);
+		handles = nh;
+		handles_size = ns;
+	}
+	e = s_malloc(sizeof(struct dir_handle));
+	e->fsid[0] = fsid[0];
+	e->fsid[1] = fsid[1];
+	e->handle = s_malloc(hs);
+	memcpy(e->handle, fh, hs);
+	e->path = s_strdup(path);
+	{
+		size_t b = handle_hash(fsid, fh) & (handles_size - 1);
+		e->next = handles[b];
+		handles[b] = e;
+	}
+	handles_count++;
+}
+
+/**
+ * Drops the directory 'path' (with trailing slash) and all
+ * directories below it from the cache, since it has been moved or
+ * deleted.
+ */
+static void
+uncache_path(const char *path)
+{
+	size_t len = strlen(path);
+	size_t i;
+	for (i = 0; i < handles_size; i++) {
+		struct dir_handle **pe = &handles[i];
+		while (*pe) {
+			struct dir_handle *e = *pe;
+			if (strncmp(e->path, path, len)) {
+				pe = &e->next;
+				continue;
+			}
+			*pe = e->next;
+			free(e->handle);
+			free(e->path);
+			free(e);
+			handles_count--;
+		}
+	}
+}
+
+/**
+ * Returns the filesystem with 'fsid' or NULL.
+ */
+static struct filesystem *
+find_filesystem(const int *fsid)
+{
+	int i;
+	for (i = 0; i < filesystems_count; i++) {
+		if (filesystems[i].fsid[0] == fsid[0] &&
+		    filesystems[i].fsid[1] == fsid[1])
+		{
+			return &filesystems[i];
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Returns the absolute path with trailing slash of a directory handle
+ * or NULL if the directory is gone.
+ */
+static const char *
+resolve_handle(lua_State *L, const int *fsid, struct file_handle *fh)
+{
+	static char link[PATH_MAX + 2];
+	struct filesystem *fs;
+	struct dir_handle *e;
+	char proc[64];
+	ssize_t len;
+	int fd;
+	if (handles_size) {
+		e = handles[handle_hash(fsid, fh) & (handles_size - 1)];
+		for (; e; e = e->next) {
+			if (handle_equals(e, fsid, fh)) {
+				handle_hits++;
+				return e->path;
+			}
+		}
+	}
+	handle_misses++;
+	fs = find_filesystem(fsid);
+	if (!fs) {
+		return NULL;
+	}
+	fd = open_by_handle_at(fs->fd, fh, O_PATH);
+	if (fd < 0) {
+		if (errno != ESTALE) {
+			printlogf(L, "Error",
+				"Cannot open directory handle (%d:%s)",
+				errno, strerror(errno));
+		}
+		handle_stale++;
+		return NULL;
+	}
+	snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+	len = readlink(proc, link, PATH_MAX);
+	close(fd);
+	if (len <= 0 || link[0] != '/') {
+		handle_stale++;
+		return NULL;
+	}
+	link[len] = 0;
+	if (len > 10 && !strcmp(link + len - 10, " (deleted)")) {
+		handle_stale++;
+		return NULL;
+	}
+	if (link[len - 1] != '/') {
+		link[len++] = '/';
+		link[len] = 0;
+	}
+	cache_handle(fsid, fh, link);
+	return link;
+}
+
+/**
+ * Writes the path of the entry 'name' in the directory 'dir'
+ * into a growing buffer.
+ *
+ * @return the path without trailing slash.
+ */
+static const char *
+join_path(char **buf, size_t *size, const char *dir, const char *name)
+{
+	size_t dl = strlen(dir);
+	size_t nl = strlen(name);
+	if (!strcmp(name, ".")) {
+		/* an event of the directory itself */
+		nl = 0;
+	}
+	if (dl + nl + 2 > *size) {
+		*size = dl + nl + 2;
+		*buf = s_realloc(*buf, *size);
+	}
+	memcpy(*buf, dir, dl);
+	memcpy(*buf + dl, name, nl);
+	if (!nl && dl > 1) {
+		dl--;
+	}
+	(*buf)[dl + nl] = 0;
+	return *buf;
+}
+
+/**
+ * Returns true if some sync is concerned about 'path' and does not
+ * exclude it. Counts the dropped events.
+ */
+static bool
+concerned(const char *path, bool isdir)
+{
+	switch (match_sync_roots(sync_roots, sync_roots_count, path, isdir)) {
+	case ROOT_WANTED:
+		return true;
+	case ROOT_EXCLUDED:
+		events_excluded++;
+		return false;
+	default:
+		events_foreign++;
+		return false;
+	}
+}
+
+/**
+ * Sends one event to the runner.
+ *
+ * @param etype  event type
+ * @param isdir  true if the event relates to a directory
+ * @param path   absolute path
+ * @param path2  for moves the absolute destination path
+ */
+static void
+send_event(lua_State *L,
+           const char *etype,
+           bool isdir,
+           const char *path,
+           const char *path2)
+{
+	load_runner_func(L, "fanotifyEvent");
+	lua_pushstring(L, etype);
+	lua_pushboolean(L, isdir);
+	l_now(L);
+	lua_pushstring(L, path);
+	if (path2) {
+		lua_pushstring(L, path2);
+	} else {
+		lua_pushnil(L);
+	}
+	if (lua_pcall(L, 5, 0, -7)) {
+		exit(-1); // ERRNO
+	}
+	lua_pop(L, 1);
+}
+
+/**
+ * Handles one fanotify event.
+ *
+ * @param meta   the event
+ * @param fid    the directory handle info, for renames the old one
+ * @param fid2   for renames the new directory handle info
+ */
+static void
+handle_event(lua_State *L,
+             struct fanotify_event_metadata *meta,
+             struct fanotify_event_info_fid *fid,
+             struct fanotify_event_info_fid *fid2)
+{
+	uint64_t mask = meta->mask;
+	bool isdir = (mask & FAN_ONDIR) != 0;
+	struct file_handle *fh = (struct file_handle *) fid->handle;
+	const char *name = (const char *) fh->f_handle + fh->handle_bytes;
+	const char *dir;
+	const char *path;
+
+	dir = resolve_handle(L, (int *) &fid->fsid, fh);
+	if (!dir) {
+		/* this is normal for events in deleted directories */
+		printlogf(L, "Fanotify", "event in a vanished directory");
+		return;
+	}
+	path = join_path(&pathbuf, &pathbuf_size, dir, name);
+
+	if (mask & FAN_RENAME) {
+		const char *path2 = NULL;
+		bool c1, c2;
+		if (fid2) {
+			struct file_handle *fh2 = (struct file_handle *) fid2->handle;
+			const char *name2 = (const char *) fh2->f_handle +
+				fh2->handle_bytes;
+			const char *dir2 = resolve_handle(L, (int *) &fid2->fsid, fh2);
+			if (dir2) {
+				path2 = join_path(&pathbuf2, &pathbuf2_size, dir2, name2);
+			}
+		}
+		if (isdir) {
+			/* the cached paths below the old one are invalid now */
+			size_t len = strlen(path);
+			pathbuf[len] = '/';
+			pathbuf[len + 1] = 0;
+			uncache_path(pathbuf);
+			pathbuf[len] = 0;
+		}
+		c1 = concerned(path, isdir);
+		c2 = path2 && concerned(path2, isdir);
+		if (c1 && c2) {
+			send_event(L, MOVE, isdir, path, path2);
+		} else if (c1) {
+			send_event(L, DELETE, isdir, path, NULL);
+		} else if (c2) {
+			send_event(L, CREATE, isdir, path2, NULL);
+		}
+		return;
+	}
+
+	if ((mask & (FAN_DELETE | FAN_MOVED_FROM)) && isdir) {
+		size_t len = strlen(path);
+		pathbuf[len] = '/';
+		pathbuf[len + 1] = 0;
+		uncache_path(pathbuf);
+		pathbuf[len] = 0;
+	}
+	if (!concerned(path, isdir)) {
+		return;
+	}
+	if ((mask & (FAN_CREATE | FAN_MOVED_TO)) &&
+	    (mask & (FAN_DELETE | FAN_MOVED_FROM)))
+	{
+		/* the kernel merged a create and a delete, orders them
+		 * by what is there now. */
+		struct stat st;
+		if (lstat(path, &st)) {
+			send_event(L, CREATE, isdir, path, NULL);
+			send_event(L, DELETE, isdir, path, NULL);
+		} else {
+			send_event(L, DELETE, isdir, path, NULL);
+			send_event(L, CREATE, isdir, path, NULL);
+		}
+		return;
+	}
+	if (mask & (FAN_CREATE | FAN_MOVED_TO)) {
+		send_event(L, CREATE, isdir, path, NULL);
+	}
+	if (mask & FAN_ATTRIB) {
+		send_event(L, ATTRIB, isdir, path, NULL);
+	}
+	if (mask & (FAN_MODIFY | FAN_CLOSE_WRITE)) {
+		send_event(L, MODIFY, isdir, path, NULL);
+	}
+	if (mask & (FAN_DELETE | FAN_MOVED_FROM)) {
+		send_event(L, DELETE, isdir, path, NULL);
+	}
+}
+
+/**
+ * buffer to read fanotify events into
+ */
+static size_t readbuf_size = 8192;
+static char * readbuf = NULL;
+
+/**
+ * Called by function pointer from when the fanotify file descriptor
+ * became ready. Reads it contents and forward all received events
+ * to the runner.
+ */
+static void
+fanotify_ready(lua_State *L, struct observance *obs)
+{
+	ssize_t len;
+	struct fanotify_event_metadata *meta;
+	if (obs->fd != fanotify_fd) {
+		logstring("Error", "Internal, fanotify_fd != ob->fd");
+		exit(-1); // ERRNO
+	}
+	len = read(fanotify_fd, readbuf, readbuf_size);
+	if (len < 0) {
+		if (errno == EAGAIN) {
+			return;
+		}
+		printlogf(L, "Error", "Read fail on fanotify");
+		exit(-1); // ERRNO
+	}
+	meta = (struct fanotify_event_metadata *) readbuf;
+	for (; FAN_EVENT_OK(meta, len) && !hup && !term;
+	     meta = FAN_EVENT_NEXT(meta, len))
+	{
+		struct fanotify_event_info_fid *fid = NULL;
+		struct fanotify_event_info_fid *fid2 = NULL;
+		size_t off;
+		if (meta->vers != FANOTIFY_METADATA_VERSION) {
+			logstring("Error", "Fanotify metadata version mismatch.");
+			exit(-1); // ERRNO
+		}
+		if (meta->fd >= 0) {
+			/* not used with handle reporting, but be safe */
+			close(meta->fd);
+		}
+		if (meta->mask & FAN_Q_OVERFLOW) {
+			/* and overflow happened, tells the runner */
+			load_runner_func(L, "overflow");
+			if (lua_pcall(L, 0, 0, -2)) {
+				exit(-1); // ERRNO
+			}
+			lua_pop(L, 1);
+			hup = 1;
+			return;
+		}
+		for (off = meta->metadata_len; off < meta->event_len; ) {
+			struct fanotify_event_info_fid *f =
+				(struct fanotify_event_info_fid *) ((char *) meta + off);
+			switch (f->hdr.info_type) {
+			case FAN_EVENT_INFO_TYPE_DFID_NAME :
+			case FAN_EVENT_INFO_TYPE_OLD_DFID_NAME :
+				fid = f;
+				break;
+			case FAN_EVENT_INFO_TYPE_NEW_DFID_NAME :
+				fid2 = f;
+				break;
+			}
+			if (!f->hdr.len) {
+				break;
+			}
+			off += f->hdr.len;
+		}
+		if (!fid) {
+			continue;
+		}
+		handle_event(L, meta, fid, fid2);
+	}
+}
+
+/**
+ * Tells the core about the root and excludes of a sync and marks
+ * the filesystem it lies on.
+ *
+ * @param path     (Lua stack) absolute path of the sync root
+ * @param excludes (Lua stack) excludes userdata of the sync
+ * @param imode    (Lua stack) inotify mode, "Modify" reports every
+ *                             write, otherwise writes are reported
+ *                             on closing.
+ * @param events   (Lua stack) table of event types wanted for files
+ */
+static int
+l_addsync(lua_State *L)
+{
+	const char *path = luaL_checkstring(L, 1);
+	struct excludes *ex = check_excludes(L, 2);
+	const char *imode = luaL_checkstring(L, 3);
+	uint64_t mask = standard_event_mask;
+	struct filesystem *fs;
+	struct statfs sfs;
+	int fd;
+
+	if (fanotify_fd < 0) {
+		printlogf(L, "Error",
+			"Cannot access fanotify monitor! (%d:%s)",
+			fanotify_errno, strerror(fanotify_errno));
+		exit(-1); // ERRNO
+	}
+
+	if (lua_istable(L, 4)) {
+		lua_getfield(L, 4, ATTRIB);
+		if (lua_toboolean(L, -1)) {
+			mask |= FAN_ATTRIB;
+		}
+		lua_getfield(L, 4, MODIFY);
+		if (lua_toboolean(L, -1)) {
+			mask |= strcmp(imode, "Modify") ? FAN_CLOSE_WRITE : FAN_MODIFY;
+		}
+		lua_pop(L, 2);
+	} else {
+		mask |= FAN_ATTRIB |
+			(strcmp(imode, "Modify") ? FAN_CLOSE_WRITE : FAN_MODIFY);
+	}
+
+	/* keeps the excludes from being collected */
+	lua_pushvalue(L, 2);
+	luaL_ref(L, LUA_REGISTRYINDEX);
+	if (sync_roots_count >= sync_roots_size) {
+		sync_roots_size = sync_roots_size ? sync_roots_size * 2 : 4;
+		sync_roots = s_realloc(sync_roots,
+			sync_roots_size * sizeof(struct sync_root));
+	}
+	sync_roots[sync_roots_count].path = s_strdup(path);
+	sync_roots[sync_roots_count].len = strlen(path);
+	sync_roots[sync_roots_count].excludes = ex;
+	sync_roots_count++;
+
+	fd = open(path, O_RDONLY | O_DIRECTORY);
+	if (fd < 0 || fstatfs(fd, &sfs)) {
+		printlogf(L, "Error", "Cannot open %s (%d:%s)",
+			path, errno, strerror(errno));
+		exit(-1); // ERRNO
+	}
+	close_exec_fd(fd);
+	fs = find_filesystem((int *) &sfs.f_fsid);
+	if (fs) {
+		close(fd);
+		if ((fs->mask | mask) == fs->mask) {
+			return 0;
+		}
+	} else {
+		if (filesystems_count >= filesystems_size) {
+			filesystems_size = filesystems_size ? filesystems_size * 2 : 4;
+			filesystems = s_realloc(filesystems,
+				filesystems_size * sizeof(struct filesystem));
+		}
+		fs = &filesystems[filesystems_count++];
+		memcpy(fs->fsid, &sfs.f_fsid, sizeof(fs->fsid));
+		fs->fd = fd;
+		fs->mask = 0;
+	}
+	fs->mask |= mask;
+
+	while (true) {
+		uint64_t m = fs->mask |
+			(have_rename ? FAN_RENAME : FAN_MOVED_FROM | FAN_MOVED_TO);
+		if (!fanotify_mark(fanotify_fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+			m, AT_FDCWD, path))
+		{
+			break;
+		}
+		if (errno == EINVAL && have_rename) {
+			/* kernel < 5.17, moves cannot be paired */
+			printlogf(L, "Normal",
+				"Fanotify without rename events, moves become "
+				"deletes and creates.");
+			have_rename = false;
+			continue;
+		}
+		printlogf(L, "Error",
+			"Cannot mark the filesystem of %s (%d:%s)",
+			path, errno, strerror(errno));
+		exit(-1); // ERRNO
+	}
+	printlogf(L, "Fanotify", "marked filesystem of %s", path);
+	return 0;
+}
+
+/**
+ * Returns a table of fanotify core statistics.
+ */
+static int
+l_stats(lua_State *L)
+{
+	lua_newtable(L);
+	lua_pushnumber(L, filesystems_count);
+	lua_setfield(L, -2, "filesystems");
+	lua_pushnumber(L, handles_count);
+	lua_setfield(L, -2, "handlesCached");
+	lua_pushnumber(L, handle_hits);
+	lua_setfield(L, -2, "handleHits");
+	lua_pushnumber(L, handle_misses);
+	lua_setfield(L, -2, "handleMisses");
+	lua_pushnumber(L, handle_stale);
+	lua_setfield(L, -2, "handlesStale");
+	lua_pushnumber(L, events_excluded);
+	lua_setfield(L, -2, "eventsExcluded");
+	lua_pushnumber(L, events_foreign);
+	lua_setfield(L, -2, "eventsForeign");
+	lua_pushboolean(L, have_rename);
+	lua_setfield(L, -2, "renames");
+	return 1;
+}
+
+/**
+ * Cores fanotify functions.
+ */
+static const luaL_reg lfanotifylib[] = {
+		{"addsync",    l_addsync    },
+		{"stats",      l_stats      },
+		{NULL, NULL}
+};
+
+/**
+ * registers fanotify functions.
+ */
+extern void
+register_fanotify(lua_State *L)
+{
+	lua_pushstring(L, "fanotify");
+	luaL_register(L, "fanotify", lfanotifylib);
+}
+
+/**
+ * closes fanotify
+ */
+static void
+fanotify_tidy(struct observance *obs)
+{
+	int i;
+	if (obs->fd != fanotify_fd) {
+		logstring("Error", "Internal, fanotify_fd != ob->fd");
+		exit(-1); // ERRNO
+	}
+	close(fanotify_fd);
+	fanotify_fd = -1;
+	free(readbuf);
+	readbuf = NULL;
+	clear_handles();
+	free(handles);
+	handles = NULL;
+	handles_size = 0;
+	for (i = 0; i < filesystems_count; i++) {
+		close(filesystems[i].fd);
+	}
+	free(filesystems);
+	filesystems = NULL;
+	filesystems_count = filesystems_size = 0;
+	/* the excludes userdata go with the Lua state */
+	for (i = 0; i < sync_roots_count; i++) {
+		free(sync_roots[i].path);
+	}
+	free(sync_roots);
+	sync_roots = NULL;
+	sync_roots_count = sync_roots_size = 0;
+	free(pathbuf);
+	pathbuf = NULL;
+	pathbuf_size = 0;
+	free(pathbuf2);
+	pathbuf2 = NULL;
+	pathbuf2_size = 0;
+}
+
+/**
+ * opens and initalizes fanotify.
+ *
+ * Failing is not fatal here, since without privileges fanotify is not
+ * available, while inotify is. Using it for a sync is.
+ */
+extern void
+open_fanotify(lua_State *L)
+{
+	if (readbuf) {
+		logstring("Error",
+			"internal fail, fanotify readbuf!=NULL in open_fanotify()")
+		exit(-1); // ERRNO
+	}
+	handle_hits = handle_misses = handle_stale = 0;
+	events_excluded = events_foreign = 0;
+	have_rename = true;
+
+	fanotify_fd = fanotify_init(
+		FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME | FAN_CLOEXEC | FAN_NONBLOCK,
+		O_RDONLY | O_LARGEFILE);
+	if (fanotify_fd < 0) {
+		fanotify_errno = errno;
+		printlogf(L, "Fanotify",
+			"Cannot access fanotify monitor! (%d:%s)",
+			errno, strerror(errno));
+		return;
+	}
+	printlogf(L, "Fanotify", "fanotify fd = %d", fanotify_fd);
+	readbuf = s_malloc(readbuf_size);
+	observe_fd(fanotify_fd, fanotify_ready, NULL, fanotify_tidy, NULL);
+}
@@ -35,6 +35,10 @@
 #include <time.h>
 #include <unistd.h>
 
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
 #include <lua.h>
 #include <lualib.h>
 #include <lauxlib.h>
@@ -54,42 +58,639 @@ static const char * MOVE   = "Move";
 static int inotify_fd = -1;
 
 /**
- * Standard inotify events to listen to.
+ * Inotify events every watch listens to. 
+ * Directories must always be tracked to keep the watches up to date.
  */
 static const uint32_t standard_event_mask = 
-		IN_ATTRIB   | IN_CLOSE_WRITE | IN_CREATE     |
-		IN_DELETE   | IN_DELETE_SELF | IN_MOVED_FROM |
-		IN_MOVED_TO | IN_DONT_FOLLOW | IN_ONLYDIR;
+		IN_CREATE     | IN_DELETE   | IN_DELETE_SELF | 
+		IN_MOVED_FROM | IN_MOVED_TO | IN_DONT_FOLLOW | 
+		IN_ONLYDIR;
 
+/**
+ * Event types a watch can want, as bits.
+ */
+enum {
+	WANT_ATTRIB = 0x01,
+	WANT_MODIFY = 0x02,
+	WANT_CREATE = 0x04,
+	WANT_DELETE = 0x08,
+	WANT_MOVE   = 0x10,
+	WANT_ALL    = 0x1f,
+};
 
 /**
- * Adds an inotify watch
- * 
- * @param dir         (Lua stack) path to directory
- * @param inotifyMode (Lua stack) path to directory
- * @return            (Lua stack) numeric watch descriptor
+ * Maps event type names to want bits.
+ */
+static const struct {
+	const char *name;
+	int bit;
+} want_names[] = {
+	{ "Attrib", WANT_ATTRIB },
+	{ "Modify", WANT_MODIFY },
+	{ "Create", WANT_CREATE },
+	{ "Delete", WANT_DELETE },
+	{ "Move",   WANT_MOVE   },
+	{ NULL, 0 }
+};
+
+/**
+ * Core information about a watch descriptor.
+ *
+ * The watches form a tree of directories. Every node only knows its 
+ * parent and its own name, absolute paths are built when needed.
+ * Roots have no parent and carry their full absolute path as name.
+ */
+struct watch {
+	/* true if the watch is live */
+	bool used;
+
+	/* the event types any sync wants for files in this directory */
+	int wants;
+
+	/* true if inotifyMode is "CloseWrite after Modify".
+	 * A CLOSE_WRITE is only a Modify if something has been written. */
+	bool after_modify;
+
+	/* when the last event happened in this directory, 
+	 * or it has been watched */
+	clock_t active;
+
+	/* the rescan that last found this directory, see rescan_dir() */
+	unsigned long seen;
+
+	/* device and inode, to recognize the directory when it reappears 
+	 * after a move that could not be paired */
+	dev_t dev;
+	ino_t ino;
+
+	/* wd of parent directory, -1 for roots */
+	int parent;
+
+	/* wd of first child, -1 if none */
+	int child;
+
+	/* wds of previous and next sibling, -1 if none */
+	int prev;
+	int next;
+
+	/* next wd in the same bucket of the name hash */
+	int hnext;
+
+	/* name relative to parent, or absolute path with trailing 
+	 * slash for roots */
+	char *name;
+};
+
+/**
+ * Watches indexed by watch descriptor.
+ */
+static struct watch *watches = NULL;
+static int watches_size = 0;
+
+/**
+ * Number of live watches.
+ */
+static int watches_count = 0;
+
+/**
+ * First root of the watch tree, siblings are further roots.
+ */
+static int first_root = -1;
+
+/**
+ * Hash of the nodes by parent and name, yielding the first wd 
+ * of a bucket. Its size is always a power of 2.
+ */
+static int *names = NULL;
+static int names_size = 0;
+
+/**
+ * Memory of the names in the watch tree.
+ */
+static size_t names_memory = 0;
+
+/**
+ * Number of moved directories whose nodes have been relinked.
+ */
+static unsigned long dirs_moved = 0;
+
+/**
+ * When the events being handled have been read.
+ */
+static clock_t read_time = 0;
+
+/**
+ * Buffer paths are built into.
+ */
+static char *pathbuf = NULL;
+static size_t pathbuf_size = 0;
+
+/**
+ * The sync roots, events all syncs exclude are dropped
+ * before reaching the runner.
+ */
+static struct sync_root *sync_roots = NULL;
+static int sync_roots_count = 0;
+static int sync_roots_size = 0;
+
+/**
+ * Counts events dropped since excluded.
+ */
+static unsigned long events_excluded = 0;
+
+/**
+ * Counts file events no sync wanted.
+ */
+static unsigned long events_dropped = 0;
+
+/**
+ * A file that has been written to since it has been last closed.
+ * Used by the "CloseWrite after Modify" inotifyMode.
+ */
+struct written {
+	/* next in hash bucket */
+	struct written *next;
+
+	/* watch descriptor of the directory */
+	int wd;
+
+	/* file name relative to wd */
+	char name[];
+};
+
+/**
+ * Hash table of written files, its size is always a power of 2.
+ */
+static struct written **writtens = NULL;
+static size_t writtens_size  = 0;
+static size_t writtens_count = 0;
+
+/**
+ * Hashes a wd/name pair.
+ */
+static size_t
+written_hash(int wd, const char *name)
+{
+	/* FNV-1a */
+	uint32_t h = 2166136261u ^ (uint32_t) wd;
+	for(; *name; name++) {
+		h = (h ^ (unsigned char) *name) * 16777619u;
+	}
+	return h;
+}
+
+/**
+ * Returns the pointer pointing to the entry of wd/name. 
+ * This pointer points to NULL if there is no such entry.
+ */
+static struct written **
+find_written(int wd, const char *name)
+{
+	struct written **pw;
+	if (!writtens) {
+		return NULL;
+	}
+	pw = &writtens[written_hash(wd, name) & (writtens_size - 1)];
+	while (*pw && ((*pw)->wd != wd || strcmp((*pw)->name, name))) {
+		pw = &(*pw)->next;
+	}
+	return pw;
+}
+
+/**
+ * Remembers wd/name has been written to.
+ */
+static void
+add_written(int wd, const char *name)
+{
+	struct written **pw = find_written(wd, name);
+	struct written *w;
+	if (pw && *pw) {
+		/* already known */
+		return;
+	}
+	if (writtens_count >= writtens_size) {
+		/* grows the table */
+		size_t ns = writtens_size ? writtens_size * 2 : 64;
+		struct written **nt = s_calloc(ns, sizeof(struct written *));
+		size_t i;
+		for (i = 0; i < writtens_size; i++) {
+			while (writtens[i]) {
+				struct written *m = writtens[i];
+				size_t h = written_hash(m->wd, m->name) & (ns - 1);
+				writtens[i] = m->next;
+				m->next = nt[h];
+				nt[h] = m;
+			}
+		}
+		free(writtens);
+		writtens = nt;
+		writtens_size = ns;
+	}
+	w = s_malloc(sizeof(struct written) + strlen(name) + 1);
+	w->wd = wd;
+	strcpy(w->name, name);
+	pw = &writtens[written_hash(wd, name) & (writtens_size - 1)];
+	w->next = *pw;
+	*pw = w;
+	writtens_count++;
+}
+
+/**
+ * Forgets wd/name has been written to.
+ *
+ * @return true if wd/name has been written to.
+ */
+static bool
+remove_written(int wd, const char *name)
+{
+	struct written **pw = find_written(wd, name);
+	struct written *w;
+	if (!pw || !*pw) {
+		return false;
+	}
+	w = *pw;
+	*pw = w->next;
+	free(w);
+	writtens_count--;
+	return true;
+}
+
+/**
+ * Forgets all written files of a watch descriptor, 
+ * or all of them if wd is negative.
+ */
+static void
+clear_writtens(int wd)
+{
+	size_t i;
+	for (i = 0; writtens_count && i < writtens_size; i++) {
+		struct written **pw = &writtens[i];
+		while (*pw) {
+			if (wd < 0 || (*pw)->wd == wd) {
+				struct written *w = *pw;
+				*pw = w->next;
+				free(w);
+				writtens_count--;
+			} else {
+				pw = &(*pw)->next;
+			}
+		}
+	}
+}
+
+/**
+ * Watch descriptors the kernel dropped (IN_IGNORED / IN_DELETE_SELF),
+ * handed to the runner in one batch after a read.
+ */
+static int *ignored_wds = NULL;
+static int ignored_size = 0;
+static int ignored_count = 0;
+
+/**
+ * When the kernel queue has last been read empty. After an overflow
+ * changes since then might have been lost.
+ */
+static time_t drained = 0;
+
+/**
+ * True while the watched tree is rescanned after an overflow.
+ * Changes since 'horizon' are told to the runner.
+ */
+static bool rescanning = false;
+static time_t horizon = 0;
+
+/**
+ * The watch descriptor the next rescan step continues with.
+ */
+static int rescan_cursor = 0;
+
+/**
+ * Counts rescanned directories, marks the directories found.
+ */
+static unsigned long rescan_gen = 0;
+
+/**
+ * Statistics of overflows and rescans.
+ */
+static unsigned long overflows = 0;
+static unsigned long rescan_stats = 0;
+static unsigned long rescan_events = 0;
+
+/**
+ * Returns the watch of wd or NULL if there is none.
+ */
+static struct watch *
+get_watch(int wd)
+{
+	if (wd < 0 || wd >= watches_size || !watches[wd].used) {
+		return NULL;
+	}
+	return &watches[wd];
+}
+
+/**
+ * Hashes a parent/name pair, name being 'len' characters long.
+ */
+static size_t
+name_hash(int parent, const char *name, size_t len)
+{
+	/* FNV-1a */
+	uint32_t h = 2166136261u ^ (uint32_t) parent;
+	for(; len; name++, len--) {
+		h = (h ^ (unsigned char) *name) * 16777619u;
+	}
+	return h;
+}
+
+/**
+ * Returns the wd of the directory 'name' (with 'len' characters)
+ * in the directory 'parent' or -1.
  */
 static int
-l_addwatch(lua_State *L)
+find_child(int parent, const char *name, size_t len)
 {
-	const char *path  = luaL_checkstring(L, 1);
-	const char *imode = luaL_checkstring(L, 2);
-	uint32_t mask = standard_event_mask;
+	int wd;
+	if (!names) {
+		return -1;
+	}
+	wd = names[name_hash(parent, name, len) & (names_size - 1)];
+	while (wd >= 0) {
+		struct watch *w = &watches[wd];
+		if (w->parent == parent && !strncmp(w->name, name, len) && 
+		    !w->name[len]) 
+		{
+			return wd;
+		}
+		wd = w->hnext;
+	}
+	return -1;
+}
+
+/**
+ * Puts the node wd into the bucket of its name.
+ */
+static void
+hash_node(int wd)
+{
+	struct watch *w = &watches[wd];
+	size_t h = name_hash(w->parent, w->name, strlen(w->name)) & 
+		(names_size - 1);
+	w->hnext = names[h];
+	names[h] = wd;
+}
+
+/**
+ * Returns the wd of the absolute directory 'path' or -1 if not watched.
+ * 'path' has a trailing slash like all directory paths of the runner.
+ */
+static int
+find_path(const char *path)
+{
+	int wd = -1;
+	size_t pl = 0;
+	int r;
+	/* finds the longest root which is a prefix of path */
+	for (r = first_root; r >= 0; r = watches[r].next) {
+		size_t rl = strlen(watches[r].name);
+		if (rl > pl && !strncmp(watches[r].name, path, rl)) {
+			wd = r;
+			pl = rl;
+		}
+	}
+	if (wd < 0) {
+		return -1;
+	}
+	path += pl;
+	/* walks down component by component */
+	while (*path && wd >= 0) {
+		const char *e = strchr(path, '/');
+		size_t len = e ? (size_t) (e - path) : strlen(path);
+		wd = find_child(wd, path, len);
+		path += len;
+		if (*path) {
+			path++;
+		}
+	}
+	return wd;
+}
+
+/**
+ * Returns the absolute path of the directory wd with trailing slash.
+ * The result is valid until the next call.
+ */
+static const char *
+node_path(int wd)
+{
+	size_t len = 0;
+	size_t p;
+	int n;
+	for (n = wd; n >= 0; n = watches[n].parent) {
+		len += strlen(watches[n].name) + 1;
+	}
+	if (len + 1 > pathbuf_size) {
+		pathbuf_size = len + 1;
+		pathbuf = s_realloc(pathbuf, pathbuf_size);
+	}
+	/* fills the buffer from its end */
+	p = len;
+	pathbuf[p] = 0;
+	for (n = wd; n >= 0; n = watches[n].parent) {
+		size_t nl = strlen(watches[n].name);
+		if (watches[n].parent >= 0) {
+			pathbuf[--p] = '/';
+		}
+		p -= nl;
+		memcpy(pathbuf + p, watches[n].name, nl);
+	}
+	/* roots have their slash already, shift out the unused byte */
+	return pathbuf + p;
+}
+
+/**
+ * Puts the node wd into the sibling list of its parent 
+ * and the name hash.
+ */
+static void
+attach_node(int wd)
+{
+	struct watch *w = &watches[wd];
+	int *first = w->parent >= 0 ? &watches[w->parent].child : &first_root;
+	w->prev = -1;
+	w->next = *first;
+	if (*first >= 0) {
+		watches[*first].prev = wd;
+	}
+	*first = wd;
+	if (w->parent >= 0) {
+		hash_node(wd);
+	}
+}
+
+/**
+ * Takes the node wd out of the sibling list of its parent 
+ * and the name hash, its subdirectories stay with it.
+ */
+static void
+detach_node(int wd)
+{
+	struct watch *w = &watches[wd];
+	if (w->parent >= 0) {
+		int *pw = &names[name_hash(w->parent, w->name, strlen(w->name)) & 
+			(names_size - 1)];
+		while (*pw != wd) {
+			pw = &watches[*pw].hnext;
+		}
+		*pw = w->hnext;
+	}
+	if (w->prev >= 0) {
+		watches[w->prev].next = w->next;
+	} else if (w->parent >= 0) {
+		watches[w->parent].child = w->next;
+	} else {
+		first_root = w->next;
+	}
+	if (w->next >= 0) {
+		watches[w->next].prev = w->prev;
+	}
+}
+
+/**
+ * Links the watch wd into the tree as 'name' of 'parent' 
+ * (-1 for a root, name then is the absolute path).
+ */
+static void
+link_node(int wd, int parent, const char *name)
+{
+	struct watch *w = &watches[wd];
+	size_t nl = strlen(name);
+	w->parent = parent;
+	w->active = now_jiffies();
+	w->child  = -1;
+	w->name   = s_strdup(name);
+	names_memory += nl + 1;
+	if (watches_count >= names_size) {
+		/* grows the name hash */
+		int i;
+		names_size = names_size ? names_size * 2 : 64;
+		names = s_realloc(names, names_size * sizeof(int));
+		for (i = 0; i < names_size; i++) {
+			names[i] = -1;
+		}
+		for (i = 0; i < watches_size; i++) {
+			if (i != wd && watches[i].used && watches[i].parent >= 0) {
+				hash_node(i);
+			}
+		}
+	}
+	attach_node(wd);
+}
+
+/**
+ * Removes the watch wd and all its subdirectories from the tree.
+ *
+ * @param core  if true also removes the watches from the kernel.
+ */
+static void
+unlink_node(int wd, bool core)
+{
+	struct watch *w = &watches[wd];
+	while (w->child >= 0) {
+		unlink_node(w->child, core);
+	}
+	detach_node(wd);
+	names_memory -= strlen(w->name) + 1;
+	free(w->name);
+	w->name = NULL;
+	w->used = false;
+	watches_count--;
+	clear_writtens(wd);
+	if (core) {
+		inotify_rm_watch(inotify_fd, wd);
+	}
+}
+
+/**
+ * Returns true if any sync wants an event of type 'bit' 
+ * in the directory 'wd'. Events of directories are always wanted.
+ */
+static bool
+wanted(int wd, int bit, bool isdir)
+{
+	struct watch *w = get_watch(wd);
+	return isdir || !w || (w->wants & bit);
+}
+
+/**
+ * Returns true if every sync concerned about 'name' in the directory 
+ * wd excludes it. 
+ */
+static bool
+excluded(int wd, const char *name, bool isdir)
+{
+	static char *buf = NULL;
+	static size_t buf_size = 0;
+	const char *dir;
+	size_t dl, nl;
+	if (!sync_roots_count || !get_watch(wd)) {
+		return false;
+	}
+	dir = node_path(wd);
+	dl = strlen(dir);
+	nl = strlen(name);
+	if (dl + nl + 1 > buf_size) {
+		buf_size = dl + nl + 1;
+		buf = s_realloc(buf, buf_size);
+	}
+	memcpy(buf, dir, dl);
+	memcpy(buf + dl, name, nl + 1);
+	return match_sync_roots(sync_roots, sync_roots_count, buf, isdir)
+		== ROOT_EXCLUDED;
+}
+
+/**
+ * Marks the directory wd as active.
+ */
+static void
+touch(int wd)
+{
+	struct watch *w = get_watch(wd);
+	if (w) {
+		w->active = read_time;
+	}
+}
+
+/**
+ * Reads the inotify mode and the table of event types wanted from
+ * the Lua stack at 'idx' and 'idx + 1'.
+ *
+ * @param mask          receives the inotify event mask
+ * @param wants         receives the WANT_* bits for files
+ * @param after_modify  receives true for "CloseWrite after Modify"
+ */
+static void
+check_watch_mode(lua_State *L, int idx, 
+                 uint32_t *mask, int *wants, bool *after_modify)
+{
+	const char *imode = luaL_checkstring(L, idx);
+	uint32_t modify_mask = IN_CLOSE_WRITE;
+	*mask = standard_event_mask;
+	*after_modify = false;
+	*wants = WANT_ALL;
+
 	if (*imode) {
 		if (!strcmp(imode, "Modify")) {
 			/* act on modify instead of closeWrite */
-			mask |= IN_MODIFY;
-			mask &= ~IN_CLOSE_WRITE;
+			modify_mask = IN_MODIFY;
 		} else if (!strcmp(imode, "CloseWrite")) {
 			/* default */
 		} else if (!strcmp(imode, "CloseWrite or Modify")) {
 			/* acts on modify and closeWrite */
-			mask |= IN_MODIFY;
+			modify_mask = IN_MODIFY | IN_CLOSE_WRITE;
 		} else if (!strcmp(imode, "CloseWrite after Modify")) {
-			/* might be done in future */
-			printlogf(L, "Error", 
-				"'CloseWrite after Modify' not implemented.");
-			exit(-1); // ERRNO
+			/* acts on closeWrite if modified before */
+			modify_mask = IN_MODIFY | IN_CLOSE_WRITE;
+			*after_modify = true;
 		} else {
 			printlogf(L, "Error", 
 				"'%s' not a valid inotfiyMode.", imode);
@@ -97,259 +698,2037 @@ l_addwatch(lua_State *L)
 		}
 	}
 
+	if (!lua_isnoneornil(L, idx + 1)) {
+		int i;
+		luaL_checktype(L, idx + 1, LUA_TTABLE);
+		*wants = 0;
+		for (i = 0; want_names[i].name; i++) {
+			lua_getfield(L, idx + 1, want_names[i].name);
+			if (lua_toboolean(L, -1)) {
+				*wants |= want_names[i].bit;
+			}
+			lua_pop(L, 1);
+		}
+	}
+	if (*wants & WANT_ATTRIB) {
+		*mask |= IN_ATTRIB;
+	}
+	if (*wants & WANT_MODIFY) {
+		*mask |= modify_mask;
+	}
+}
 
-	int wd = inotify_add_watch(inotify_fd, path, mask);
-	if (wd < 0) {
-		if (errno == ENOSPC) {
-			printlogf(L, "Error", 
-"Terminating since out of inotify watches.");
-			printlogf(L, "Error", 
-"Consider increasing /proc/sys/fs/inotify/max_user_watches");
-			exit(-1); // ERRNO.
+/**
+ * Puts the watch wd the kernel gave for 'path' into the watch table.
+ */
+static void
+record_watch(int wd, const char *path, int wants, bool after_modify)
+{
+	if (wd >= watches_size) {
+		int ns = watches_size ? watches_size : 64;
+		while (ns <= wd) {
+			ns *= 2;
 		}
-		printlogf(L, "Inotify", "addwatch(%s)->%d; err=%d:%s", path, wd,
-			errno, strerror(errno));
-	} else {
-		printlogf(L, "Inotify", "addwatch(%s)->%d", path, wd);
+		watches = s_realloc(watches, ns * sizeof(struct watch));
+		memset(watches + watches_size, 0, 
+			(ns - watches_size) * sizeof(struct watch));
+		watches_size = ns;
+	}
+	if (watches[wd].used && strcmp(node_path(wd), path)) {
+		/* the kernel reused the wd or the directory moved.
+		 * the old path is gone either way. */
+		unlink_node(wd, false);
+	}
+	if (watches[wd].used) {
+		/* another sync watches this directory too */
+		if (!(watches[wd].wants & WANT_MODIFY)) {
+			watches[wd].after_modify = after_modify;
+		} else if (wants & WANT_MODIFY) {
+			watches[wd].after_modify &= after_modify;
+		}
+		watches[wd].wants |= wants;
+	} else {
+		/* splits path into parent and name */
+		size_t pl = strlen(path);
+		int parent = -1;
+		char *name;
+		struct stat st;
+		if (pl > 1 && path[pl - 1] == '/') {
+			const char *e = path + pl - 1;
+			while (e > path && e[-1] != '/') {
+				e--;
+			}
+			if (e > path) {
+				char *pp = s_strdup(path);
+				pp[e - path] = 0;
+				parent = find_path(pp);
+				free(pp);
+			}
+			if (parent >= 0) {
+				name = s_strdup(e);
+				name[strlen(name) - 1] = 0;
+			}
+		}
+		if (parent < 0) {
+			/* a root */
+			name = s_strdup(path);
+		}
+		watches[wd].used = true;
+		watches[wd].wants = wants;
+		watches[wd].after_modify = after_modify;
+		if (lstat(path, &st)) {
+			watches[wd].dev = 0;
+			watches[wd].ino = 0;
+		} else {
+			watches[wd].dev = st.st_dev;
+			watches[wd].ino = st.st_ino;
+		}
+		watches_count++;
+		link_node(wd, parent, name);
+		free(name);
+	}
+}
+
+/**
+ * Adds an inotify watch.
+ *
+ * If the directory is watched already, the events of this call are 
+ * added to the watch (the union of all syncs interested in it).
+ * 
+ * @param dir         (Lua stack) path to directory
+ * @param inotifyMode (Lua stack) inotify mode to use
+ * @param events      (Lua stack) optional, table of event types wanted 
+ *                                for files, all if nil.
+ * @return            (Lua stack) numeric watch descriptor, 
+ *                                negative on error followed by
+ *                                "nospace" if out of watches.
+ */
+static int
+l_addwatch(lua_State *L)
+{
+	const char *path  = luaL_checkstring(L, 1);
+	uint32_t mask;
+	bool after_modify;
+	int wants;
+	int wd;
+
+	check_watch_mode(L, 2, &mask, &wants, &after_modify);
+	wd = inotify_add_watch(inotify_fd, path, mask | IN_MASK_ADD);
+	if (wd < 0) {
+		int err = errno;
+		printlogf(L, "Inotify", "addwatch(%s)->%d; err=%d:%s", path, wd,
+			err, strerror(err));
+		lua_pushinteger(L, wd);
+		if (err == ENOSPC) {
+			/* the runner decides what to do */
+			lua_pushstring(L, "nospace");
+			return 2;
+		}
+		return 1;
+	} 
+	printlogf(L, "Inotify", "addwatch(%s)->%d", path, wd);
+	record_watch(wd, path, wants, after_modify);
+	lua_pushinteger(L, wd);
+	return 1;
+}
+
+/**
+ * Removes an inotify watch and all watches of its subdirectories.
+ * 
+ * @param wd   (Lua stack) numeric watch descriptor
+ * @param core (Lua stack) if false the watches are only removed from 
+ *                         the watch table not the kernel.
+ *                         (used in moves which reuse the watch)
+ * @return    nil
+ */
+static int
+l_rmwatch(lua_State *L)
+{
+	int wd = luaL_checkinteger(L, 1);
+	bool core = lua_isnoneornil(L, 2) || lua_toboolean(L, 2);
+	if (!get_watch(wd)) {
+		return 0;
+	}
+	unlink_node(wd, core);
+	printlogf(L, "Inotify", "rmwatch()<-%d", wd);
+	return 0;
+}
+
+/**
+ * Follows a directory that moved within the watch tree.
+ *
+ * The kernel keeps the watches of a moved directory and its 
+ * subdirectories, so only its node is relinked under the new parent
+ * and name. The paths of all its subdirectories follow from that.
+ *
+ * @param path  (Lua stack) old path of the directory, trailing slash
+ * @param path2 (Lua stack) new path of the directory, trailing slash
+ * @return      (Lua stack) true if moved, false if the new parent is
+ *                          not watched or the directory was not.
+ */
+static int
+l_move(lua_State *L)
+{
+	const char *path  = luaL_checkstring(L, 1);
+	const char *path2 = luaL_checkstring(L, 2);
+	size_t pl = strlen(path2);
+	int wd = find_path(path);
+	int parent = -1;
+	int old, n;
+	const char *e;
+	char *name;
+	struct watch *w;
+
+	if (wd < 0 || watches[wd].parent < 0 || pl < 2 || path2[pl - 1] != '/') {
+		lua_pushboolean(L, false);
+		return 1;
+	}
+	/* splits path2 into parent and name */
+	e = path2 + pl - 1;
+	while (e > path2 && e[-1] != '/') {
+		e--;
+	}
+	if (e > path2) {
+		char *pp = s_strdup(path2);
+		pp[e - path2] = 0;
+		parent = find_path(pp);
+		free(pp);
+	}
+	/* a directory cannot move into itself, but better safe than looping */
+	for (n = parent; n >= 0 && n != wd; n = watches[n].parent);
+	if (parent < 0 || n == wd) {
+		lua_pushboolean(L, false);
+		return 1;
+	}
+	name = s_strdup(e);
+	name[strlen(name) - 1] = 0;
+
+	/* an empty directory can be replaced by a rename */
+	old = find_child(parent, name, strlen(name));
+	if (old >= 0 && old != wd) {
+		unlink_node(old, false);
+	}
+
+	w = &watches[wd];
+	detach_node(wd);
+	names_memory += strlen(name);
+	names_memory -= strlen(w->name);
+	free(w->name);
+	w->name = name;
+	w->parent = parent;
+	w->active = now_jiffies();
+	attach_node(wd);
+	dirs_moved++;
+	printlogf(L, "Inotify", "move(%s -> %s)<-%d", path, path2, wd);
+	lua_pushboolean(L, true);
+	return 1;
+}
+
+/**
+ * Returns the absolute path of a watch descriptor.
+ *
+ * @param wd (Lua stack) numeric watch descriptor
+ * @return   (Lua stack) the path or nil if not watched
+ */
+static int
+l_path(lua_State *L)
+{
+	int wd = luaL_checkinteger(L, 1);
+	if (!get_watch(wd)) {
+		return 0;
+	}
+	lua_pushstring(L, node_path(wd));
+	return 1;
+}
+
+/**
+ * Returns the watch descriptor of an absolute path.
+ *
+ * @param path (Lua stack) path of directory with trailing slash
+ * @return     (Lua stack) the watch descriptor or nil if not watched
+ */
+static int
+l_lookup(lua_State *L)
+{
+	int wd = find_path(luaL_checkstring(L, 1));
+	if (wd < 0) {
+		return 0;
+	}
+	lua_pushinteger(L, wd);
+	return 1;
+}
+
+/**
+ * Iterator for l_walk, upvalue is the next wd to look at.
+ */
+static int
+l_walk_next(lua_State *L)
+{
+	int wd = lua_tointeger(L, lua_upvalueindex(1));
+	while (wd < watches_size && !watches[wd].used) {
+		wd++;
+	}
+	if (wd >= watches_size) {
+		return 0;
+	}
+	lua_pushinteger(L, wd + 1);
+	lua_replace(L, lua_upvalueindex(1));
+	lua_pushinteger(L, wd);
+	lua_pushstring(L, node_path(wd));
+	return 2;
+}
+
+/**
+ * Returns an iterator for a for-loop over all watch descriptors 
+ * and their paths.
+ */
+static int
+l_walk(lua_State *L)
+{
+	lua_pushinteger(L, 0);
+	lua_pushcclosure(L, l_walk_next, 1);
+	return 1;
+}
+
+/**
+ * Tells the core about the root and excludes of a sync.
+ *
+ * @param path     (Lua stack) absolute path of the sync root
+ * @param excludes (Lua stack) excludes userdata of the sync
+ */
+static int
+l_addsync(lua_State *L)
+{
+	const char *path = luaL_checkstring(L, 1);
+	struct excludes *ex = check_excludes(L, 2);
+	/* keeps the excludes from being collected */
+	lua_pushvalue(L, 2);
+	luaL_ref(L, LUA_REGISTRYINDEX);
+	if (sync_roots_count >= sync_roots_size) {
+		sync_roots_size = sync_roots_size ? sync_roots_size * 2 : 4;
+		sync_roots = s_realloc(sync_roots, 
+			sync_roots_size * sizeof(struct sync_root));
+	}
+	sync_roots[sync_roots_count].path = s_strdup(path);
+	sync_roots[sync_roots_count].len = strlen(path);
+	sync_roots[sync_roots_count].excludes = ex;
+	sync_roots_count++;
+	return 0;
+}
+
+/**
+ * A MOVED_FROM event waiting for its MOVED_TO partner.
+ *
+ * Lsyncd buffers MOVED_FROM events in a table indexed by their cookie.
+ * If a MOVED_TO event with an identical cookie arrives within the move 
+ * window both are condensed into one Move event to be sent to the runner.
+ * Otherwise the MOVED_FROM becomes a Delete, it was a move out of the 
+ * watched tree.
+ */
+struct pending_move {
+	/* true if this slot holds a buffered event */
+	bool used;
+
+	/* the buffered event */
+	struct inotify_event *event;
+
+	/* memory allocated for event */
+	size_t size;
+
+	/* point in time the move window of this event closes */
+	clock_t alarm;
+
+	/* arrival number, unpaired moves are flushed in order */
+	unsigned long seq;
+};
+
+/**
+ * Number of slots in the pending moves table, must be a power of 2.
+ * One slot is always kept free for the open addressing to terminate.
+ */
+#define MOVES_SIZE 64
+
+/**
+ * The pending moves indexed by cookie (open addressing).
+ */
+static struct pending_move moves[MOVES_SIZE];
+
+/**
+ * Number of used slots in moves.
+ */
+static int moves_pending = 0;
+
+/**
+ * Counts arriving MOVED_FROM events.
+ */
+static unsigned long moves_seq = 0;
+
+/**
+ * Time in jiffies a MOVED_FROM waits for its MOVED_TO.
+ */
+static clock_t move_window = 0;
+
+/**
+ * Statistics about moves.
+ */
+static unsigned long moves_paired    = 0;
+static unsigned long moves_unpaired  = 0;
+static unsigned long moves_reclaimed = 0;
+
+/**
+ * Statistics about CLOSE_WRITEs without anything written.
+ */
+static unsigned long writes_skipped = 0;
+
+/**
+ * Sends an event to the runner.
+ *
+ * @param etype  event type
+ * @param wd     watch descriptor the event happened in
+ * @param isdir  true if the event relates to a directory
+ * @param name   file name relative to wd
+ * @param wd2    for moves the watch descriptor of the destination
+ * @param name2  for moves the destination name
+ */
+static void
+send_event(lua_State *L,
+           const char *etype,
+           int wd,
+           bool isdir,
+           const char *name,
+           int wd2,
+           const char *name2)
+{
+	load_runner_func(L, "inotifyEvent"); 
+	lua_pushstring(L, etype); 
+	lua_pushnumber(L, wd);
+	lua_pushboolean(L, isdir);
+	l_now(L);
+	lua_pushstring(L, name);
+	if (name2) {
+		lua_pushnumber(L, wd2);
+		lua_pushstring(L, name2);
+	} else {
+		lua_pushnil(L);
+		lua_pushnil(L);
+	}
+	if (lua_pcall(L, 7, 0, -9)) {
+		exit(-1); // ERRNO
+	}
+	lua_pop(L, 1);
+}
+
+/**
+ * Remembers the watched subdirectory 'name' of wd as vanished, 
+ * it has been told as deleted but might just have been moved.
+ */
+static void
+gone_dir(int wd, const char *name)
+{
+	int cw = find_child(wd, name, strlen(name));
+	const char *dpath;
+	char *path;
+	size_t dl, nl;
+	if (cw < 0 || !watches[cw].ino) {
+		return;
+	}
+	dpath = node_path(wd);
+	dl = strlen(dpath);
+	nl = strlen(name);
+	path = s_malloc(dl + nl + 2);
+	memcpy(path, dpath, dl);
+	memcpy(path + dl, name, nl);
+	path[dl + nl] = '/';
+	path[dl + nl + 1] = 0;
+	gone_add(watches[cw].dev, watches[cw].ino, true, 0, 0, path);
+	free(path);
+}
+
+/**
+ * An entry appeared without a known origin, by an unary MOVED_TO or 
+ * found by a rescan. If its inode vanished from a watched directory 
+ * recently it is sent as Move, the runner turns the Delete it got 
+ * before into it if still waiting. 
+ *
+ * @param st  stat of the entry, NULL to stat it
+ * @return    true if sent
+ */
+static bool
+send_reclaimed(lua_State *L, int wd, const char *name, 
+               const struct stat *st)
+{
+	char *dpath = s_strdup(node_path(wd));
+	size_t dl = strlen(dpath);
+	size_t nl = strlen(name);
+	char *path = s_malloc(dl + nl + 2);
+	struct stat sb;
+	const char *origin = NULL;
+	bool isdir = false;
+	char *odir;
+	char *oname;
+	size_t ol;
+	int owd;
+	memcpy(path, dpath, dl);
+	memcpy(path + dl, name, nl + 1);
+	if (!st && !lstat(path, &sb)) {
+		st = &sb;
+	}
+	if (st) {
+		isdir = S_ISDIR(st->st_mode);
+		if (isdir) {
+			path[dl + nl] = '/';
+			path[dl + nl + 1] = 0;
+		}
+		origin = gone_claim(st->st_dev, st->st_ino, isdir,
+			(int64_t) st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec,
+			st->st_size, path);
+	}
+	free(path);
+	if (!origin) {
+		free(dpath);
+		return false;
+	}
+	/* splits the origin into its directory and name */
+	odir = s_strdup(origin);
+	ol = strlen(odir);
+	if (isdir) {
+		odir[--ol] = 0;
+	}
+	oname = strrchr(odir, '/');
+	if (!oname) {
+		free(odir);
+		return false;
+	}
+	oname = s_strdup(oname + 1);
+	odir[ol - strlen(oname)] = 0;
+	owd = find_path(odir);
+	free(odir);
+	if (owd < 0 || (excluded(owd, oname, isdir) && 
+	                excluded(wd, name, isdir)))
+	{
+		/* the origin is not watched anymore */
+		free(oname);
+		free(dpath);
+		return false;
+	}
+	printlogf(L, "Inotify", "icore, %s%s reappeared as %s%s",
+		node_path(owd), oname, dpath, name);
+	free(dpath);
+	moves_reclaimed++;
+	load_runner_func(L, "inotifyEvent"); 
+	lua_pushstring(L, MOVE); 
+	lua_pushnumber(L, owd);
+	lua_pushboolean(L, isdir);
+	l_now(L);
+	lua_pushstring(L, oname);
+	lua_pushnumber(L, wd);
+	lua_pushstring(L, name);
+	lua_pushboolean(L, true);
+	free(oname);
+	if (lua_pcall(L, 8, 0, -10)) {
+		exit(-1); // ERRNO
+	}
+	lua_pop(L, 1);
+	return true;
+}
+
+/**
+ * Returns the slot of the pending move with 'cookie' or -1.
+ */
+static int
+find_move(uint32_t cookie) 
+{
+	int i = cookie & (MOVES_SIZE - 1);
+	while (moves[i].used) {
+		if (moves[i].event->cookie == cookie) {
+			return i;
+		}
+		i = (i + 1) & (MOVES_SIZE - 1);
+	}
+	return -1;
+}
+
+/**
+ * Frees the slot 'i' of the pending moves table.
+ *
+ * Moves following entries back so lookups need no tombstones.
+ * The event buffers are swapped, thus the event of slot 'i' stays valid 
+ * until the next call to buffer_move().
+ */
+static void
+remove_move(int i)
+{
+	int j = i;
+	moves[i].used = false;
+	moves_pending--;
+	while (true) {
+		int k;
+		j = (j + 1) & (MOVES_SIZE - 1);
+		if (!moves[j].used) {
+			return;
+		}
+		/* the home slot of the entry in j */
+		k = moves[j].event->cookie & (MOVES_SIZE - 1);
+		if (i <= j ? (i < k && k <= j) : (i < k || k <= j)) {
+			/* entry is between its home and i, stays */
+			continue;
+		}
+		{
+			struct pending_move t = moves[i];
+			moves[i] = moves[j];
+			moves[j] = t;
+		}
+		i = j;
+	}
+}
+
+/**
+ * Sends the pending move in slot 'i' as unary Delete to the runner.
+ */
+static void
+unpair_move(lua_State *L, int i)
+{
+	struct inotify_event *event = moves[i].event;
+	logstring("Inotify", "icore, changing unary MOVE_FROM into DELETE");
+	moves_unpaired++;
+	remove_move(i);
+	remove_written(event->wd, event->name);
+	if (!wanted(event->wd, WANT_DELETE, (event->mask & IN_ISDIR) != 0)) {
+		events_dropped++;
+		return;
+	}
+	if (excluded(event->wd, event->name, (event->mask & IN_ISDIR) != 0)) {
+		events_excluded++;
+		return;
+	}
+	if (event->mask & IN_ISDIR) {
+		gone_dir(event->wd, event->name);
+	}
+	send_event(L, DELETE, event->wd, (event->mask & IN_ISDIR) != 0, 
+		event->name, 0, NULL);
+}
+
+/**
+ * Returns the slot of the oldest pending move or -1.
+ */
+static int
+oldest_move(void)
+{
+	int i, o = -1;
+	if (!moves_pending) {
+		return -1;
+	}
+	for (i = 0; i < MOVES_SIZE; i++) {
+		if (moves[i].used && (o < 0 || moves[i].seq < moves[o].seq)) {
+			o = i;
+		}
+	}
+	return o;
+}
+
+/**
+ * Sends pending moves as Deletes.
+ *
+ * @param all   if false only moves whose window closed are flushed.
+ */
+static void
+flush_moves(lua_State *L, bool all)
+{
+	clock_t now = now_jiffies();
+	int i;
+	while ((i = oldest_move()) >= 0) {
+		if (!all && time_before(now, moves[i].alarm)) {
+			return;
+		}
+		unpair_move(L, i);
+	}
+}
+
+/**
+ * An event on the origin of a pending move must not overtake it.
+ * Thus such a pending move is flushed as Delete before.
+ * A MOVED_TO does not flush its own partner.
+ */
+static void
+flush_conflicts(lua_State *L, struct inotify_event *event) 
+{
+	int i;
+	for (i = 0; moves_pending && i < MOVES_SIZE; i++) {
+		struct inotify_event *m = moves[i].event;
+		if (!moves[i].used || m->wd != event->wd || 
+		    strcmp(m->name, event->name)) 
+		{
+			continue;
+		}
+		if ((event->mask & IN_MOVED_TO) && m->cookie == event->cookie) {
+			continue;
+		}
+		unpair_move(L, i);
+		/* the table has been reordered, starts over */
+		i = -1;
+	}
+}
+
+/**
+ * Buffers a MOVED_FROM event waiting for its MOVED_TO.
+ */
+static void
+buffer_move(lua_State *L, struct inotify_event *event)
+{
+	size_t el = sizeof(struct inotify_event) + event->len;
+	int i;
+	if (moves_pending >= MOVES_SIZE - 1) {
+		/* table is full, the oldest move has waited long enough */
+		unpair_move(L, oldest_move());
+	}
+	i = event->cookie & (MOVES_SIZE - 1);
+	while (moves[i].used) {
+		i = (i + 1) & (MOVES_SIZE - 1);
+	}
+	if (moves[i].size < el) {
+		moves[i].size = el;
+		moves[i].event = s_realloc(moves[i].event, el);
+	}
+	memcpy(moves[i].event, event, el);
+	moves[i].used  = true;
+	moves[i].alarm = now_jiffies() + move_window;
+	moves[i].seq   = moves_seq++;
+	moves_pending++;
+}
+
+/**
+ * Remembers wd to be reported as gone to the runner.
+ */
+static void
+ignore_wd(int wd)
+{
+	struct watch *w = get_watch(wd);
+	if (!w) {
+		/* already gone (IN_IGNORED after IN_DELETE_SELF) */
+		return;
+	}
+	/* subdirectories are gone too or not reachable anymore */
+	unlink_node(wd, true);
+	if (ignored_count >= ignored_size) {
+		ignored_size = ignored_size ? ignored_size * 2 : 16;
+		ignored_wds = s_realloc(ignored_wds, ignored_size * sizeof(int));
+	}
+	ignored_wds[ignored_count++] = wd;
+}
+
+/**
+ * Tells the runner about all watch descriptors gone since last call.
+ * A wd that has been reused by a new watch meanwhile is not reported.
+ */
+static void
+flush_ignored(lua_State *L)
+{
+	int i, n = 0;
+	if (!ignored_count) {
+		return;
+	}
+	load_runner_func(L, "inotifyIgnored");
+	lua_newtable(L);
+	for (i = 0; i < ignored_count; i++) {
+		if (!get_watch(ignored_wds[i])) {
+			lua_pushinteger(L, ignored_wds[i]);
+			lua_rawseti(L, -2, ++n);
+		}
+	}
+	ignored_count = 0;
+	if (lua_pcall(L, 1, 0, -3)) {
+		exit(-1); // ERRNO
+	}
+	lua_pop(L, 1);
+}
+
+/**
+ * Handles an inotify event.
+ */
+static void 
+handle_event(lua_State *L, 
+             struct inotify_event *event) 
+{
+	const char *event_type = NULL;
+	bool isdir = (event->mask & IN_ISDIR) != 0;
+	struct watch *w;
+	int want;
+	int mi = -1;
+
+	if (IN_Q_OVERFLOW & event->mask) {
+		/* an overflow happened, anything since the queue has last 
+		 * been drained might be lost. Rescans the watched tree. */
+		flush_moves(L, true);
+		overflows++;
+		if (!rescanning || drained < horizon) {
+			horizon = drained;
+		}
+		rescanning = true;
+		rescan_cursor = 0;
+		load_runner_func(L, "overflow");
+		if (lua_pcall(L, 0, 0, -2)) {
+			exit(-1); // ERRNO
+		}
+		lua_pop(L, 1);
+		return;
+	}
+	w = get_watch(event->wd);
+	/* the watch is gone, the directory has been deleted or unwatched */
+	if ((IN_IGNORED | IN_DELETE_SELF) & event->mask) {
+		ignore_wd(event->wd);
+		return;
+	}
+	if (event->len == 0) {
+		/* sometimes inotify sends such strange events, 
+		 * (e.g. when touching a dir */
+		return;
+	}
+	touch(event->wd);
+
+	flush_conflicts(L, event);
+	if (IN_MOVED_TO & event->mask) {
+		mi = find_move(event->cookie);
+	}
+
+	if (mi >= 0) {
+		/* this is indeed a matched move */
+		struct inotify_event *from = moves[mi].event;
+		moves_paired++;
+		remove_move(mi);
+		if (remove_written(from->wd, from->name)) {
+			/* a file still open for writing has been moved */
+			add_written(event->wd, event->name);
+		}
+		if (!wanted(from->wd, WANT_MOVE, isdir) &&
+		    !wanted(event->wd, WANT_MOVE, isdir)) 
+		{
+			events_dropped++;
+			return;
+		}
+		if (excluded(from->wd, from->name, isdir) && 
+		    excluded(event->wd, event->name, isdir)) 
+		{
+			events_excluded++;
+			return;
+		}
+		send_event(L, MOVE, from->wd, isdir,
+			from->name, event->wd, event->name);
+		return;
+	} else if (IN_MOVED_FROM & event->mask) {
+		/* just the MOVE_FROM, buffers this event, and wait if a matching 
+		 * MOVED_TO follows within the move window, or if this is an unary 
+		 * move out of the watched tree. */
+		buffer_move(L, event);
+		return;
+	} else if (IN_MOVED_TO & event->mask) {
+		/* must be an unary move-to, 
+		 * unless coming from where a Delete has been told */
+		if (send_reclaimed(L, event->wd, event->name, NULL)) {
+			return;
+		}
+		event_type = CREATE;
+		want = WANT_CREATE;
+	} else if (IN_ATTRIB & event->mask) {
+		/* just attrib change */
+		event_type = ATTRIB;
+		want = WANT_ATTRIB;
+	} else if (IN_MODIFY & event->mask) {
+		if (w && w->after_modify) {
+			/* waits for the close */
+			add_written(event->wd, event->name);
+			return;
+		}
+		event_type = MODIFY;
+		want = WANT_MODIFY;
+	} else if (IN_CLOSE_WRITE & event->mask) {
+		/* closed after written something */
+		if (w && w->after_modify && 
+		    !remove_written(event->wd, event->name)) 
+		{
+			/* opened for writing but nothing written */
+			writes_skipped++;
+			return;
+		}
+		event_type = MODIFY;
+		want = WANT_MODIFY;
+	} else if (IN_CREATE & event->mask) {
+		/* a new file */
+		event_type = CREATE;
+		want = WANT_CREATE;
+	} else if (IN_DELETE & event->mask) {
+		/* rm'ed */
+		remove_written(event->wd, event->name);
+		event_type = DELETE;
+		want = WANT_DELETE;
+	} else {
+		logstring("Inotify", "icore, skipped some inotify event.");
+		return;
+	}
+
+	if (!wanted(event->wd, want, isdir)) {
+		/* no sync cares about this */
+		events_dropped++;
+		return;
+	}
+	if (excluded(event->wd, event->name, isdir)) {
+		events_excluded++;
+		return;
+	}
+
+	/* and hands over to runner */
+	send_event(L, event_type, event->wd, isdir, event->name, 0, NULL);
+}
+
+/** 
+ * buffer to read inotify events into
+ */
+static size_t readbuf_size = 2048;
+static char * readbuf = NULL;
+
+/**
+ * Reads the inotify file descriptor and forwards all received events 
+ * to the runner. Keeps reading as long MOVED_FROMs wait for partners 
+ * and the kernel has something.
+ */
+static void
+read_events(lua_State *L)
+{
+	while(true) {
+		ptrdiff_t len; 
+		int err;
+		do {
+			len = read (inotify_fd, readbuf, readbuf_size);
+			err = errno;
+			read_time = now_jiffies();
+			if (len < 0 && err == EINVAL) {
+				/* kernel > 2.6.21 indicates that way that way that
+				 * the buffer was too small to fit a filename.
+				 * double its size and try again. When using a lower
+				 * kernel and a filename > 2KB appears lsyncd
+				 * will fail. (but does a 2KB filename really happen?)
+				 */
+				readbuf_size *= 2;
+				readbuf = s_realloc(readbuf, readbuf_size);
+				continue;
+			}
+		} while(0);
+		if (len == 0) {
+			/* nothing more inotify */
+			break;
+		}
+		if (len < 0) {
+			if (err == EAGAIN) {
+				/* nothing more inotify */
+				drained = time(NULL);
+				break;
+			} else {
+				printlogf(L, "Error", "Read fail on inotify");
+				exit(-1); // ERRNO
+			}
+		}
+		{
+			int i = 0;
+			while (i < len && !hup && !term) {
+				struct inotify_event *event = 
+					(struct inotify_event *) &readbuf[i];
+				handle_event(L, event);
+				i += sizeof(struct inotify_event) + event->len;
+			}
+		}
+		if (!moves_pending) {
+			/* give it a pause if not endangering splitting a move */
+			break;
+		}
+	}
+
+	/* unary MOVE_FROMs whose window closed are deletes */
+	flush_moves(L, false);
+	flush_ignored(L);
+}
+
+/**
+ * Called by function pointer from when the inotify file descriptor 
+ * became ready. Reads it contents and forward all received events
+ * to the runner.
+ */
+static void
+inotify_ready(lua_State *L, struct observance *obs)
+{
+	if (obs->fd != inotify_fd) {
+		logstring("Error", "Internal, inotify_fd != ob->fd");
+		exit(-1); // ERRNO
+	}
+	read_events(L);
+}
+
+/**
+ * A directory of an initial crawl to be listed.
+ */
+struct crawl_job {
+	/* next job in the queue */
+	struct crawl_job *next;
+
+	/* the crawl it belongs to */
+	int crawl;
+
+	/* absolute path with trailing slash */
+	char *path;
+
+	/* true if watched after the crawl has been marked */
+	bool late;
+
+	/* errno if the directory could not be listed */
+	int err;
+
+	/* the subdirectories found by the listing, names each
+	 * terminated by a 0 */
+	char *subdirs;
+	size_t subdirs_len;
+	size_t subdirs_size;
+};
+
+/**
+ * The initial crawl of a sync root.
+ *
+ * Adding the watches for a large tree by recursing in the runner takes
+ * long and nothing else is done meanwhile. Instead worker threads list 
+ * the directories and the main loop adds watches for the subdirectories
+ * they found, queuing them to be listed in turn. The watch table stays 
+ * with the main loop, and since a directory is watched before being 
+ * listed no subdirectory created meanwhile is missed. Events and the
+ * startup of syncs are handled while the crawl goes on.
+ */
+struct crawl {
+	/* true if this slot is in use */
+	bool used;
+
+	/* the root crawled */
+	char *path;
+
+	/* watch mode for all directories */
+	uint32_t mask;
+	int wants;
+	bool after_modify;
+
+	/* jobs queued, being listed or waiting to be processed */
+	int pending;
+
+	/* directories watched */
+	unsigned long dirs;
+
+	/* true once the startup of the sync began, see l_crawlmark() */
+	bool marked;
+
+	/* the topmost directories watched after being marked */
+	char **late;
+	int late_count;
+	int late_size;
+};
+
+static struct crawl *crawls = NULL;
+static int crawls_count = 0;
+
+/**
+ * Jobs to be listed, and listed jobs to be processed by the main loop.
+ */
+static struct crawl_job *todo_head = NULL;
+static struct crawl_job *todo_tail = NULL;
+static struct crawl_job *done_head = NULL;
+static struct crawl_job *done_tail = NULL;
+
+/**
+ * Number of listed jobs processed per call of crawl_process(), 
+ * so events are not held back for long.
+ */
+#define CRAWL_BATCH 256
+
+/**
+ * Number of worker threads to list directories, 
+ * 0 lists them in the main loop.
+ */
+static int crawl_threads = 4;
+
+/**
+ * Statistics about crawls.
+ */
+static unsigned long crawl_dirs = 0;
+static unsigned long crawl_listed = 0;
+static unsigned long crawl_failed = 0;
+
+#ifdef HAVE_PTHREAD
+/**
+ * The worker threads, the lock protecting the queues and crawl_stop, 
+ * the condition workers wait for jobs on and the pipe they wake up 
+ * the main loop with.
+ */
+static pthread_t *workers = NULL;
+static int workers_count = 0;
+static pthread_mutex_t crawl_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t crawl_cond = PTHREAD_COND_INITIALIZER;
+static bool crawl_stop = false;
+static int crawl_pipe[2] = { -1, -1 };
+#endif
+
+/**
+ * Adds 'name' to the subdirectories of 'job'.
+ */
+static void
+add_subdir(struct crawl_job *job, const char *name)
+{
+	size_t nl = strlen(name) + 1;
+	if (job->subdirs_len + nl > job->subdirs_size) {
+		job->subdirs_size = (job->subdirs_len + nl) * 2;
+		job->subdirs = s_realloc(job->subdirs, job->subdirs_size);
+	}
+	memcpy(job->subdirs + job->subdirs_len, name, nl);
+	job->subdirs_len += nl;
+}
+
+/**
+ * Lists the subdirectories of a job. Called by the worker threads, 
+ * touches nothing but the job.
+ */
+static void
+list_job(struct crawl_job *job)
+{
+	struct dirstream ds;
+	const char *name;
+	bool isdir;
+	if (!dirstream_open(&ds, job->path)) {
+		job->err = ds.err;
+		return;
+	}
+	while ((name = dirstream_next(&ds, &isdir))) {
+		if (isdir) {
+			add_subdir(job, name);
+		}
+	}
+}
+
+/**
+ * Appends a job to a queue.
+ */
+static void
+enqueue_job(struct crawl_job **head, struct crawl_job **tail, 
+            struct crawl_job *job)
+{
+	job->next = NULL;
+	if (*tail) {
+		(*tail)->next = job;
+	} else {
+		*head = job;
+	}
+	*tail = job;
+}
+
+/**
+ * Takes the first job of a queue, NULL if empty.
+ */
+static struct crawl_job *
+dequeue_job(struct crawl_job **head, struct crawl_job **tail)
+{
+	struct crawl_job *job = *head;
+	if (job) {
+		*head = job->next;
+		if (!*head) {
+			*tail = NULL;
+		}
+	}
+	return job;
+}
+
+#ifdef HAVE_PTHREAD
+/**
+ * A worker thread, lists queued jobs until told to stop.
+ */
+static void *
+crawl_worker(void *arg)
+{
+	pthread_mutex_lock(&crawl_lock);
+	while (!crawl_stop) {
+		struct crawl_job *job = dequeue_job(&todo_head, &todo_tail);
+		bool wake;
+		if (!job) {
+			pthread_cond_wait(&crawl_cond, &crawl_lock);
+			continue;
+		}
+		pthread_mutex_unlock(&crawl_lock);
+		list_job(job);
+		pthread_mutex_lock(&crawl_lock);
+		wake = !done_head;
+		enqueue_job(&done_head, &done_tail, job);
+		if (wake) {
+			/* the main loop sleeps in select() */
+			char c = 0;
+			if (write(crawl_pipe[1], &c, 1) < 0) {
+				/* the pipe is full, thus the main loop awake */
+			}
+		}
+	}
+	pthread_mutex_unlock(&crawl_lock);
+	return NULL;
+}
+#endif
+
+/**
+ * Queues a directory to be listed.
+ */
+static void
+queue_job(int crawl, const char *path, bool late)
+{
+	struct crawl_job *job = s_calloc(1, sizeof(struct crawl_job));
+	job->crawl = crawl;
+	job->path = s_strdup(path);
+	job->late = late;
+	crawls[crawl].pending++;
+#ifdef HAVE_PTHREAD
+	if (workers_count) {
+		pthread_mutex_lock(&crawl_lock);
+		enqueue_job(&todo_head, &todo_tail, job);
+		pthread_cond_signal(&crawl_cond);
+		pthread_mutex_unlock(&crawl_lock);
+		return;
+	}
+#endif
+	enqueue_job(&todo_head, &todo_tail, job);
+}
+
+/**
+ * Adds the watch for a directory found by a crawl and queues it to be 
+ * listed. Out of watches the runner is asked to make room, and the 
+ * second time to poll the directory.
+ *
+ * @param parent_late  true if the parent has been watched late already
+ * @return             true if watched
+ */
+static bool
+crawl_watch(lua_State *L, int crawl, const char *path, bool parent_late)
+{
+	struct crawl *c = &crawls[crawl];
+	int tries = 0;
+	int wd;
+	while ((wd = inotify_add_watch(inotify_fd, path, c->mask | IN_MASK_ADD))
+	       < 0 && errno == ENOSPC) 
+	{
+		bool retry;
+		load_runner_func(L, "inotifyNoSpace");
+		lua_pushstring(L, path);
+		lua_pushboolean(L, tries++ > 0);
+		if (lua_pcall(L, 2, 1, -4)) {
+			exit(-1); // ERRNO
+		}
+		retry = lua_toboolean(L, -1);
+		lua_pop(L, 2);
+		if (!retry) {
+			/* polled now */
+			return false;
+		}
+	}
+	if (wd < 0) {
+		int err = errno;
+		printlogf(L, "Inotify", "addwatch(%s)->%d; err=%d:%s", path, wd,
+			err, strerror(err));
+		crawl_failed++;
+		return false;
+	}
+	record_watch(wd, path, c->wants, c->after_modify);
+	c->dirs++;
+	crawl_dirs++;
+	if (c->marked && !parent_late) {
+		/* the startup might have passed it before */
+		if (c->late_count >= c->late_size) {
+			c->late_size = c->late_size ? c->late_size * 2 : 16;
+			c->late = s_realloc(c->late, c->late_size * sizeof(char *));
+		}
+		c->late[c->late_count++] = s_strdup(path);
+	}
+	queue_job(crawl, path, c->marked);
+	return true;
+}
+
+/**
+ * Processes listed jobs, watches the subdirectories found and queues
+ * them. Tells the runner about crawls completed.
+ */
+static void
+crawl_process(lua_State *L)
+{
+	int n;
+	for (n = 0; n < CRAWL_BATCH && !hup && !term; n++) {
+		struct crawl_job *job;
+		struct crawl *c;
+		size_t o;
+#ifdef HAVE_PTHREAD
+		if (workers_count) {
+			pthread_mutex_lock(&crawl_lock);
+			job = dequeue_job(&done_head, &done_tail);
+			pthread_mutex_unlock(&crawl_lock);
+		} else
+#endif
+		job = dequeue_job(&done_head, &done_tail);
+		if (!job) {
+			break;
+		}
+		crawl_listed++;
+		if (job->err) {
+			crawl_failed++;
+		}
+		c = &crawls[job->crawl];
+		{
+			int wd = find_path(job->path);
+			for (o = 0; wd >= 0 && o < job->subdirs_len; 
+			     o += strlen(job->subdirs + o) + 1) 
+			{
+				const char *name = job->subdirs + o;
+				char *sub;
+				size_t pl, nl;
+				if (excluded(wd, name, true)) {
+					continue;
+				}
+				pl = strlen(job->path);
+				nl = strlen(name);
+				sub = s_malloc(pl + nl + 2);
+				memcpy(sub, job->path, pl);
+				memcpy(sub + pl, name, nl);
+				sub[pl + nl] = '/';
+				sub[pl + nl + 1] = 0;
+				if (find_path(sub) < 0) {
+					crawl_watch(L, job->crawl, sub, job->late);
+				}
+				free(sub);
+				/* the runner might have changed the table */
+				wd = find_path(job->path);
+			}
+		}
+		if (--c->pending == 0) {
+			int i;
+			printlogf(L, "Inotify", "crawled %s, %d directories",
+				c->path, (int) c->dirs);
+			c->used = false;
+			free(c->path);
+			c->path = NULL;
+			load_runner_func(L, "inotifyCrawled");
+			lua_pushinteger(L, job->crawl);
+			lua_pushnumber(L, c->dirs);
+			lua_createtable(L, c->late_count, 0);
+			for (i = 0; i < c->late_count; i++) {
+				lua_pushstring(L, c->late[i]);
+				lua_rawseti(L, -2, i + 1);
+				free(c->late[i]);
+			}
+			free(c->late);
+			c->late = NULL;
+			c->late_count = c->late_size = 0;
+			if (lua_pcall(L, 3, 0, -5)) {
+				exit(-1); // ERRNO
+			}
+			lua_pop(L, 1);
+		}
+		free(job->path);
+		free(job->subdirs);
+		free(job);
+	}
+#ifdef HAVE_PTHREAD
+	if (workers_count && n == CRAWL_BATCH) {
+		/* comes back after other observances got their turn */
+		char ch = 0;
+		if (write(crawl_pipe[1], &ch, 1) < 0) {
+			/* the pipe is full, thus the main loop will come back */
+		}
+	}
+#endif
+}
+
+#ifdef HAVE_PTHREAD
+/**
+ * Called when a worker signals listed jobs.
+ */
+static void
+crawl_ready(lua_State *L, struct observance *obs)
+{
+	char buf[64];
+	while (read(crawl_pipe[0], buf, sizeof(buf)) > 0);
+	crawl_process(L);
+}
+
+/**
+ * Stops the workers and closes the pipe.
+ */
+static void
+stop_workers(void)
+{
+	int i;
+	if (!workers_count) {
+		return;
+	}
+	pthread_mutex_lock(&crawl_lock);
+	crawl_stop = true;
+	pthread_cond_broadcast(&crawl_cond);
+	pthread_mutex_unlock(&crawl_lock);
+	for (i = 0; i < workers_count; i++) {
+		pthread_join(workers[i], NULL);
+	}
+	free(workers);
+	workers = NULL;
+	workers_count = 0;
+	crawl_stop = false;
+	close(crawl_pipe[0]);
+	close(crawl_pipe[1]);
+	crawl_pipe[0] = crawl_pipe[1] = -1;
+}
+
+/**
+ * Called when the core stops observing the crawl pipe.
+ */
+static void
+crawl_tidy(struct observance *obs)
+{
+	stop_workers();
+}
+
+/**
+ * Starts the worker threads.
+ */
+static void
+start_workers(lua_State *L)
+{
+	if (pipe(crawl_pipe)) {
+		printlogf(L, "Error", "Cannot create crawl pipe (%d:%s)", 
+			errno, strerror(errno));
+		exit(-1); // ERRNO
+	}
+	close_exec_fd(crawl_pipe[0]);
+	close_exec_fd(crawl_pipe[1]);
+	non_block_fd(crawl_pipe[0]);
+	non_block_fd(crawl_pipe[1]);
+	workers = s_calloc(crawl_threads, sizeof(pthread_t));
+	for (workers_count = 0; workers_count < crawl_threads; workers_count++) {
+		if (pthread_create(&workers[workers_count], NULL, crawl_worker, NULL)) {
+			break;
+		}
+	}
+	printlogf(L, "Inotify", "started %d crawl threads", workers_count);
+	observe_fd(crawl_pipe[0], crawl_ready, NULL, crawl_tidy, NULL);
+}
+#endif
+
+/**
+ * Lists queued jobs in the main loop if there are no worker threads.
+ */
+static void
+crawl_inline(lua_State *L)
+{
+	int n;
+#ifdef HAVE_PTHREAD
+	if (workers_count) {
+		return;
+	}
+#endif
+	for (n = 0; n < CRAWL_BATCH && todo_head; n++) {
+		struct crawl_job *job = dequeue_job(&todo_head, &todo_tail);
+		list_job(job);
+		enqueue_job(&done_head, &done_tail, job);
+	}
+	crawl_process(L);
+}
+
+/**
+ * Starts the initial crawl of a sync root. Watches the root and 
+ * all directories below in the background.
+ *
+ * @param dir         (Lua stack) path of the root
+ * @param inotifyMode (Lua stack) inotify mode to use
+ * @param events      (Lua stack) optional, table of event types wanted 
+ *                                for files, all if nil.
+ * @return            (Lua stack) the crawl number inotifyCrawled() 
+ *                                tells, nil if the root could not 
+ *                                be watched.
+ */
+static int
+l_crawl(lua_State *L)
+{
+	const char *path = luaL_checkstring(L, 1);
+	int c;
+	for (c = 0; c < crawls_count && crawls[c].used; c++);
+	if (c == crawls_count) {
+		crawls = s_realloc(crawls, (crawls_count + 1) * sizeof(struct crawl));
+		crawls_count++;
 	}
-	lua_pushinteger(L, wd);
+	crawls[c].used = true;
+	crawls[c].path = s_strdup(path);
+	crawls[c].pending = 0;
+	crawls[c].dirs = 0;
+	crawls[c].marked = false;
+	crawls[c].late = NULL;
+	crawls[c].late_count = crawls[c].late_size = 0;
+	check_watch_mode(L, 2, &crawls[c].mask, &crawls[c].wants, 
+		&crawls[c].after_modify);
+#ifdef HAVE_PTHREAD
+	if (crawl_threads > 0 && !workers_count) {
+		start_workers(L);
+	}
+#endif
+	if (!crawl_watch(L, c, path, false)) {
+		crawls[c].used = false;
+		free(crawls[c].path);
+		crawls[c].path = NULL;
+		return 0;
+	}
+	lua_pushinteger(L, c);
 	return 1;
 }
 
 /**
- * Removes an inotify watch
- * 
- * @param dir (Lua stack) numeric watch descriptor
- * @return    nil
+ * Marks a crawl as its sync began the startup. The topmost directories
+ * watched from now on are told to inotifyCrawled(), the startup might
+ * have passed them before.
+ *
+ * @param crawl  (Lua stack) the crawl number
  */
 static int
-l_rmwatch(lua_State *L)
+l_crawlmark(lua_State *L)
 {
-	int wd = luaL_checkinteger(L, 1);
-	inotify_rm_watch(inotify_fd, wd);
-	printlogf(L, "Inotify", "rmwatch()<-%d", wd);
+	int c = luaL_checkinteger(L, 1);
+	if (c >= 0 && c < crawls_count && crawls[c].used) {
+		crawls[c].marked = true;
+	}
 	return 0;
 }
 
 /**
- * Cores inotify functions.
+ * Returns true if there are pending moves, alarm is set to the point 
+ * in time the first move window closes. Or right now if a crawl without 
+ * worker threads has directories to list.
  */
-static const luaL_reg linotfylib[] = {
-		{"addwatch",   l_addwatch   },
-		{"rmwatch",    l_rmwatch    },
-		{NULL, NULL}
-};
+extern bool
+inotify_getalarm(clock_t *alarm)
+{
+	int i = oldest_move();
+#ifdef HAVE_PTHREAD
+	if (!workers_count && (todo_head || done_head)) {
+#else
+	if (todo_head || done_head) {
+#endif
+		*alarm = now_jiffies();
+		return true;
+	}
+	if (i < 0) {
+		return false;
+	}
+	*alarm = moves[i].alarm;
+	return true;
+}
+
+/**
+ * Called every masterloop cycle. Continues crawls without worker 
+ * threads. Flushes unary MOVE_FROMs whose window closed as deletes. 
+ * Before anything still waiting in the kernel is read, so a MOVED_TO 
+ * queued in time still gets its partner.
+ */
+extern void
+inotify_cycle(lua_State *L)
+{
+	int i = oldest_move();
+	crawl_inline(L);
+	if (i < 0 || time_before(now_jiffies(), moves[i].alarm)) {
+		return;
+	}
+	if (inotify_fd >= 0 && !hup && !term) {
+		read_events(L);
+	}
+	flush_moves(L, false);
+}
 
 /**
- * Buffer for MOVE_FROM events.
- * Lsyncd buffers MOVE_FROM events to check if
- * they are followed by MOVE_TO events with identical cookie
- * then they are condensed into one move event to be sent to the
- * runner
+ * File times are coarse on some filesystems, 
+ * changes this many seconds before the horizon are told too.
  */
-static struct inotify_event * move_event_buf = NULL;
+#define RESCAN_SLACK 1
 
 /**
- * Memory allocated for move_event_buf
+ * Tells the runner about a change a rescan found, 
+ * unless no sync wants it.
  */
-static size_t move_event_buf_size = 0;
+static void
+rescan_event(lua_State *L, const char *etype, int want, 
+             int wd, bool isdir, const char *name)
+{
+	if (!wanted(wd, want, isdir) || excluded(wd, name, isdir)) {
+		return;
+	}
+	rescan_events++;
+	send_event(L, etype, wd, isdir, name, 0, NULL);
+}
 
 /**
- * true if the buffer is used.
+ * Returns true if the time 't' is not before the rescan horizon.
  */
-static bool move_event = false;
+static bool
+since_horizon(time_t t)
+{
+	return t >= horizon - RESCAN_SLACK;
+}
 
 /**
- * Handles an inotify event.
+ * Rescans the watched directory wd after an overflow.
+ *
+ * Files changed since the horizon are told as Modify, or as Create 
+ * respectively Attrib if only their inode changed and the directory 
+ * listing did or did not. New subdirectories are told as Create, 
+ * the runner watches them and tells their contents. Watched 
+ * subdirectories gone are told as Delete. 
+ *
+ * Files deleted from the directory can not be named, if its listing
+ * changed since the horizon the directory itself is told as Modify.
+ *
+ * @return the number of stat calls done.
  */
-static void 
-handle_event(lua_State *L, 
-             struct inotify_event *event) 
+static int
+rescan_dir(lua_State *L, int wd)
 {
-	const char *event_type = NULL;
+	char *dpath = s_strdup(node_path(wd));
+	size_t dl = strlen(dpath);
+	char *fpath = NULL;
+	size_t fsize = 0;
+	int *children = NULL;
+	int nc = 0;
+	int stats = 1;
+	bool changed;
+	struct stat st;
+	DIR *d;
+	int c;
 
-	/* used to execute two events in case of unmatched MOVE_FROM buffer */
-	struct inotify_event *after_buf = NULL;
-	if (event && (IN_Q_OVERFLOW & event->mask)) {
-		/* and overflow happened, tells the runner */
-		load_runner_func(L, "overflow");
-		if (lua_pcall(L, 0, 0, -2)) {
-			exit(-1); // ERRNO
+	if (lstat(dpath, &st) || !S_ISDIR(st.st_mode)) {
+		/* gone, its parent or IN_IGNORED will tell */
+		free(dpath);
+		return stats;
+	}
+	changed = since_horizon(st.st_mtime);
+	d = opendir(dpath);
+	if (!d) {
+		free(dpath);
+		return stats;
+	}
+	rescan_gen++;
+	while (true) {
+		struct dirent *de = readdir(d);
+		size_t nl;
+		bool isdir;
+		if (!de) {
+			break;
+		}
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) {
+			continue;
+		}
+		nl = strlen(de->d_name);
+		if (dl + nl + 1 > fsize) {
+			fsize = dl + nl + 1;
+			fpath = s_realloc(fpath, fsize);
+		}
+		memcpy(fpath, dpath, dl);
+		memcpy(fpath + dl, de->d_name, nl + 1);
+		stats++;
+		if (lstat(fpath, &st)) {
+			/* vanished meanwhile, an event follows */
+			continue;
+		}
+		isdir = S_ISDIR(st.st_mode);
+		if (isdir) {
+			int cw = find_child(wd, de->d_name, nl);
+			if (cw < 0) {
+				if (send_reclaimed(L, wd, de->d_name, &st)) {
+					rescan_events++;
+				} else {
+					rescan_event(L, CREATE, WANT_CREATE, 
+						wd, true, de->d_name);
+				}
+				/* the runner watches it now */
+				cw = find_child(wd, de->d_name, nl);
+			}
+			if (cw >= 0) {
+				watches[cw].seen = rescan_gen;
+			}
+		} else if (since_horizon(st.st_mtime)) {
+			rescan_event(L, MODIFY, WANT_MODIFY, wd, false, de->d_name);
+		} else if (since_horizon(st.st_ctime)) {
+			if (changed) {
+				/* might have been moved here */
+				if (send_reclaimed(L, wd, de->d_name, &st)) {
+					rescan_events++;
+				} else {
+					rescan_event(L, CREATE, WANT_CREATE, 
+						wd, false, de->d_name);
+				}
+			} else {
+				rescan_event(L, ATTRIB, WANT_ATTRIB, wd, false, de->d_name);
+			}
+		}
+		if (hup || term || !get_watch(wd)) {
+			break;
 		}
-		lua_pop(L, 1);
-		hup = 1;
-		return;
 	}
-	/* cancel on ignored or resetting */
-	if (event && (IN_IGNORED & event->mask)) {
-		return;
+	closedir(d);
+	free(fpath);
+
+	/* the runner might have changed the tree meanwhile */
+	if (!get_watch(wd)) {
+		free(dpath);
+		return stats;
 	}
-	if (event && event->len == 0) {
-		/* sometimes inotify sends such strange events, 
-		 * (e.g. when touching a dir */
-		return;
+	for (c = watches[wd].child; c >= 0; c = watches[c].next) {
+		if (watches[c].seen != rescan_gen) {
+			children = s_realloc(children, (nc + 1) * sizeof(int));
+			children[nc++] = c;
+		}
+	}
+	for (c = 0; c < nc; c++) {
+		struct watch *cw = get_watch(children[c]);
+		if (cw && cw->parent == wd) {
+			char *name = s_strdup(cw->name);
+			/* might have been moved away */
+			gone_dir(wd, name);
+			rescan_event(L, DELETE, WANT_DELETE, wd, true, name);
+			free(name);
+		}
 	}
+	free(children);
 
-	if (event == NULL) {
-		/* a buffered MOVE_FROM is not followed by anything, 
-		   thus it is unary */
-		event = move_event_buf;
-		event_type = "Delete";
-		move_event = false;
-	} else if (move_event && 
-	            ( !(IN_MOVED_TO & event->mask) || 
-			      event->cookie != move_event_buf->cookie) ) {
-		/* there is a MOVE_FROM event in the buffer and this is not the match
-		 * continue in this function iteration to handle the buffer instead */
-		logstring("Inotify", "icore, changing unary MOVE_FROM into DELETE")
-		after_buf = event;
-		event = move_event_buf;
-		event_type = "Delete";
-		move_event = false;
-	} else if ( move_event && 
-	            (IN_MOVED_TO & event->mask) && 
-			    event->cookie == move_event_buf->cookie ) {
-		/* this is indeed a matched move */
-		event_type = "Move";
-		move_event = false;
-	} else if (IN_MOVED_FROM & event->mask) {
-		/* just the MOVE_FROM, buffers this event, and wait if next event is 
-		 * a matching MOVED_TO of this was an unary move out of the watched 
-		 * tree. */
-		size_t el = sizeof(struct inotify_event) + event->len;
-		if (move_event_buf_size < el) {
-			move_event_buf_size = el;
-			move_event_buf = s_realloc(move_event_buf, el);
-		}
-		memcpy(move_event_buf, event, el);
-		move_event = true;
-		return;
-	} else if (IN_MOVED_TO & event->mask) {
-		/* must be an unary move-to */
-		event_type = CREATE;
-	} else if (IN_ATTRIB & event->mask) {
-		/* just attrib change */
-		event_type = ATTRIB;
-	} else if (IN_CLOSE_WRITE & event->mask) {
-		/* closed after written something */
-		event_type = MODIFY;
-	} else if (IN_CREATE & event->mask) {
-		/* a new file */
-		event_type = CREATE;
-	} else if (IN_DELETE & event->mask) {
-		/* rm'ed */
-		event_type = DELETE;
-	} else {
-		logstring("Inotify", "icore, skipped some inotify event.");
-		return;
+	if (changed && get_watch(wd)) {
+		if (watches[wd].parent >= 0) {
+			char *name = s_strdup(watches[wd].name);
+			rescan_event(L, MODIFY, WANT_MODIFY, 
+				watches[wd].parent, true, name);
+			free(name);
+		} else {
+			/* a root, told by its own wd */
+			rescan_event(L, MODIFY, WANT_MODIFY, wd, true, "");
+		}
 	}
+	free(dpath);
+	return stats;
+}
 
-	/* and hands over to runner */
-	load_runner_func(L, "inotifyEvent"); 
-	if (!event_type) {
-		logstring("Error", "Internal: unknown event in handle_event()"); 
-		exit(-1);	// ERRNO
+/**
+ * Does a step of the rescan after an overflow. Rescans watched 
+ * directories until 'budget' stat calls have been done.
+ *
+ * @param budget (Lua stack) number of stat calls allowed.
+ * @return       (Lua stack) true if the rescan is not yet complete.
+ */
+static int
+l_rescan(lua_State *L)
+{
+	unsigned long budget = luaL_checkinteger(L, 1);
+	unsigned long done = 0;
+	while (rescanning && done < budget && !hup && !term) {
+		if (rescan_cursor >= watches_size) {
+			rescanning = false;
+			break;
+		}
+		if (watches[rescan_cursor].used) {
+			done += rescan_dir(L, rescan_cursor);
+		}
+		rescan_cursor++;
 	}
-	lua_pushstring(L, event_type); 
-	if (event_type != MOVE) {
-		lua_pushnumber(L, event->wd);
+	rescan_stats += done;
+	lua_pushboolean(L, rescanning);
+	return 1;
+}
+
+/**
+ * Configures the inotify core.
+ *
+ * @param (Lua stack) command, "movewindow" sets the time in seconds a 
+ *                    MOVED_FROM waits for its MOVED_TO.
+ *                    "crawlthreads" the number of threads listing
+ *                    directories for initial crawls, 0 for none.
+ * @param (Lua stack) value of the command.
+ */
+static int
+l_configure(lua_State *L)
+{
+	const char *command = luaL_checkstring(L, 1);
+	if (!strcmp(command, "movewindow")) {
+		lua_Number w = luaL_checknumber(L, 2);
+		if (w < 0) {
+			printlogf(L, "Error", "inotify move window must not be negative.");
+			exit(-1); // ERRNO
+		}
+		move_window = (clock_t) (w * clocks_per_sec);
+		printlogf(L, "Inotify", "move window = %d jiffies", (int) move_window);
+	} else if (!strcmp(command, "crawlthreads")) {
+		int n = luaL_checkinteger(L, 2);
+		if (n < 0) {
+			printlogf(L, "Error", "inotify crawl threads must not be negative.");
+			exit(-1); // ERRNO
+		}
+		crawl_threads = n;
 	} else {
-		lua_pushnumber(L, move_event_buf->wd);
+		printlogf(L, "Error", 
+			"Internal error, unknown inotify configure command '%s'", command);
+		exit(-1); // ERRNO
 	}
-	lua_pushboolean(L, (event->mask & IN_ISDIR) != 0);
-	l_now(L);
-	if (event_type == MOVE) {
-		lua_pushstring(L, move_event_buf->name);
-		lua_pushnumber(L, event->wd);
-		lua_pushstring(L, event->name);
-	} else {
-		lua_pushstring(L, event->name);
-		lua_pushnil(L);
-		lua_pushnil(L);
+	return 0;
+}
+
+/**
+ * Checks the watch tree for consistency. Drops nodes whose parent
+ * is gone, these are not reachable by path anymore.
+ *
+ * @return (Lua stack) number of stale watch table entries dropped.
+ */
+static int
+l_check(lua_State *L)
+{
+	int wd;
+	int stale = 0;
+	for (wd = 0; wd < watches_size; wd++) {
+		struct watch *w = &watches[wd];
+		if (w->used && w->parent >= 0 && !watches[w->parent].used) {
+			int c = watches_count;
+			unlink_node(wd, true);
+			stale += c - watches_count;
+		}
 	}
-	if (lua_pcall(L, 7, 0, -9)) {
-		exit(-1); // ERRNO
+	lua_pushinteger(L, stale);
+	return 1;
+}
+
+/**
+ * A subtree that could be handed over to polling.
+ */
+struct cold {
+	/* its top directory */
+	int wd;
+
+	/* jiffies since anything happened in the subtree */
+	long idle;
+
+	/* number of watches in the subtree */
+	int size;
+};
+
+/**
+ * Collects the subtrees below wd into 'colds', returns when
+ * anything last happened in wd or below.
+ */
+static clock_t
+collect_colds(int wd, clock_t now, struct cold *colds, int *n, int *size)
+{
+	clock_t last = watches[wd].active;
+	int c;
+	*size = 1;
+	for (c = watches[wd].child; c >= 0; c = watches[c].next) {
+		int cs;
+		clock_t cl = collect_colds(c, now, colds, n, &cs);
+		if (time_after(cl, last)) {
+			last = cl;
+		}
+		*size += cs;
 	}
-	lua_pop(L, 1);
+	if (watches[wd].parent >= 0) {
+		/* sync roots stay watched */
+		colds[*n].wd = wd;
+		colds[*n].idle = (long) now - (long) last;
+		colds[*n].size = *size;
+		(*n)++;
+	}
+	return last;
+}
 
-	/* if there is a buffered event executes it */
-	if (after_buf) {
-		logstring("Inotify", "icore, handling buffered event.");
-		handle_event(L, after_buf);
+/**
+ * Compares subtrees for qsort, the longest idle and then the
+ * largest first.
+ */
+static int
+cold_cmp(const void *a, const void *b)
+{
+	const struct cold *ca = a;
+	const struct cold *cb = b;
+	if (ca->idle != cb->idle) {
+		return ca->idle > cb->idle ? -1 : 1;
 	}
+	return cb->size - ca->size;
 }
 
-/** 
- * buffer to read inotify events into
+/**
+ * Marks the unmarked watches of the subtree wd, returns their number.
+ * Subtrees marked already are skipped as a whole.
  */
-static size_t readbuf_size = 2048;
-static char * readbuf = NULL;
+static int
+mark_subtree(int wd, bool *marks)
+{
+	int n = 1;
+	int c;
+	marks[wd] = true;
+	for (c = watches[wd].child; c >= 0; c = watches[c].next) {
+		if (!marks[c]) {
+			n += mark_subtree(c, marks);
+		}
+	}
+	return n;
+}
 
 /**
- * Called by function pointer from when the inotify file descriptor 
- * became ready. Reads it contents and forward all received events
- * to the runner.
+ * Returns the subtrees of the watch tree nothing happened in for the 
+ * longest time, to be handed over to polling.
+ *
+ * A subtree listed after subtrees below it covers them.
+ *
+ * @param need (Lua stack) number of watches to free, 
+ *                         0 to list all subtrees idle enough.
+ * @param idle (Lua stack) seconds a subtree must be idle at least.
+ * @return     (Lua stack) list of absolute paths of the subtrees.
  */
-static void
-inotify_ready(lua_State *L, struct observance *obs)
+static int
+l_coldest(lua_State *L)
 {
-	if (obs->fd != inotify_fd) {
-		logstring("Error", "Internal, inotify_fd != ob->fd");
-		exit(-1); // ERRNO
+	int need = luaL_checkinteger(L, 1);
+	long idle = (long) (luaL_checknumber(L, 2) * clocks_per_sec);
+	clock_t now = now_jiffies();
+	struct cold *colds = s_malloc((watches_count + 1) * sizeof(struct cold));
+	bool *marks = s_calloc(watches_size + 1, sizeof(bool));
+	int n = 0;
+	int freed = 0;
+	int listed = 0;
+	int r, i;
+	for (r = first_root; r >= 0; r = watches[r].next) {
+		int size;
+		collect_colds(r, now, colds, &n, &size);
 	}
-	while(true) {
-		ptrdiff_t len; 
-		int err;
-		do {
-			len = read (inotify_fd, readbuf, readbuf_size);
-			err = errno;
-			if (len < 0 && err == EINVAL) {
-				/* kernel > 2.6.21 indicates that way that way that
-				 * the buffer was too small to fit a filename.
-				 * double its size and try again. When using a lower
-				 * kernel and a filename > 2KB appears lsyncd
-				 * will fail. (but does a 2KB filename really happen?)
-				 */
-				readbuf_size *= 2;
-				readbuf = s_realloc(readbuf, readbuf_size);
-				continue;
-			}
-		} while(0);
-		if (len == 0) {
-			/* nothing more inotify */
+	qsort(colds, n, sizeof(struct cold), cold_cmp);
+	lua_newtable(L);
+	for (i = 0; i < n && (!need || freed < need); i++) {
+		int a;
+		if (colds[i].idle < idle) {
 			break;
 		}
-		if (len < 0) {
-			if (err == EAGAIN) {
-				/* nothing more inotify */
-				break;
-			} else {
-				printlogf(L, "Error", "Read fail on inotify");
-				exit(-1); // ERRNO
-			}
+		/* skips subtrees within a listed one */
+		for (a = watches[colds[i].wd].parent; a >= 0 && !marks[a]; 
+		     a = watches[a].parent);
+		if (a >= 0) {
+			continue;
 		}
-		{
-			int i = 0;
-			while (i < len && !hup && !term) {
-				struct inotify_event *event = 
-					(struct inotify_event *) &readbuf[i];
-				handle_event(L, event);
-				i += sizeof(struct inotify_event) + event->len;
+		freed += mark_subtree(colds[i].wd, marks);
+		lua_pushstring(L, node_path(colds[i].wd));
+		lua_rawseti(L, -2, ++listed);
+	}
+	free(colds);
+	free(marks);
+	return 1;
+}
+
+/**
+ * Returns the sum of the path lengths of the directory wd and all its
+ * subdirectories, the length of wd's parents path being 'base'.
+ */
+static size_t
+path_lengths(int wd, size_t base)
+{
+	size_t len = base + strlen(watches[wd].name) + 
+		(watches[wd].parent >= 0 ? 1 : 0);
+	size_t sum = len;
+	int c;
+	for (c = watches[wd].child; c >= 0; c = watches[c].next) {
+		sum += path_lengths(c, len);
+	}
+	return sum;
+}
+
+/**
+ * Returns a table of inotify core statistics.
+ *
+ * @param (Lua stack) if true also calculates the memory of the watch 
+ *                    table compared to Lua tables of absolute paths.
+ */
+static int
+l_stats(lua_State *L)
+{
+	bool with_memory = lua_toboolean(L, 1);
+	lua_newtable(L);
+	lua_pushnumber(L, moves_paired);
+	lua_setfield(L, -2, "movesPaired");
+	lua_pushnumber(L, dirs_moved);
+	lua_setfield(L, -2, "directoriesMoved");
+	lua_pushnumber(L, moves_reclaimed);
+	lua_setfield(L, -2, "movesReclaimed");
+	lua_pushnumber(L, moves_unpaired);
+	lua_setfield(L, -2, "movesUnpaired");
+	lua_pushnumber(L, moves_pending);
+	lua_setfield(L, -2, "movesPending");
+	lua_pushnumber(L, events_dropped);
+	lua_setfield(L, -2, "eventsDropped");
+	lua_pushnumber(L, events_excluded);
+	lua_setfield(L, -2, "eventsExcluded");
+	lua_pushnumber(L, writes_skipped);
+	lua_setfield(L, -2, "writesSkipped");
+	lua_pushnumber(L, writtens_count);
+	lua_setfield(L, -2, "writesOpen");
+	lua_pushnumber(L, watches_count);
+	lua_setfield(L, -2, "watches");
+	lua_pushnumber(L, overflows);
+	lua_setfield(L, -2, "overflows");
+	lua_pushnumber(L, rescan_stats);
+	lua_setfield(L, -2, "rescanStats");
+	lua_pushnumber(L, rescan_events);
+	lua_setfield(L, -2, "rescanEvents");
+	lua_pushnumber(L, crawl_dirs);
+	lua_setfield(L, -2, "crawlDirectories");
+	lua_pushnumber(L, crawl_listed);
+	lua_setfield(L, -2, "crawlListed");
+	lua_pushnumber(L, crawl_failed);
+	lua_setfield(L, -2, "crawlFailed");
+	{
+		int c, pending = 0;
+		for (c = 0; c < crawls_count; c++) {
+			if (crawls[c].used) {
+				pending += crawls[c].pending;
 			}
 		}
-		if (!move_event) {
-			/* give it a pause if not endangering splitting a move */
-			break;
-		}
+		lua_pushnumber(L, pending);
+		lua_setfield(L, -2, "crawlPending");
 	}
-
-	/* checks if there is an unary MOVE_FROM left in the buffer */
-	if (move_event) {
-		logstring("Inotify", "icore, handling unary move from.");
-		handle_event(L, NULL);	
+	if (with_memory) {
+		/* the watch table, guesses 16 bytes malloc overhead per name */
+		size_t mem = watches_size * sizeof(struct watch) + 
+			names_size * sizeof(int) + names_memory + 16 * watches_count;
+		/* the same as Lua tables of absolute paths, every directory 
+		 * needs a string (24 bytes + path) and two hash nodes 
+		 * (40 bytes each) */
+		size_t lmem = 104 * (size_t) watches_count;
+		int r;
+		for (r = first_root; r >= 0; r = watches[r].next) {
+			lmem += path_lengths(r, 0) + 1;
+		}
+		lua_pushnumber(L, mem);
+		lua_setfield(L, -2, "watchMemory");
+		lua_pushnumber(L, lmem);
+		lua_setfield(L, -2, "watchMemoryLua");
 	}
+	return 1;
 }
 
+/**
+ * Cores inotify functions.
+ */
+static const luaL_reg linotfylib[] = {
+		{"addsync",    l_addsync    },
+		{"addwatch",   l_addwatch   },
+		{"check",      l_check      },
+		{"coldest",    l_coldest    },
+		{"configure",  l_configure  },
+		{"crawl",      l_crawl      },
+		{"crawlmark",  l_crawlmark  },
+		{"lookup",     l_lookup     },
+		{"move",       l_move       },
+		{"path",       l_path       },
+		{"rescan",     l_rescan     },
+		{"rmwatch",    l_rmwatch    },
+		{"stats",      l_stats      },
+		{"walk",       l_walk       },
+		{NULL, NULL}
+};
+
 /** 
  * registers inotify functions.
  */
@@ -371,8 +2750,80 @@ inotify_tidy(struct observance *obs)
 		exit(-1); // ERRNO
 	}
 	close(inotify_fd);
+	inotify_fd = -1;
 	free(readbuf);
 	readbuf = NULL;
+	{
+		int i;
+		for (i = 0; i < MOVES_SIZE; i++) {
+			free(moves[i].event);
+		}
+		memset(moves, 0, sizeof(moves));
+		moves_pending = 0;
+	}
+	clear_writtens(-1);
+	free(writtens);
+	writtens = NULL;
+	writtens_size = 0;
+	{
+		int wd;
+		for (wd = 0; wd < watches_size; wd++) {
+			free(watches[wd].name);
+		}
+	}
+	free(watches);
+	watches = NULL;
+	watches_size = 0;
+	watches_count = 0;
+	first_root = -1;
+	free(names);
+	names = NULL;
+	names_size = 0;
+	names_memory = 0;
+	free(pathbuf);
+	pathbuf = NULL;
+	pathbuf_size = 0;
+	{
+		/* the excludes userdata go with the Lua state */
+		int i;
+		for (i = 0; i < sync_roots_count; i++) {
+			free(sync_roots[i].path);
+		}
+		free(sync_roots);
+		sync_roots = NULL;
+		sync_roots_count = sync_roots_size = 0;
+	}
+	free(ignored_wds);
+	ignored_wds = NULL;
+	ignored_size = ignored_count = 0;
+	rescanning = false;
+	rescan_cursor = 0;
+	{
+		/* the workers touch the queues */
+		struct crawl_job *job;
+		int c;
+#ifdef HAVE_PTHREAD
+		stop_workers();
+#endif
+		while ((job = dequeue_job(&todo_head, &todo_tail)) ||
+		       (job = dequeue_job(&done_head, &done_tail)))
+		{
+			free(job->path);
+			free(job->subdirs);
+			free(job);
+		}
+		for (c = 0; c < crawls_count; c++) {
+			int i;
+			free(crawls[c].path);
+			for (i = 0; i < crawls[c].late_count; i++) {
+				free(crawls[c].late[i]);
+			}
+			free(crawls[c].late);
+		}
+		free(crawls);
+		crawls = NULL;
+		crawls_count = 0;
+	}
 }
 
 /** 
@@ -387,6 +2838,15 @@ open_inotify(lua_State *L)
 		exit(-1); // ERRNO
 	}
 	readbuf = s_malloc(readbuf_size);
+	move_window = clocks_per_sec / 10;
+	moves_paired = moves_unpaired = moves_reclaimed = 0;
+	dirs_moved = 0;
+	writes_skipped = 0;
+	events_dropped = 0;
+	events_excluded = 0;
+	overflows = rescan_stats = rescan_events = 0;
+	crawl_dirs = crawl_listed = crawl_failed = 0;
+	drained = time(NULL);
 
 	inotify_fd = inotify_init();
 	if (inotify_fd < 0) {
@@ -18,6 +18,7 @@
 
 #include <sys/select.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/times.h>
 #include <sys/types.h>
 #include <sys/wait.h>
@@ -37,6 +38,10 @@
 #include <time.h>
 #include <unistd.h>
 
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
 #define LUA_USE_APICHECK 1
 
 #include <lua.h>
@@ -57,10 +62,12 @@
 #ifndef LSYNCD_WITH_INOTIFY
 #ifndef LSYNCD_WITH_FANOTIFY
 #ifndef LSYNCD_WITH_FSEVENTS
+#ifndef LSYNCD_WITH_POLL
 #	error "need at least one notifcation system. please rerun ./configure"
 #endif
 #endif
 #endif
+#endif
 
 /**
  * All monitors supported by this Lsyncd.
@@ -74,6 +81,9 @@ static char *monitors[] = {
 #endif
 #ifdef LSYNCD_WITH_FSEVENTS
 	"fsevents",
+#endif
+#ifdef LSYNCD_WITH_POLL
+	"poll",
 #endif
 	NULL,
 };
@@ -147,7 +157,7 @@ volatile sig_atomic_t term = 0;
 /**
  * The kernels clock ticks per second.
  */
-static long clocks_per_sec; 
+long clocks_per_sec; 
 
 /**
  * signal handler
@@ -738,6 +748,346 @@ user_obs_tidy(struct observance *obs)
 }
 
 
+/*****************************************************************************
+ * Directory streams
+ *
+ * Reads directories with getdents64() into large buffers. Only entries
+ * the filesystem tells no type for cost a stat, relative to the 
+ * directory. The runner reads huge directories this way a batch at a 
+ * time, instead of building a table of all entries at once.
+ ****************************************************************************/
+
+/**
+ * Bytes of entries read from the kernel at once.
+ */
+#define DIRSTREAM_BUFFER 65536
+
+/**
+ * The entry format of getdents64(). 
+ */
+struct linux_dirent64 {
+	uint64_t       d_ino;
+	int64_t        d_off;
+	unsigned short d_reclen;
+	unsigned char  d_type;
+	char           d_name[];
+};
+
+/**
+ * Opens the directory 'path' for reading.
+ */
+extern bool
+dirstream_open(struct dirstream *ds, const char *path)
+{
+	ds->err = 0;
+	ds->buf = NULL;
+	ds->pos = ds->len = 0;
+	ds->fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (ds->fd < 0) {
+		ds->err = errno;
+		return false;
+	}
+	ds->buf = s_malloc(DIRSTREAM_BUFFER);
+	return true;
+}
+
+/**
+ * Returns the next entry of a directory stream or NULL at its end.
+ */
+extern const char *
+dirstream_next(struct dirstream *ds, bool *isdir)
+{
+	while (ds->fd >= 0) {
+		struct linux_dirent64 *de;
+		if (ds->pos >= ds->len) {
+			ds->len = syscall(SYS_getdents64, ds->fd, 
+				ds->buf, DIRSTREAM_BUFFER);
+			ds->pos = 0;
+			if (ds->len <= 0) {
+				ds->err = ds->len < 0 ? errno : 0;
+				dirstream_close(ds);
+				return NULL;
+			}
+		}
+		de = (struct linux_dirent64 *) (ds->buf + ds->pos);
+		ds->pos += de->d_reclen;
+		if (de->d_name[0] == '.' && (!de->d_name[1] || 
+		    (de->d_name[1] == '.' && !de->d_name[2]))) 
+		{
+			continue;
+		}
+		if (de->d_type == DT_UNKNOWN) {
+			/* must call stat on some filesystems */
+			struct stat st;
+			if (fstatat(ds->fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW)) {
+				/* vanished meanwhile */
+				continue;
+			}
+			*isdir = S_ISDIR(st.st_mode);
+		} else {
+			*isdir = de->d_type == DT_DIR;
+		}
+		return de->d_name;
+	}
+	return NULL;
+}
+
+/**
+ * Closes a directory stream.
+ */
+extern void
+dirstream_close(struct dirstream *ds)
+{
+	if (ds->fd >= 0) {
+		close(ds->fd);
+		ds->fd = -1;
+	}
+	free(ds->buf);
+	ds->buf = NULL;
+}
+
+/*****************************************************************************
+ * Metadata service
+ *
+ * Stats the paths of events for the runner in worker threads, so the 
+ * main loop does not wait for a slow filesystem. The results are handed
+ * to the runner by the main loop when a worker wakes it through a pipe.
+ ****************************************************************************/
+
+/**
+ * A path to stat.
+ */
+struct stat_job {
+	/* next job in its queue */
+	struct stat_job *next;
+
+	/* the number the runner got for this job */
+	unsigned long ticket;
+
+	/* errno of lstat(), 0 on success */
+	int err;
+
+	/* the result */
+	struct stat st;
+
+	/* absolute path */
+	char path[];
+};
+
+/**
+ * Jobs to do and jobs done, the first and last of each.
+ */
+static struct stat_job *stat_todo = NULL;
+static struct stat_job *stat_todo_tail = NULL;
+static struct stat_job *stat_done = NULL;
+static struct stat_job *stat_done_tail = NULL;
+
+/**
+ * The last ticket given.
+ */
+static unsigned long stat_tickets = 0;
+
+/**
+ * Number of threads to start, 0 stats in the main loop.
+ */
+static int stat_threads = 2;
+
+/**
+ * Pipe the results are signaled through, -1 if not yet opened.
+ */
+static int stat_pipe[2] = { -1, -1 };
+
+#ifdef HAVE_PTHREAD
+static pthread_t *stat_workers = NULL;
+static int stat_workers_count = 0;
+static pthread_mutex_t stat_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t stat_cond = PTHREAD_COND_INITIALIZER;
+static bool stat_stop = false;
+#endif
+
+/**
+ * Appends a job to a queue.
+ */
+static void
+enqueue_stat(struct stat_job **head, struct stat_job **tail, 
+             struct stat_job *job)
+{
+	job->next = NULL;
+	if (*tail) {
+		(*tail)->next = job;
+	} else {
+		*head = job;
+	}
+	*tail = job;
+}
+
+/**
+ * Stats a job and puts it to the jobs done. 
+ * Wakes the main loop if it is the first.
+ */
+static void
+stat_job(struct stat_job *job)
+{
+	bool wake;
+	job->err = lstat(job->path, &job->st) ? errno : 0;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&stat_lock);
+#endif
+	wake = !stat_done;
+	enqueue_stat(&stat_done, &stat_done_tail, job);
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&stat_lock);
+#endif
+	if (wake) {
+		char c = 0;
+		if (write(stat_pipe[1], &c, 1) < 0) {
+			/* the pipe is full, thus the main loop awake */
+		}
+	}
+}
+
+#ifdef HAVE_PTHREAD
+/**
+ * A thread statting jobs.
+ */
+static void *
+stat_worker(void *arg)
+{
+	pthread_mutex_lock(&stat_lock);
+	while (!stat_stop) {
+		struct stat_job *job = stat_todo;
+		if (!job) {
+			pthread_cond_wait(&stat_cond, &stat_lock);
+			continue;
+		}
+		stat_todo = job->next;
+		if (!stat_todo) {
+			stat_todo_tail = NULL;
+		}
+		pthread_mutex_unlock(&stat_lock);
+		stat_job(job);
+		pthread_mutex_lock(&stat_lock);
+	}
+	pthread_mutex_unlock(&stat_lock);
+	return NULL;
+}
+#endif
+
+/**
+ * Hands the jobs done to the runner.
+ */
+static void
+stat_ready(lua_State *L, struct observance *obs)
+{
+	struct stat_job *job;
+	char buf[64];
+	while (read(stat_pipe[0], buf, sizeof(buf)) > 0);
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&stat_lock);
+#endif
+	job = stat_done;
+	stat_done = stat_done_tail = NULL;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&stat_lock);
+#endif
+	while (job) {
+		struct stat_job *next = job->next;
+		int nargs = 1;
+		load_runner_func(L, "statted");
+		lua_pushnumber(L, job->ticket);
+		if (!job->err) {
+			lua_pushnumber(L, job->st.st_size);
+			lua_pushnumber(L, job->st.st_mtim.tv_sec + 
+				job->st.st_mtim.tv_nsec / 1000000000.0);
+			lua_pushnumber(L, job->st.st_ino);
+			lua_pushinteger(L, job->st.st_mode);
+			nargs += 4;
+		}
+		if (lua_pcall(L, nargs, 0, -(nargs + 2))) {
+			exit(-1); // ERRNO
+		}
+		lua_pop(L, 1);
+		free(job);
+		job = next;
+	}
+}
+
+/**
+ * Frees the jobs of a queue.
+ */
+static void
+free_stats(struct stat_job **head, struct stat_job **tail)
+{
+	while (*head) {
+		struct stat_job *next = (*head)->next;
+		free(*head);
+		*head = next;
+	}
+	*tail = NULL;
+}
+
+/**
+ * Called when the core stops observing the pipe, on reset and exit.
+ * Stops the workers and drops all jobs.
+ */
+static void
+stat_tidy(struct observance *obs)
+{
+#ifdef HAVE_PTHREAD
+	int i;
+	pthread_mutex_lock(&stat_lock);
+	stat_stop = true;
+	pthread_cond_broadcast(&stat_cond);
+	pthread_mutex_unlock(&stat_lock);
+	for (i = 0; i < stat_workers_count; i++) {
+		pthread_join(stat_workers[i], NULL);
+	}
+	free(stat_workers);
+	stat_workers = NULL;
+	stat_workers_count = 0;
+	stat_stop = false;
+#endif
+	free_stats(&stat_todo, &stat_todo_tail);
+	free_stats(&stat_done, &stat_done_tail);
+	close(stat_pipe[0]);
+	close(stat_pipe[1]);
+	stat_pipe[0] = stat_pipe[1] = -1;
+}
+
+/**
+ * Opens the pipe and starts the workers.
+ */
+static void
+stat_start(lua_State *L)
+{
+	if (pipe(stat_pipe)) {
+		printlogf(L, "Error", "Cannot create stat pipe (%d:%s)", 
+			errno, strerror(errno));
+		exit(-1); // ERRNO
+	}
+	close_exec_fd(stat_pipe[0]);
+	close_exec_fd(stat_pipe[1]);
+	non_block_fd(stat_pipe[0]);
+	non_block_fd(stat_pipe[1]);
+#ifdef HAVE_PTHREAD
+	if (stat_threads > 0) {
+		stat_workers = s_calloc(stat_threads, sizeof(pthread_t));
+		for (stat_workers_count = 0; stat_workers_count < stat_threads; 
+		     stat_workers_count++) 
+		{
+			if (pthread_create(&stat_workers[stat_workers_count], 
+			    NULL, stat_worker, NULL)) 
+			{
+				break;
+			}
+		}
+		printlogf(L, "Normal", "started %d stat threads", 
+			stat_workers_count);
+	}
+#endif
+	observe_fd(stat_pipe[0], stat_ready, NULL, stat_tidy, NULL);
+}
+
 /*****************************************************************************
  * Library calls for lsyncd.lua
  * 
@@ -816,6 +1166,15 @@ l_log(lua_State *L)
 	return 0;
 }
 
+/**
+ * Returns the current kernels clock state (jiffies)
+ */
+extern clock_t
+now_jiffies(void)
+{
+	return times(dummy_tms);
+}
+
 /**
  * Returns (on Lua stack) the current kernels 
  * clock state (jiffies)
@@ -826,7 +1185,7 @@ l_now(lua_State *L)
 	clock_t *j = lua_newuserdata(L, sizeof(clock_t));
 	luaL_getmetatable(L, "Lsyncd.jiffies");
 	lua_setmetatable(L, -2);
-	*j = times(dummy_tms);
+	*j = now_jiffies();
 	return 1;
 }
 
@@ -1087,56 +1446,141 @@ l_stackdump(lua_State* L)
  *
  * @param  (Lua stack) absolute path to directory.
  * @return (Lua stack) a table of directory names.
- *                     names are keys, values are boolean 
+ *                     names are keys, values are boolean
  *                     true on dirs.
+ *                     nil if unreadable or interrupted by a signal.
  */
 static int
 l_readdir (lua_State *L)
 {
 	const char * dirname = luaL_checkstring(L, 1);
-	DIR *d;
+	struct dirstream ds;
+	const char *name;
+	bool isdir;
 
-	d = opendir(dirname);
-	if (d == NULL) {
+	if (!dirstream_open(&ds, dirname)) {
 		printlogf(L, "Error", "cannot open dir [%s].", dirname);
 		return 0;
 	}
 	
 	lua_newtable(L);
-	while (!hup && !term) {
-		struct dirent *de = readdir(d);
-		bool isdir;
-		if (de == NULL) {
-			/* finished */
-			break;
+	while ((name = dirstream_next(&ds, &isdir))) {
+		if (hup || term) {
+			/* a partial list must not be taken as complete */
+			dirstream_close(&ds);
+			lua_pop(L, 1);
+			return 0;
 		}
+		/* adds this entry to the Lua table */
+		lua_pushstring(L, name);
+		lua_pushboolean(L, isdir);
+		lua_settable(L, -3);
+	}
+	return 1;
+}
 
-		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) { 
-			/* ignores . and .. */
-			continue;
-		}
+/**
+ * Opens a directory to read its entries one by one, for directories 
+ * too large to be read at once by readdir().
+ *
+ * @param  (Lua stack) absolute path to directory.
+ * @return (Lua stack) directory userdata, or nil and an error message.
+ */
+static int
+l_opendir(lua_State *L)
+{
+	const char *dirname = luaL_checkstring(L, 1);
+	struct dirstream *ds = lua_newuserdata(L, sizeof(struct dirstream));
+	ds->fd = -1;
+	ds->buf = NULL;
+	luaL_getmetatable(L, "Lsyncd.dir");
+	lua_setmetatable(L, -2);
+	if (!dirstream_open(ds, dirname)) {
+		lua_pushnil(L);
+		lua_pushstring(L, strerror(errno));
+		return 2;
+	}
+	return 1;
+}
 
-		if (de->d_type == DT_UNKNOWN) {
-			/* must call stat on some systems :-/ */
-			char *entry = s_malloc(strlen(dirname) + strlen(de->d_name) + 2);
-			struct stat st;
-			strcpy(entry, dirname);
-			strcat(entry, "/");
-			strcat(entry, de->d_name);
-			lstat(entry, &st);
-			isdir = S_ISDIR(st.st_mode);
-			free(entry);
-		} else {
-			/* readdir can trusted */
-			isdir = de->d_type == DT_DIR;
+/**
+ * Returns the directory userdata at 'idx' of the Lua stack.
+ */
+static struct dirstream *
+check_dir(lua_State *L, int idx)
+{
+	return (struct dirstream *) luaL_checkudata(L, idx, "Lsyncd.dir");
+}
+
+/**
+ * Reads the next entry of a directory.
+ *
+ * @param  (Lua stack) directory userdata
+ * @return (Lua stack) name and true if a directory, 
+ *                     nil at the end, followed by an error message
+ *                     if reading failed.
+ */
+static int
+l_dir_next(lua_State *L)
+{
+	struct dirstream *ds = check_dir(L, 1);
+	bool isdir;
+	const char *name = dirstream_next(ds, &isdir);
+	if (!name) {
+		lua_pushnil(L);
+		if (ds->err) {
+			lua_pushstring(L, strerror(ds->err));
+			return 2;
 		}
+		return 1;
+	}
+	lua_pushstring(L, name);
+	lua_pushboolean(L, isdir);
+	return 2;
+}
 
-		/* adds this entry to the Lua table */
-		lua_pushstring(L, de->d_name);
-		lua_pushboolean(L, isdir);
-		lua_settable(L, -3);
+/**
+ * Closes a directory before reaching its end.
+ */
+static int
+l_dir_close(lua_State *L)
+{
+	dirstream_close(check_dir(L, 1));
+	return 0;
+}
+
+/**
+ * Stats a path in the background. The result is handed to the 
+ * runners statted() with the ticket, and if the path exists its 
+ * size, mtime, inode and mode.
+ *
+ * @param  (Lua stack) absolute path
+ * @return (Lua stack) the ticket
+ */
+static int
+l_stat(lua_State *L)
+{
+	size_t pl;
+	const char *path = luaL_checklstring(L, 1, &pl);
+	struct stat_job *job = s_malloc(sizeof(struct stat_job) + pl + 1);
+	memcpy(job->path, path, pl + 1);
+	job->ticket = ++stat_tickets;
+	if (stat_pipe[0] < 0) {
+		stat_start(L);
+	}
+	lua_pushnumber(L, job->ticket);
+#ifdef HAVE_PTHREAD
+	if (stat_workers_count) {
+		pthread_mutex_lock(&stat_lock);
+		enqueue_stat(&stat_todo, &stat_todo_tail, job);
+		pthread_cond_signal(&stat_cond);
+		pthread_mutex_unlock(&stat_lock);
+		return 1;
 	}
-	closedir(d);
+#endif
+	/* no threads, stats right away but tells in the next cycle
+	 * just the same */
+	stat_job(job);
 	return 1;
 }
 
@@ -1220,6 +1664,9 @@ l_configure(lua_State *L)
 			printlogf(L, "Error", "Logging facility must be a number or string");
 			exit(-1); // ERRNO;
 		}
+	} else if (!strcmp(command, "statthreads")) {
+		/* takes effect when the workers are started */
+		stat_threads = luaL_checkinteger(L, 2);
 	} else if (!strcmp(command, "logident")) {
 		const char * ident = luaL_checkstring(L, 2);
 		if (settings.log_ident) {
@@ -1327,54 +1774,1731 @@ l_nonobserve_fd(lua_State *L)
 
 
 
-static const luaL_reg lsyncdlib[] = {
-		{"configure",     l_configure     },
-		{"exec",          l_exec          },
-		{"log",           l_log           },
-		{"now",           l_now           },
-		{"nonobserve_fd", l_nonobserve_fd },
-		{"observe_fd",    l_observe_fd    },
-		{"readdir",       l_readdir       },
-		{"realdir",       l_realdir       },
-		{"stackdump",     l_stackdump     },
-		{"terminate",     l_terminate     },
-		{NULL, NULL}
+/*****************************************************************************
+ * Compiled exclude patterns
+ *
+ * The patterns are rsync like, '?' matches any character but '/', '*' 
+ * any number of those and '**' anything. A pattern starting with '/' 
+ * matches from the root only, others at the start of any path component.
+ * A match must end at a '/' or the end of the path, unless the pattern 
+ * ends with '$'.
+ *
+ * All patterns of a set are compiled into one tree of tokens sharing 
+ * their prefixes, that is simulated as nondeterministic automaton. 
+ * Literal transitions are looked up in a hash.
+ ****************************************************************************/
+
+/* how a node is entered */
+enum exnode_type { 
+	EX_ROOT,  /* a root */
+	EX_LIT,   /* a literal character */
+	EX_ANY,   /* '?'  any character but '/' */
+	EX_STAR,  /* '*'  any number of characters but '/' */
+	EX_DSTAR, /* '**' any number of any characters */
 };
 
+/* node accepts if followed by '/' or the end */
+#define EX_ACCEPT_BOUNDARY 0x01
+/* node accepts whatever follows */
+#define EX_ACCEPT_ANY      0x02
+
 /**
- * Adds two jiffies or a number to a jiffy
+ * A node of the compiled patterns.
  */
-static int 
-l_jiffies_add(lua_State *L) 
-{
-	clock_t *p1 = (clock_t *) lua_touserdata(L, 1);
-	clock_t *p2 = (clock_t *) lua_touserdata(L, 2);
-	if (p1 && p2) {
-		logstring("Error", "Cannot add to timestamps!");
-		exit(-1); /* ERRNO */
-	}
-	{
-		clock_t a1  = p1 ? *p1 :  luaL_checknumber(L, 1) * clocks_per_sec;
-		clock_t a2  = p2 ? *p2 :  luaL_checknumber(L, 2) * clocks_per_sec;
-		clock_t *r  = (clock_t *) lua_newuserdata(L, sizeof(clock_t));
-		luaL_getmetatable(L, "Lsyncd.jiffies");
-		lua_setmetatable(L, -2);
-		*r = a1 + a2; 
-		return 1;
-	}
-}
+struct exnode {
+	/* how the node is entered (enum exnode_type) */
+	unsigned char type;
+
+	/* EX_ACCEPT_* flags */
+	unsigned char accept;
+
+	/* wildcard children, -1 if none */
+	int any;
+	int star;
+	int dstar;
+};
 
 /**
- * Adds two jiffies or a number to a jiffy
+ * A literal transition.
  */
-static int 
-l_jiffies_sub(lua_State *L) 
-{
-	clock_t *p1 = (clock_t *) lua_touserdata(L, 1);
-	clock_t *p2 = (clock_t *) lua_touserdata(L, 2);
-	if (p1 && p2) {
-		/* substracting two timestamps result in a timespan in seconds */
-		clock_t a1  = *p1;
+struct exedge {
+	/* from and to node */
+	int from;
+	int to;
+
+	/* the character */
+	unsigned char c;
+
+	/* next edge in the hash bucket */
+	int next;
+};
+
+/**
+ * A set of compiled exclude patterns.
+ */
+struct excludes {
+	/* the patterns as given */
+	char **patterns;
+	int pcount;
+	int psize;
+
+	/* the nodes, 0 is the root of unanchored patterns, 1 of anchored. */
+	struct exnode *nodes;
+	int ncount;
+	int nsize;
+
+	/* the literal transitions and their hash buckets (power of 2) */
+	struct exedge *edges;
+	int ecount;
+	int esize;
+	int *buckets;
+	int bsize;
+
+	/* scratch space for the simulation */
+	int *active;
+	int *next;
+	unsigned int *marks;
+	unsigned int generation;
+};
+
+/**
+ * Hashes a literal transition.
+ */
+static inline int
+exedge_hash(struct excludes *ex, int from, unsigned char c)
+{
+	return (int) (((unsigned int) from * 31u + c) * 2654435761u) & 
+		(ex->bsize - 1);
+}
+
+/**
+ * Returns the node reached from 'from' by literal 'c' or -1.
+ */
+static inline int
+exedge_find(struct excludes *ex, int from, unsigned char c)
+{
+	int e;
+	if (!ex->bsize) {
+		return -1;
+	}
+	e = ex->buckets[exedge_hash(ex, from, c)];
+	while (e >= 0) {
+		if (ex->edges[e].from == from && ex->edges[e].c == c) {
+			return ex->edges[e].to;
+		}
+		e = ex->edges[e].next;
+	}
+	return -1;
+}
+
+/**
+ * Adds a new node of 'type'.
+ */
+static int
+exnode_new(struct excludes *ex, enum exnode_type type)
+{
+	struct exnode *n;
+	if (ex->ncount >= ex->nsize) {
+		ex->nsize = ex->nsize ? ex->nsize * 2 : 64;
+		ex->nodes = s_realloc(ex->nodes, ex->nsize * sizeof(struct exnode));
+		ex->active = s_realloc(ex->active, ex->nsize * sizeof(int));
+		ex->next = s_realloc(ex->next, ex->nsize * sizeof(int));
+		ex->marks = s_realloc(ex->marks, ex->nsize * sizeof(unsigned int));
+	}
+	n = &ex->nodes[ex->ncount];
+	n->type = type;
+	n->accept = 0;
+	n->any = n->star = n->dstar = -1;
+	ex->marks[ex->ncount] = 0;
+	return ex->ncount++;
+}
+
+/**
+ * Returns the node reached from 'from' by literal 'c', 
+ * creates it if not there.
+ */
+static int
+exedge_add(struct excludes *ex, int from, unsigned char c)
+{
+	int to = exedge_find(ex, from, c);
+	int h;
+	if (to >= 0) {
+		return to;
+	}
+	to = exnode_new(ex, EX_LIT);
+	if (ex->ecount >= ex->esize) {
+		ex->esize = ex->esize ? ex->esize * 2 : 64;
+		ex->edges = s_realloc(ex->edges, ex->esize * sizeof(struct exedge));
+	}
+	if (ex->ecount >= ex->bsize) {
+		/* grows and rehashes the buckets */
+		int i;
+		ex->bsize = ex->bsize ? ex->bsize * 2 : 64;
+		ex->buckets = s_realloc(ex->buckets, ex->bsize * sizeof(int));
+		for (i = 0; i < ex->bsize; i++) {
+			ex->buckets[i] = -1;
+		}
+		for (i = 0; i < ex->ecount; i++) {
+			h = exedge_hash(ex, ex->edges[i].from, ex->edges[i].c);
+			ex->edges[i].next = ex->buckets[h];
+			ex->buckets[h] = i;
+		}
+	}
+	h = exedge_hash(ex, from, c);
+	ex->edges[ex->ecount].from = from;
+	ex->edges[ex->ecount].to = to;
+	ex->edges[ex->ecount].c = c;
+	ex->edges[ex->ecount].next = ex->buckets[h];
+	ex->buckets[h] = ex->ecount++;
+	return to;
+}
+
+/**
+ * Returns the wildcard child 'type' of node 'from', 
+ * creates it if not there.
+ */
+static int
+exwild_add(struct excludes *ex, int from, enum exnode_type type)
+{
+	int *child;
+	int to;
+	switch (type) {
+	case EX_ANY   : child = &ex->nodes[from].any;   break;
+	case EX_STAR  : child = &ex->nodes[from].star;  break;
+	default       : child = &ex->nodes[from].dstar; break;
+	}
+	if (*child >= 0) {
+		return *child;
+	}
+	/* nodes might be reallocated */
+	to = exnode_new(ex, type);
+	switch (type) {
+	case EX_ANY   : ex->nodes[from].any   = to; break;
+	case EX_STAR  : ex->nodes[from].star  = to; break;
+	default       : ex->nodes[from].dstar = to; break;
+	}
+	return to;
+}
+
+/**
+ * Compiles a pattern into the set.
+ */
+static void
+excludes_compile(struct excludes *ex, const char *pattern)
+{
+	size_t len = strlen(pattern);
+	const char *p = pattern;
+	int n;
+	if (*p == '/') {
+		n = exedge_add(ex, 1, '/');
+		p++;
+	} else {
+		/* all matches begin at a '/' */
+		n = exedge_add(ex, 0, '/');
+	}
+	while (*p) {
+		if (p[0] == '*' && p[1] == '*') {
+			n = exwild_add(ex, n, EX_DSTAR);
+			p += 2;
+		} else if (*p == '*') {
+			n = exwild_add(ex, n, EX_STAR);
+			p++;
+		} else if (*p == '?') {
+			n = exwild_add(ex, n, EX_ANY);
+			p++;
+		} else {
+			n = exedge_add(ex, n, (unsigned char) *p);
+			p++;
+		}
+	}
+	if (len > 0 && pattern[len - 1] == '$') {
+		ex->nodes[n].accept |= EX_ACCEPT_ANY;
+	} else {
+		ex->nodes[n].accept |= EX_ACCEPT_BOUNDARY;
+	}
+}
+
+/**
+ * Throws away the compiled patterns and compiles all anew.
+ */
+static void
+excludes_rebuild(struct excludes *ex)
+{
+	int i;
+	ex->ncount = 0;
+	ex->ecount = 0;
+	for (i = 0; i < ex->bsize; i++) {
+		ex->buckets[i] = -1;
+	}
+	exnode_new(ex, EX_ROOT);
+	exnode_new(ex, EX_ROOT);
+	for (i = 0; i < ex->pcount; i++) {
+		excludes_compile(ex, ex->patterns[i]);
+	}
+}
+
+/**
+ * Puts node n and the wildcard nodes it can skip to into 'set'.
+ *
+ * @return new size of set.
+ */
+static int
+exset_add(struct excludes *ex, int *set, int size, int n)
+{
+	while (n >= 0 && ex->marks[n] != ex->generation) {
+		struct exnode *node = &ex->nodes[n];
+		ex->marks[n] = ex->generation;
+		set[size++] = n;
+		/* stars can match nothing */
+		if (node->dstar >= 0) {
+			size = exset_add(ex, set, size, node->dstar);
+		}
+		n = node->star;
+	}
+	return size;
+}
+
+/**
+ * Starts a new generation of set marks.
+ */
+static inline void
+exset_clear(struct excludes *ex)
+{
+	if (++ex->generation == 0) {
+		/* wrapped around */
+		memset(ex->marks, 0, ex->ncount * sizeof(unsigned int));
+		ex->generation = 1;
+	}
+}
+
+/**
+ * True if the relative path 'path' is excluded.
+ */
+extern bool
+excludes_test(struct excludes *ex, const char *path)
+{
+	int *active = ex->active;
+	int *next = ex->next;
+	int acount = 0;
+	const char *p;
+
+	if (ex->pcount == 0) {
+		return false;
+	}
+
+	exset_clear(ex);
+	acount = exset_add(ex, active, acount, 1);
+	for (p = path; *p; p++) {
+		unsigned char c = (unsigned char) *p;
+		int ncount = 0;
+		int i;
+		if (c == '/') {
+			/* unanchored patterns may start here */
+			acount = exset_add(ex, active, acount, 0);
+		}
+		if (acount == 0) {
+			continue;
+		}
+		exset_clear(ex);
+		for (i = 0; i < acount; i++) {
+			int n = active[i];
+			struct exnode *node = &ex->nodes[n];
+			int to = exedge_find(ex, n, c);
+			if (to >= 0) {
+				ncount = exset_add(ex, next, ncount, to);
+			}
+			if (c != '/') {
+				if (node->any >= 0) {
+					ncount = exset_add(ex, next, ncount, node->any);
+				}
+				if (node->type == EX_STAR) {
+					ncount = exset_add(ex, next, ncount, n);
+				}
+			}
+			if (node->type == EX_DSTAR) {
+				ncount = exset_add(ex, next, ncount, n);
+			}
+		}
+		/* checks if any pattern matched up to here */
+		for (i = 0; i < ncount; i++) {
+			unsigned char accept = ex->nodes[next[i]].accept;
+			if ((accept & EX_ACCEPT_ANY) ||
+			    ((accept & EX_ACCEPT_BOUNDARY) && (p[1] == '/' || !p[1]))) 
+			{
+				return true;
+			}
+		}
+		{
+			int *t = active;
+			active = next;
+			next = t;
+		}
+		acount = ncount;
+	}
+	return false;
+}
+
+/**
+ * Matches an absolute path against the roots and excludes of syncs.
+ * The path is tested relative to each root it lies in, starting
+ * with '/', directories with a trailing slash.
+ *
+ * @param roots  the syncs
+ * @param count  number of syncs
+ * @param path   absolute path
+ * @param isdir  true if path is a directory
+ * @return       ROOT_WANTED if some sync does not exclude it,
+ *               ROOT_EXCLUDED if all syncs concerned exclude it,
+ *               ROOT_FOREIGN if it lies in no sync root.
+ */
+extern enum root_match
+match_sync_roots(const struct sync_root *roots, int count,
+                 const char *path, bool isdir)
+{
+	static char *buf = NULL;
+	static size_t buf_size = 0;
+	size_t len = strlen(path);
+	bool inside = false;
+	int i;
+	if (isdir && (!len || path[len - 1] != '/')) {
+		if (len + 2 > buf_size) {
+			buf_size = len + 2;
+			buf = s_realloc(buf, buf_size);
+		}
+		memcpy(buf, path, len);
+		buf[len++] = '/';
+		buf[len] = 0;
+		path = buf;
+	}
+	for (i = 0; i < count; i++) {
+		const struct sync_root *r = &roots[i];
+		if (strncmp(path, r->path, r->len)) {
+			continue;
+		}
+		inside = true;
+		/* tests the path relative to the sync root, starting with '/' */
+		if (!excludes_test(r->excludes, path + r->len - 1)) {
+			return ROOT_WANTED;
+		}
+	}
+	return inside ? ROOT_EXCLUDED : ROOT_FOREIGN;
+}
+
+/**
+ * Returns the excludes userdata at 'idx' of the Lua stack.
+ */
+extern struct excludes *
+check_excludes(lua_State *L, int idx)
+{
+	return (struct excludes *) luaL_checkudata(L, idx, "Lsyncd.excludes");
+}
+
+/**
+ * Creates a new empty set of exclude patterns.
+ *
+ * @return (Lua stack) excludes userdata
+ */
+static int
+l_excludes(lua_State *L)
+{
+	struct excludes *ex = lua_newuserdata(L, sizeof(struct excludes));
+	memset(ex, 0, sizeof(struct excludes));
+	luaL_getmetatable(L, "Lsyncd.excludes");
+	lua_setmetatable(L, -2);
+	excludes_rebuild(ex);
+	return 1;
+}
+
+/**
+ * Adds a pattern to an exclude set.
+ *
+ * @param (Lua stack) excludes userdata
+ * @param (Lua stack) the pattern
+ */
+static int
+l_excludes_add(lua_State *L)
+{
+	struct excludes *ex = check_excludes(L, 1);
+	const char *pattern = luaL_checkstring(L, 2);
+	if (ex->pcount >= ex->psize) {
+		ex->psize = ex->psize ? ex->psize * 2 : 16;
+		ex->patterns = s_realloc(ex->patterns, ex->psize * sizeof(char *));
+	}
+	ex->patterns[ex->pcount++] = s_strdup(pattern);
+	excludes_compile(ex, pattern);
+	return 0;
+}
+
+/**
+ * Removes a pattern from an exclude set.
+ *
+ * @param (Lua stack) excludes userdata
+ * @param (Lua stack) the pattern
+ */
+static int
+l_excludes_remove(lua_State *L)
+{
+	struct excludes *ex = check_excludes(L, 1);
+	const char *pattern = luaL_checkstring(L, 2);
+	int i;
+	for (i = 0; i < ex->pcount; i++) {
+		if (!strcmp(ex->patterns[i], pattern)) {
+			free(ex->patterns[i]);
+			ex->patterns[i] = ex->patterns[--ex->pcount];
+			excludes_rebuild(ex);
+			break;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Tests if a path is excluded.
+ *
+ * @param (Lua stack) excludes userdata
+ * @param (Lua stack) path relative to the sync root
+ * @return (Lua stack) true if excluded
+ */
+static int
+l_excludes_test(lua_State *L)
+{
+	struct excludes *ex = check_excludes(L, 1);
+	const char *path = luaL_checkstring(L, 2);
+	lua_pushboolean(L, excludes_test(ex, path));
+	return 1;
+}
+
+/**
+ * Frees an exclude set.
+ */
+static int
+l_excludes_gc(lua_State *L)
+{
+	struct excludes *ex = check_excludes(L, 1);
+	int i;
+	for (i = 0; i < ex->pcount; i++) {
+		free(ex->patterns[i]);
+	}
+	free(ex->patterns);
+	free(ex->nodes);
+	free(ex->edges);
+	free(ex->buckets);
+	free(ex->active);
+	free(ex->next);
+	free(ex->marks);
+	return 0;
+}
+
+/*****************************************************************************
+ * Vanished entries
+ *
+ * Remembers the inodes of entries told as deleted since a rename could 
+ * not be paired, like a move out of the watched tree or one lost in an 
+ * overflow. When the same inode reappears elsewhere the monitors can 
+ * tell a move instead of a new entry to transfer again.
+ ****************************************************************************/
+
+/**
+ * A vanished entry.
+ */
+struct gone {
+	/* true if this slot holds an entry */
+	bool used;
+
+	/* device and inode number */
+	dev_t dev;
+	ino_t ino;
+
+	/* true for directories */
+	bool isdir;
+
+	/* for files the modification time in nanoseconds and the size,
+	 * a moved file keeps them while a reused inode hardly does */
+	int64_t mtime;
+	off_t size;
+
+	/* absolute former path, trailing slash for directories */
+	char *path;
+
+	/* point in time the entry is forgotten */
+	clock_t alarm;
+};
+
+/**
+ * Number of vanished entries remembered, the oldest is overwritten.
+ */
+#define GONE_SIZE 256
+
+/**
+ * Seconds a vanished entry is remembered.
+ */
+#define GONE_SECONDS 60
+
+static struct gone gones[GONE_SIZE];
+
+/**
+ * The slot to fill next.
+ */
+static int gone_next = 0;
+
+/**
+ * Buffer returned by gone_claim().
+ */
+static char *gone_path = NULL;
+
+/**
+ * Remembers the entry (dev, ino) vanished from the absolute 'path'.
+ */
+extern void
+gone_add(dev_t dev, ino_t ino, bool isdir, 
+         int64_t mtime, off_t size, const char *path)
+{
+	struct gone *g = &gones[gone_next];
+	gone_next = (gone_next + 1) % GONE_SIZE;
+	free(g->path);
+	g->used  = true;
+	g->dev   = dev;
+	g->ino   = ino;
+	g->isdir = isdir;
+	g->mtime = mtime;
+	g->size  = size;
+	g->path  = s_strdup(path);
+	g->alarm = now_jiffies() + GONE_SECONDS * clocks_per_sec;
+}
+
+/**
+ * Returns the former absolute path of the entry (dev, ino) now at 
+ * 'path' if it vanished recently elsewhere and forgets it. 
+ * Otherwise returns NULL.
+ */
+extern const char *
+gone_claim(dev_t dev, ino_t ino, bool isdir, 
+           int64_t mtime, off_t size, const char *path)
+{
+	clock_t now = now_jiffies();
+	int i;
+	for (i = 0; i < GONE_SIZE; i++) {
+		struct gone *g = &gones[i];
+		if (!g->used || g->ino != ino || g->dev != dev) {
+			continue;
+		}
+		g->used = false;
+		if (time_after(now, g->alarm) || g->isdir != isdir ||
+		    (!isdir && (g->mtime != mtime || g->size != size)) ||
+		    !strcmp(g->path, path)) 
+		{
+			/* outdated, a reused inode or no move */
+			return NULL;
+		}
+		free(gone_path);
+		gone_path = g->path;
+		g->path = NULL;
+		return gone_path;
+	}
+	return NULL;
+}
+
+/*****************************************************************************
+ * Delays
+ *
+ * The delays of all syncs are records in one slab, unused records are
+ * chained into a free list. A sync queues its delays in a list linked
+ * through the records, and the delays blocked by another are linked
+ * into a list of that one. Each delay also is in the list of its class
+ * in the queue, the policy applying to it, so the runner finds the 
+ * next of each without going through all. Links are indices, since 
+ * the slab moves when it grows.
+ *
+ * The runner holds a delay as small userdata ("Lsyncd.delay") with the
+ * index of its record, the fields are read and written through its
+ * metatable. The strings of a delay and the userdata while queued are
+ * referenced from a registry table, DELAY_REFS slots per record.
+ * A removed delay keeps the index of the one queued next to it, so an
+ * iteration can continue, as long as that record is not freed.
+ * Fields unknown to the core go into a table set as environment of the
+ * userdata on the first write.
+ *
+ * A record is kept until its userdata is collected, thus a delay can
+ * still be read after it left its queue.
+ ****************************************************************************/
+
+/* the types of delays, the etype of a record indexes it */
+static const char *delay_etypes[] =
+	{"Attrib", "Modify", "Create", "Delete", "Move", "Init", "Blanket", NULL};
+
+/* the stati of delays, in order of enum delay_status */
+static const char *delay_stati[] = {"wait", "active", "block", NULL};
+
+enum delay_status {
+	DELAY_WAIT,
+	DELAY_ACTIVE,
+	DELAY_BLOCK,
+};
+
+/* the alarm is 'true', the delay is due immediately */
+#define DELAY_NOW      0x01
+/* the delay is in the list of its queue */
+#define DELAY_QUEUED   0x02
+/* the delay has been removed from its queue */
+#define DELAY_REMOVED  0x04
+/* size, mtime, ino and mode are set */
+#define DELAY_SIZE     0x08
+#define DELAY_MTIME    0x10
+#define DELAY_INO      0x20
+#define DELAY_MODE     0x40
+/* the delay covers the tree below its directory */
+#define DELAY_RECURSIVE 0x80
+/* the path might be on the target already */
+#define DELAY_ONTARGET 0x100
+
+/**
+ * A delay record.
+ */
+struct delay {
+	/* latest point in time this should be catered for,
+	 * unless DELAY_NOW */
+	clock_t alarm;
+
+	/* position in the queue, increasing with every push */
+	long dpos;
+
+	/* seconds it waits for changes to pause, as queued */
+	double wait;
+
+	/* the priority of its class */
+	double priority;
+
+	/* for syncs with 'stat', see the DELAY_* flags */
+	double size;
+	double mtime;
+	double ino;
+	double mode;
+
+	/* the stat waited for, 0 if none */
+	unsigned long ticket;
+
+	/* id of the queue this is or was in, 0 if none */
+	int queue;
+
+	/* its class, neighbours in the list of the class, -1 at its ends */
+	int class;
+	int cprev;
+	int cnext;
+
+	/* neighbours in the queue, -1 at its ends.
+	 * A removed delay keeps 'next' with its 'gen' in 'next_gen'.
+	 * 'next' chains the free list of unused records. */
+	int prev;
+	int next;
+	unsigned int next_gen;
+
+	/* counts the times the record has been freed */
+	unsigned int gen;
+
+	/* the delay blocking this one, the first of those this one blocks
+	 * and the neighbours blocked by the same delay, -1 if none */
+	int blocker;
+	int blocks;
+	int prev_block;
+	int next_block;
+
+	/* index into delay_etypes, enum delay_status and DELAY_* flags */
+	unsigned char etype;
+	unsigned char status;
+	unsigned short flags;
+};
+
+/**
+ * A queue of delays, userdata "Lsyncd.delays".
+ */
+struct delayq {
+	/* id the delays in this queue are marked with */
+	int id;
+
+	/* first and last delay, -1 if empty */
+	int first;
+	int last;
+
+	/* number of delays */
+	int size;
+
+	/* dpos of the last delay pushed */
+	long dpos;
+
+	/* first and last delay of each class, -1 if none */
+	int classes;
+	struct {
+		int first;
+		int last;
+	} class[];
+};
+
+/**
+ * References per record in the registry table:
+ * the userdata while queued, the path and path2.
+ */
+#define DELAY_REFS 3
+
+/**
+ * Bytes Lua takes per delay on top of its record, the userdata with the
+ * index (the header of a 5.1 userdata is 40 bytes on 64 bit systems)
+ * and the references (16 bytes each).
+ */
+#define DELAY_LUA_BYTES (40 + sizeof(int) + DELAY_REFS * 16)
+
+/* the slab */
+static struct delay *delays = NULL;
+
+/* records in the slab */
+static int delays_size = 0;
+
+/* records in use */
+static int delays_used = 0;
+
+/* first unused record, -1 if none */
+static int delays_free = -1;
+
+/* registry reference to the table of references */
+static int delays_refs = LUA_NOREF;
+
+/* the id the next queue gets */
+static int delayq_ids = 0;
+
+/**
+ * Takes a record from the free list, grows the slab if there is none.
+ */
+static int
+delay_alloc(void)
+{
+	int i;
+	if (delays_free < 0) {
+		int size = delays_size ? delays_size * 2 : 256;
+		delays = s_realloc(delays, size * sizeof(struct delay));
+		for (i = size - 1; i >= delays_size; i--) {
+			delays[i].next = delays_free;
+			delays_free = i;
+		}
+		delays_size = size;
+	}
+	i = delays_free;
+	delays_free = delays[i].next;
+	delays_used++;
+	{
+		unsigned int gen = delays[i].gen;
+		memset(&delays[i], 0, sizeof(struct delay));
+		delays[i].gen = gen;
+	}
+	delays[i].prev = delays[i].next = -1;
+	delays[i].cprev = delays[i].cnext = -1;
+	delays[i].blocker = delays[i].blocks = -1;
+	delays[i].prev_block = delays[i].next_block = -1;
+	return i;
+}
+
+/**
+ * Sets reference 'r' of record 'i' to the value on top of the stack
+ * and pops it.
+ */
+static void
+delay_setref(lua_State *L, int i, int r)
+{
+	lua_rawgeti(L, LUA_REGISTRYINDEX, delays_refs);
+	lua_insert(L, -2);
+	lua_rawseti(L, -2, i * DELAY_REFS + r);
+	lua_pop(L, 1);
+}
+
+/**
+ * Pushes reference 'r' of record 'i'.
+ */
+static void
+delay_getref(lua_State *L, int i, int r)
+{
+	lua_rawgeti(L, LUA_REGISTRYINDEX, delays_refs);
+	lua_rawgeti(L, -1, i * DELAY_REFS + r);
+	lua_remove(L, -2);
+}
+
+/**
+ * Takes delay 'i' out of the list of delays blocked by the same.
+ */
+static void
+delay_unstack(int i)
+{
+	struct delay *d = &delays[i];
+	if (d->blocker < 0) {
+		return;
+	}
+	if (d->prev_block >= 0) {
+		delays[d->prev_block].next_block = d->next_block;
+	} else {
+		delays[d->blocker].blocks = d->next_block;
+	}
+	if (d->next_block >= 0) {
+		delays[d->next_block].prev_block = d->prev_block;
+	}
+	d->blocker = d->prev_block = d->next_block = -1;
+}
+
+/**
+ * Lets all delays blocked by delay 'i' wait again.
+ */
+static void
+delay_unblock(int i)
+{
+	int b = delays[i].blocks;
+	while (b >= 0) {
+		int n = delays[b].next_block;
+		delays[b].blocker = delays[b].prev_block = delays[b].next_block = -1;
+		delays[b].status = DELAY_WAIT;
+		b = n;
+	}
+	delays[i].blocks = -1;
+}
+
+/**
+ * Returns the record index of the delay userdata at 'idx'.
+ */
+static int
+check_delay(lua_State *L, int idx)
+{
+	int i = *(int *) luaL_checkudata(L, idx, "Lsyncd.delay");
+	if (i < 0) {
+		luaL_error(L, "delay has been collected");
+	}
+	return i;
+}
+
+/**
+ * Creates a new delay, not yet queued.
+ *
+ * @param (Lua stack) the type of event
+ * @param (Lua stack) the alarm, jiffies or true
+ * @param (Lua stack) the path
+ * @param (Lua stack) path2 for moves, otherwise nil
+ * @return (Lua stack) the delay userdata
+ */
+static int
+l_delay(lua_State *L)
+{
+	int etype = luaL_checkoption(L, 1, NULL, delay_etypes);
+	clock_t alarm = 0;
+	int i;
+	int *ud;
+	if (lua_isboolean(L, 2)) {
+		if (!lua_toboolean(L, 2)) {
+			return luaL_error(L, "alarm of a delay must be jiffies or true");
+		}
+	} else {
+		alarm = *(clock_t *) luaL_checkudata(L, 2, "Lsyncd.jiffies");
+	}
+	luaL_checkstring(L, 3);
+	if (!lua_isnoneornil(L, 4)) {
+		luaL_checkstring(L, 4);
+	}
+	lua_settop(L, 4);
+
+	i = delay_alloc();
+	delays[i].etype = etype;
+	delays[i].status = DELAY_WAIT;
+	delays[i].alarm = alarm;
+	if (lua_isboolean(L, 2)) {
+		delays[i].flags |= DELAY_NOW;
+	}
+	lua_pushvalue(L, 3);
+	delay_setref(L, i, 2);
+	lua_pushvalue(L, 4);
+	delay_setref(L, i, 3);
+
+	ud = lua_newuserdata(L, sizeof(int));
+	*ud = i;
+	luaL_getmetatable(L, "Lsyncd.delay");
+	lua_setmetatable(L, -2);
+	/* the references stand in for a table of its own */
+	lua_rawgeti(L, LUA_REGISTRYINDEX, delays_refs);
+	lua_setfenv(L, -2);
+	return 1;
+}
+
+/**
+ * Reads a field of a delay.
+ *
+ * @param (Lua stack) the delay userdata
+ * @param (Lua stack) the field name
+ * @return (Lua stack) the value
+ */
+static int
+l_delay_index(lua_State *L)
+{
+	int i = check_delay(L, 1);
+	struct delay *d = &delays[i];
+	const char *k = luaL_checkstring(L, 2);
+	switch (k[0]) {
+	case 'a' :
+		if (!strcmp(k, "alarm")) {
+			if (d->flags & DELAY_NOW) {
+				lua_pushboolean(L, 1);
+			} else {
+				clock_t *j = lua_newuserdata(L, sizeof(clock_t));
+				luaL_getmetatable(L, "Lsyncd.jiffies");
+				lua_setmetatable(L, -2);
+				*j = d->alarm;
+			}
+			return 1;
+		}
+		break;
+	case 'b' :
+		if (!strcmp(k, "blocks")) {
+			/* true if blocking others */
+			if (d->blocks >= 0) {
+				lua_pushboolean(L, 1);
+			} else {
+				lua_pushnil(L);
+			}
+			return 1;
+		}
+		break;
+	case 'c' :
+		if (!strcmp(k, "class")) {
+			lua_pushinteger(L, d->class);
+			return 1;
+		}
+		break;
+	case 'd' :
+		if (!strcmp(k, "dpos")) {
+			lua_pushnumber(L, d->dpos);
+			return 1;
+		}
+		break;
+	case 'e' :
+		if (!strcmp(k, "etype")) {
+			lua_pushstring(L, delay_etypes[d->etype]);
+			return 1;
+		}
+		break;
+	case 'i' :
+		if (!strcmp(k, "ino")) {
+			if (d->flags & DELAY_INO) {
+				lua_pushnumber(L, d->ino);
+			} else {
+				lua_pushnil(L);
+			}
+			return 1;
+		}
+		break;
+	case 'm' :
+		if (!strcmp(k, "mtime")) {
+			if (d->flags & DELAY_MTIME) {
+				lua_pushnumber(L, d->mtime);
+			} else {
+				lua_pushnil(L);
+			}
+			return 1;
+		}
+		if (!strcmp(k, "mode")) {
+			if (d->flags & DELAY_MODE) {
+				lua_pushnumber(L, d->mode);
+			} else {
+				lua_pushnil(L);
+			}
+			return 1;
+		}
+		break;
+	case 'o' :
+		if (!strcmp(k, "onTarget")) {
+			if (d->flags & DELAY_ONTARGET) {
+				lua_pushboolean(L, 1);
+			} else {
+				lua_pushnil(L);
+			}
+			return 1;
+		}
+		break;
+	case 'p' :
+		if (!strcmp(k, "path")) {
+			delay_getref(L, i, 2);
+			return 1;
+		}
+		if (!strcmp(k, "path2")) {
+			delay_getref(L, i, 3);
+			return 1;
+		}
+		if (!strcmp(k, "priority")) {
+			lua_pushnumber(L, d->priority);
+			return 1;
+		}
+		break;
+	case 'r' :
+		if (!strcmp(k, "recursive")) {
+			if (d->flags & DELAY_RECURSIVE) {
+				lua_pushboolean(L, 1);
+			} else {
+				lua_pushnil(L);
+			}
+			return 1;
+		}
+		break;
+	case 's' :
+		if (!strcmp(k, "status")) {
+			lua_pushstring(L, delay_stati[d->status]);
+			return 1;
+		}
+		if (!strcmp(k, "size")) {
+			if (d->flags & DELAY_SIZE) {
+				lua_pushnumber(L, d->size);
+			} else {
+				lua_pushnil(L);
+			}
+			return 1;
+		}
+		break;
+	case 't' :
+		if (!strcmp(k, "ticket")) {
+			if (d->ticket) {
+				lua_pushnumber(L, d->ticket);
+			} else {
+				lua_pushnil(L);
+			}
+			return 1;
+		}
+		break;
+	case 'w' :
+		if (!strcmp(k, "wait")) {
+			lua_pushnumber(L, d->wait);
+			return 1;
+		}
+		break;
+	}
+	/* fields unknown to the core, the references have none */
+	lua_getfenv(L, 1);
+	lua_pushvalue(L, 2);
+	lua_rawget(L, -2);
+	return 1;
+}
+
+/**
+ * Sets the stat field 'flag' of delay 'd' to the optional number
+ * at index 3.
+ */
+static void
+delay_setstat(lua_State *L, struct delay *d, double *v, int flag)
+{
+	if (lua_isnil(L, 3)) {
+		d->flags &= ~flag;
+	} else {
+		*v = luaL_checknumber(L, 3);
+		d->flags |= flag;
+	}
+}
+
+/**
+ * Writes a field of a delay.
+ *
+ * @param (Lua stack) the delay userdata
+ * @param (Lua stack) the field name
+ * @param (Lua stack) the value
+ */
+static int
+l_delay_newindex(lua_State *L)
+{
+	int i = check_delay(L, 1);
+	struct delay *d = &delays[i];
+	const char *k = luaL_checkstring(L, 2);
+	lua_settop(L, 3);
+	if (!strcmp(k, "etype")) {
+		d->etype = luaL_checkoption(L, 3, NULL, delay_etypes);
+	} else if (!strcmp(k, "status")) {
+		d->status = luaL_checkoption(L, 3, NULL, delay_stati);
+	} else if (!strcmp(k, "alarm")) {
+		if (!lua_isboolean(L, 3)) {
+			d->alarm = *(clock_t *) luaL_checkudata(L, 3, "Lsyncd.jiffies");
+			d->flags &= ~DELAY_NOW;
+		} else if (lua_toboolean(L, 3)) {
+			d->flags |= DELAY_NOW;
+		} else {
+			luaL_error(L, "alarm of a delay must be jiffies or true");
+		}
+	} else if (!strcmp(k, "path")) {
+		luaL_checkstring(L, 3);
+		delay_setref(L, i, 2);
+	} else if (!strcmp(k, "path2")) {
+		if (!lua_isnil(L, 3)) {
+			luaL_checkstring(L, 3);
+		}
+		delay_setref(L, i, 3);
+	} else if (!strcmp(k, "size")) {
+		delay_setstat(L, d, &d->size, DELAY_SIZE);
+	} else if (!strcmp(k, "mtime")) {
+		delay_setstat(L, d, &d->mtime, DELAY_MTIME);
+	} else if (!strcmp(k, "ino")) {
+		delay_setstat(L, d, &d->ino, DELAY_INO);
+	} else if (!strcmp(k, "mode")) {
+		delay_setstat(L, d, &d->mode, DELAY_MODE);
+	} else if (!strcmp(k, "recursive")) {
+		if (lua_toboolean(L, 3)) {
+			d->flags |= DELAY_RECURSIVE;
+		} else {
+			d->flags &= ~DELAY_RECURSIVE;
+		}
+	} else if (!strcmp(k, "onTarget")) {
+		if (lua_toboolean(L, 3)) {
+			d->flags |= DELAY_ONTARGET;
+		} else {
+			d->flags &= ~DELAY_ONTARGET;
+		}
+	} else if (!strcmp(k, "ticket")) {
+		d->ticket = lua_isnil(L, 3) ? 0 : luaL_checknumber(L, 3);
+	} else if (!strcmp(k, "wait")) {
+		d->wait = luaL_checknumber(L, 3);
+	} else if (!strcmp(k, "priority")) {
+		d->priority = luaL_checknumber(L, 3);
+	} else if (!strcmp(k, "class")) {
+		if (d->flags & DELAY_QUEUED) {
+			luaL_error(L, "a queued delay changes its class by moving");
+		}
+		if (luaL_checkinteger(L, 3) < 0) {
+			luaL_error(L, "delay classes start at 0");
+		}
+		d->class = lua_tointeger(L, 3);
+	} else if (!strcmp(k, "dpos") || !strcmp(k, "blocks")) {
+		luaL_error(L, "delay field '%s' is read only", k);
+	} else {
+		/* the first field unknown to the core gets the delay a table */
+		lua_getfenv(L, 1);
+		lua_rawgeti(L, LUA_REGISTRYINDEX, delays_refs);
+		if (lua_rawequal(L, -1, -2)) {
+			lua_newtable(L);
+			lua_pushvalue(L, -1);
+			lua_setfenv(L, 1);
+		} else {
+			lua_pop(L, 1);
+		}
+		lua_pushvalue(L, 2);
+		lua_pushvalue(L, 3);
+		lua_rawset(L, -3);
+	}
+	return 0;
+}
+
+/**
+ * Frees the record of a collected delay.
+ */
+static int
+l_delay_gc(lua_State *L)
+{
+	int *ud = (int *) luaL_checkudata(L, 1, "Lsyncd.delay");
+	int i = *ud;
+	int r;
+	if (i < 0) {
+		return 0;
+	}
+	*ud = -1;
+	/* a queued delay is referenced, so cannot be collected */
+	delay_unstack(i);
+	delay_unblock(i);
+	for (r = 1; r <= DELAY_REFS; r++) {
+		lua_pushnil(L);
+		delay_setref(L, i, r);
+	}
+	delays[i].gen++;
+	delays[i].next = delays_free;
+	delays_free = i;
+	delays_used--;
+	return 0;
+}
+
+/**
+ * Returns the queue userdata at 'idx' of the Lua stack.
+ */
+static struct delayq *
+check_delayq(lua_State *L, int idx)
+{
+	return (struct delayq *) luaL_checkudata(L, idx, "Lsyncd.delays");
+}
+
+/**
+ * Links delay 'i' at the end of the list of its class in queue 'q'.
+ */
+static void
+delay_linkclass(struct delayq *q, int i)
+{
+	struct delay *d = &delays[i];
+	d->cprev = q->class[d->class].last;
+	d->cnext = -1;
+	if (d->cprev >= 0) {
+		delays[d->cprev].cnext = i;
+	} else {
+		q->class[d->class].first = i;
+	}
+	q->class[d->class].last = i;
+}
+
+/**
+ * Takes delay 'i' out of the list of its class in queue 'q'.
+ */
+static void
+delay_unlinkclass(struct delayq *q, int i)
+{
+	struct delay *d = &delays[i];
+	if (d->cprev >= 0) {
+		delays[d->cprev].cnext = d->cnext;
+	} else {
+		q->class[d->class].first = d->cnext;
+	}
+	if (d->cnext >= 0) {
+		delays[d->cnext].cprev = d->cprev;
+	} else {
+		q->class[d->class].last = d->cprev;
+	}
+	d->cprev = d->cnext = -1;
+}
+
+/**
+ * Returns the class at 'idx' of the Lua stack,
+ * raises an error if the queue 'q' has no such.
+ */
+static int
+check_class(lua_State *L, struct delayq *q, int idx)
+{
+	int c = luaL_checkinteger(L, idx);
+	if (c < 0 || c >= q->classes) {
+		luaL_error(L, "no delay class %d in the queue", c);
+	}
+	return c;
+}
+
+/**
+ * Creates a new empty queue of delays.
+ *
+ * @param (Lua stack) the number of classes of delays, 1 if none
+ * @return (Lua stack) the queue userdata
+ */
+static int
+l_delays(lua_State *L)
+{
+	int classes = luaL_optinteger(L, 1, 1);
+	struct delayq *q;
+	int c;
+	if (classes < 1) {
+		return luaL_error(L, "a queue of delays needs a class");
+	}
+	q = lua_newuserdata(L, 
+		sizeof(struct delayq) + classes * sizeof(q->class[0]));
+	q->id = ++delayq_ids;
+	q->first = q->last = -1;
+	q->size = 0;
+	q->dpos = 0;
+	q->classes = classes;
+	for (c = 0; c < classes; c++) {
+		q->class[c].first = q->class[c].last = -1;
+	}
+	luaL_getmetatable(L, "Lsyncd.delays");
+	lua_setmetatable(L, -2);
+	return 1;
+}
+
+/**
+ * Pushes a delay at the end of a queue.
+ *
+ * @param (Lua stack) the queue
+ * @param (Lua stack) the delay, it must not have been queued before
+ * @return (Lua stack) its position 'dpos'
+ */
+static int
+l_delays_push(lua_State *L)
+{
+	struct delayq *q = check_delayq(L, 1);
+	int i = check_delay(L, 2);
+	struct delay *d = &delays[i];
+	if (d->flags & (DELAY_QUEUED | DELAY_REMOVED)) {
+		return luaL_error(L, "pushing a delay queued before");
+	}
+	if (d->class >= q->classes) {
+		return luaL_error(L, "no delay class %d in the queue", d->class);
+	}
+	d->flags |= DELAY_QUEUED;
+	d->queue = q->id;
+	d->dpos = ++q->dpos;
+	d->prev = q->last;
+	d->next = -1;
+	if (q->last >= 0) {
+		delays[q->last].next = i;
+	} else {
+		q->first = i;
+	}
+	q->last = i;
+	q->size++;
+	delay_linkclass(q, i);
+	lua_pushvalue(L, 2);
+	delay_setref(L, i, 1);
+	lua_pushnumber(L, d->dpos);
+	return 1;
+}
+
+/**
+ * Removes a delay from a queue.
+ * The delays it blocks wait again.
+ *
+ * @param (Lua stack) the queue
+ * @param (Lua stack) the delay
+ */
+static int
+l_delays_remove(lua_State *L)
+{
+	struct delayq *q = check_delayq(L, 1);
+	int i = check_delay(L, 2);
+	struct delay *d = &delays[i];
+	if (!(d->flags & DELAY_QUEUED) || d->queue != q->id) {
+		return luaL_error(L, "removing a delay not in the queue");
+	}
+	if (d->prev >= 0) {
+		delays[d->prev].next = d->next;
+	} else {
+		q->first = d->next;
+	}
+	if (d->next >= 0) {
+		delays[d->next].prev = d->prev;
+		/* an iteration at this delay continues with the next */
+		d->next_gen = delays[d->next].gen;
+	} else {
+		q->last = d->prev;
+	}
+	lua_pushnil(L);
+	delay_setref(L, i, 1);
+	q->size--;
+	delay_unlinkclass(q, i);
+	d->flags = (d->flags & ~DELAY_QUEUED) | DELAY_REMOVED;
+	delay_unstack(i);
+	delay_unblock(i);
+	return 0;
+}
+
+/**
+ * Lets a delay block another, that one gets the status 'block'.
+ * A delay is blocked by one delay at most.
+ *
+ * @param (Lua stack) the queue
+ * @param (Lua stack) the blocking delay
+ * @param (Lua stack) the blocked delay
+ */
+static int
+l_delays_stack(lua_State *L)
+{
+	int o = check_delay(L, 2);
+	int n = check_delay(L, 3);
+	check_delayq(L, 1);
+	delay_unstack(n);
+	delays[n].status = DELAY_BLOCK;
+	delays[n].blocker = o;
+	delays[n].next_block = delays[o].blocks;
+	if (delays[o].blocks >= 0) {
+		delays[delays[o].blocks].prev_block = n;
+	}
+	delays[o].blocks = n;
+	return 0;
+}
+
+/**
+ * Puts a delay and all delays blocked by it, directly or not, as keys
+ * into a table.
+ *
+ * @param (Lua stack) the queue
+ * @param (Lua stack) the delay
+ * @param (Lua stack) the table
+ */
+static int
+l_delays_blocked(lua_State *L)
+{
+	int root = check_delay(L, 2);
+	int i;
+	check_delayq(L, 1);
+	luaL_checktype(L, 3, LUA_TTABLE);
+	lua_pushvalue(L, 2);
+	lua_pushboolean(L, 1);
+	lua_rawset(L, 3);
+	/* walks the tree of blocked delays depth first */
+	i = delays[root].blocks;
+	while (i >= 0) {
+		if (delays[i].flags & DELAY_QUEUED) {
+			delay_getref(L, i, 1);
+			lua_pushboolean(L, 1);
+			lua_rawset(L, 3);
+		}
+		if (delays[i].blocks >= 0) {
+			i = delays[i].blocks;
+			continue;
+		}
+		while (i != root && delays[i].next_block < 0) {
+			i = delays[i].blocker;
+		}
+		if (i == root) {
+			break;
+		}
+		i = delays[i].next_block;
+	}
+	return 0;
+}
+
+/**
+ * Iterator of a queue.
+ *
+ * @param (Lua stack) the queue
+ * @param (Lua stack) the last delay returned, nil at start
+ * @return (Lua stack) the next delay, nil at the end
+ */
+static int
+l_delays_next(lua_State *L)
+{
+	struct delayq *q = check_delayq(L, 1);
+	int i;
+	if (lua_isnil(L, 2)) {
+		i = q->first;
+	} else {
+		i = check_delay(L, 2);
+		if (delays[i].flags & DELAY_QUEUED) {
+			i = delays[i].next;
+		} else {
+			/* removed while iterating, continues with the delay
+			 * queued next to it, unless removed as well */
+			for(;;) {
+				int n = delays[i].next;
+				if (n < 0 || delays[n].gen != delays[i].next_gen) {
+					/* was last or the next is freed, continues with 
+					 * the delays queued after */
+					long dpos = delays[i].dpos;
+					i = -1;
+					for (n = q->last; n >= 0 && delays[n].dpos > dpos;
+					     n = delays[n].prev)
+					{
+						i = n;
+					}
+					break;
+				}
+				i = n;
+				if (delays[i].flags & DELAY_QUEUED) {
+					break;
+				}
+			}
+		}
+	}
+	if (i < 0) {
+		lua_pushnil(L);
+	} else {
+		delay_getref(L, i, 1);
+	}
+	return 1;
+}
+
+/**
+ * Iterates a queue from first to last,
+ * delays can be removed meanwhile.
+ *
+ * @param (Lua stack) the queue
+ * @return (Lua stack) iterator function, the queue and nil
+ */
+static int
+l_delays_iter(lua_State *L)
+{
+	check_delayq(L, 1);
+	lua_pushcfunction(L, l_delays_next);
+	lua_pushvalue(L, 1);
+	lua_pushnil(L);
+	return 3;
+}
+
+/**
+ * Returns the first delay of a queue, nil if empty.
+ */
+static int
+l_delays_first(lua_State *L)
+{
+	struct delayq *q = check_delayq(L, 1);
+	if (q->first < 0) {
+		lua_pushnil(L);
+	} else {
+		delay_getref(L, q->first, 1);
+	}
+	return 1;
+}
+
+/**
+ * Returns the last delay of a queue, nil if empty.
+ */
+static int
+l_delays_last(lua_State *L)
+{
+	struct delayq *q = check_delayq(L, 1);
+	if (q->last < 0) {
+		lua_pushnil(L);
+	} else {
+		delay_getref(L, q->last, 1);
+	}
+	return 1;
+}
+
+/**
+ * Moves a delay to the end of the list of a class.
+ *
+ * @param (Lua stack) the queue
+ * @param (Lua stack) the delay
+ * @param (Lua stack) the class
+ */
+static int
+l_delays_move(lua_State *L)
+{
+	struct delayq *q = check_delayq(L, 1);
+	int i = check_delay(L, 2);
+	int c = check_class(L, q, 3);
+	if (!(delays[i].flags & DELAY_QUEUED) || delays[i].queue != q->id) {
+		return luaL_error(L, "moving a delay not in the queue");
+	}
+	delay_unlinkclass(q, i);
+	delays[i].class = c;
+	delay_linkclass(q, i);
+	return 0;
+}
+
+/**
+ * Returns the first delay of a class with the status 'wait', 
+ * nil if none.
+ *
+ * @param (Lua stack) the queue
+ * @param (Lua stack) the class
+ */
+static int
+l_delays_waiting(lua_State *L)
+{
+	struct delayq *q = check_delayq(L, 1);
+	int i = q->class[check_class(L, q, 2)].first;
+	while (i >= 0 && delays[i].status != DELAY_WAIT) {
+		i = delays[i].cnext;
+	}
+	if (i < 0) {
+		lua_pushnil(L);
+	} else {
+		delay_getref(L, i, 1);
+	}
+	return 1;
+}
+
+/**
+ * Returns the number of delays in a queue.
+ */
+static int
+l_delays_size(lua_State *L)
+{
+	struct delayq *q = check_delayq(L, 1);
+	lua_pushinteger(L, q->size);
+	return 1;
+}
+
+/**
+ * Returns numbers about the memory of delays.
+ *
+ * @return (Lua stack) a table with 'used' delays, 'slab' records
+ *                     and the 'bytes' a delay takes.
+ */
+static int
+l_delaystats(lua_State *L)
+{
+	lua_newtable(L);
+	lua_pushinteger(L, delays_used);
+	lua_setfield(L, -2, "used");
+	lua_pushinteger(L, delays_size);
+	lua_setfield(L, -2, "slab");
+	lua_pushinteger(L, sizeof(struct delay) + DELAY_LUA_BYTES);
+	lua_setfield(L, -2, "bytes");
+	return 1;
+}
+
+static const luaL_reg excludeslib[] = {
+		{"add",           l_excludes_add    },
+		{"remove",        l_excludes_remove },
+		{"test",          l_excludes_test   },
+		{NULL, NULL}
+};
+
+static const luaL_reg delaylib[] = {
+		{"__gc",          l_delay_gc        },
+		{"__index",       l_delay_index     },
+		{"__newindex",    l_delay_newindex  },
+		{NULL, NULL}
+};
+
+static const luaL_reg delayslib[] = {
+		{"blocked",       l_delays_blocked  },
+		{"first",         l_delays_first    },
+		{"iter",          l_delays_iter     },
+		{"last",          l_delays_last     },
+		{"move",          l_delays_move     },
+		{"push",          l_delays_push     },
+		{"remove",        l_delays_remove   },
+		{"size",          l_delays_size     },
+		{"stack",         l_delays_stack    },
+		{"waiting",       l_delays_waiting  },
+		{NULL, NULL}
+};
+
+static const luaL_reg dirlib[] = {
+		{"close",         l_dir_close       },
+		{"next",          l_dir_next        },
+		{NULL, NULL}
+};
+
+static const luaL_reg lsyncdlib[] = {
+		{"configure",     l_configure     },
+		{"delay",         l_delay         },
+		{"delays",        l_delays        },
+		{"delaystats",    l_delaystats    },
+		{"exec",          l_exec          },
+		{"excludes",      l_excludes      },
+		{"log",           l_log           },
+		{"now",           l_now           },
+		{"nonobserve_fd", l_nonobserve_fd },
+		{"observe_fd",    l_observe_fd    },
+		{"opendir",       l_opendir       },
+		{"readdir",       l_readdir       },
+		{"realdir",       l_realdir       },
+		{"stat",          l_stat          },
+		{"stackdump",     l_stackdump     },
+		{"terminate",     l_terminate     },
+		{NULL, NULL}
+};
+
+/**
+ * Adds two jiffies or a number to a jiffy
+ */
+static int 
+l_jiffies_add(lua_State *L) 
+{
+	clock_t *p1 = (clock_t *) lua_touserdata(L, 1);
+	clock_t *p2 = (clock_t *) lua_touserdata(L, 2);
+	if (p1 && p2) {
+		logstring("Error", "Cannot add to timestamps!");
+		exit(-1); /* ERRNO */
+	}
+	{
+		clock_t a1  = p1 ? *p1 :  luaL_checknumber(L, 1) * clocks_per_sec;
+		clock_t a2  = p2 ? *p2 :  luaL_checknumber(L, 2) * clocks_per_sec;
+		clock_t *r  = (clock_t *) lua_newuserdata(L, sizeof(clock_t));
+		luaL_getmetatable(L, "Lsyncd.jiffies");
+		lua_setmetatable(L, -2);
+		*r = a1 + a2; 
+		return 1;
+	}
+}
+
+/**
+ * Adds two jiffies or a number to a jiffy
+ */
+static int 
+l_jiffies_sub(lua_State *L) 
+{
+	clock_t *p1 = (clock_t *) lua_touserdata(L, 1);
+	clock_t *p2 = (clock_t *) lua_touserdata(L, 2);
+	if (p1 && p2) {
+		/* substracting two timestamps result in a timespan in seconds */
+		clock_t a1  = *p1;
 		clock_t a2  = *p2;
 		lua_pushnumber(L, ((double) (a1 -a2)) / clocks_per_sec);
 		return 1;
@@ -1457,11 +3581,58 @@ register_lsyncd(lua_State *L)
 	lua_pushcfunction(L, l_jiffies_eq);
 	lua_settable(L, -3);
 	lua_pop(L, 1);
+
+	/* creates the metatable for excludes userdata */
+	luaL_newmetatable(L, "Lsyncd.excludes");
+	lua_pushstring(L, "__gc");
+	lua_pushcfunction(L, l_excludes_gc);
+	lua_settable(L, -3);
+
+	lua_pushstring(L, "__index");
+	lua_newtable(L);
+	luaL_register(L, NULL, excludeslib);
+	lua_settable(L, -3);
+	lua_pop(L, 1);
+
+	/* creates the metatables for delay and delay queue userdata */
+	luaL_newmetatable(L, "Lsyncd.delay");
+	luaL_register(L, NULL, delaylib);
+	lua_pop(L, 1);
+
+	luaL_newmetatable(L, "Lsyncd.delays");
+	lua_pushstring(L, "__index");
+	lua_newtable(L);
+	luaL_register(L, NULL, delayslib);
+	lua_settable(L, -3);
+	lua_pop(L, 1);
+
+	lua_newtable(L);
+	delays_refs = luaL_ref(L, LUA_REGISTRYINDEX);
+
+	/* creates the metatable for directory userdata */
+	luaL_newmetatable(L, "Lsyncd.dir");
+	lua_pushstring(L, "__gc");
+	lua_pushcfunction(L, l_dir_close);
+	lua_settable(L, -3);
+
+	lua_pushstring(L, "__index");
+	lua_newtable(L);
+	luaL_register(L, NULL, dirlib);
+	lua_settable(L, -3);
+	lua_pop(L, 1);
 	
 	lua_getglobal(L, "lysncd");
 #ifdef LSYNCD_WITH_INOTIFY
 	register_inotify(L);
 	lua_settable(L, -3);
+#endif
+#ifdef LSYNCD_WITH_FANOTIFY
+	register_fanotify(L);
+	lua_settable(L, -3);
+#endif
+#ifdef LSYNCD_WITH_POLL
+	register_poll(L);
+	lua_settable(L, -3);
 #endif
 	lua_pop(L, 1);
 	if (lua_gettop(L)) {
@@ -1563,8 +3734,8 @@ masterloop(lua_State *L)
 {
 	while(true) {
 		bool have_alarm;
-		bool force_alarm;
-		clock_t now = times(dummy_tms);
+		bool force_alarm = false;
+		clock_t now = now_jiffies();
 		clock_t alarm_time;
 
 		/* queries runner about soonest alarm  */
@@ -1583,6 +3754,19 @@ masterloop(lua_State *L)
 		}
 		lua_pop(L, 2);
 
+#ifdef LSYNCD_WITH_INOTIFY
+		{
+			/* inotify might hold back events for a while */
+			clock_t ia;
+			if (inotify_getalarm(&ia) && 
+			    (!have_alarm || time_before(ia, alarm_time))) 
+			{
+				have_alarm = true;
+				alarm_time = ia;
+			}
+		}
+#endif
+
 		if (force_alarm || 
 		    (have_alarm && time_before_eq(alarm_time, now))
 		) {
@@ -1676,6 +3860,11 @@ masterloop(lua_State *L)
 				}
 			}
 		} 
+
+#ifdef LSYNCD_WITH_INOTIFY
+		/* lets inotify flush events it held back */
+		inotify_cycle(L);
+#endif
 	
 		/* collects zombified child processes */
 		while(1) {
@@ -1973,9 +4162,15 @@ main1(int argc, char *argv[])
 #ifdef LSYNCD_WITH_INOTIFY
 	open_inotify(L);
 #endif
+#ifdef LSYNCD_WITH_FANOTIFY
+	open_fanotify(L);
+#endif
 #ifdef LSYNCD_WITH_FSEVENTS
 	open_fsevents(L);
 #endif
+#ifdef LSYNCD_WITH_POLL
+	open_poll(L);
+#endif
 
 	{
 		/* adds signal handlers *
@@ -19,9 +19,12 @@
 /* includes needed for headerfile */
 #include "config.h"
 
+#include <sys/types.h>
 #include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <time.h>
 
 #define LUA_USE_APICHECK 1
 #include <lua.h>
@@ -61,6 +64,12 @@ extern struct settings {
 #define time_after_eq(a,b)      ((long)(a) - (long)(b) >= 0)
 #define time_before_eq(a,b)     time_after_eq(b,a)
 
+/* the kernels clock ticks per second */
+extern long clocks_per_sec;
+
+/* returns the current kernels clock state (jiffies) */
+extern clock_t now_jiffies(void);
+
 /* returns (on Lua stack) the current kernels * clock state (jiffies) */
 extern int l_now(lua_State *L);
 
@@ -106,6 +115,87 @@ printlogf0(lua_State *L,
 		  ...)
 	__attribute__((format(printf, 4, 5)));
 
+/*-----------------------------------------------------------------------------
+ * Exclude patterns
+ */
+
+/* a set of compiled exclude patterns (Lua userdata "Lsyncd.excludes") */
+struct excludes;
+
+/* returns the excludes userdata at 'idx' of the Lua stack */
+extern struct excludes *check_excludes(lua_State *L, int idx);
+
+/* true if the relative path 'path' is excluded */
+extern bool excludes_test(struct excludes *ex, const char *path);
+
+/* the root directory and excludes of a sync, monitors drop the events
+ * every sync concerned excludes before they reach the runner */
+struct sync_root {
+	/* absolute path with trailing slash */
+	char *path;
+
+	/* length of path */
+	size_t len;
+
+	/* the syncs exclude patterns */
+	struct excludes *excludes;
+};
+
+/* what match_sync_roots() tells about a path */
+enum root_match {
+	ROOT_FOREIGN  = 0,  /* no sync is concerned */
+	ROOT_EXCLUDED = 1,  /* every sync concerned excludes it */
+	ROOT_WANTED   = 2,  /* some sync wants it */
+};
+
+/* matches the absolute 'path' against the syncs 'roots',
+ * directories are tested with a trailing slash */
+extern enum root_match match_sync_roots(const struct sync_root *roots,
+	int count, const char *path, bool isdir);
+
+/*-----------------------------------------------------------------------------
+ * Vanished entries, recognized by inode when reappearing elsewhere
+ */
+
+/* remembers the entry (dev, ino) vanished from the absolute 'path'.
+ * mtime (nanoseconds) and size are checked for files only. */
+extern void gone_add(dev_t dev, ino_t ino, bool isdir, 
+                     int64_t mtime, off_t size, const char *path);
+
+/* if the entry (dev, ino) now at 'path' vanished recently elsewhere
+ * returns its former absolute path and forgets it, otherwise NULL. 
+ * The result is valid until the next call. */
+extern const char *gone_claim(dev_t dev, ino_t ino, bool isdir, 
+                              int64_t mtime, off_t size, const char *path);
+
+/*-----------------------------------------------------------------------------
+ * Directory streams, reading directories in large chunks
+ */
+
+struct dirstream {
+	/* file descriptor of the directory, -1 when closed */
+	int fd;
+
+	/* errno if reading failed, 0 otherwise */
+	int err;
+
+	/* entries read from the kernel and the position in them */
+	char *buf;
+	long pos;
+	long len;
+};
+
+/* opens the directory 'path', returns false with errno set on failure */
+extern bool dirstream_open(struct dirstream *ds, const char *path);
+
+/* returns the name of the next entry but . and .., NULL at the end.
+ * isdir tells if it is a directory. The name is valid until the next 
+ * call. Closes the stream at the end. Safe to call from threads. */
+extern const char *dirstream_next(struct dirstream *ds, bool *isdir);
+
+/* closes the stream, may be called more than once */
+extern void dirstream_close(struct dirstream *ds);
+
 /*-----------------------------------------------------------------------------
  * File-descriptor helpers
  */
@@ -156,6 +246,12 @@ extern void nonobserve_fd(int fd);
 #ifdef LSYNCD_WITH_INOTIFY
 extern void register_inotify(lua_State *L);
 extern void open_inotify(lua_State *L);
+
+/* true if inotify wants the core to wake up at 'alarm' the latest */
+extern bool inotify_getalarm(clock_t *alarm);
+
+/* called by the core every masterloop cycle */
+extern void inotify_cycle(lua_State *L);
 #endif
 
 /*-----------------------------------------------------------------------------
@@ -166,6 +262,14 @@ extern void register_fanotify(lua_State *L);
 extern void open_fanotify(lua_State *L);
 #endif
 
+/*-----------------------------------------------------------------------------
+ * poll
+ */
+#ifdef LSYNCD_WITH_POLL
+extern void register_poll(lua_State *L);
+extern void open_poll(lua_State *L);
+#endif
+
 /*-----------------------------------------------------------------------------
  * /dev/fsevents
  */
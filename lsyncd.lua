@@ -161,6 +161,166 @@ local CountArray = (function()
 	return {new = new}
 end)()
 
+-----
+-- Heap
+--   a priority queue of items, the one with the earliest key on top.
+--   Keys are jiffies or true for "as soon as possible", items with 
+--   equal keys come in the order they have been set.
+--
+local Heap = (function()
+	-----
+	-- Creates a new heap.
+	--
+	local function new()
+		return { 
+			-- items in heap order
+			n = 0, 
+			-- keys, positions and sequence numbers by item
+			key = {}, pos = {}, seq = {}, 
+			-- last sequence number given
+			lastSeq = 0,
+		}
+	end
+
+	-----
+	-- True if item 'a' comes before item 'b'.
+	--
+	local function before(h, a, b)
+		local ka, kb = h.key[a], h.key[b]
+		if ka ~= kb then
+			if ka == true then
+				return true
+			elseif kb == true then
+				return false
+			elseif ka < kb then
+				return true
+			elseif kb < ka then
+				return false
+			end
+		end
+		return h.seq[a] < h.seq[b]
+	end
+
+	-----
+	-- Puts the item at position 'i'.
+	--
+	local function place(h, item, i)
+		h[i] = item
+		h.pos[item] = i
+	end
+
+	-----
+	-- Moves the item at position 'i' up to its place.
+	--
+	local function up(h, i)
+		local item = h[i]
+		while i > 1 do
+			local p = math.floor(i / 2)
+			if not before(h, item, h[p]) then
+				break
+			end
+			place(h, h[p], i)
+			i = p
+		end
+		place(h, item, i)
+	end
+
+	-----
+	-- Moves the item at position 'i' down to its place.
+	--
+	local function down(h, i)
+		local item = h[i]
+		local n = h.n
+		while true do
+			local c = i * 2
+			if c > n then
+				break
+			end
+			if c < n and before(h, h[c + 1], h[c]) then
+				c = c + 1
+			end
+			if not before(h, h[c], item) then
+				break
+			end
+			place(h, h[c], i)
+			i = c
+		end
+		place(h, item, i)
+	end
+
+	-----
+	-- Removes an item, if it is in the heap.
+	--
+	local function remove(h, item)
+		local i = h.pos[item]
+		if not i then
+			return
+		end
+		local last = h[h.n]
+		h[h.n] = nil
+		h.n = h.n - 1
+		h.key[item], h.pos[item], h.seq[item] = nil, nil, nil
+		if last ~= item then
+			place(h, last, i)
+			up(h, i)
+			down(h, h.pos[last])
+		end
+	end
+
+	-----
+	-- Sets the key of an item, adds it if not in the heap.
+	-- A false key removes it.
+	--
+	local function set(h, item, key)
+		if not key then
+			remove(h, item)
+			return
+		end
+		if h.key[item] == key then
+			return
+		end
+		h.key[item] = key
+		h.lastSeq = h.lastSeq + 1
+		h.seq[item] = h.lastSeq
+		local i = h.pos[item]
+		if not i then
+			h.n = h.n + 1
+			place(h, item, h.n)
+			up(h, h.n)
+		else
+			up(h, i)
+			down(h, h.pos[item])
+		end
+	end
+
+	-----
+	-- Returns the item on top and its key, nil if empty.
+	--
+	local function top(h)
+		local item = h[1]
+		if item then
+			return item, h.key[item]
+		end
+	end
+
+	-----
+	-- Removes and returns the item on top and its key, nil if empty.
+	--
+	local function pop(h)
+		local item, key = top(h)
+		if item then
+			remove(h, item)
+		end
+		return item, key
+	end
+
+	return {new = new, 
+			pop = pop, 
+			remove = remove, 
+			set = set, 
+			top = top}
+end)()
+
 -----
 -- Queue
 --   optimized for pushing on the right and poping on the left.
@@ -298,61 +458,98 @@ end
 -----
 -- Holds information about a delayed event of one Sync.
 --
+-- Delays are records kept by the core (see 'Delays' in lsyncd.c),
+-- queued by lsyncd.delays(). Their fields are:
+--
+-- etype  ... type of event, can be 'Attrib', 'Modify', 'Create', 
+--            'Delete', 'Move', 'Init' and 'Blanket'.
+-- alarm  ... latest point in time this should be catered for, 
+--            in kernel ticks (jiffies), true for as soon as possible.
+-- path   ... path and filename or dirname of the delay relative 
+--            to the syncs root, for directories with a trailing slash.
+-- path2  ... only not nil for 'Move's, the move destination.
+-- status ... 'wait'    the event is ready to be handled.
+--            'active'  there is process running catering for this event.
+--            'block'   this event waits for another to be handled first.
+-- dpos   ... position in the queue, increasing with every push.
+-- wait   ... seconds the delay waits for changes to pause, the delay
+--            of its policy or of the sync when queued, 0 for none.
+-- class  ... index of the policy of the sync applying to the delay,
+--            0 if none. The queue lists the delays of each class. 
+--            Set before queuing, moved by the queue after.
+-- priority ... priority of that policy, 0 if none.
+-- blocks ... true if other delays wait for this one.
+-- recursive ... true for Deletes of directories and, if the action
+--            syncs whole trees, Creates of directories and the
+--            Modifies a storm turns events into. 
+--            The delay covers the entries below it.
+-- onTarget ... true for Creates of paths that might be on the target
+--            already, as they replaced another delay or waited for
+--            an Init, a Blanket or a delay syncing the tree they are
+--            in. Others are new to the target.
+-- size, mtime, ino, mode ... for syncs with 'stat' of path 
+--            (path2 for moves) once the core statted it.
+--            nil before and if it is gone.
+--
+-- Other fields can be set as with tables.
+--
 local Delay = (function()
 	-----
 	-- Creates a new delay.
 	-- 
-	-- @params see below
+	-- @params see above
 	--
 	local function new(etype, alarm, path, path2)
-		local o = {
-			-----
-			-- Type of event.
-			-- Can be 'Create', 'Modify', 'Attrib', 'Delete' and 'Move'
-			etype = etype,
-
-			-----
-			-- Latest point in time this should be catered for.
-			-- This value is in kernel ticks, return of the C's 
-			-- times(NULL) call.
-			alarm = alarm,
-
-			-----
-			-- path and filename or dirname of the delay relative 
-			-- to the syncs root.
-			-- for the directories it contains a trailing slash
-			--
-			path  = path,
-
-			------
-			-- only not nil for 'Move's.
-			-- path and file/dirname of a move destination.
-			--
-			path2  = path2,
-	
-			------
-			-- Status of the event. Valid stati are: 
-			-- 'wait'    ... the event is ready to be handled.
-			-- 'active'  ... there is process running catering for this event.
-			-- 'blocked' ... this event waits for another to be handled first.
-			-- 'done'    ... event has been collected. This should never be 
-			--               visible as all references should be droped on
-			--               collection, nevertheless seperat status for 
-			--               insurrance.
-			--
-			status = "wait",
-		
-			-----
-			-- Position in the queue 
-			dpos = -1,
-		}
-		return o
+		return lsyncd.delay(etype, alarm, path, path2)
 	end
 
 	-- public interface
 	return {new = new}
 end)()
 
+-----
+-- Stats the paths of delays in the background, 
+-- so the main loop does not wait for the filesystem.
+--
+local Metadata = (function()
+	-----
+	-- Delays waiting for a stat, indexed by the ticket the core gave.
+	--
+	local pending = {}
+
+	-----
+	-- Lets the core stat the absolute 'path' for 'delay'.
+	-- A stat asked for earlier is no longer waited for.
+	--
+	local function request(delay, path)
+		if delay.ticket then
+			pending[delay.ticket] = nil
+		end
+		delay.ticket = lsyncd.stat(path)
+		pending[delay.ticket] = delay
+	end
+
+	-----
+	-- Called by the core with the result of a stat, 
+	-- only the ticket if the path is gone.
+	--
+	local function statted(ticket, size, mtime, ino, mode)
+		local delay = pending[ticket]
+		if not delay then
+			return
+		end
+		pending[ticket] = nil
+		delay.ticket = nil
+		delay.size  = size
+		delay.mtime = mtime
+		delay.ino   = ino
+		delay.mode  = mode
+	end
+
+	-- public interface
+	return { request = request, statted = statted }
+end)()
+
 -----
 -- combines delays
 --
@@ -400,14 +597,43 @@ local Combiner = (function()
 		return "remove"
 	end
 
+	----
+	-- old delay is covered by the new one, 
+	-- the new one is combined further.
+	--
+	local function subs(d1, d2)
+		log("Delay",d2.etype,":",d2.path," subsumes ",
+		            d1.etype,":",d1.path)
+		return "subsume"
+	end
+
+	-----
+	-- True if 'path' is below the directory 'dir'.
+	--
+	local function below(path, dir)
+		return #path > #dir and dir:byte(-1) == 47 and 
+			path:sub(1, #dir) == dir
+	end
+
+	----
+	-- a Delete nullifies a Create of something the target never had,
+	-- otherwise replaces it
+	--
+	local function crde(d1, d2)
+		if d1.onTarget or d1.blocks then
+			return repl(d1, d2)
+		end
+		return null(d1, d2)
+	end
+
 	-----
 	-- Table how to combine events that dont involve a move.
 	--
 	local combineNoMove = {
 		Attrib = {Attrib=abso, Modify=repl, Create=repl, Delete=repl },
 		Modify = {Attrib=abso, Modify=abso, Create=repl, Delete=repl },
-		Create = {Attrib=abso, Modify=abso, Create=abso, Delete=repl },
-		Delete = {Attrib=abso, Modify=abso, Create=refi, Delete=abso },
+		Create = {Attrib=abso, Modify=abso, Create=abso, Delete=crde },
+		Delete = {Attrib=abso, Modify=refi, Create=refi, Delete=abso },
 	}
 	
 	------
@@ -435,6 +661,23 @@ local Combiner = (function()
 				return combineNoMove[d1.etype][d2.etype](d1, d2)
 			end
 
+			-- a Create of a directory not yet handled or a storm 
+			-- marker covers what happens below it, if recursive
+			if d1.recursive and d1.etype ~= "Delete" and 
+			   d1.status ~= "active" and below(d2.path, d1.path) 
+			then
+				return abso(d1, d2)
+			end
+
+			-- a Delete of a directory or a storm marker covers 
+			-- the delays below it
+			if d2.recursive and d2.etype ~= "Create" and
+			   d1.status ~= "active" and not d1.blocks and
+			   below(d1.path, d2.path)
+			then
+				return subs(d1, d2)
+			end
+
 			-- blocks events if one is a parent directory of another
 			if d1.path:byte(-1) == 47 and string.starts(d2.path, d1.path) or
 			   d2.path:byte(-1) == 47 and string.starts(d1.path, d2.path) 
@@ -485,6 +728,17 @@ local Combiner = (function()
 		
 		-- Move upon a single event
 		if d1.etype ~= "Move" and d2.etype == "Move" then
+			-- a file written under a temporary name and moved over 
+			-- another, the target does not need to know the former
+			if d1.etype == "Create" and d1.path == d2.path and
+			   d1.status ~= "active" and not d1.onTarget and 
+			   d1.path:byte(-1) ~= 47
+			then
+				log("Delay","Move:",d2.path,"->",d2.path2,
+					" of new ",d1.path," turns into Modify:",d2.path2)
+				return "save"
+			end
+
 			if d1.path == d2.path or d1.path == d2.path2 or
 			   d1.path :byte(-1) == 47 and string.starts(d2.path,  d1.path) or
 			   d1.path :byte(-1) == 47 and string.starts(d2.path2, d1.path) or
@@ -500,7 +754,26 @@ local Combiner = (function()
 		
 		-- Move upon move
 		if d1.etype == "Move" and d2.etype == "Move" then
-			-- TODO combine moves,
+			-- moves on what has been moved
+			if d1.path2 == d2.path then
+				if d1.status == "active" then
+					return "stack"
+				end
+				log("Delay","Move:",d2.path,"->",d2.path2,
+					" chains Move:",d1.path,"->",d1.path2)
+				return "chain"
+			end
+
+			-- moves something where the other moved from, 
+			-- like rotating logs, waits for the other
+			if d1.path == d2.path2 and d1.path2 ~= d2.path and
+			   d1.path:byte(-1) ~= 47 and d1.path2:byte(-1) ~= 47 and
+			   d2.path:byte(-1) ~= 47
+			then
+				log("Delay","Move:",d2.path,"->",d2.path2,
+					" blocked by Move:",d1.path,"->",d1.path2)
+				return "stack"
+			end
 
 			if d1.path  == d2.path or d1.path  == d2.path2 or
 			   d1.path2 == d2.path or d2.path2 == d2.path or
@@ -531,14 +804,18 @@ end)()
 -- Creates inlets for syncs: the user interface for events.
 --
 local InletFactory = (function()
-	-- table to receive the delay of an event.
-	--       or the delay list of an event list.
-	local e2d = {}
-	-- table to receive the sync of an event or event list
-	local e2s = {}
-	-- dont stop the garbage collector to remove entries.
-	setmetatable(e2d, { __mode = 'k' })
-	setmetatable(e2s, { __mode = 'k' })
+	-----
+	-- Events and event lists are views holding their delay (or 
+	-- delay list) and sync by these keys, private to the runner.
+	--
+	local k_delay = {}
+	local k_sync  = {}
+
+	-----
+	-- Key of events that are pointed to one delay after another,
+	-- they do not cache fields.
+	--
+	local k_view = {}
 	
 	-----
 	-- removes the trailing slash from a path
@@ -552,9 +829,9 @@ local InletFactory = (function()
 	
 	local function getPath(event)
 		if event.move ~= "To" then
-			return e2d[event].path
+			return event[k_delay].path
 		else
-			return e2d[event].path2
+			return event[k_delay].path2
 		end
 	end
 
@@ -569,14 +846,14 @@ local InletFactory = (function()
 		-- TODO give user a readonly version.
 		--
 		config = function(event)
-			return e2s[event].config
+			return event[k_sync].config
 		end,
 
 		-----
 		-- Returns the inlet belonging to an event.
 		-- 
 		inlet = function(event)
-			return e2s[event].inlet
+			return event[k_sync].inlet
 		end,
 
 		-----
@@ -586,7 +863,7 @@ local InletFactory = (function()
 		--    "Modify" or "Move",
 		--
 		etype = function(event)
-			return e2d[event].etype
+			return event[k_delay].etype
 		end,
 
 		-----
@@ -602,7 +879,39 @@ local InletFactory = (function()
 		--    'wait', 'active', 'block'.
 		-- 
 		status = function(event)
-			return e2d[event].status
+			return event[k_delay].status
+		end,
+
+		-----
+		-- Returns the size of the file when the event has been
+		-- captured, nil if not known (yet) or gone.
+		-- Like mtime, ino and mode only if the sync has 'stat' set.
+		--
+		size = function(event)
+			return event[k_delay].size
+		end,
+
+		-----
+		-- Returns the modification time of the file, seconds since 
+		-- the epoch with fraction, nil if not known.
+		--
+		mtime = function(event)
+			return event[k_delay].mtime
+		end,
+
+		-----
+		-- Returns the inode number of the file, nil if not known.
+		--
+		ino = function(event)
+			return event[k_delay].ino
+		end,
+
+		-----
+		-- Returns the mode bits of the file (type and permissions),
+		-- nil if not known.
+		--
+		mode = function(event)
+			return event[k_delay].mode
 		end,
 
 		-----
@@ -657,7 +966,7 @@ local InletFactory = (function()
 		-- All symlinks will have been resolved.
 		--
 		source = function(event)
-			return e2s[event].source
+			return event[k_sync].source
 		end,
 
 		------
@@ -665,7 +974,7 @@ local InletFactory = (function()
 		-- Includes a trailing slash for dirs.
 		--
 		sourcePath = function(event)
-			return e2s[event].source .. getPath(event)
+			return event[k_sync].source .. getPath(event)
 		end,
 	
 		------
@@ -673,7 +982,7 @@ local InletFactory = (function()
 		-- Includes a trailing slash.
 		--
 		sourcePathdir = function(event)
-			return e2s[event].source .. 
+			return event[k_sync].source .. 
 				(string.match(getPath(event), "^(.*/)[^/]+/?") or "")
 		end,
 	
@@ -682,7 +991,7 @@ local InletFactory = (function()
 		-- Excludes a trailing slash for dirs.
 		--
 		sourcePathname = function(event)
-			return e2s[event].source .. cutSlash(getPath(event))
+			return event[k_sync].source .. cutSlash(getPath(event))
 		end,
 	
 		------
@@ -693,7 +1002,7 @@ local InletFactory = (function()
 		--  this is completly up to the action scripts.)
 		--
 		target = function(event)
-			return e2s[event].config.target
+			return event[k_sync].config.target
 		end,
 
 		------
@@ -701,7 +1010,7 @@ local InletFactory = (function()
 		-- Includes a trailing slash for dirs.
 		--
 		targetPath = function(event)
-			return e2s[event].config.target .. getPath(event)
+			return event[k_sync].config.target .. getPath(event)
 		end,
 	
 		------
@@ -709,7 +1018,7 @@ local InletFactory = (function()
 		-- Includes a trailing slash.
 		--
 		targetPathdir = function(event)
-			return e2s[event].config.target .. 
+			return event[k_sync].config.target .. 
 				(string.match(getPath(event), "^(.*/)[^/]+/?") or "")
 		end,
 	
@@ -718,11 +1027,35 @@ local InletFactory = (function()
 		-- Excludes a trailing slash for dirs.
 		--
 		targetPathname = function(event)
-			return e2s[event].config.target .. 
+			return event[k_sync].config.target .. 
 				cutSlash(getPath(event))
 		end,
 	}
 		
+	-----
+	-- Event fields that stay the same for an event, they are computed
+	-- on first access only. An event is handed out for a delay about 
+	-- to be handled, so its paths do not change meanwhile.
+	--
+	local cachedFields = {
+		basename = true,
+		config = true,
+		inlet = true,
+		isdir = true,
+		name = true,
+		path = true,
+		pathdir = true,
+		pathname = true,
+		source = true,
+		sourcePath = true,
+		sourcePathdir = true,
+		sourcePathname = true,
+		target = true,
+		targetPath = true,
+		targetPathdir = true,
+		targetPathname = true,
+	}
+		
 	-----
 	-- Retrievs event fields for the user script.
 	--
@@ -736,7 +1069,11 @@ local InletFactory = (function()
 				end
 				error("event does not have field '"..field.."'", 2)
 			end
-			return f(event)
+			local v = f(event)
+			if cachedFields[field] and not rawget(event, k_view) then
+				rawset(event, field, v)
+			end
+			return v
 		end
 	}
 	
@@ -748,32 +1085,64 @@ local InletFactory = (function()
 		-- Returns a list of paths of all events in list.
 		-- 
 		-- @param elist -- handle returned by getevents()
-		-- @param mutator -- if not nil called with (etype, path, path2)
-		--                   returns one or two strings to add.
+		-- @param mutator -- if not nil called with (etype, path, path2,
+		--                   recursive) returns one or two strings to add.
 		--
 		getPaths = function(elist, mutator)
-			local dlist = e2d[elist]
-			if not dlist then
-				error("cannot find delay list from event list.")
-			end
 			local result = {}
 			local resultn = 1
-			for k, d in ipairs(dlist) do
-				local s1, s2
-				if mutator then
-					s1, s2 = mutator(d.etype, d.path, d.path2)
-				else
-					s1, s2 = d.path, d.path2
-				end
-				result[resultn] = s1
+			for path in elist.paths(mutator) do
+				result[resultn] = path
 				resultn = resultn + 1
-				if s2 then
-					result[resultn] = s2
-					resultn = resultn + 1
-				end
 			end
 			return result
-		end
+		end,
+
+		-----
+		-- Iterates the paths of all events in list, 
+		-- without making events or a list of them.
+		--
+		-- @param elist -- handle returned by getevents()
+		-- @param mutator -- as for getPaths()
+		--
+		paths = function(elist, mutator)
+			local dlist = elist[k_delay]
+			local i = 0
+			local pending = nil
+			return function()
+				if pending then
+					local p = pending
+					pending = nil
+					return p
+				end
+				while true do
+					i = i + 1
+					local d = dlist[i]
+					if not d then
+						return nil
+					end
+					local s1, s2
+					if mutator then
+						s1, s2 = mutator(d.etype, d.path, d.path2, d.recursive)
+					else
+						s1, s2 = d.path, d.path2
+					end
+					if s1 then
+						pending = s2
+						return s1
+					elseif s2 then
+						return s2
+					end
+				end
+			end
+		end,
+
+		-----
+		-- Returns the number of events in list.
+		--
+		size = function(elist)
+			return #elist[k_delay]
+		end,
 	}
 
 	-----
@@ -786,7 +1155,7 @@ local InletFactory = (function()
 			end
 		
 			if func == "config" then
-				return e2s[elist].config
+				return elist[k_sync].config
 			end
 
 			local f = eventListFuncs[func]
@@ -794,9 +1163,11 @@ local InletFactory = (function()
 				error("event list does not have function '"..func.."'", 2)
 			end
 		
-			return function(...)
+			local bound = function(...)
 				return f(elist, ...)
 			end
+			rawset(elist, func, bound)
+			return bound
 		end
 	}
 
@@ -813,50 +1184,51 @@ local InletFactory = (function()
 	-- Encapsulates a delay into an event for the user script.
 	--
 	local function d2e(sync, delay)
+		local event = {[k_delay] = delay, [k_sync] = sync}
+		setmetatable(event, eventMeta)
 		if delay.etype ~= "Move" then
-			if not delay.event then
-				local event = {}
-				delay.event = event
-				setmetatable(event, eventMeta)
-				e2d[event] = delay
-				e2s[event] = sync
-			end
-			return delay.event
+			return event
+		end
+		-- moves have 2 events - origin and destination
+		local event2 = {[k_delay] = delay, [k_sync] = sync}
+		setmetatable(event2, eventMeta)
+		-- move events have a field 'move'
+		event.move  = "Fr"
+		event2.move = "To"
+		return event, event2
+	end
+
+	-----
+	-- Creates a view, an event to be pointed to one delay after another
+	-- by d2v(). It is only valid till pointed to the next.
+	--
+	local function newView(sync)
+		local view = {[k_sync] = sync, [k_view] = true}
+		setmetatable(view, eventMeta)
+		return view
+	end
+
+	-----
+	-- Points a view to a delay, returns it as event.
+	-- For moves as the origin event.
+	--
+	local function d2v(view, delay)
+		view[k_delay] = delay
+		if delay.etype == "Move" then
+			view.move = "Fr"
 		else
-			-- moves have 2 events - origin and destination
-			if not delay.event then
-				local event  = {}
-				local event2 = {}
-				delay.event  = event
-				delay.event2 = event2
-
-				setmetatable(event, eventMeta)
-				setmetatable(event2, eventMeta)
-				e2d[delay.event]  = delay
-				e2d[delay.event2] = delay
-				e2s[delay.event]  = sync
-				e2s[delay.event2] = sync
-				
-				-- move events have a field 'move'
-				event.move  = "Fr"
-				event2.move = "To"
-			end
-			return delay.event, delay.event2
+			view.move = nil
 		end
+		return view
 	end
 	
 	-----
 	-- Encapsulates a delay list into an event list for the user script.
 	--
 	local function dl2el(sync, dlist)
-		if not dlist.elist then
-			local elist = {}
-			dlist.elist = elist
-			setmetatable(elist, eventListMeta)
-			e2d[elist] = dlist
-			e2s[elist] = sync
-		end
-		return dlist.elist
+		local elist = {[k_delay] = dlist, [k_sync] = sync}
+		setmetatable(elist, eventListMeta)
+		return elist
 	end
 
 	-----
@@ -903,7 +1275,7 @@ local InletFactory = (function()
 		-- Discards a waiting event.
 		--
 		discardEvent = function(sync, event)
-			local delay = e2d[event]
+			local delay = rawget(event, k_delay)
 			if delay.status ~= "wait" then
 				log("Error", 
 					"Ignored cancel of a non-waiting event of type ",
@@ -923,7 +1295,8 @@ local InletFactory = (function()
 		-----
 		-- Gets all events that are not blocked by active events.
 		--
-		-- @param if not nil a function to test each delay
+		-- @param if not nil a function to test each delay, the event
+		--        given is only valid during the call.
 		--
 		getEvents = function(sync, test)
 			local dlist = sync:getDelays(test) 
@@ -948,9 +1321,11 @@ local InletFactory = (function()
 			if not f then
 				error("inlet does not have function '"..func.."'", 2)
 			end
-			return function(...)
+			local bound = function(...)
 				return f(inlets[inlet], ...)
 			end
+			rawset(inlet, func, bound)
+			return bound
 		end,
 	}
 
@@ -971,14 +1346,14 @@ local InletFactory = (function()
 	-- Returns the delay from a event.
 	--
 	local function getDelayOrList(event)
-		return e2d[event]
+		return rawget(event, k_delay)
 	end
 	
 	-----
 	-- Returns the sync from an event or list
 	--
 	local function getSync(agent)
-		return e2s[agent]
+		return rawget(agent, k_sync)
 	end
 
 	-----
@@ -987,9 +1362,11 @@ local InletFactory = (function()
 	return {
 		getDelayOrList = getDelayOrList,
 		d2e            = d2e,
+		d2v            = d2v,
 		dl2el          = dl2el,
 		getSync        = getSync,
 		newInlet       = newInlet,
+		newView        = newView,
 	}
 end)()
 
@@ -999,35 +1376,6 @@ end)()
 --
 local Excludes = (function()
 	
-	-----
-	-- Turns a rsync like file pattern to a lua pattern.
-	-- 
-	-- 
-	local function toLuaPattern(p)
-		local o = p
-		p = string.gsub(p, "%%", "%%%%")
-		p = string.gsub(p, "%^", "%%^")
-		p = string.gsub(p, "%$", "%%$")
-		p = string.gsub(p, "%(", "%%(")
-		p = string.gsub(p, "%)", "%%)")
-		p = string.gsub(p, "%.", "%%.")
-		p = string.gsub(p, "%[", "%%[")
-		p = string.gsub(p, "%]", "%%]")
-		p = string.gsub(p, "%+", "%%+")
-		p = string.gsub(p, "%-", "%%-")
-		p = string.gsub(p, "%?", "[^/]")
-		p = string.gsub(p, "%*", "[^/]*")
-		-- this was a ** before 
-		p = string.gsub(p, "%[%^/%]%*%[%^/%]%*", ".*") 
-		p = string.gsub(p, "^/", "^/") 
-		if p:sub(1,2) ~= "^/" then -- does not begin with "^/"
-			-- all matches should begin with "/".
-			p = "/" .. p;
-		end
-		log("Exclude", "toLuaPattern '",o,"' = '",p,'"')
-		return p
-	end
-
 	-----
 	-- Adds a pattern to exclude.
 	--
@@ -1036,8 +1384,9 @@ local Excludes = (function()
 			-- already in the list
 			return
 		end
-		local lp = toLuaPattern(pattern)
-		self.list[pattern] = lp
+		log("Exclude", "adding '",pattern,"'")
+		self.list[pattern] = true
+		self.matcher:add(pattern)
 	end
 	
 	-----
@@ -1050,6 +1399,7 @@ local Excludes = (function()
 			return
 		end
 		self.list[pattern] = nil
+		self.matcher:remove(pattern)
 	end
 
 
@@ -1086,24 +1436,11 @@ local Excludes = (function()
 	-----
 	-- Tests if 'path' is excluded.
 	--
+	-- rsync like patterns are compiled by the core, 
+	-- see 'Compiled exclude patterns' in lsyncd.c
+	--
 	local function test(self, path)
-		for _, p in pairs(self.list) do
-			if p:byte(-1) == 36 then
-				-- ends with $
-				if path:match(p) then
-					--log("Exclude", "'",path,"' matches '",p,"' (1)")
-					return true
-				end
-			else
-				-- end either end with / or $ 
-				if path:match(p.."/") or path:match(p.."$") then
-					--log("Exclude", "'",path,"' matches '",p,"' (2)")
-					return true
-				end
-			end
-			--log("Exclude", "'",path,"' NOT matches '",p,"'")
-		end
-		return false
+		return self.matcher:test(path)
 	end
 
 	-----
@@ -1112,6 +1449,7 @@ local Excludes = (function()
 	local function new() 
 		return { 
 			list = {},
+			matcher = lsyncd.excludes(),
 
 			-- functions
 			add      = add,
@@ -1128,76 +1466,429 @@ local Excludes = (function()
 end)()
 
 -----
--- Holds information about one observed directory inclusively subdirs.
+-- Indexes the delays of a sync by their paths, so a new delay is only
+-- combined with delays on the same paths, their parent directories 
+-- and, for directories, the entries below them.
 --
-local Sync = (function()
+local DelayIndex = (function()
 	-----
-	-- Syncs that have no name specified by the user script 
-	-- get an incremental default name 'Sync[X]'
+	-- Creates a new index.
 	--
-	local nextDefaultName = 1
+	local function new()
+		return { 
+			-- delays by path and path2, a delay or a set of delays
+			at = {}, 
+			-- sets of delays by every directory their paths are below
+			below = {}, 
+			-- Init and Blanket delays, they block everything
+			blankets = {},
+		}
+	end
 
 	-----
-	-- Adds an exclude.
+	-- Adds or removes 'd' to/from the delays at 'path' and below its
+	-- parent directories.
 	--
-	local function addExclude(self, pattern)
-		return self.excludes:add(pattern)
+	local function setPath(self, d, path, v)
+		local at = self.at[path]
+		if v then
+			if not at then
+				self.at[path] = d
+			elseif at.etype then
+				self.at[path] = { [at] = true, [d] = true }
+			else
+				at[d] = true
+			end
+		elseif at == d then
+			self.at[path] = nil
+		elseif at then
+			at[d] = nil
+			if not next(at) then
+				self.at[path] = nil
+			end
+		end
+
+		local below = self.below
+		local p = path:find("/", 1, true)
+		while p and p < #path do
+			local dir = path:sub(1, p)
+			local set = below[dir]
+			if v then
+				if not set then
+					set = {}
+					below[dir] = set
+				end
+				set[d] = true
+			elseif set then
+				set[d] = nil
+				if not next(set) then
+					below[dir] = nil
+				end
+			end
+			p = path:find("/", p + 1, true)
+		end
 	end
 
 	-----
-	-- Removes an exclude.
+	-- Adds a delay, with the paths it has now.
 	--
-	local function rmExclude(self, pattern)
-		return self.excludes:remove(pattern)
+	local function add(self, d)
+		if d.etype == "Init" or d.etype == "Blanket" then
+			self.blankets[d] = true
+			return
+		end
+		setPath(self, d, d.path, true)
+		if d.path2 then
+			setPath(self, d, d.path2, true)
+		end
 	end
 
 	-----
-	-- Removes a delay.
+	-- Removes a delay indexed with 'path' and 'path2', 
+	-- if not given with the paths it has now.
 	--
-	local function removeDelay(self, delay) 
-		if self.delays[delay.dpos] ~= delay then
-			error("Queue is broken, delay not a dpos")
+	local function remove(self, d, path, path2)
+		if d.etype == "Init" or d.etype == "Blanket" then
+			self.blankets[d] = nil
+			return
 		end
-		Queue.remove(self.delays, delay.dpos)
-
-		-- free all delays blocked by this one. 
-		if delay.blocks then
-			for i, vd in pairs(delay.blocks) do
-				vd.status = "wait"
-			end
+		if not path then
+			path, path2 = d.path, d.path2
+		end
+		setPath(self, d, path, nil)
+		if path2 then
+			setPath(self, d, path2, nil)
 		end
 	end
 
 	-----
-	-- Returns true if this Sync concerns about
-	-- 'path'
+	-- Indexes a delay anew if its paths changed
+	-- from 'path' and 'path2' it has been indexed with.
 	--
-	local function concerns(self, path)
-		-- not concerned if watch rootdir doesnt match
-		if not path:starts(self.source) then
-			return false
-		end
-
-		-- a sub dir and not concerned about subdirs
-		if self.config.subdirs == false and
-			path:sub(#self.source, -1):match("[^/]+/?")
-		then
-			return false
+	local function update(self, d, path, path2)
+		if path ~= d.path or path2 ~= d.path2 then
+			remove(self, d, path, path2)
+			add(self, d)
 		end
-
-		-- concerned if not excluded
-		return not self.excludes:test(path:sub(#self.source))
 	end
 
 	-----
-	-- Collects a child process 
+	-- Puts the delays related to 'path' into the set 'into'.
 	--
-	local function collect(self, pid, exitcode)
-		local delay = self.processes[pid]
+	local function collect(self, path, into)
+		local at = self.at
+		local function put(v)
+			if not v then
+				return
+			elseif v.etype then
+				into[v] = true
+			else
+				for d, _ in pairs(v) do
+					into[d] = true
+				end
+			end
+		end
+		-- same path
+		put(at[path])
+		-- parent directories
+		local p = path:find("/", 1, true)
+		while p and p < #path do
+			put(at[path:sub(1, p)])
+			p = path:find("/", p + 1, true)
+		end
+		-- entries below a directory
+		if path:byte(-1) == 47 then
+			local set = self.below[path]
+			if set then
+				for d, _ in pairs(set) do
+					into[d] = true
+				end
+			end
+		end
+	end
+
+	-----
+	-- Returns the set of delays a delay on 'path' (and 'path2') 
+	-- might be combined with. Others are not related to it.
+	--
+	local function related(self, path, path2)
+		local set = {}
+		for d, _ in pairs(self.blankets) do
+			set[d] = true
+		end
+		collect(self, path, set)
+		if path2 then
+			collect(self, path2, set)
+		end
+		return set
+	end
+
+	-----
+	-- True if an Init or Blanket delay is indexed.
+	--
+	local function blanketed(self)
+		return next(self.blankets) ~= nil
+	end
+
+	-----
+	-- Takes the latest queued delay out of a set, nil if empty.
+	--
+	local function latest(set)
+		local ld
+		for d, _ in pairs(set) do
+			if not ld or d.dpos > ld.dpos then
+				ld = d
+			end
+		end
+		if ld then
+			set[ld] = nil
+		end
+		return ld
+	end
+
+	-- public interface
+	return {
+		add = add,
+		blanketed = blanketed,
+		latest = latest,
+		new = new,
+		related = related,
+		remove = remove,
+		update = update,
+	}
+end)()
+
+-----
+-- Schedules the syncs by the alarms of their delays.
+--
+-- A sync touches itself whenever its delays or processes change, only
+-- those touched are asked for their alarm again. The alarms are kept 
+-- in a heap, so the nearest is known at once and a cycle only invokes
+-- the syncs that are due.
+--
+local Scheduler = (function()
+	-----
+	-- Syncs by their alarm.
+	--
+	local alarms = Heap.new()
+
+	-----
+	-- Syncs touched since their alarm was asked.
+	--
+	local touched = {}
+
+	-----
+	-- Tells the scheduler a sync changed.
+	--
+	local function touch(sync)
+		touched[sync] = true
+	end
+
+	-----
+	-- Asks the touched syncs for their alarm.
+	--
+	local function refresh()
+		local sync = next(touched)
+		while sync do
+			touched[sync] = nil
+			Heap.set(alarms, sync, sync:getAlarm())
+			sync = next(touched)
+		end
+	end
+
+	-----
+	-- Returns the nearest alarm of all syncs.
+	--
+	local function getAlarm()
+		refresh()
+		local _, alarm = Heap.top(alarms)
+		return alarm or false
+	end
+
+	-----
+	-- Returns the list of syncs due at 'timestamp'. 
+	-- They are touched, as they are about to be invoked.
+	--
+	local function due(timestamp)
+		refresh()
+		local list = {}
+		while true do
+			local sync, alarm = Heap.top(alarms)
+			if not sync or (alarm ~= true and timestamp < alarm) then
+				break
+			end
+			Heap.pop(alarms)
+			touched[sync] = true
+			table.insert(list, sync)
+		end
+		return list
+	end
+
+	-- public interface
+	return {due = due, getAlarm = getAlarm, touch = touch}
+end)()
+
+-----
+-- Holds information about one observed directory inclusively subdirs.
+--
+local Sync = (function()
+	-----
+	-- Syncs that have no name specified by the user script 
+	-- get an incremental default name 'Sync[X]'
+	--
+	local nextDefaultName = 1
+
+	-----
+	-- Adds an exclude.
+	--
+	local function addExclude(self, pattern)
+		return self.excludes:add(pattern)
+	end
+
+	-----
+	-- Removes an exclude.
+	--
+	local function rmExclude(self, pattern)
+		return self.excludes:remove(pattern)
+	end
+
+	-----
+	-- Removes a delay, 
+	-- all delays blocked by this one wait again.
+	--
+	local function removeDelay(self, delay) 
+		self.delays:remove(delay)
+		DelayIndex.remove(self.index, delay)
+		local storm = self.storm
+		if storm and storm.markers[delay.path] == delay then
+			storm.markers[delay.path] = nil
+		end
+		Scheduler.touch(self)
+	end
+
+	-----
+	-- Returns the directory a storm syncs for a change of 'path', 
+	-- the one at 'stormDepth' containing it or the directory 
+	-- of 'path' if that is above.
+	--
+	local function stormDir(self, path)
+		local dir = path:match("^(.*/)") or "/"
+		local p = 1
+		for i = 1, self.config.stormDepth do
+			p = dir:find("/", p + 1, true)
+			if not p then
+				return dir
+			end
+		end
+		return dir:sub(1, p)
+	end
+
+	-----
+	-- Lets the sync enter a storm, from now on it syncs directories
+	-- instead of single entries. 
+	--
+	-- @return the paths of the delays waiting, to collapse them
+	--
+	local function startStorm(self)
+		log("Normal", "Sync ",self.config.name," enters storm mode with ",
+			self.delays:size()," delays, syncing directories at depth ",
+			self.config.stormDepth," instead of entries.")
+		self.storm = {
+			since   = now(),
+			changes = 0,
+			recent  = 0,
+			dirs    = 0,
+			-- the marker of a directory while it is not active
+			markers = {},
+		}
+		local paths = {}
+		for d in self.delays:iter() do
+			if d.status ~= "active" and 
+			   d.etype ~= "Init" and d.etype ~= "Blanket"
+			then
+				table.insert(paths, d.path)
+				if d.path2 then
+					table.insert(paths, d.path2)
+				end
+			end
+		end
+		return paths
+	end
+
+	-----
+	-- Ends the storm if less than 'maxDelays' changes came in 
+	-- since the last process finished or nothing is left to do.
+	--
+	local function calmStorm(self)
+		local storm = self.storm
+		if storm.recent >= self.config.maxDelays and 
+		   self.delays:size() > 0
+		then
+			storm.recent = 0
+			return
+		end
+		storm.took = now() - storm.since
+		storm.markers = nil
+		log("Normal", "Sync ",self.config.name," leaves storm mode after ",
+			storm.took," seconds, ",storm.changes,
+			" changes collapsed into ",storm.dirs," directory syncs.")
+		self.storm = nil
+		self.lastStorm = storm
+	end
+
+	-----
+	-- Returns true if this Sync concerns about
+	-- 'path'
+	--
+	local function concerns(self, path)
+		-- not concerned if watch rootdir doesnt match
+		if not path:starts(self.source) then
+			return false
+		end
+
+		-- a sub dir and not concerned about subdirs
+		if self.config.subdirs == false and
+			path:sub(#self.source, -1):match("[^/]+/?")
+		then
+			return false
+		end
+
+		-- concerned if not excluded
+		return not self.excludes:test(path:sub(#self.source))
+	end
+
+	-----
+	-- Lets the delay 'd' wait again after its action failed.
+	--
+	local function retry(self, d)
+		d.status = "wait"
+		-- might have got to the target partly
+		if d.etype == "Create" then
+			d.onTarget = true
+		end
+		-- with policies it waits like the others of its class and
+		-- is the latest due of those
+		local alarm = self.policies and d.wait or self.config.delay
+		-- delays at least 1 second
+		if alarm < 1 then
+			alarm = 1 
+		end
+		d.alarm = now() + alarm
+		if self.policies then
+			self.delays:move(d, d.class)
+		end
+	end
+
+	-----
+	-- Collects a child process 
+	--
+	local function collect(self, pid, exitcode)
+		local delay = self.processes[pid]
 		if not delay then
 			-- not a child of this sync.
 			return
 		end
+		Scheduler.touch(self)
 
 		if delay.status then
 			log("Delay", "collected an event")
@@ -1218,13 +1909,7 @@ local Sync = (function()
 					self.source,delay.path," = ",exitcode)
 			else 
 				-- sets the delay on wait again
-				delay.status = "wait"
-				local alarm = self.config.delay 
-				-- delays at least 1 second
-				if alarm < 1 then
-					alarm = 1 
-				end
-				delay.alarm = now() + alarm
+				retry(self, delay)
 			end
 		else
 			log("Delay", "collected a list")
@@ -1236,29 +1921,22 @@ local Sync = (function()
 				terminate(-1) --ERRNO
 			end
 			if rc == "again" then
-				-- sets the delay on wait again
+				-- sets the delays on wait again
 				delay.status = "wait"
-				local alarm = self.config.delay 
-				-- delays at least 1 second
-				if alarm < 1 then
-					alarm = 1 
-				end
-				alarm = now() + alarm
 				for _, d in ipairs(delay) do
-					d.alarm = alarm
-					d.status = "wait"
+					retry(self, d)
 				end
-			end
-			for _, d in ipairs(delay) do
-				if rc ~= "again" then
+			else
+				for _, d in ipairs(delay) do
 					removeDelay(self, d)
-				else
-					d.status = "wait"
 				end
 			end
 			log("Delay","Finished list = ",exitcode)
 		end
 		self.processes[pid] = nil
+		if self.storm then
+			calmStorm(self)
+		end
 	end
 
 	-----
@@ -1268,18 +1946,133 @@ local Sync = (function()
 	-- A delay can block 'n' other delays, 
 	-- but is blocked at most by one, the latest delay.
 	-- 
-	local function stack(oldDelay, newDelay)
-		newDelay.status = "block"
-		if not oldDelay.blocks then
-			oldDelay.blocks = {}
+	local function stack(self, oldDelay, newDelay)
+		self.delays:stack(oldDelay, newDelay)
+	end
+
+	-----
+	-- For syncs with 'stat' lets the core stat the path of a delay
+	-- (the destination of moves) in the background.
+	--
+	local function enrich(self, d)
+		if not self.config.stat or d.etype == "Delete" or 
+		   d.etype == "Init" or d.etype == "Blanket"
+		then
+			return
+		end
+		Metadata.request(d, self.source .. (d.path2 or d.path))
+	end
+
+	-----
+	-- Returns the first policy of the sync applying to a change,
+	-- nil if none does.
+	--
+	local function policyOf(self, etype, path, path2)
+		for _, p in ipairs(self.policies) do
+			if (not p.etype or p.etype == etype) and
+			   (not p.matcher or p.matcher:test(path) or
+			    path2 and p.matcher:test(path2))
+			then
+				return p
+			end
+		end
+		return nil
+	end
+
+	-----
+	-- Lets the delay 'od' be due when 'nd' is, if that is earlier. 
+	-- With policies a change might be due before those it joins,
+	-- the delay then goes on in the class of the new one.
+	--
+	local function hasten(self, od, nd)
+		if od.alarm ~= true and nd.alarm ~= true and nd.alarm < od.alarm then
+			od.alarm = nd.alarm
+			od.wait  = nd.wait
+			if self.policies then
+				od.priority = nd.priority
+				self.delays:move(od, nd.class)
+			end
+			Scheduler.touch(self)
+		end
+	end
+
+	-----
+	-- Queues a delay and indexes it.
+	--
+	local function push(self, d)
+		self.delays:push(d)
+		DelayIndex.add(self.index, d)
+		local storm = self.storm
+		if storm and d.recursive and d.etype == "Modify" then
+			storm.markers[d.path] = d
+			storm.dirs = storm.dirs + 1
+		end
+		Scheduler.touch(self)
+	end
+
+	-----
+	-- A directory not yet on the target moved from 'path' to 'path2'.
+	-- Turns its Create and the delays below it to the destination, 
+	-- if none is active and no other delay involves either path 
+	-- except for Creates and Modifies of common parent directories.
+	--
+	-- @return true if turned
+	--
+	local function renameNew(self, path, path2)
+		local below = {}
+		local found = false
+		for od, _ in pairs(DelayIndex.related(self.index, path, path2)) do
+			local op, op2 = od.path, od.path2
+			if od.status == "active" or 
+			   od.etype == "Init" or od.etype == "Blanket" 
+			then
+				return false
+			elseif op:sub(1, #path) == path and 
+			   (not op2 or op2:sub(1, #path) == path)
+			then
+				if op == path and od.etype == "Create" then
+					if od.onTarget then
+						-- the target might have it already
+						return false
+					end
+					found = true
+				end
+				below[od] = true
+			elseif op2 or #op >= #path or #op >= #path2 or
+			       op:byte(-1) ~= 47 or 
+			       path:sub(1, #op) ~= op or path2:sub(1, #op) ~= op or
+			       (od.etype ~= "Create" and od.etype ~= "Modify")
+			then
+				return false
+			end
+		end
+		if not found then
+			return false
+		end
+		log("Delay", "Move:",path,"->",path2,
+			" turns the delays of new ",path)
+		for od, _ in pairs(below) do
+			local op, op2 = od.path, od.path2
+			od.path = path2 .. op:sub(#path + 1)
+			if op2 then
+				od.path2 = path2 .. op2:sub(#path + 1)
+			end
+			DelayIndex.update(self.index, od, op, op2)
+			enrich(self, od)
 		end
-		table.insert(oldDelay.blocks, newDelay)
+		return true
 	end
 
+	-- forward declaration, moveIn() and delay() call each other
+	local moveIn
+
 	-----
 	-- Puts an action on the delay stack.
 	--
-	local function delay(self, etype, time, path, path2)
+	-- @param onTarget  for Creates true if what is created might 
+	--                  replace something on the target, like moves do.
+	--
+	local function delay(self, etype, time, path, path2, onTarget)
 		log("Function", "delay(",self.config.name,", ",
 			etype,", ",path,", ",path2,")")
 
@@ -1308,71 +2101,187 @@ local Sync = (function()
 				-- splits the move if only partly excluded
 				log("Exclude", "excluded origin transformed ",etype,
 					" to Create.",path2)
-				delay(self, "Create", time, path2, nil)
+				moveIn(self, time, path2)
 				return
 			end
 		end
 
-		if etype == "Move" and not self.config.onMove then
-			-- if there is no move action defined, 
-			-- split a move as delete/create
-			-- layer 1 scripts which want moves events have to
-			-- set onMove simply to "true"
-			log("Delay", "splitting Move into Delete & Create")
-			delay(self, "Delete", time, path,  nil)
-			delay(self, "Create", time, path2, nil)
+		if time and self.config.maxLatency then
+			-- delays wait for the changes to pause
+			self.lastChange = time
+		end
+
+		if not self.storm and self.config.recursive and 
+		   self.config.stormDepth and 
+		   self.delays:size() >= self.config.maxDelays
+		then
+			-- collapses what waits already
+			for _, p in ipairs(startStorm(self)) do
+				delay(self, "Modify", time, p, nil)
+			end
+		end
+
+		-- in a storm the directory is synced the change happened in
+		if self.storm and etype ~= "Init" then
+			local storm = self.storm
+			if path2 then
+				delay(self, "Modify", time, path2, nil)
+			end
+			storm.changes = storm.changes + 1
+			storm.recent  = storm.recent  + 1
+			etype = "Modify"
+			path  = stormDir(self, path)
+			path2 = nil
+			local md = storm.markers[path]
+			if md and md.status ~= "active" then
+				return
+			end
+		end
+
+		if etype == "Move" and path:byte(-1) == 47 and 
+		   renameNew(self, path, path2) 
+		then
 			return
 		end
 
+		-- if there is no move action defined, a move is split 
+		-- as delete/create when queued, after combining.
+		-- layer 1 scripts which want moves events have to
+		-- set onMove simply to "true"
+		local splits = etype == "Move" and not self.config.onMove
+
 		-- creates the new action
+		local wait = self.config.delay
+		local policy = self.policies and policyOf(self, etype, path, path2)
+		if policy and policy.delay then
+			wait = policy.delay
+		end
 		local alarm 
-		if time and self.config.delay then
-			alarm = time + self.config.delay
+		if time and wait then
+			alarm = time + wait
 		else
 			alarm = now()
 		end
 		-- new delay
 		local nd = Delay.new(etype, alarm, path, path2)
+		if time and wait then
+			nd.wait = wait
+		end
+		if policy then
+			nd.class = policy.class
+			nd.priority = policy.priority
+		end
+		if path:byte(-1) == 47 and 
+		   (etype == "Delete" or self.storm or 
+		    etype == "Create" and self.config.recursive)
+		then
+			nd.recursive = true
+		end
+		if etype == "Create" and 
+		   (onTarget or DelayIndex.blanketed(self.index))
+		then
+			-- the Init or Blanket might bring it to the target as well
+			nd.onTarget = true
+		end
 		if nd.etype == "Init" or nd.etype == "Blanket" then
 			-- always stack blanket events on the last event
 			log("Delay", "Stacking ",nd.etype," event.")
-			if self.delays.size > 0 then
-				stack(self.delays[self.delays.last], nd)
+			local last = self.delays:last()
+			if last then
+				stack(self, last, nd)
 			end
-			nd.dpos = Queue.push(self.delays, nd)
+			push(self, nd)
 			return
 		end
 
-		-- detects blocks and combos by working from back until 
-		-- front through the fifo
-		for il, od in Queue.qpairsReverse(self.delays) do
+		-- detects blocks and combos by working from the latest to the
+		-- earliest delay related to the new one, others cannot combine
+		local related = DelayIndex.related(self.index, path, path2)
+		while true do
+			local od = DelayIndex.latest(related)
+			if not od then
+				break
+			end
 			-- asks Combiner what to do
+			local op, op2 = od.path, od.path2
 			local ac = Combiner.combine(od, nd) 
 
 			if ac then
+				-- the Combiner might have changed the old delay
+				DelayIndex.update(self.index, od, op, op2)
 				if ac == "remove" then
-					Queue.remove(self.delays, il)
+					removeDelay(self, od)
 					return
+				elseif ac == "subsume" then
+					-- goes on with the delays before
+					removeDelay(self, od)
 				elseif ac == "stack" then
-					stack(od, nd)
-					nd.dpos = Queue.push(self.delays, nd)
+					if splits then
+						log("Delay", "splitting Move into Delete & Create")
+						delay(self, "Delete", time, path,  nil)
+						delay(self, "Create", time, path2, nil, true)
+						return
+					end
+					if nd.etype == "Create" and
+					   (od.path == path or od.path2 == path or
+					    od.recursive and od.etype ~= "Delete" and
+					    path:sub(1, #od.path) == od.path)
+					then
+						-- the delay waited for might bring it to the target
+						nd.onTarget = true
+					end
+					stack(self, od, nd)
+					hasten(self, od, nd)
+					push(self, nd)
+					enrich(self, nd)
 					return
 				elseif ac == "absorb" then
+					-- the entry changed again
+					hasten(self, od, nd)
+					enrich(self, od)
 					return
 				elseif ac == "replace" then
+					op, op2 = od.path, od.path2
+					if nd.etype == "Create" and od.etype ~= "Create" then
+						-- created again where something has been
+						od.onTarget = true
+					end
 					od.etype = nd.etype
 					od.path  = nd.path
 					od.path2 = nd.path2
+					od.recursive = nd.recursive
+					hasten(self, od, nd)
+					DelayIndex.update(self.index, od, op, op2)
+					enrich(self, od)
 					return
 				elseif ac == "split" then
 					delay(self, "Delete", time, path,  nil)
-					delay(self, "Create", time, path2, nil)
+					moveIn(self, time, path2)
+					return
+				elseif ac == "chain" then
+					-- the old move goes to the destination of the new, 
+					-- what has been at its former destination is gone
+					removeDelay(self, od)
+					if od.path ~= path2 then
+						delay(self, "Move", time, od.path, path2)
+					end
+					delay(self, "Delete", time, path, nil)
+					return
+				elseif ac == "save" then
+					-- the new entry is taken as change of the moved over
+					removeDelay(self, od)
+					delay(self, "Modify", time, path2, nil)
 					return
 				else 
 					error("unknown result of combine()")
 				end
 			end
-			il = il - 1
+		end
+		if splits then
+			log("Delay", "splitting Move into Delete & Create")
+			delay(self, "Delete", time, path,  nil)
+			moveIn(self, time, path2)
+			return
 		end
 		if nd.path2 then
 			log("Delay", "New ",nd.etype,":",nd.path,"->",nd.path2)
@@ -1380,35 +2289,171 @@ local Sync = (function()
 			log("Delay", "New ",nd.etype,":",nd.path)
 		end
 		-- no block or combo
-		nd.dpos = Queue.push(self.delays, nd)
+		push(self, nd)
+		enrich(self, nd)
 	end
-	
 
 	-----
-	-- Returns the nearest alarm for this Sync.
+	-- Queues the Create of what a Move turned into one brought to
+	-- 'path'. Monitors tell only about the moved directory, so unless
+	-- the action syncs whole trees for Creates, the entries below it
+	-- are raised as well.
 	--
-	local function getAlarm(self)
-		if self.processes:size() >= self.config.maxProcesses then
-			return false
+	moveIn = function(self, time, path)
+		delay(self, "Create", time, path, nil, true)
+		if path:byte(-1) ~= 47 or self.config.recursive then
+			return
 		end
-
-		-- first checks if more processses could be spawned 
-		if self.processes:size() < self.config.maxProcesses then
-			-- finds the nearest delay waiting to be spawned
-			for _, d in Queue.qpairs(self.delays) do
-				if d.status == "wait" then
-					return d.alarm 
+		local dirs = { path }
+		while #dirs > 0 do
+			local dir = table.remove(dirs)
+			local ds = lsyncd.opendir(self.source .. dir:sub(2))
+			local name, isdir
+			if ds then
+				name, isdir = ds:next()
+			end
+			while name do
+				local p = dir .. name
+				if isdir then
+					p = p .. "/"
+					table.insert(dirs, p)
 				end
+				delay(self, "Create", time, p, nil, true)
+				name, isdir = ds:next()
 			end
 		end
+	end
 
-		-- nothing to spawn
-		return false
+	-----
+	-- True if the paths 'a' and 'b' are the same or one is a
+	-- directory containing the other.
+	--
+	local function overlaps(a, b)
+		return a == b or
+			a:byte(-1) == 47 and b:sub(1, #a) == a or
+			b:byte(-1) == 47 and a:sub(1, #b) == b
 	end
-		
-	
+
 	-----
-	-- Gets all delays that are not blocked by active delays.
+	-- An entry told as deleted reappeared as 'path2'. Turns the Delete 
+	-- of 'path' into a Move, if it still waits and no other delay 
+	-- involves either path.
+	--
+	-- @return true if turned into a Move
+	--
+	local function reclaim(self, path, path2)
+		if not self.config.onMove or
+		   self.excludes:test(path) or self.excludes:test(path2)
+		then
+			return false
+		end
+		local found = false
+		for od, _ in pairs(DelayIndex.related(self.index, path, path2)) do
+			if od.etype == "Delete" and od.path == path and 
+			   od.status == "wait" and not od.blocks 
+			then
+				found = od
+			elseif od.etype == "Init" or od.etype == "Blanket" or
+			       overlaps(od.path, path) or overlaps(od.path, path2) or
+			       od.path2 and 
+			       (overlaps(od.path2, path) or overlaps(od.path2, path2)) 
+			then
+				return false
+			end
+		end
+		if not found then
+			return false
+		end
+		log("Delay", "Delete:",path," turns into Move:",path,"->",path2)
+		found.etype = "Move"
+		found.path2 = path2
+		DelayIndex.update(self.index, found, path, nil)
+		return true
+	end
+	
+
+	-----
+	-- Returns the point in time a delay is due. 
+	--
+	-- With 'maxLatency' it waits until no change came in for the 
+	-- seconds it waits, but not longer than 'maxLatency' after it 
+	-- was queued.
+	--
+	local function dueAt(self, d)
+		local alarm = d.alarm
+		if alarm == true or not self.lastChange then
+			return alarm
+		end
+		local quiet = self.lastChange + d.wait
+		if quiet < alarm then
+			return alarm
+		end
+		local latest = alarm + (self.config.maxLatency - d.wait)
+		if latest < quiet then
+			return latest
+		end
+		return quiet
+	end
+
+	-----
+	-- True if the delay 'd' is due at 'timestamp'.
+	--
+	local function isDue(self, d, timestamp)
+		-- time constrains are only concerned if not maxed 
+		-- the delay FIFO already.
+		return d.alarm == true or
+			self.delays:size() >= self.config.maxDelays or
+			not (timestamp < dueAt(self, d))
+	end
+
+	-----
+	-- Returns the nearest alarm for this Sync.
+	-- Asked by the Scheduler after the sync touched it.
+	--
+	local function getAlarm(self)
+		if self.processes:size() >= self.config.maxProcesses then
+			return false
+		end
+
+		if not self.policies then
+			-- finds the nearest delay waiting to be spawned
+			for d in self.delays:iter() do
+				if d.status == "wait" then
+					if self.delays:size() >= self.config.maxDelays then
+						-- time constrains are not concerned if maxed
+						return true
+					end
+					return dueAt(self, d)
+				end
+			end
+			-- false if nothing to spawn
+			return false
+		end
+
+		-- with policies the nearest of the first waiting of each class,
+		-- those of a class wait equally long
+		local alarm = false
+		for class = 0, #self.policies do
+			local d = self.delays:waiting(class)
+			if d then
+				if self.delays:size() >= self.config.maxDelays then
+					return true
+				end
+				local due = dueAt(self, d)
+				if due == true then
+					return true
+				end
+				if not alarm or due < alarm then
+					alarm = due
+				end
+			end
+		end
+		return alarm
+	end
+		
+	
+	-----
+	-- Gets all delays that are not blocked by active delays.
 	--
 	-- @param test   function to test each delay
 	--
@@ -1416,25 +2461,19 @@ local Sync = (function()
 		local dlist = {}
 		local dlistn = 1
 
+		-- delays blocked by those not taken, inheritly
 		local blocks = {}
+		local view = test and InletFactory.newView(self)
 
-		----
-		-- inheritly transfers all blocks from delay
-		--
-		local function getBlocks(delay) 
-			blocks[delay] = true
-			if delay.blocks then
-				for i, d in ipairs(delay.blocks) do
-					getBlocks(d)
-				end
-			end
-		end
+		-- with policies those not yet due are not taken
+		local timestamp = self.policies and now()
 
-		for i, d in Queue.qpairs(self.delays) do
+		for d in self.delays:iter() do
 			if d.status == "active" or
-				(test and not test(InletFactory.d2e(self, d))) 
+				(timestamp and not isDue(self, d, timestamp)) or
+				(test and not test(InletFactory.d2v(view, d))) 
 			then
-				getBlocks(d)
+				self.delays:blocked(d, blocks)
 			elseif not blocks[d] then
 				dlist[dlistn] = d
 				dlistn = dlistn + 1
@@ -1444,6 +2483,38 @@ local Sync = (function()
 		return dlist
 	end
 
+	-----
+	-- Gets the next event to be processed.
+	-- With policies the due one of the highest priority, the earliest
+	-- queued of those. It is the first waiting of its class.
+	--
+	local function getNextDelay(self, timestamp)
+		if not self.policies then
+			for d in self.delays:iter() do
+				if not isDue(self, d, timestamp) then
+					-- reached point in stack where delays are in future
+					return nil
+				end
+				if d.status == "wait" then
+					-- found a waiting delay
+					return d
+				end
+			end
+			return nil
+		end
+		local found
+		for class = 0, #self.policies do
+			local d = self.delays:waiting(class)
+			if d and isDue(self, d, timestamp) and
+			   (not found or d.priority > found.priority or
+			    d.priority == found.priority and d.dpos < found.dpos)
+			then
+				found = d
+			end
+		end
+		return found
+	end
+
 	-----
 	-- Creates new actions
 	--
@@ -1453,25 +2524,41 @@ local Sync = (function()
 			-- no new processes
 			return
 		end
-		for _, d in Queue.qpairs(self.delays) do
+		-- with policies the action is asked as long as it takes
+		-- the next delay (see getNextDelay)
+		local last
+		local iter, q, d = self.delays:iter()
+		while true do
+			if self.policies then
+				d = getNextDelay(self, timestamp)
+				if not d or d == last then
+					return
+				end
+				last = d
+			else
+				d = iter(q, d)
+				if not d then
+					return
+				end
+			end
 			-- if reached the global limit return
 			if settings.maxProcesses and processCount >= settings.maxProcesses then
 				log("Alarm", "at global process limit.")
 				return
 			end
-			if self.delays.size < self.config.maxDelays then
-				-- time constrains are only concerned if not maxed 
-				-- the delay FIFO already.
-				if d.alarm ~= true and timestamp < d.alarm then
-					-- reached point in stack where delays are in future
-					return
-				end
+			local due = isDue(self, d, timestamp)
+			if not due then
+				-- reached point in stack where delays are in future
+				return
 			end
 			if d.status == "wait" then
 				-- found a waiting delay
 				if d.etype ~= "Init" then
 					self.config.action(self.inlet)
 				else
+					-- monitors still crawling the tree take what they
+					-- watch from now on as maybe passed by the startup
+					self.initSpawned = true
 					self.config.init(InletFactory.d2e(self, d))
 				end
 				if self.processes:size() >= self.config.maxProcesses then
@@ -1482,25 +2569,6 @@ local Sync = (function()
 		end
 	end
 	
-	-----
-	-- Gets the next event to be processed.
-	--
-	local function getNextDelay(self, timestamp)
-		for i, d in Queue.qpairs(self.delays) do
-			if self.delays.size < self.config.maxDelays then
-				-- time constrains are only concerned if not maxed 
-				-- the delay FIFO already.
-				if d.alarm ~= true and timestamp < d.alarm then
-					-- reached point in stack where delays are in future
-					return nil
-				end
-			end
-			if d.status == "wait" then
-				-- found a waiting delay
-				return d
-			end
-		end
-	end
 
 	------
 	-- Adds and returns a blanket delay thats blocks all.
@@ -1508,7 +2576,7 @@ local Sync = (function()
 	--
 	local function addBlanketDelay(self)
 		local newd = Delay.new("Blanket", true, "")
-		newd.dpos = Queue.push(self.delays, newd)
+		push(self, newd)
 		return newd 
 	end
 	
@@ -1518,7 +2586,7 @@ local Sync = (function()
 	--
 	local function addInitDelay(self)
 		local newd = Delay.new("Init", true, "")
-		newd.dpos = Queue.push(self.delays, newd)
+		push(self, newd)
 		return newd 
 	end
 	
@@ -1528,8 +2596,30 @@ local Sync = (function()
 	local function statusReport(self, f)
 		local spaces = "                    "
 		f:write(self.config.name," source=",self.source,"\n")
-		f:write("There are ",self.delays.size, " delays\n")
-		for i, vd in Queue.qpairs(self.delays) do
+		f:write("There are ",self.delays:size(), " delays\n")
+		if self.config.maxLatency then
+			local delay = self.config.delay
+			for d in self.delays:iter() do
+				if d.status == "wait" and d.alarm ~= true then
+					delay = dueAt(self, d) - d.alarm + d.wait
+					break
+				end
+			end
+			f:write("Delaying changes for ",delay," seconds, ",
+				self.config.maxLatency," at most\n")
+		end
+		local storm = self.storm
+		if storm then
+			f:write("Storm mode for ",now() - storm.since," seconds, ",
+				storm.changes," changes collapsed into ",storm.dirs,
+				" directory syncs\n")
+		elseif self.lastStorm then
+			storm = self.lastStorm
+			f:write("Last storm took ",storm.took," seconds, ",
+				storm.changes," changes collapsed into ",storm.dirs,
+				" directory syncs\n")
+		end
+		for vd in self.delays:iter() do
 			local st = vd.status
 			f:write(st, string.sub(spaces, 1, 7 - #st))
 			f:write(vd.etype," ")
@@ -1548,20 +2638,129 @@ local Sync = (function()
 		if nothing then
 			f:write("  nothing.\n")
 		end
+		if self.policies then
+			local count = {}
+			for d in self.delays:iter() do
+				count[d.class] = (count[d.class] or 0) + 1
+			end
+			f:write("Policies:\n")
+			for class, p in ipairs(self.policies) do
+				f:write("  ",p.name," delay=",p.delay or self.config.delay,
+					" priority=",p.priority,", ",count[class] or 0,
+					" delays\n")
+			end
+		end
 		f:write("\n")
 	end
 
+	-----
+	-- Returns a table of the event types this sync wants for files.
+	-- Directory events are always delivered regardless.
+	--
+	-- Either explicitly configured as 'events' or derived from the 
+	-- on* handlers when the default action calls them. Modifies
+	-- need deletes and moves too, so the Combiner can drop them.
+	--
+	local function wantedEvents(config)
+		local events = {}
+		if config.events then
+			for _, etype in ipairs(config.events) do
+				if etype ~= "Attrib" and etype ~= "Modify" and 
+				   etype ~= "Create" and etype ~= "Delete" and 
+				   etype ~= "Move" 
+				then
+					error("unknown event type '"..etype.."' in events", 3)
+				end
+				events[etype] = true
+			end
+			return events
+		end
+		if config.action ~= default.action then
+			-- a custom action gets all events
+			return {Attrib=true, Modify=true, Create=true, 
+				Delete=true, Move=true}
+		end
+		events.Attrib = config.onAttrib and true
+		events.Modify = config.onModify and true
+		if config.onCreate or config.onDelete or 
+		   config.onMove or config.onModify 
+		then
+			events.Create = true
+			events.Delete = true
+			events.Move   = true
+		end
+		return events
+	end
+
+	-----
+	-- Compiles the 'policies' of a config. Each tells the 'delay' 
+	-- and 'priority' of the changes of an 'etype' and/or on paths 
+	-- matching 'path', a pattern or list of patterns like excludes.
+	-- The first matching policy applies. A delay longer than 
+	-- 'maxLatency' is cut to it.
+	--
+	local function compilePolicies(config)
+		if not config.policies then
+			return nil
+		end
+		local policies = {}
+		for _, cp in ipairs(config.policies) do
+			local etype = cp.etype
+			if etype and etype ~= "Attrib" and etype ~= "Modify" and 
+			   etype ~= "Create" and etype ~= "Delete" and 
+			   etype ~= "Move" 
+			then
+				error("unknown event type '"..etype.."' in policies", 3)
+			end
+			if cp.delay ~= nil and type(cp.delay) ~= "number" or
+			   cp.priority ~= nil and type(cp.priority) ~= "number"
+			then
+				error("delay and priority of policies must be numbers", 3)
+			end
+			local p = {
+				class = #policies + 1,
+				etype = etype,
+				delay = cp.delay,
+				priority = cp.priority or 0,
+			}
+			if p.delay and config.maxLatency and 
+			   p.delay > config.maxLatency 
+			then
+				p.delay = config.maxLatency
+			end
+			local patterns = cp.path
+			if type(patterns) == "string" then
+				patterns = {patterns}
+			end
+			if patterns then
+				p.matcher = lsyncd.excludes()
+				for _, pattern in ipairs(patterns) do
+					p.matcher:add(pattern)
+				end
+			end
+			p.name = (etype or "*") .. " " ..
+				(patterns and table.concat(patterns, " ") or "*")
+			table.insert(policies, p)
+		end
+		return policies
+	end
+
 	-----
 	-- Creates a new Sync
 	--
 	local function new(config) 
+		local policies = compilePolicies(config)
 		local s = {
 			-- fields
 			config = config,
-			delays = Queue.new(),
+			-- a class of delays for each policy and those of none
+			delays = lsyncd.delays(policies and #policies + 1),
+			index = DelayIndex.new(),
 			source = config.source,
 			processes = CountArray.new(),
 			excludes = Excludes.new(),
+			events = wantedEvents(config),
+			policies = policies,
 
 			-- functions
 			addBlanketDelay = addBlanketDelay,
@@ -1574,6 +2773,7 @@ local Sync = (function()
 			getDelays       = getDelays,
 			getNextDelay    = getNextDelay,
 			invokeActions   = invokeActions,
+			reclaim         = reclaim,
 			removeDelay     = removeDelay,
 			rmExclude       = rmExclude,
 			statusReport    = statusReport,
@@ -1731,7 +2931,9 @@ local Syncs = (function()
 			'collect', 
 			'init', 
 			'maxDelays', 
+			'maxLatency',
 			'maxProcesses', 
+			'stormDepth',
 		}
 		for _, dn in pairs(defaultValues) do
 			if config[dn] == nil then
@@ -1739,12 +2941,19 @@ local Syncs = (function()
 			end
 		end
 
+		if config.maxLatency and 
+		   (not config.delay or config.maxLatency < config.delay)
+		then
+			local info = debug.getinfo(3, "Sl")
+			log("Error", info.short_src, ":", info.currentline,
+				": maxLatency needs to be at least the delay.")
+			terminate(-1) -- ERRNO
+		end
+
 		-- the monitor to use
 		config.monitor = 
 			settings.monitor or config.monitor or Monitors.default()
-		if config.monitor ~= "inotify" 
-		and config.monitor ~= "fsevents" 
-		then
+		if not Monitors.supports(config.monitor) then
 			local info = debug.getinfo(3, "Sl")
 			log("Error", info.short_src, ":", info.currentline,
 				": event monitor '",config.monitor,"' unknown.")
@@ -1754,6 +2963,8 @@ local Syncs = (function()
 		--- creates the new sync
 		local s = Sync.new(config)
 		table.insert(list, s)
+		-- its position for the round robin
+		s.listpos = #list
 		return s
 	end
 
@@ -1812,135 +3023,1025 @@ local function splitPath(path, root)
 end
 
 -----
--- Interface to inotify, watches recursively subdirs and 
--- sends events.
+-- Polls directories on filesystems the kernel does not report
+-- changes of (NFS, CIFS, FUSE), and subtrees of inotify watched
+-- syncs handed over to polling.
 --
--- All inotify specific implementation should be enclosed here.
+-- The core keeps the index and scans, this schedules the scans.
 --
-local Inotify = (function()
+local Poll = (function()
+	-----
+	-- The syncs indexed by the root number the core gave them.
+	--
+	local syncs = {}
 
 	-----
-	-- A list indexed by inotifies watch descriptor yielding the 
-	-- directories absolute paths.
+	-- The polled subtrees of inotify watched syncs, indexed by the
+	-- root number the core gave them. Each holds the absolute path
+	-- and the function receiving its events.
 	--
-	local wdpaths = CountArray.new()
+	local trees = {}
 
 	-----
-	-- The same vice versa, all watch descriptors by its
-	-- absolute path.
+	-- When the next scan is due, false if no sync polls.
 	--
-	local pathwds = {}
+	local nextScan = false
 
 	-----
-	-- A list indexed by sync's containing the root path this
-	-- sync is interested in.
+	-- When the next scan of the subtrees is due, false if there
+	-- are none.
 	--
-	local syncRoots = {}
-	
+	local nextTreeScan = false
+
 	-----
-	-- Stops watching a directory
+	-- adds a Sync to poll
 	--
-	-- @param path    absolute path to unwatch
-	-- @param core    if false not actually send the unwatch to the kernel
-	--                (used in moves which reuse the watch)
+	-- @param sync      Object to receive events
+	-- @param rootdir   root dir to poll
 	--
-	local function removeWatch(path, core)
-		local wd = pathwds[path]
-		if not wd then
-			return 
+	local function addSync(sync, rootdir)
+		for _, s in pairs(syncs) do
+			if s == sync then
+				error("duplicate sync in Poll.addSync()")
+			end
+		end
+		local root = lsyncd.poll.addsync(rootdir, sync.excludes.matcher)
+		syncs[root] = sync
+		nextScan = now() + settings.pollInterval
+	end
+
+	-----
+	-- Polls a subtree of inotify watched syncs.
+	--
+	-- @param path      absolute path of the subtree
+	-- @param filters   list of {root, excludes matcher} of the syncs
+	-- @param handler   function(etype, isdir, time, path, path2, reclaimed)
+	--                  receiving the events with absolute paths
+	-- @return          the root number
+	--
+	local function addTree(path, filters, handler)
+		local root = lsyncd.poll.addtree(path, filters)
+		trees[root] = { path = path, handler = handler }
+		if not nextTreeScan then
+			nextTreeScan = now() + settings.inotifyPollInterval
 		end
-		if core then
-			lsyncd.inotify.rmwatch(wd)
+		return root
+	end
+
+	-----
+	-- Stops polling a subtree.
+	--
+	local function rmTree(root)
+		lsyncd.poll.rmroot(root)
+		trees[root] = nil
+		if not next(trees) then
+			nextTreeScan = false
 		end
-		wdpaths[wd] = nil
-		pathwds[path] = nil
 	end
 
 	-----
-	-- Adds watches for a directory (optionally) including all subdirectories.
+	-- Called by the core for every change a scan found.
 	--
-	-- @param path       absolute path of directory to observe
-	-- @param recurse    true if recursing into subdirs 
-	-- @param raiseSync  --X --
-	--        raiseTime  if not nil sends create Events for all files/dirs
-	--                   to this sync.
+	-- @param etype     "Attrib", "Mofify", "Create", "Delete", "Move")
+	-- @param root      root number of the sync or subtree
+	-- @param isdir     true if path is a directory
+	-- @param time      time of event
+	-- @param path      path relative to the root
+	-- @param path2     for moves the destination path
+	-- @param reclaimed true for a Move of an entry told as deleted before
 	--
-	local function addWatch(path, recurse, raiseSync, raiseTime)
-		log("Function", 
-			"Inotify.addWatch(",path,", ",recurse,", ",
-			raiseSync,", ",raiseTime,")")
+	local function event(etype, root, isdir, time, path, path2, reclaimed)
+		if isdir then
+			path = path .. "/"
+			if path2 then
+				path2 = path2 .. "/"
+			end
+		end
 
-		if not Syncs.concerns(path) then
-			log("Inotify", "not concerning '",path,"'")
-			return
+		if path2 then
+			log("Poll", "got event ",etype," ",path," to ",path2) 
+		else 
+			log("Poll", "got event ",etype," ",path)
 		end
 
-		-- lets the core registers watch with the kernel
-		local wd = lsyncd.inotify.addwatch(path, 
-			(settings and settings.inotifyMode) or "");
-		if wd < 0 then
-			log("Inotify","Unable to add watch '",path,"'")
+		local tree = trees[root]
+		if tree then
+			path = tree.path .. path:sub(2)
+			if path2 then
+				path2 = tree.path .. path2:sub(2)
+			end
+			tree.handler(etype, isdir, time, path, path2, reclaimed)
 			return
 		end
 
-		do
-			-- If this wd is registered already the kernel
-			-- reused it for a new dir for a reason - old 
-			-- dir is gone.
-			local op = wdpaths[wd]
-			if op and op ~= path then
-				pathwds[op] = nil
+		local sync = syncs[root]
+		if reclaimed then
+			if sync:reclaim(path, path2) then
+				return
 			end
+			etype = "Create"
+			path = path2
+			path2 = nil
+		end
+		if not isdir and not sync.events[etype] then
+			return
 		end
-		pathwds[path] = wd
-		wdpaths[wd] = path
+		-- what is moved might replace something
+		sync:delay(etype, time, path, path2, reclaimed)
+	end
 
-		-- registers and adds watches for all subdirectories 
-		-- and/or raises create events for all entries
-		if not recurse and not raise then 
+	-----
+	-- Returns the time of the next scan.
+	--
+	local function getAlarm()
+		if not nextScan or 
+		   (nextTreeScan and nextTreeScan < nextScan) 
+		then
+			return nextTreeScan
+		end
+		return nextScan
+	end
+
+	-----
+	-- Lets the core scan if due.
+	--
+	local function cycle(timestamp)
+		if nextScan and timestamp >= nextScan then
+			lsyncd.poll.scan(settings.pollBudget, "sync")
+			nextScan = timestamp + settings.pollInterval
+		end
+		if nextTreeScan and timestamp >= nextTreeScan then
+			lsyncd.poll.scan(settings.pollBudget, "tree")
+			nextTreeScan = timestamp + settings.inotifyPollInterval
+		end
+	end
+
+	-----
+	-- Writes a status report about polling to a filedescriptor
+	--
+	local function statusReport(f)
+		if not nextScan then
 			return
 		end
+		local stats = lsyncd.poll.stats()
+		f:write("Poll index holds ",stats.directories," directories with ",
+			stats.entries," entries\n")
+		f:write("Poll did ",stats.scans," scans, ",stats.passes,
+			" full passes, ",stats.stats," stats and ",stats.readdirs,
+			" directory listings\n")
+	end
+
+	-- public interface
+	return { 
+		addSync = addSync, 
+		addTree = addTree,
+		cycle = cycle,
+		event = event, 
+		getAlarm = getAlarm,
+		rmTree = rmTree,
+		statusReport = statusReport 
+	}
+end)()
+
+-----
+-- Interface to inotify, watches recursively subdirs and 
+-- sends events.
+--
+-- All inotify specific implementation should be enclosed here.
+--
+local Inotify = (function()
+
+	-----
+	-- The watch descriptors and their directories absolute paths are 
+	-- kept by the core as tree of directory names 
+	-- (lsyncd.inotify.path, lookup and walk).
+	--
+
+	-----
+	-- A list indexed by sync's containing the root path this
+	-- sync is interested in.
+	--
+	local syncRoots = {}
+
+	-----
+	-- Subtrees handed over to polling, since nothing happened in them
+	-- for long or Lsyncd ran out of watches. The root numbers of the 
+	-- poll core indexed by absolute path.
+	--
+	local polled = {}
+
+	-----
+	-- Polled subtrees something happened in, to be watched again.
+	--
+	local awoken = {}
+
+	-----
+	-- Number of watches Lsyncd may use before handing subtrees over 
+	-- to polling, false if unknown. Lowered when the kernel refuses 
+	-- watches earlier.
+	--
+	local maxWatches = false
+
+	-----
+	-- True if watches have been added since the last balance().
+	--
+	local added = false
+
+	-----
+	-- Directories whose watch could not be added as they vanished
+	-- before their Create was handled, in this and the cycle before.
+	-- If moved along with a parent, the Move of the parent follows
+	-- and watches them at their new path.
+	--
+	local lost = {}
+	local lostBefore = {}
+
+	-----
+	-- The initial crawls going on, indexed by the number the core
+	-- gave them, each with its sync, path and when it started.
+	--
+	local crawls = {}
+
+	-----
+	-- Number of directories and seconds the last crawl took.
+	--
+	local lastCrawl = false
+	
+	-----
+	-- Stops watching a directory, or polling it.
+	--
+	-- @param path    absolute path to unwatch
+	-- @param core    if false not actually send the unwatch to the kernel
+	--                (used in moves which reuse the watch)
+	--
+	local function removeWatch(path, core)
+		for p, root in pairs(polled) do
+			if p:sub(1, #path) == path then
+				polled[p] = nil
+				Poll.rmTree(root)
+			end
+		end
+		local wd = lsyncd.inotify.lookup(path)
+		if not wd then
+			return 
+		end
+		lsyncd.inotify.rmwatch(wd, core)
+	end
+
+	-----
+	-- Returns the union of events all syncs watching 'path' want
+	-- and the inotifyMode to use for it. If syncs wanting modifies 
+	-- use different modes, it acts on modify and closeWrite.
+	--
+	local function watchEvents(path)
+		local events = {}
+		local imode
+		for sync, root in pairs(syncRoots) do
+			if splitPath(path, root) then
+				for etype, _ in pairs(sync.events) do
+					events[etype] = true
+				end
+				if sync.events.Modify then
+					local m = sync.config.inotifyMode or
+						(settings and settings.inotifyMode) or ""
+					if imode and imode ~= m then
+						m = "CloseWrite or Modify"
+					end
+					imode = m
+				end
+			end
+		end
+		return events, imode or ""
+	end
+
+	-----
+	-- Directories whose entries are still to be read, a batch every
+	-- cycle. Each with its path, the sync and time to raise Create
+	-- events for, if its subdirectories are to be watched and, for 
+	-- the one being read, the directory stream.
+	--
+	local listings = Queue.new()
+
+	-----
+	-- Queues the entries below 'path' to be read.
+	--
+	-- @param sync   if not nil raises Create events for all entries 
+	--               to this sync, at 'time'
+	-- @param watch  true to watch the subdirectories found
+	--
+	local function list(path, sync, time, watch)
+		Queue.push(listings, 
+			{ path = path, sync = sync, time = time, watch = watch })
+	end
+
+	-----
+	-- Raises Create events for all entries below 'path'.
+	--
+	local function raise(path, sync, time)
+		list(path, sync, time, false)
+	end
+
+	-- forward declaration, polled subtrees send their events here
+	local dispatch
+
+	-----
+	-- Hands the subtree at 'path' over to polling. Stops watching it
+	-- and polling subtrees below it.
+	--
+	local function demote(path)
+		local filters = {}
+		for sync, root in pairs(syncRoots) do
+			table.insert(filters, {root, sync.excludes.matcher})
+		end
+		local root = Poll.addTree(path, filters, 
+			function(etype, isdir, time, p, p2, reclaimed)
+				awoken[path] = true
+				dispatch(etype, isdir, time, p, p2, false, reclaimed)
+			end)
+		for p, r in pairs(polled) do
+			if p:sub(1, #path) == path then
+				polled[p] = nil
+				Poll.rmTree(r)
+			end
+		end
+		polled[path] = root
+		local wd = lsyncd.inotify.lookup(path)
+		if wd then
+			lsyncd.inotify.rmwatch(wd, true)
+		end
+		log("Normal", "Polling ",path," with ",lsyncd.poll.count(root),
+			" directories instead of watching.")
+	end
+
+	-----
+	-- Follows a directory moved within the watched trees. The core 
+	-- relinks its watch, the kernel keeps the watches of all
+	-- subdirectories. Polled subtrees below it are polled anew at 
+	-- their new paths.
+	--
+	-- @return  true if done, false if the directory must be watched
+	--          anew, as the syncs concerned want other events there.
+	--
+	local function moveWatch(path, path2)
+		local events, imode = watchEvents(path)
+		local events2, imode2 = watchEvents(path2)
+		if imode ~= imode2 then
+			return false
+		end
+		for etype, _ in pairs(events) do
+			if not events2[etype] then
+				return false
+			end
+		end
+		for etype, _ in pairs(events2) do
+			if not events[etype] then
+				return false
+			end
+		end
+		if not lsyncd.inotify.move(path, path2) then
+			return false
+		end
+		local moved = {}
+		for p, root in pairs(polled) do
+			if p:sub(1, #path) == path then
+				table.insert(moved, p)
+			end
+		end
+		for _, p in ipairs(moved) do
+			Poll.rmTree(polled[p])
+			polled[p] = nil
+			awoken[p] = nil
+			demote(path2 .. p:sub(#path + 1))
+		end
+		return true
+	end
+
+	-----
+	-- Returns the new paths of the lost directories a Move of 
+	-- 'path' to 'path2' carried along and forgets them.
+	--
+	local function findLost(path, path2)
+		local found = {}
+		for _, set in ipairs({lost, lostBefore}) do
+			for p, _ in pairs(set) do
+				if p:sub(1, #path) == path then
+					table.insert(found, path2 .. p:sub(#path + 1))
+					set[p] = nil
+				end
+			end
+		end
+		return found
+	end
+
+	-----
+	-- Hands subtrees nothing happened in for the longest time over
+	-- to polling, until 'count' watches are down to 90% of the budget.
+	--
+	-- @param count  number of watches used
+	-- @param keep   path the subtrees must not be a prefix of
+	--
+	local function relieve(count, keep)
+		local low = math.floor(maxWatches * 0.9)
+		if count <= low then
+			return
+		end
+		for _, path in ipairs(lsyncd.inotify.coldest(count - low, 0)) do
+			if not keep or keep:sub(1, #path) ~= path then
+				demote(path)
+			end
+		end
+	end
+
+	-----
+	-- Called when the kernel refused a watch. Lowers the budget to 
+	-- the watches in use and frees some by polling cold subtrees.
+	--
+	-- @param path  the directory that could not be watched
+	--
+	local function outOfWatches(path)
+		if not lsyncd.poll then
+			log("Error", "Terminating since out of inotify watches.")
+			log("Error", 
+				"Consider increasing /proc/sys/fs/inotify/max_user_watches")
+			terminate(-1) -- ERRNO
+		end
+		local count = lsyncd.inotify.stats().watches
+		if not maxWatches or count < maxWatches then
+			log("Normal", "Out of inotify watches at ",count," watches.")
+			maxWatches = count
+		end
+		relieve(count, path)
+	end
+
+	-----
+	-- Adds watches for a directory (optionally) including all subdirectories.
+	--
+	-- @param path       absolute path of directory to observe
+	-- @param recurse    true if recursing into subdirs 
+	-- @param raiseSync  --X --
+	--        raiseTime  if not nil sends create Events for all files/dirs
+	--                   to this sync.
+	--
+	local function addWatch(path, recurse, raiseSync, raiseTime)
+		log("Function", 
+			"Inotify.addWatch(",path,", ",recurse,", ",
+			raiseSync,", ",raiseTime,")")
+
+		if not Syncs.concerns(path) then
+			log("Inotify", "not concerning '",path,"'")
+			return
+		end
+
+		-- lets the core registers watch with the kernel
+		local events, imode = watchEvents(path)
+		local wd, err = lsyncd.inotify.addwatch(path, imode, events);
+		if wd < 0 and err == "nospace" then
+			outOfWatches(path)
+			wd, err = lsyncd.inotify.addwatch(path, imode, events);
+			if wd < 0 and err == "nospace" then
+				-- polls this one itself
+				demote(path)
+				if raiseSync then
+					raise(path, raiseSync, raiseTime)
+				end
+				return
+			end
+		end
+		if wd < 0 then
+			log("Inotify","Unable to add watch '",path,"'")
+			lost[path] = true
+			return
+		end
+		added = true
+
+		-- registers and adds watches for all subdirectories 
+		-- and/or raises create events for all entries
+		if recurse or raiseSync then
+			list(path, raiseSync, raiseTime, recurse)
+		end
+	end
+
+	-----
+	-- Reads up to 'budget' entries of the directories queued by list(),
+	-- resuming where the last call stopped.
+	--
+	local function listEntries(budget)
+		while budget > 0 and listings.size > 0 do repeat
+			local pos = listings.first
+			local l = listings[pos]
+			if not l.dir then
+				local err
+				l.dir, err = lsyncd.opendir(l.path)
+				if not l.dir then
+					-- normal if deleted meanwhile
+					log("Inotify", "cannot read ",l.path,": ",err)
+					Queue.remove(listings, pos)
+					break -- continue
+				end
+			end
+			local dir = l.dir
+			local root = l.sync and syncRoots[l.sync]
+			while budget > 0 do
+				local name, isdir = dir:next()
+				if not name then
+					Queue.remove(listings, pos)
+					break
+				end
+				budget = budget - 1
+				local pd = l.path .. name
+				if isdir then
+					pd = pd .. "/"
+				end
+				-- creates a Create event for entry.
+				if root then
+					local relative = splitPath(pd, root)
+					if relative then
+						l.sync:delay("Create", l.time, relative)
+					end
+				end
+				if isdir then
+					if l.watch then
+						addWatch(pd, true, l.sync, l.time)
+					else
+						list(pd, l.sync, l.time, false)
+					end
+				end
+			end
+		until true end
+	end
+
+	-----
+	-- adds a Sync to receive events
+	--
+	-- @param sync   Object to receive events
+	-- @param rootdir   root dir to watch
+	--
+	local function addSync(sync, rootdir)
+		if syncRoots[sync] then
+			error("duplicate sync in Inotify.addSync()")
+		end
+		if not next(syncRoots) then
+			lsyncd.inotify.configure("movewindow", settings.inotifyMoveWindow)
+			lsyncd.inotify.configure("crawlthreads", 
+				settings.inotifyCrawlThreads)
+		end
+		syncRoots[sync] = rootdir
+		if not maxWatches and lsyncd.poll then
+			maxWatches = settings.inotifyMaxWatches
+			if not maxWatches then
+				-- leaves some watches to others
+				local f = io.open("/proc/sys/fs/inotify/max_user_watches")
+				local n = f and tonumber(f:read("*l"))
+				if f then
+					f:close()
+				end
+				maxWatches = n and math.floor(n * 0.95) or false
+			end
+		end
+		lsyncd.inotify.addsync(rootdir, sync.excludes.matcher)
+
+		-- the core watches the tree in the background
+		local events, imode = watchEvents(rootdir)
+		local c = lsyncd.inotify.crawl(rootdir, imode, events)
+		if not c then
+			log("Error", "Unable to watch '",rootdir,"'")
+			return
+		end
+		crawls[c] = { sync = sync, path = rootdir, started = now() }
+	end
+
+	-----
+	-- Called every cycle after the syncs invoked their actions. Marks
+	-- the crawls of syncs whose startup began, so the core tells the
+	-- directories watched from now on.
+	--
+	local function markCrawls()
+		for c, crawl in pairs(crawls) do
+			if not crawl.marked and crawl.sync.initSpawned then
+				lsyncd.inotify.crawlmark(c)
+				crawl.marked = true
+			end
+		end
+	end
+
+	-----
+	-- Called by the core when the crawl 'c' watched all directories.
+	--
+	-- @param dirs  number of directories watched
+	-- @param late  the topmost directories watched after the startup 
+	--              of the sync began
+	--
+	local function crawled(c, dirs, late)
+		local crawl = crawls[c]
+		crawls[c] = nil
+		local took = now() - crawl.started
+		log("Normal", "Watching ",dirs," directories of ",crawl.path,
+			" took ",took," seconds.")
+		lastCrawl = { dirs = dirs, took = took }
+
+		-- the startup might have passed these directories before they
+		-- have been watched, thus changes made meanwhile could be missed.
+		-- Catching up is part of the startup, so it does not wait.
+		local sync = crawl.sync
+		if not sync.config.init or #late == 0 then
+			return
+		end
+		log("Normal", "Catching up on ",#late," directories of ",
+			sync.config.name," watched after its startup began.")
+		local root = syncRoots[sync]
+		for _, path in ipairs(late) do
+			local relative = splitPath(path, root)
+			if relative then
+				sync:delay("Create", nil, relative, nil, true)
+				if not sync.config.recursive then
+					raise(path, sync, nil)
+				end
+			end
+		end
+	end
+
+	-----
+	-- Called by the core when a crawl ran out of watches.
+	--
+	-- @param path   the directory that could not be watched
+	-- @param again  true if it still could not be after making room
+	-- @return       true to try again, false if 'path' is polled now
+	--
+	local function noSpace(path, again)
+		if again then
+			demote(path)
+			return false
+		end
+		outOfWatches(path)
+		return true
+	end
+
+	-----
+	-- Sends an event to all syncs concerned.
+	--
+	-- @param watching  true if the event came from a watch, watches 
+	--                  are then added and removed for directories.
+	--                  false for events of polled subtrees.
+	-- @param reclaimed true for a Move of an entry the core told as
+	--                  deleted before, see Sync.reclaim()
+	--
+	dispatch = function(etype, isdir, time, path, path2, watching, reclaimed)
+		-- a directory moved within the watched trees keeps its watches
+		local moved = isdir and watching and etype == "Move" and 
+			not reclaimed and path and path2 and Syncs.concerns(path2) and
+			moveWatch(path, path2)
+		local found = moved and findLost(path, path2)
+
+		for sync, root in pairs(syncRoots) do repeat
+			local relative  = path and splitPath(path, root)
+			local relative2 
+			if path2 then
+				relative2 = splitPath(path2, root)
+			end
+			if not relative and not relative2 then
+				-- sync is not interested in this dir
+				break -- continue
+			end
+		
+			-- makes a copy of etype to possibly change it
+			local etyped = etype 
+			local created = path
+			if etyped == 'Move' then
+				if not relative2 then
+					log("Normal", "Transformed Move to Delete for ",
+						sync.config.name)
+					etyped = 'Delete'
+				elseif not relative or 
+				       reclaimed and not sync:reclaim(relative, relative2)
+				then
+					-- moved in, or the Delete of the origin is gone
+					relative = relative2
+					relative2 = nil
+					created = path2
+					log("Normal", "Transformed Move to Create for ",
+						sync.config.name)
+					etyped = 'Create'
+				end
+			end
+			if not isdir and not sync.events[etyped] then
+				-- another sync on this directory wanted the event
+				break -- continue
+			end
+			if etyped ~= 'Move' or not reclaimed then
+				-- what is moved in might replace something
+				sync:delay(etyped, time, relative, relative2, 
+					etyped ~= etype)
+			end
+			
+			if isdir and watching then
+				if etyped == "Create" then
+					addWatch(created, true, sync, time)
+				elseif etyped == "Delete" then
+					if not moved then
+						removeWatch(path, true)
+					end
+				elseif etyped == "Move" then
+					if not moved then
+						removeWatch(path, false)
+						addWatch(path2, true, sync, time)
+					else
+						for _, p in ipairs(found) do
+							addWatch(p, true, sync, time)
+						end
+					end
+				end
+			end
+		until true end
+	end
+
+	-----
+	-- Called when an event has occured.
+	--
+	-- @param etype     "Attrib", "Mofify", "Create", "Delete", "Move")
+	-- @param wd        watch descriptor (matches lsyncd.inotifyadd())
+	-- @param isdir     true if filename is a directory
+	-- @param time      time of event
+	-- @param filename  string filename without path
+	-- @param filename2 
+	-- @param reclaimed true for a Move of an entry told as deleted before
+	--
+	local function event(etype, wd, isdir, time, filename, wd2, filename2,
+	                     reclaimed)
+		-- an empty filename is the directory of wd itself
+		if isdir and filename ~= "" then
+			filename = filename .. "/"
+			if filename2 then
+				filename2 = filename2 .. "/"
+			end
+		end
+
+		if filename2 then
+			log("Inotify", "got event ",etype," ",filename, 
+				"(",wd,") to ",filename2,"(",wd2,")") 
+		else 
+			log("Inotify","got event ",etype," ",filename,"(",wd,")")
+		end
+
+		-- looks up the watch descriptor id
+		local path = lsyncd.inotify.path(wd)
+		if path then
+			path = path..filename
+		end
+		
+		local path2 = wd2 and lsyncd.inotify.path(wd2)
+		if path2 and filename2 then
+			path2 = path2..filename2
+		end
+		
+		if not path and path2 and etype =="Move" then
+			-- dispatch() takes it as moved in
+			log("Inotify", "Move from deleted directory ",path2,
+				" becomes Create.")
+		elseif not path then
+			-- this is normal in case of deleted subdirs
+			log("Inotify", "event belongs to unknown watch descriptor.")
+			return
+		end
+
+		dispatch(etype, isdir, time, path, path2, true, reclaimed)
+	end
+
+	-----
+	-- Called by the core with a list of watch descriptors the kernel
+	-- dropped, since their directories were deleted or moved away.
+	--
+	local function ignored(wds)
+		for _, wd in ipairs(wds) do
+			log("Inotify", "dropped watch ",wd)
+		end
+	end
+
+	-----
+	-- Timestamp of the next consistency check.
+	--
+	local nextCheck = false
+
+	-----
+	-- Number of stale watch table entries the last check found.
+	--
+	local leaked = 0
+
+	-----
+	-- Periodically lets the core check the watch table for 
+	-- consistency, it drops and reports stale entries. Every cycle
+	-- forgets the directories lost the cycle before.
+	--
+	local function check(timestamp)
+		-- the Move carrying a lost directory along has been read by now
+		lostBefore = lost
+		lost = {}
+
+		if not next(syncRoots) or settings.inotifyCheckInterval <= 0 then
+			return
+		end
+		if nextCheck and timestamp < nextCheck then
+			return
+		end
+		nextCheck = timestamp + settings.inotifyCheckInterval
+
+		leaked = lsyncd.inotify.check()
+		if leaked > 0 then
+			log("Normal", "Inotify check dropped ",leaked,
+				" stale watch table entries.")
+		end
+
+		-- polls subtrees nothing happened in for long
+		if settings.inotifyColdAfter and lsyncd.poll then
+			for _, path in ipairs(
+				lsyncd.inotify.coldest(0, settings.inotifyColdAfter)) 
+			do
+				demote(path)
+			end
+		end
+	end
+
+	-----
+	-- When the next step of a rescan after an overflow is due,
+	-- false if none is running.
+	--
+	local nextRescan = false
+
+	-----
+	-- Called by the runner on an overflow of the kernels event queue.
+	-- Changes might have been lost, the watched tree is rescanned
+	-- step by step while events keep flowing.
+	--
+	local function overflow()
+		if not nextRescan then
+			nextRescan = now()
+		end
+	end
+
+	-----
+	-- Does a rescan step if due.
+	--
+	local function rescan(timestamp)
+		if not nextRescan or timestamp < nextRescan then
+			return
+		end
+		if lsyncd.inotify.rescan(settings.inotifyRescanBudget) then
+			nextRescan = timestamp + settings.inotifyRescanInterval
+		else
+			log("Normal", "Rescan after overflow finished.")
+			nextRescan = false
+		end
+	end
+
+	-----
+	-- Returns the time of the next rescan step.
+	--
+	local function getAlarm()
+		if listings.size > 0 then
+			-- directories to read
+			return now()
+		end
+		return nextRescan
+	end
 
-		local entries = lsyncd.readdir(path)
-		if not entries then
+	-----
+	-- Called every cycle. Hands cold subtrees over to polling when
+	-- over the watch budget, and watches polled subtrees something 
+	-- happened in again if the budget allows.
+	--
+	local function balance()
+		if not maxWatches then
 			return
 		end
-		for dirname, isdir in pairs(entries) do
-			local pd = path .. dirname
-			if isdir then
-				pd = pd .. "/"
+		local count
+		if added then
+			added = false
+			count = lsyncd.inotify.stats().watches
+			if count > maxWatches then
+				relieve(count)
+				count = lsyncd.inotify.stats().watches
 			end
-			
-			-- creates a Create event for entry.
-			if raiseSync then
-				local relative  = splitPath(pd, syncRoots[raiseSync])
-				if relative then
-					raiseSync:delay("Create", raiseTime, relative)
+		end
+		if not next(awoken) then
+			return
+		end
+		count = count or lsyncd.inotify.stats().watches
+		local low = math.floor(maxWatches * 0.9)
+		for path, _ in pairs(awoken) do
+			local root = polled[path]
+			if root then
+				local dirs = lsyncd.poll.count(root)
+				if count + dirs <= low then
+					log("Normal", "Watching ",path," again.")
+					polled[path] = nil
+					addWatch(path, true)
+					Poll.rmTree(root)
+					count = count + dirs
 				end
 			end
-			-- adds syncs for subdirs
-			if isdir then
-				addWatch(pd, true, raiseSync, raiseTime)
-			end
+		end
+		awoken = {}
+		added = false
+	end
+
+	-----
+	-- Writes a status report about inotifies to a filedescriptor
+	--
+	local function statusReport(f)
+		local stats = lsyncd.inotify.stats(true)
+		f:write("Inotify watching ",stats.watches," directories\n")
+		for _, crawl in pairs(crawls) do
+			f:write("Inotify crawling ",crawl.path," for ",
+				now() - crawl.started," seconds, ",stats.crawlDirectories,
+				" directories watched, ",stats.crawlPending," to list\n")
+		end
+		if lastCrawl then
+			f:write("Inotify last crawl watched ",lastCrawl.dirs,
+				" directories in ",lastCrawl.took," seconds\n")
+		end
+		if listings.size > 0 then
+			f:write("Inotify reading the entries of ",listings.size,
+				" directories\n")
+		end
+		if next(polled) then
+			local pstats = lsyncd.poll.stats()
+			f:write("Inotify polling ",pstats.treeDirectories,
+				" directories in ",pstats.trees," subtrees\n")
+		end
+		f:write("Inotify watch table uses ",stats.watchMemory,
+			" bytes, as tables of paths about ",stats.watchMemoryLua,
+			" bytes\n")
+		f:write("Inotify moves paired: ",stats.movesPaired,
+			", unpaired: ",stats.movesUnpaired,
+			", pending: ",stats.movesPending,
+			", recognized by inode: ",stats.movesReclaimed,"\n")
+		f:write("Inotify followed ",stats.directoriesMoved,
+			" moved directories without watching them anew\n")
+		f:write("Inotify dropped ",stats.eventsDropped,
+			" events no sync wanted, ",stats.eventsExcluded,
+			" events excluded\n")
+		f:write("Inotify last check found ",leaked,
+			" stale watch table entries\n")
+		if stats.overflows > 0 then
+			f:write("Inotify event queue overflowed ",stats.overflows,
+				" times, rescans did ",stats.rescanStats," stats and found ",
+				stats.rescanEvents," changes",
+				nextRescan and ", rescanning" or "","\n")
+		end
+		if stats.writesSkipped > 0 then
+			f:write("Inotify skipped ",stats.writesSkipped,
+				" closes without writes, ",stats.writesOpen,
+				" files written and still open\n")
+		end
+		for wd, path in lsyncd.inotify.walk() do
+			f:write("  ",wd,": ",path,"\n")
 		end
 	end
 
+	-- public interface
+	return { 
+		addSync = addSync, 
+		balance = balance,
+		check = check,
+		crawled = crawled,
+		event = event, 
+		getAlarm = getAlarm,
+		ignored = ignored,
+		listEntries = listEntries,
+		markCrawls = markCrawls,
+		noSpace = noSpace,
+		overflow = overflow,
+		rescan = rescan,
+		statusReport = statusReport 
+	}
+end)()
+
+----
+-- Interface to OSX /dev/fsevents, watches the whole filesystems
+--
+-- All fsevents specific implementation should be enclosed here.
+--
+local Fsevents = (function()
+	-----
+	-- A list indexed by sync's containing the root path this
+	-- sync is interested in.
+	--
+	local syncRoots = {}
+
 	-----
 	-- adds a Sync to receive events
 	--
 	-- @param sync   Object to receive events
-	-- @param rootdir   root dir to watch
+	-- @param dir    dir to watch
 	--
-	local function addSync(sync, rootdir)
+	local function addSync(sync, dir)
 		if syncRoots[sync] then
-			error("duplicate sync in Inotify.addSync()")
+			error("duplicate sync in Fanotify.addSync()")
 		end
-		syncRoots[sync] = rootdir
-		addWatch(rootdir, true)
+		syncRoots[sync] = dir
 	end
 
 	-----
-	-- Called when an event has occured.
+	-- Called when any event has occured.
 	--
 	-- @param etype     "Attrib", "Mofify", "Create", "Delete", "Move")
 	-- @param wd        watch descriptor (matches lsyncd.inotifyadd())
@@ -1949,57 +4050,28 @@ local Inotify = (function()
 	-- @param filename  string filename without path
 	-- @param filename2 
 	--
-	local function event(etype, wd, isdir, time, filename, wd2, filename2)
+	local function event(etype, isdir, time, path, path2)
+		
 		if isdir then
-			filename = filename .. "/"
-			if filename2 then
-				filename2 = filename2 .. "/"
+			path = path .. '/'
+			if path2 then
+				path2 = path2 .. '/'
 			end
 		end
 
-		if filename2 then
-			log("Inotify", "got event ",etype," ",filename, 
-				"(",wd,") to ",filename2,"(",wd2,")") 
-		else 
-			log("Inotify","got event ",etype," ",filename,"(",wd,")")
-		end
-
-		-- looks up the watch descriptor id
-		local path = wdpaths[wd]
-		if path then
-			path = path..filename
-		end
-		
-		local path2 = wd2 and wdpaths[wd2]
-		if path2 and filename2 then
-			path2 = path2..filename2
-		end
-		
-		if not path and path2 and etype =="Move" then
-			log("Inotify", "Move from deleted directory ",path2,
-				" becomes Create.")
-			path = path2
-			path2 = nil
-			etype = "Create"
-		end
-
-		if not path then
-			-- this is normal in case of deleted subdirs
-			log("Inotify", "event belongs to unknown watch descriptor.")
-			return
-		end
-
-		for sync, root in pairs(syncRoots) do repeat
+		log("Fsevents",etype,",",isdir,",",time,",",path,",",path2)
+	
+		for _, s in Syncs.iwalk() do repeat
+			local root = s.source
+			if not path:starts(root) then
+				break  -- continue
+			end
 			local relative  = splitPath(path, root)
 			local relative2 
 			if path2 then
 				relative2 = splitPath(path2, root)
 			end
-			if not relative and not relative2 then
-				-- sync is not interested in this dir
-				break -- continue
-			end
-		
+			
 			-- makes a copy of etype to possibly change it
 			local etyped = etype 
 			if etyped == 'Move' then
@@ -2015,18 +4087,7 @@ local Inotify = (function()
 					etyped = 'Delete'
 				end
 			end
-			sync:delay(etyped, time, relative, relative2)
-			
-			if isdir then
-				if etyped == "Create" then
-					addWatch(path, true, sync, time)
-				elseif etyped == "Delete" then
-					removeWatch(path, true)
-				elseif etyped == "Move" then
-					removeWatch(path, false)
-					addWatch(path2, true, sync, time)
-				end
-			end
+			s:delay(etyped, time, relative, relative2, etyped ~= etype)
 		until true end
 	end
 
@@ -2034,10 +4095,7 @@ local Inotify = (function()
 	-- Writes a status report about inotifies to a filedescriptor
 	--
 	local function statusReport(f)
-		f:write("Inotify watching ",wdpaths:size()," directories\n")
-		for wd, path in wdpaths:walk() do
-			f:write("  ",wd,": ",path,"\n")
-		end
+		-- TODO
 	end
 
 	-- public interface
@@ -2048,12 +4106,13 @@ local Inotify = (function()
 	}
 end)()
 
-----
--- Interface to OSX /dev/fsevents, watches the whole filesystems
+-----
+-- Interface to Linux fanotify. One filesystem wide mark reports
+-- all changes, there are no watches per directory.
 --
--- All fsevents specific implementation should be enclosed here.
+-- All fanotify specific implementation should be enclosed here.
 --
-local Fsevents = (function()
+local Fanotify = (function()
 	-----
 	-- A list indexed by sync's containing the root path this
 	-- sync is interested in.
@@ -2063,72 +4122,95 @@ local Fsevents = (function()
 	-----
 	-- adds a Sync to receive events
 	--
-	-- @param sync   Object to receive events
-	-- @param dir    dir to watch
+	-- @param sync      Object to receive events
+	-- @param rootdir   root dir to watch
 	--
-	local function addSync(sync, dir)
+	local function addSync(sync, rootdir)
 		if syncRoots[sync] then
 			error("duplicate sync in Fanotify.addSync()")
 		end
-		syncRoots[sync] = dir
+		syncRoots[sync] = rootdir
+		lsyncd.fanotify.addsync(rootdir, sync.excludes.matcher, 
+			sync.config.inotifyMode or 
+				(settings and settings.inotifyMode) or "", 
+			sync.events)
 	end
 
 	-----
-	-- Called when any event has occured.
+	-- Called when an event has occured.
 	--
 	-- @param etype     "Attrib", "Mofify", "Create", "Delete", "Move")
-	-- @param wd        watch descriptor (matches lsyncd.inotifyadd())
-	-- @param isdir     true if filename is a directory
+	-- @param isdir     true if path is a directory
 	-- @param time      time of event
-	-- @param filename  string filename without path
-	-- @param filename2 
+	-- @param path      absolute path 
+	-- @param path2     for moves the absolute destination path
 	--
 	local function event(etype, isdir, time, path, path2)
-		
 		if isdir then
-			path = path .. '/'
+			path = path .. "/"
 			if path2 then
-				path2 = path2 .. '/'
+				path2 = path2 .. "/"
 			end
 		end
 
-		log("Fsevents",etype,",",isdir,",",time,",",path,",",path2)
-	
-		for _, s in Syncs.iwalk() do repeat
-			local root = s.source
-			if not path:starts(root) then
-				break  -- continue
-			end
+		if path2 then
+			log("Fanotify", "got event ",etype," ",path," to ",path2) 
+		else 
+			log("Fanotify", "got event ",etype," ",path)
+		end
+
+		for sync, root in pairs(syncRoots) do repeat
 			local relative  = splitPath(path, root)
 			local relative2 
 			if path2 then
 				relative2 = splitPath(path2, root)
 			end
-			
+			if not relative and not relative2 then
+				-- sync is not interested in this dir
+				break -- continue
+			end
+		
 			-- makes a copy of etype to possibly change it
 			local etyped = etype 
-			if etyped == 'Move' then
+			if etyped == "Move" then
 				if not relative2 then
-					log("Normal", "Transformed Move to Create for ",
+					log("Normal", "Transformed Move to Delete for ",
 						sync.config.name)
-					etyped = 'Create'
+					etyped = "Delete"
 				elseif not relative then
 					relative = relative2
 					relative2 = nil
-					log("Normal", "Transformed Move to Delete for ",
+					log("Normal", "Transformed Move to Create for ",
 						sync.config.name)
-					etyped = 'Delete'
+					etyped = "Create"
 				end
 			end
-			s:delay(etyped, time, relative, relative2)
+			if not isdir and not sync.events[etyped] then
+				-- another sync on this filesystem wanted the event
+				break -- continue
+			end
+			-- what is moved in might replace something
+			sync:delay(etyped, time, relative, relative2, 
+				etyped ~= etype)
 		until true end
 	end
 
 	-----
-	-- Writes a status report about inotifies to a filedescriptor
+	-- Writes a status report about fanotify to a filedescriptor
 	--
 	local function statusReport(f)
-		-- TODO
+		if not next(syncRoots) then
+			return
+		end
+		local stats = lsyncd.fanotify.stats()
+		f:write("Fanotify marks ",stats.filesystems," filesystems",
+			stats.renames and "" or ", moves are not paired","\n")
+		f:write("Fanotify directory handles cached: ",stats.handlesCached,
+			", hits: ",stats.handleHits,", misses: ",stats.handleMisses,
+			", stale: ",stats.handlesStale,"\n")
+		f:write("Fanotify dropped ",stats.eventsForeign,
+			" events outside syncs, ",stats.eventsExcluded,
+			" events excluded\n")
 	end
 
 	-- public interface
@@ -2166,10 +4248,23 @@ Monitors = (function()
 		end
 	end
 
+	-----
+	-- Returns true if the core supports the monitor 'name'.
+	--
+	local function supports(name)
+		for _, v in ipairs(list) do
+			if v == name then
+				return true
+			end
+		end
+		return false
+	end
+
 	-- public interface
 	return { default = default,
 			 list = list,
-	         initialize = initialize 
+	         initialize = initialize,
+	         supports = supports
 	}
 end)()
 
@@ -2446,8 +4541,16 @@ local StatusFile = (function()
 			s:statusReport(f)
 			f:write("\n")
 		end
+
+		local ds = lsyncd.delaystats()
+		f:write("Delays take ",ds.bytes," bytes each, ",
+			string.format("%.1f", ds.bytes * 1000000 / 1048576),
+			" MiB per million delays (",ds.used," in a slab of ",
+			ds.slab,")\n\n")
 		
 		Inotify.statusReport(f)
+		Fanotify.statusReport(f)
+		Poll.statusReport(f)
 		f:close()
 	end
 
@@ -2459,47 +4562,37 @@ end)()
 -- Lets the userscript make its own alarms.
 --
 local UserAlarms = (function() 
-	local alarms = {}
+	local alarms = Heap.new()
 
 	-----
 	-- Calls the user function at timestamp.
 	--
 	local function alarm(timestamp, func, extra)
-		local idx 
-		for k, v in ipairs(alarms) do
-			if timestamp < v.timestamp then
-				idx = k
-				break
-			end
-		end
 		local a = {timestamp = timestamp, 
 		           func = func, 
 		           extra = extra}
-		if idx then
-			table.insert(alarms, idx, a)
-		else
-			table.insert(alarms, a)
-		end
+		Heap.set(alarms, a, timestamp)
 	end
 
 	----
 	-- Retrieves the nearest alarm.
 	--
 	local function getAlarm()
-		if #alarms == 0 then
-			return false 
-		else
-			return alarms[1].timestamp
-		end
+		local _, timestamp = Heap.top(alarms)
+		return timestamp or false
 	end
 
 	-----
 	-- Calls user alarms.
 	--
 	local function invoke(timestamp)
-		while #alarms > 0 and alarms[1].timestamp <= timestamp do
-			alarms[1].func(alarms[1].timestamp, alarms[1].extra)
-			table.remove(alarms, 1)
+		while true do
+			local a = Heap.top(alarms)
+			if not a or timestamp < a.timestamp then
+				break
+			end
+			Heap.pop(alarms)
+			a.func(a.timestamp, a.extra)
 		end
 	end
 
@@ -2588,22 +4681,30 @@ function runner.cycle(timestamp)
 		error("runner.cycle() called while not running!")
 	end
 
+	-- polls for changes first, so no delay is missed
+	Poll.cycle(timestamp)
+
 	--- only let Syncs invoke actions if not on global limit
 	if not settings.maxProcesses or processCount < settings.maxProcesses then
+		-- the due syncs in round robin order
+		local due = Scheduler.due(timestamp)
 		local start = Syncs.getRound()
-		local ir = start
-		repeat
-			local s = Syncs.get(ir)
+		local n = Syncs.size()
+		table.sort(due, function(a, b)
+			return (a.listpos - start) % n < (b.listpos - start) % n
+		end)
+		for _, s in ipairs(due) do
 			s:invokeActions(timestamp)
-			ir = ir + 1
-			if ir > Syncs.size() then
-				ir = 1
-			end
-		until ir == start
+		end
 		Syncs.nextRound()
 	end
 
 	UserAlarms.invoke(timestamp)
+	Inotify.markCrawls()
+	Inotify.listEntries(settings.inotifyListBudget)
+	Inotify.check(timestamp)
+	Inotify.rescan(timestamp)
+	Inotify.balance()
 
 	if settings.statusFile then
 		StatusFile.write(timestamp)
@@ -2656,7 +4757,7 @@ SEE:
 
 --
 --  -monitor NAME       Uses operating systems event montior NAME 
---                      (inotify/fanotify/fsevents)
+--                      (inotify/fanotify/fsevents/poll)
 
 	os.exit(-1) -- ERRNO
 end
@@ -2873,6 +4974,40 @@ function runner.initialize(firstTime)
 	if settings.statusInterval == nil then
 		settings.statusInterval = default.statusInterval
 	end
+	if settings.inotifyMoveWindow == nil then
+		settings.inotifyMoveWindow = default.inotifyMoveWindow
+	end
+	if settings.inotifyCheckInterval == nil then
+		settings.inotifyCheckInterval = default.inotifyCheckInterval
+	end
+	if settings.pollInterval == nil then
+		settings.pollInterval = default.pollInterval
+	end
+	if settings.pollBudget == nil then
+		settings.pollBudget = default.pollBudget
+	end
+	if settings.inotifyPollInterval == nil then
+		settings.inotifyPollInterval = default.inotifyPollInterval
+	end
+	if settings.inotifyColdAfter == nil then
+		settings.inotifyColdAfter = default.inotifyColdAfter
+	end
+	if settings.inotifyRescanBudget == nil then
+		settings.inotifyRescanBudget = default.inotifyRescanBudget
+	end
+	if settings.inotifyRescanInterval == nil then
+		settings.inotifyRescanInterval = default.inotifyRescanInterval
+	end
+	if settings.inotifyCrawlThreads == nil then
+		settings.inotifyCrawlThreads = default.inotifyCrawlThreads
+	end
+	if settings.inotifyListBudget == nil then
+		settings.inotifyListBudget = default.inotifyListBudget
+	end
+	if settings.statThreads == nil then
+		settings.statThreads = default.statThreads
+	end
+	lsyncd.configure("statthreads", settings.statThreads)
 
 	-- makes sure the user gave Lsyncd anything to do 
 	if Syncs.size() == 0 then
@@ -2906,8 +5041,12 @@ function runner.initialize(firstTime)
 	for _, s in Syncs.iwalk() do
 		if s.config.monitor == "inotify" then
 			Inotify.addSync(s, s.source)
+		elseif s.config.monitor == "fanotify" then 
+			Fanotify.addSync(s, s.source)
 		elseif s.config.monitor == "fsevents" then 
 			Fsevents.addSync(s, s.source)
+		elseif s.config.monitor == "poll" then 
+			Poll.addSync(s, s.source)
 		else
 			error("sync "..s.config.name..
 				" has no known event monitor interface.")
@@ -2949,12 +5088,10 @@ function runner.getAlarm()
 		end
 	end
 
-	-- checks all syncs for their earliest alarm
+	-- checks the earliest alarm of all syncs 
 	-- but only if the global process limit is not yet reached.
 	if not settings.maxProcesses or processCount < settings.maxProcesses then
-		for _, s in Syncs.iwalk() do
-			checkAlarm(s:getAlarm())
-		end
+		checkAlarm(Scheduler.getAlarm())
 	else
 		log("Alarm", "at global process limit.")
 	end
@@ -2963,6 +5100,10 @@ function runner.getAlarm()
 	checkAlarm(StatusFile.getAlarm())
 	-- checks for an userAlarm
 	checkAlarm(UserAlarms.getAlarm())
+	-- checks when the next poll scan is due
+	checkAlarm(Poll.getAlarm())
+	-- checks when the next rescan step is due
+	checkAlarm(Inotify.getAlarm())
 
 	log("Alarm","runner.getAlarm returns: ",alarm)
 	return alarm
@@ -2974,7 +5115,13 @@ end
 -- Simply forwards it directly to the object.
 --
 runner.inotifyEvent = Inotify.event
+runner.inotifyIgnored = Inotify.ignored
+runner.inotifyCrawled = Inotify.crawled
+runner.inotifyNoSpace = Inotify.noSpace
+runner.fanotifyEvent = Fanotify.event
+runner.statted = Metadata.statted
 runner.fsEventsEvent = Fsevents.event
+runner.pollEvent = Poll.event
 
 -----
 -- Collector for every child process that finished in startup phase
@@ -2997,8 +5144,8 @@ end
 -- Called by core when an overflow happened.
 --
 function runner.overflow()
-	log("Normal", "--- OVERFLOW on inotify event queue ---")
-	lsyncdStatus = "fade"
+	log("Normal", "--- OVERFLOW on inotify event queue, rescanning ---")
+	Inotify.overflow()
 end
 
 -----
@@ -3078,6 +5225,7 @@ function spawn(agent, binary, ...)
 			error("Spawned too much processes!")
 		end
 		local sync = InletFactory.getSync(agent)
+		Scheduler.touch(sync)
 		-- delay or list
 		if dol.status then
 			-- is a delay
@@ -3204,17 +5352,29 @@ local default_rsync = {
 			       gsub("%]", "\\]")
 		end
 
-		local paths = elist.getPaths(
-			function(etype, path1, path2) 
-				if etype == "Delete" and string.byte(path1, -1) == 47 then
-					return sub(path1) .. "***", sub(path2)
-				else
-					return sub(path1), sub(path2)
-				end
-			end)
-		-- stores all filters with integer index	
-		-- local filterI = inlet.getExcludes();
+		local function mutator(etype, path1, path2, recursive) 
+			if path1 == "/" and recursive then
+				-- the whole tree
+				return "/**"
+			elseif (etype == "Delete" or etype == "Create" or recursive) and 
+			   string.byte(path1, -1) == 47 
+			then
+				-- the directory with all entries below it
+				return sub(path1) .. "***", sub(path2)
+			elseif etype == "Modify" and string.byte(path1, -1) == 47 then
+				-- the directory listing changed, 
+				-- syncs its entries to delete vanished ones
+				return sub(path1) .. "*"
+			else
+				return sub(path1), sub(path2)
+			end
+		end
+		-- stores all filters with integer index,
+		-- excludes come first, so whole directories keep to them
 		local filterI = {}
+		for _, ex in ipairs(inlet.getExcludes()) do
+			table.insert(filterI, "- " .. ex)
+		end
 		-- stores all filters with path index	
 		local filterP = {}
 
@@ -3234,8 +5394,8 @@ local default_rsync = {
 		-- to have entries for all steps in the path, so the file
 		-- d1/d2/d3/f1 needs filters 
 		-- "d1/", "d1/d2/", "d1/d2/d3/" and "d1/d2/d3/f1"
-		for _, path in ipairs(paths) do
-			if path and path ~="" then
+		for path in elist.paths(mutator) do
+			if path ~="" then
 				addToFilter(path)
 				local pp = string.match(path, "^(.*/)[^/]+/?")
 				while pp do
@@ -3333,6 +5493,11 @@ local default_rsync = {
 	-- Default delay
 	--
 	delay = 15,
+
+	-----
+	-- Creates of directories sync their trees.
+	--
+	recursive = true,
 }
 
 
@@ -3360,6 +5525,19 @@ local default_rsyncssh = {
 			return
 		end
 		
+		-- syncs the entries of a directory whose listing changed
+		-- to delete vanished ones
+		if event.etype == 'Modify' and event.isdir then
+			log("Normal", "Rsyncing directory ",event.path)
+			spawn(event, config.rsyncBinary,
+				"--delete",
+				config.rsyncOpts,
+				"-d",
+				event.sourcePath,
+				config.host .. ":" .. config.targetdir .. event.path)
+			return
+		end
+
 		-- uses ssh to delete files on remote host
 		-- instead of constructing rsync filters
 		if event.etype == 'Delete' then
@@ -3603,7 +5781,18 @@ local default_direct = {
 			end
 		elseif event.etype == "Modify" then
 			if event.isdir then
-				error("Do not know how to handle 'Modify' on dirs")
+				-- the directory listing changed,
+				-- syncs its entries to delete vanished ones
+				local config = inlet.getConfig()
+				spawn(event,
+					config.rsyncBinary,
+					"--delete",
+					config.rsyncOpts,
+					"-d",
+					event.sourcePath,
+					event.targetPath
+				)
+				return
 			end
 			spawn(event, 
 				"/bin/cp", 
@@ -3624,7 +5813,10 @@ local default_direct = {
 			if tp == "" or tp == "/" or not tp then
 				error("Refusing to erase your harddisk")
 			end
-			spawnShell(event, "/bin/mv $1 $2 || /bin/rm -rf $1", event.targetPath, event2.targetPath)
+			-- -T replaces an empty directory like the rename did
+			-- instead of moving into it
+			spawnShell(event, "/bin/mv -T $1 $2 || /bin/rm -rf $1",
+				event.targetPath, event2.targetPath)
 		else
 			log("Warn", "ignored an event of type '", event.etype, "'")
 			inlet.discardEvent(event)
@@ -3687,6 +5879,12 @@ local default_direct = {
 	-- Let the core not split move events.
 	--
 	onMove = true,
+
+	-----
+	-- Attribute changes are ignored by the action,
+	-- so the kernel does not need to report them.
+	--
+	events = { "Create", "Modify", "Delete", "Move" },
 	
 	-----
 	-- The rsync binary called.
@@ -3826,6 +6024,34 @@ default = {
 	--
 	maxDelays = 1000,
 
+	-----
+	-- If set, changes wait until none came in for 'delay' seconds,
+	-- so a burst is handled at once, but at most this many seconds.
+	-- false handles each change 'delay' seconds after it came in.
+	--
+	maxLatency = false,
+
+	-----
+	-- If true the size, mtime, ino and mode of the entries are
+	-- statted in the background and told by the events.
+	--
+	stat = false,
+
+	-----
+	-- If true the action syncs the whole tree below a directory for
+	-- its Create, so what happens below one not yet handled is 
+	-- absorbed by it.
+	--
+	recursive = false,
+
+	-----
+	-- When a sync whose action syncs whole trees reaches 'maxDelays',
+	-- it syncs the directories at this depth the changes happen in, 
+	-- instead of each entry, until the storm calms down.
+	-- false keeps to the entries.
+	--
+	stormDepth = 2,
+
 	-----
 	-- a default rsync configuration for easy usage.
 	--
@@ -3845,6 +6071,68 @@ default = {
 	-- Minimum seconds between two writes of a status file.
 	--
 	statusInterval = 10,
+
+	-----
+	-- Seconds an inotify MOVED_FROM waits for its MOVED_TO,
+	-- until it is taken as move out of the watched tree.
+	--
+	inotifyMoveWindow = 0.1,
+
+	-----
+	-- Seconds between two consistency checks of the inotify
+	-- watch tables, 0 disables them.
+	--
+	inotifyCheckInterval = 60,
+
+	-----
+	-- Seconds between two scans of polled syncs.
+	--
+	pollInterval = 2,
+
+	-----
+	-- Number of stat calls a poll scan may do, a scan not getting
+	-- through all directories is continued by the next one.
+	--
+	pollBudget = 10000,
+
+	-----
+	-- Seconds between two scans of subtrees of inotify watched syncs
+	-- handed over to polling.
+	--
+	inotifyPollInterval = 10,
+
+	-----
+	-- Seconds nothing must happen in a subtree to hand it over to 
+	-- polling, false to only do so when out of watches.
+	-- (inotifyMaxWatches sets the number of watches to use, by default
+	-- 95% of /proc/sys/fs/inotify/max_user_watches)
+	--
+	inotifyColdAfter = false,
+
+	-----
+	-- Number of stat calls a rescan step after an overflow of the
+	-- inotify event queue may do, and seconds between two steps.
+	--
+	inotifyRescanBudget = 1000,
+	inotifyRescanInterval = 0.1,
+
+	-----
+	-- Number of threads listing directories while the watches 
+	-- of a sync are added, 0 lists them in the main loop.
+	--
+	inotifyCrawlThreads = 4,
+
+	-----
+	-- Number of directory entries read every cycle for directories 
+	-- created, moved in or polled no longer.
+	--
+	inotifyListBudget = 10000,
+
+	-----
+	-- Number of threads statting the paths of events for syncs
+	-- with 'stat', 0 stats them in the main loop.
+	--
+	statThreads = 2,
 }
 
 -----
@@ -0,0 +1,1411 @@
+/**
+ * poll.c from Lsyncd - Live (Mirror) Syncing Demon
+ *
+ * License: GPLv2 (see COPYING) or any later version
+ *
+ * Authors: Axel Kittenberger <axkibe@gmail.com>
+ *
+ * -----------------------------------------------------------------------
+ *
+ * Polling event interface for filesystems the kernel does not report
+ * changes of, like NFS, CIFS or FUSE mounts changed by remote writers.
+ *
+ * Keeps an index of (inode, mtime, ctime, size) of every entry per
+ * directory. A scan stats the directories, lists only those whose own
+ * mtime changed and stats their files to find modifications. Each scan
+ * is limited by a budget of stat calls, the next one continues where
+ * the last stopped. Deletes and creates of the same inode within one
+ * scan are condensed to moves, across scans as far as the core 
+ * remembers the vanished entries (see gone_add()).
+ */
+
+#include "lsyncd.h"
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+
+/*-----------------------------------------------------------------------------
+ * Event types.
+ */
+static const char * ATTRIB = "Attrib";
+static const char * MODIFY = "Modify";
+static const char * CREATE = "Create";
+static const char * DELETE = "Delete";
+static const char * MOVE   = "Move";
+
+/**
+ * What the index remembers about a directory entry.
+ */
+struct pentry {
+	/* entry name */
+	char *name;
+
+	/* inode number */
+	ino_t ino;
+
+	/* modification and change time in nanoseconds */
+	int64_t mtime;
+	int64_t ctime;
+
+	/* file size */
+	off_t size;
+
+	/* true if a directory */
+	bool isdir;
+
+	/* for directories the index of its struct pdir or -1 */
+	int dir;
+};
+
+/**
+ * A polled directory.
+ */
+struct pdir {
+	/* false if this slot is free */
+	bool used;
+
+	/* the sync root it belongs to */
+	int root;
+
+	/* path relative to the root, with leading and trailing slash */
+	char *path;
+
+	/* the directories inode, the path might lead to another one
+	 * meanwhile */
+	ino_t ino;
+
+	/* the directories own modification and change time */
+	int64_t mtime;
+	int64_t ctime;
+
+	/* entries sorted by name */
+	struct pentry *entries;
+	int count;
+};
+
+static struct pdir *dirs = NULL;
+static int dirs_size = 0;
+
+/**
+ * Number of slots ever used, all above are free.
+ */
+static int dirs_top = 0;
+
+/**
+ * Slots below dirs_top freed again.
+ */
+static int *free_dirs = NULL;
+static int free_count = 0;
+
+/**
+ * Number of used directory slots.
+ */
+static int dirs_count = 0;
+
+/**
+ * Roots are either the root of a polled sync or a subtree of
+ * inotify watched syncs, demoted to polling since cold or out of
+ * watches. Each kind is scanned separately.
+ */
+enum {
+	TIER_SYNC = 0,
+	TIER_TREE = 1,
+	TIERS     = 2,
+};
+
+/**
+ * A polled directory tree.
+ */
+struct proot {
+	/* false if this slot is free */
+	bool used;
+
+	/* absolute path with trailing slash */
+	char *path;
+
+	/* TIER_SYNC or TIER_TREE */
+	int tier;
+
+	/* device of the root directory, taken for all entries */
+	dev_t dev;
+
+	/* the syncs concerned, an entry is not indexed if every sync
+	 * it belongs to excludes it */
+	struct sync_root *filters;
+	int filters_count;
+
+	/* number of directories indexed */
+	int dirs;
+};
+
+static struct proot *roots = NULL;
+static int roots_count = 0;
+
+/**
+ * The directory the next scan of each tier starts with.
+ */
+static int cursors[TIERS];
+
+/**
+ * A change found by a scan, an entry that appeared or vanished.
+ * Sent after the scan completed, so moves can be paired.
+ *
+ * Appearing directories queue their contents as appeared,
+ * vanishing ones their former contents as vanished, so the contents
+ * of a moved directory can be told apart from actual changes.
+ */
+struct pevent {
+	/* CREATE, DELETE, or for files whose stat changed
+	 * MODIFY or ATTRIB */
+	const char *etype;
+
+	int root;
+	bool isdir;
+
+	/* path relative to root */
+	char *path;
+
+	/* the stat data to pair and compare */
+	ino_t ino;
+	int64_t mtime;
+	off_t size;
+
+	/* the event of the containing directory appearing or vanishing
+	 * or -1 */
+	int parent;
+
+	/* the paired event of the same inode or -1 */
+	int pair;
+
+	/* for an entry replacing one of the same name,
+	 * the event of the replaced one, else -1 */
+	int replaces;
+
+	/* when to send it, see order_events() */
+	int64_t key;
+	int state;
+};
+
+static struct pevent *events = NULL;
+static int events_count = 0;
+static int events_size = 0;
+
+/**
+ * Statistics.
+ */
+static unsigned long stat_calls = 0;
+static unsigned long readdirs = 0;
+static unsigned long scans = 0;
+static unsigned long passes = 0;
+static unsigned long entries_count = 0;
+static unsigned long moves_paired = 0;
+static unsigned long moves_reclaimed = 0;
+
+/**
+ * Buffer for absolute paths.
+ */
+static char *pathbuf = NULL;
+static size_t pathbuf_size = 0;
+
+/**
+ * Returns the absolute path of 'rel' in 'root'.
+ */
+static const char *
+abs_path(int root, const char *rel)
+{
+	const char *rp = roots[root].path;
+	size_t rl = strlen(rp);
+	size_t l = strlen(rel);
+	if (rl + l + 1 > pathbuf_size) {
+		pathbuf_size = rl + l + 1;
+		pathbuf = s_realloc(pathbuf, pathbuf_size);
+	}
+	/* the root path ends with a slash, rel begins with one */
+	memcpy(pathbuf, rp, rl - 1);
+	memcpy(pathbuf + rl - 1, rel, l + 1);
+	return pathbuf;
+}
+
+/**
+ * Joins the relative directory path 'dir' (trailing slash) and 'name'.
+ * If 'slash' adds a trailing slash. Returns a new string.
+ */
+static char *
+join(const char *dir, const char *name, bool slash)
+{
+	size_t dl = strlen(dir);
+	size_t nl = strlen(name);
+	char *p = s_malloc(dl + nl + 2);
+	memcpy(p, dir, dl);
+	memcpy(p + dl, name, nl);
+	if (slash) {
+		p[dl + nl++] = '/';
+	}
+	p[dl + nl] = 0;
+	return p;
+}
+
+/**
+ * Converts a timespec to nanoseconds.
+ */
+static int64_t
+nanos(const struct timespec *ts)
+{
+	return (int64_t) ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+/**
+ * File times are taken from a coarse clock, a directory changing
+ * within this many nanoseconds of being listed might still show the
+ * time it had when listed.
+ */
+#define RACY_NANOS 50000000
+
+/**
+ * Records the times of the directory 'di' from its stat before being
+ * listed. If it changed too recently for the times to tell another
+ * change they are cleared, so the next scan lists it again.
+ */
+static void
+set_dir_times(int di, const struct stat *st)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	if (nanos(&ts) - nanos(&st->st_ctim) < RACY_NANOS) {
+		dirs[di].mtime = dirs[di].ctime = 0;
+	} else {
+		dirs[di].mtime = nanos(&st->st_mtim);
+		dirs[di].ctime = nanos(&st->st_ctim);
+	}
+}
+
+/**
+ * Stats 'path', counts the call.
+ */
+static int
+pstat(const char *path, struct stat *st)
+{
+	stat_calls++;
+	return lstat(path, st);
+}
+
+/**
+ * Fills an entry from stat data.
+ */
+static void
+set_entry(struct pentry *e, const struct stat *st)
+{
+	e->ino = st->st_ino;
+	e->mtime = nanos(&st->st_mtim);
+	e->ctime = nanos(&st->st_ctim);
+	e->size = st->st_size;
+	e->isdir = S_ISDIR(st->st_mode);
+}
+
+/**
+ * Queues an event about the entry 'e' in the directory 'dpath'.
+ *
+ * @return the index of the event
+ */
+static int
+add_event(const char *etype, int root, const char *dpath,
+          const struct pentry *e, int parent)
+{
+	struct pevent *ev;
+	if (events_count >= events_size) {
+		events_size = events_size ? events_size * 2 : 64;
+		events = s_realloc(events, events_size * sizeof(struct pevent));
+	}
+	ev = &events[events_count];
+	ev->etype = etype;
+	ev->root = root;
+	ev->isdir = e->isdir;
+	ev->path = join(dpath, e->name, false);
+	ev->ino = e->ino;
+	ev->mtime = e->mtime;
+	ev->size = e->size;
+	ev->parent = parent;
+	ev->pair = -1;
+	ev->replaces = -1;
+	return events_count++;
+}
+
+/**
+ * Frees the entries of a directory.
+ */
+static void
+free_entries(struct pentry *entries, int count)
+{
+	int i;
+	for (i = 0; i < count; i++) {
+		free(entries[i].name);
+	}
+	free(entries);
+	entries_count -= count;
+}
+
+/**
+ * Adds a directory slot, returns its index.
+ */
+static int
+new_dir(int root, char *path)
+{
+	int di;
+	if (free_count) {
+		di = free_dirs[--free_count];
+	} else {
+		if (dirs_top >= dirs_size) {
+			dirs_size = dirs_size ? dirs_size * 2 : 16;
+			dirs = s_realloc(dirs, dirs_size * sizeof(struct pdir));
+			/* a free slot is at most once on the stack */
+			free_dirs = s_realloc(free_dirs, dirs_size * sizeof(int));
+		}
+		di = dirs_top++;
+	}
+	dirs[di].used = true;
+	dirs[di].root = root;
+	dirs[di].path = path;
+	dirs[di].ino = 0;
+	dirs[di].mtime = dirs[di].ctime = 0;
+	dirs[di].entries = NULL;
+	dirs[di].count = 0;
+	dirs_count++;
+	roots[root].dirs++;
+	return di;
+}
+
+/**
+ * Frees the slot of a directory.
+ */
+static void
+free_dir(int di)
+{
+	struct pdir *d = &dirs[di];
+	free_entries(d->entries, d->count);
+	free(d->path);
+	d->used = false;
+	d->entries = NULL;
+	d->count = 0;
+	dirs_count--;
+	roots[d->root].dirs--;
+	free_dirs[free_count++] = di;
+}
+
+/**
+ * Returns true if every sync concerned about the entry 'rel' 
+ * (relative to the root) excludes it. Directories are passed with
+ * their trailing slash.
+ */
+static bool
+excluded(int root, const char *rel)
+{
+	return match_sync_roots(roots[root].filters, roots[root].filters_count,
+		abs_path(root, rel), false) == ROOT_EXCLUDED;
+}
+
+/**
+ * Compares entries by name for qsort.
+ */
+static int
+entry_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct pentry *) a)->name,
+		((const struct pentry *) b)->name);
+}
+
+/**
+ * Lists a directory and stats its entries.
+ * Excluded entries are skipped.
+ *
+ * @param di     the directory
+ * @param count  receives the number of entries
+ * @return       the entries sorted by name, NULL on error
+ */
+static struct pentry *
+list_dir(int di, int *count)
+{
+	int root = dirs[di].root;
+	struct pentry *entries = NULL;
+	int size = 0;
+	int n = 0;
+	DIR *d;
+	char *dpath = s_strdup(abs_path(root, dirs[di].path));
+	size_t dl = strlen(dpath);
+	char *fpath = NULL;
+	size_t fsize = 0;
+
+	readdirs++;
+	d = opendir(dpath);
+	if (!d) {
+		free(dpath);
+		*count = 0;
+		return NULL;
+	}
+	while (true) {
+		struct dirent *de = readdir(d);
+		struct stat st;
+		size_t nl;
+		if (!de) {
+			break;
+		}
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) {
+			continue;
+		}
+		nl = strlen(de->d_name);
+		if (dl + nl + 1 > fsize) {
+			fsize = dl + nl + 1;
+			fpath = s_realloc(fpath, fsize);
+		}
+		memcpy(fpath, dpath, dl);
+		memcpy(fpath + dl, de->d_name, nl + 1);
+		if (pstat(fpath, &st)) {
+			/* vanished meanwhile */
+			continue;
+		}
+		{
+			bool isdir = S_ISDIR(st.st_mode);
+			char *rel = join(dirs[di].path, de->d_name, isdir);
+			bool ex = excluded(root, rel);
+			free(rel);
+			if (ex) {
+				continue;
+			}
+		}
+		if (n >= size) {
+			size = size ? size * 2 : 16;
+			entries = s_realloc(entries, size * sizeof(struct pentry));
+		}
+		entries[n].name = s_strdup(de->d_name);
+		entries[n].dir = -1;
+		set_entry(&entries[n], &st);
+		n++;
+	}
+	closedir(d);
+	free(dpath);
+	free(fpath);
+	qsort(entries, n, sizeof(struct pentry), entry_cmp);
+	entries_count += n;
+	*count = n;
+	return entries;
+}
+
+/**
+ * Indexes the directory 'path' (trailing slash) and all below it.
+ *
+ * @param parent  if >= 0 queues creates for all entries as belonging to
+ *                this event, otherwise indexes silently.
+ * @return        the index of the directory
+ */
+static int
+index_dir(int root, char *path, int parent)
+{
+	int di = new_dir(root, path);
+	struct stat st;
+	int i;
+	if (pstat(abs_path(root, path), &st)) {
+		return di;
+	}
+	dirs[di].ino = st.st_ino;
+	dirs[di].entries = list_dir(di, &dirs[di].count);
+	set_dir_times(di, &st);
+	for (i = 0; i < dirs[di].count; i++) {
+		/* the entries stay, but dirs might be moved by recursion */
+		struct pentry *e = &dirs[di].entries[i];
+		int ev = parent;
+		if (parent >= 0) {
+			ev = add_event(CREATE, root, dirs[di].path, e, parent);
+		}
+		if (e->isdir) {
+			e->dir = index_dir(root, join(dirs[di].path, e->name, true), ev);
+		}
+	}
+	return di;
+}
+
+/**
+ * Queues the Create of a new entry, indexes new directories.
+ */
+static void
+found_entry(int root, const char *dpath, struct pentry *e, int parent,
+            int replaces)
+{
+	int ev = add_event(CREATE, root, dpath, e, parent);
+	events[ev].replaces = replaces;
+	if (e->isdir) {
+		e->dir = index_dir(root, join(dpath, e->name, true), ev);
+	}
+}
+
+/**
+ * Queues the Delete of a vanished entry. For directories drops them
+ * from the index queueing the former contents.
+ *
+ * @return the index of the event
+ */
+static int
+lost_entry(int root, const char *dpath, struct pentry *e, int parent)
+{
+	int ev = add_event(DELETE, root, dpath, e, parent);
+	if (e->isdir && e->dir >= 0) {
+		struct pdir *d = &dirs[e->dir];
+		int i;
+		for (i = 0; i < d->count; i++) {
+			lost_entry(root, d->path, &d->entries[i], ev);
+		}
+		free_dir(e->dir);
+		e->dir = -1;
+	}
+	return ev;
+}
+
+/**
+ * Queues a Modify or Attrib if a files stat changed.
+ */
+static void
+compare_entry(int root, const char *dpath,
+              const struct pentry *o, const struct pentry *n)
+{
+	if (n->isdir) {
+		return;
+	}
+	if (o->mtime != n->mtime || o->size != n->size) {
+		add_event(MODIFY, root, dpath, n, -1);
+	} else if (o->ctime != n->ctime) {
+		add_event(ATTRIB, root, dpath, n, -1);
+	}
+}
+
+/**
+ * Scans one directory.
+ */
+static void
+scan_dir(int di)
+{
+	int root = dirs[di].root;
+	char *dpath = s_strdup(dirs[di].path);
+	struct stat st;
+	if (pstat(abs_path(root, dpath), &st) || st.st_ino != dirs[di].ino) {
+		/* gone or replaced, the scan of the parent will tell */
+		free(dpath);
+		return;
+	}
+	if (nanos(&st.st_mtim) != dirs[di].mtime ||
+	    nanos(&st.st_ctim) != dirs[di].ctime)
+	{
+		/* lists the directory and merges the sorted entries */
+		struct pentry *old = dirs[di].entries;
+		int oc = dirs[di].count;
+		int nc;
+		struct pentry *new = list_dir(di, &nc);
+		int o = 0, n = 0;
+		set_dir_times(di, &st);
+		dirs[di].entries = new;
+		dirs[di].count = nc;
+		while (o < oc || n < nc) {
+			int c = o >= oc ? 1 : n >= nc ? -1 :
+				strcmp(old[o].name, new[n].name);
+			if (c < 0) {
+				lost_entry(root, dpath, &old[o++], -1);
+			} else if (c > 0) {
+				found_entry(root, dpath, &new[n++], -1, -1);
+			} else if (old[o].ino != new[n].ino ||
+			           old[o].isdir != new[n].isdir)
+			{
+				/* replaced */
+				int r = lost_entry(root, dpath, &old[o++], -1);
+				found_entry(root, dpath, &new[n++], -1, r);
+			} else {
+				new[n].dir = old[o].dir;
+				compare_entry(root, dpath, &old[o++], &new[n++]);
+			}
+		}
+		free_entries(old, oc);
+	} else {
+		/* stats the files for modifications */
+		int i;
+		for (i = 0; i < dirs[di].count; i++) {
+			struct pentry *e = &dirs[di].entries[i];
+			struct pentry n;
+			if (e->isdir) {
+				continue;
+			}
+			{
+				char *fp = join(abs_path(root, dpath), e->name, false);
+				int r = pstat(fp, &st);
+				free(fp);
+				if (r) {
+					/* the listing after the next change will tell */
+					continue;
+				}
+			}
+			n.name = e->name;
+			set_entry(&n, &st);
+			if (n.ino != e->ino || n.isdir) {
+				/* replaced without changing the directory mtime,
+				 * rather unusual, lists it next scan */
+				dirs[di].mtime = 0;
+				continue;
+			}
+			compare_entry(root, dpath, e, &n);
+			set_entry(e, &st);
+		}
+	}
+	free(dpath);
+}
+
+/**
+ * Compares events by root and inode for qsort.
+ */
+static int
+inode_cmp(const void *a, const void *b)
+{
+	const struct pevent *ea = &events[*(const int *) a];
+	const struct pevent *eb = &events[*(const int *) b];
+	if (ea->root != eb->root) {
+		return ea->root < eb->root ? -1 : 1;
+	}
+	if (ea->ino != eb->ino) {
+		return ea->ino < eb->ino ? -1 : 1;
+	}
+	return 0;
+}
+
+/**
+ * Returns true if the appeared entry 'c' would just have moved along 
+ * with its directory when paired with the vanished entry 'd'.
+ */
+static bool
+moved_along(const struct pevent *c, const struct pevent *d)
+{
+	return c->parent >= 0 && d->parent >= 0 &&
+		events[c->parent].pair == d->parent &&
+		!strcmp(strrchr(c->path, '/'), strrchr(d->path, '/'));
+}
+
+/**
+ * Pairs vanished and appeared entries of the same inode.
+ */
+static void
+pair_moves(void)
+{
+	int *deletes = s_malloc((events_count + 1) * sizeof(int));
+	int nd = 0;
+	int i;
+	for (i = 0; i < events_count; i++) {
+		if (events[i].etype == DELETE) {
+			deletes[nd++] = i;
+		}
+	}
+	if (nd) {
+		qsort(deletes, nd, sizeof(int), inode_cmp);
+		for (i = 0; i < events_count; i++) {
+			struct pevent *c = &events[i];
+			int lo = 0, hi = nd;
+			if (c->etype != CREATE) {
+				continue;
+			}
+			/* finds the first delete of the inode */
+			while (lo < hi) {
+				int mid = (lo + hi) / 2;
+				if (inode_cmp(&deletes[mid], &i) < 0) {
+					lo = mid + 1;
+				} else {
+					hi = mid;
+				}
+			}
+			for (; lo < nd && !inode_cmp(&deletes[lo], &i); lo++) {
+				struct pevent *d = &events[deletes[lo]];
+				if (d->pair >= 0 || d->isdir != c->isdir) {
+					continue;
+				}
+				/* the entry found in a directory that vanished later
+				 * in the same pass, not where it came from */
+				if (!strcmp(d->path, c->path)) {
+					continue;
+				}
+				/* inodes are reused quickly, a moved file keeps its
+				 * mtime and size unless it moved along its directory */
+				if (c->isdir || 
+				    (c->mtime == d->mtime && c->size == d->size) ||
+				    moved_along(c, d))
+				{
+					c->pair = deletes[lo];
+					d->pair = i;
+					break;
+				}
+			}
+		}
+	}
+	free(deletes);
+}
+
+
+
+/**
+ * Sending order of the events, indices into events.
+ */
+static int *order = NULL;
+
+/**
+ * Position of each event in the sending order.
+ */
+static int *rank = NULL;
+
+/**
+ * Events whose key is being computed, to find cycles.
+ */
+static int *key_stack = NULL;
+static int key_depth = 0;
+static bool key_cycle = false;
+
+/**
+ * Keys of events in their queued order, leaves room to send events
+ * right after another.
+ */
+#define KEY_SPAN ((int64_t) 1 << 20)
+
+/**
+ * Dissolves the pair of the appeared entry 'c' into a Delete and a
+ * Create. For directories also the pairs of their former contents,
+ * which would move out of a vanished directory.
+ */
+static void
+unpair(int c)
+{
+	int d = events[c].pair;
+	int i;
+	events[c].pair = -1;
+	events[d].pair = -1;
+	if (!events[d].isdir) {
+		return;
+	}
+	for (i = d + 1; i < events_count; i++) {
+		int a;
+		if (events[i].etype != DELETE || events[i].pair < 0) {
+			continue;
+		}
+		for (a = events[i].parent; a >= 0 && a != d; a = events[a].parent);
+		if (a == d) {
+			unpair(events[i].pair);
+		}
+	}
+}
+
+/**
+ * Returns the key to sort event 'i' by for sending.
+ *
+ * Events are sent in the order queued except moves, which are sent
+ * where the entry vanished. That way a move is sent before anything
+ * taking over its old name. Anything in an appeared directory is sent
+ * after the directory, anything taking the name of a replaced entry
+ * after the replaced one is gone.
+ */
+static int64_t
+key_of(int i)
+{
+	struct pevent *ev = &events[i];
+	int64_t k;
+	int j;
+	if (ev->state == 2) {
+		return ev->key;
+	}
+	if (ev->state == 1) {
+		/* dissolves the moves of the cycle */
+		int c = key_depth;
+		while (key_stack[--c] != i);
+		for (; c < key_depth; c++) {
+			j = key_stack[c];
+			if (events[j].etype == CREATE && events[j].pair >= 0) {
+				unpair(j);
+			}
+		}
+		key_cycle = true;
+		return 0;
+	}
+	if (ev->etype == DELETE && ev->pair >= 0) {
+		return key_of(ev->pair);
+	}
+	ev->state = 1;
+	key_stack[key_depth++] = i;
+	k = i * KEY_SPAN;
+	if (ev->etype == CREATE && ev->pair >= 0 &&
+	    !moved_along(ev, &events[ev->pair]))
+	{
+		k = ev->pair * KEY_SPAN;
+	}
+	if (ev->parent >= 0 && ev->etype != DELETE) {
+		j = ev->parent;
+		if (key_of(j) + 1 > k) {
+			k = events[j].key + 1;
+		}
+	}
+	if (ev->replaces >= 0) {
+		int64_t r = key_of(ev->replaces) + 1;
+		if (r > k) {
+			k = r;
+		}
+	}
+	ev->key = k;
+	ev->state = 2;
+	key_depth--;
+	return k;
+}
+
+/**
+ * Compares events by key and queued order for qsort.
+ */
+static int
+key_cmp(const void *a, const void *b)
+{
+	int ia = *(const int *) a;
+	int ib = *(const int *) b;
+	if (events[ia].key != events[ib].key) {
+		return events[ia].key < events[ib].key ? -1 : 1;
+	}
+	return ia < ib ? -1 : ia > ib ? 1 : 0;
+}
+
+/**
+ * Compares vanished entries by directory event and name for qsort.
+ */
+static int
+child_cmp(const void *a, const void *b)
+{
+	const struct pevent *ea = &events[*(const int *) a];
+	const struct pevent *eb = &events[*(const int *) b];
+	if (ea->parent != eb->parent) {
+		return ea->parent < eb->parent ? -1 : 1;
+	}
+	return strcmp(strrchr(ea->path, '/'), strrchr(eb->path, '/'));
+}
+
+/**
+ * An entry appearing in a moved directory replaces an entry of the
+ * same name that vanished from it, unless it is that entry.
+ */
+static void
+link_replaced(void)
+{
+	int *deletes = s_malloc((events_count + 1) * sizeof(int));
+	int nd = 0;
+	int i;
+	for (i = 0; i < events_count; i++) {
+		if (events[i].etype == DELETE && events[i].parent >= 0) {
+			deletes[nd++] = i;
+		}
+	}
+	qsort(deletes, nd, sizeof(int), child_cmp);
+	for (i = 0; i < events_count && nd; i++) {
+		struct pevent *c = &events[i];
+		int lo = 0, hi = nd;
+		int p;
+		if (c->etype != CREATE || c->parent < 0 ||
+		    events[c->parent].pair < 0)
+		{
+			continue;
+		}
+		/* compares as a vanished entry of the paired directory */
+		p = c->parent;
+		c->parent = events[p].pair;
+		while (lo < hi) {
+			int mid = (lo + hi) / 2;
+			if (child_cmp(&deletes[mid], &i) < 0) {
+				lo = mid + 1;
+			} else {
+				hi = mid;
+			}
+		}
+		if (lo < nd && !child_cmp(&deletes[lo], &i) &&
+		    deletes[lo] != c->pair)
+		{
+			c->replaces = deletes[lo];
+		}
+		c->parent = p;
+	}
+	free(deletes);
+}
+
+/**
+ * Puts the events into sending order. A swap of names or a directory
+ * moved into its own replacement can not be sent as moves, these
+ * are dissolved into Deletes and Creates.
+ */
+static void
+order_events(void)
+{
+	int i;
+	order = s_realloc(order, (events_count + 1) * sizeof(int));
+	rank = s_realloc(rank, (events_count + 1) * sizeof(int));
+	key_stack = s_realloc(key_stack, (events_count + 1) * sizeof(int));
+	link_replaced();
+	do {
+		key_cycle = false;
+		for (i = 0; i < events_count; i++) {
+			events[i].state = 0;
+		}
+		for (i = 0; i < events_count && !key_cycle; i++) {
+			key_depth = 0;
+			key_of(i);
+		}
+	} while (key_cycle);
+	for (i = 0; i < events_count; i++) {
+		order[i] = i;
+	}
+	qsort(order, events_count, sizeof(int), key_cmp);
+	for (i = 0; i < events_count; i++) {
+		rank[order[i]] = i;
+	}
+}
+
+/**
+ * Returns where the vanished entry 'j' is at the target when the
+ * events sent before 'upto' have been sent. It moved along with a
+ * directory whose move has already been sent. Returns a new string.
+ */
+static char *
+current_path(int j, int upto)
+{
+	const char *base;
+	char *dir, *p;
+	int parent = events[j].parent;
+	if (parent < 0) {
+		return s_strdup(events[j].path);
+	}
+	if (events[parent].pair >= 0 &&
+	    rank[events[parent].pair] < rank[upto])
+	{
+		dir = join(events[events[parent].pair].path, "", true);
+	} else {
+		char *pp = current_path(parent, upto);
+		dir = join(pp, "", true);
+		free(pp);
+	}
+	base = strrchr(events[j].path, '/') + 1;
+	p = join(dir, base, false);
+	free(dir);
+	return p;
+}
+
+/**
+ * Sends an event to the runner.
+ *
+ * @param reclaimed  true for a Move of an entry that has been told
+ *                   as deleted before.
+ */
+static void
+send_event(lua_State *L, const char *etype, int root, bool isdir,
+           const char *path, const char *path2, bool reclaimed)
+{
+	load_runner_func(L, "pollEvent");
+	lua_pushstring(L, etype);
+	lua_pushinteger(L, root);
+	lua_pushboolean(L, isdir);
+	l_now(L);
+	lua_pushstring(L, path);
+	if (path2) {
+		lua_pushstring(L, path2);
+	} else {
+		lua_pushnil(L);
+	}
+	lua_pushboolean(L, reclaimed);
+	if (lua_pcall(L, 7, 0, -9)) {
+		exit(-1); // ERRNO
+	}
+	lua_pop(L, 1);
+}
+
+/**
+ * Returns the absolute path of the event 'ev', 
+ * with trailing slash for directories. Returns a new string.
+ */
+static char *
+event_path(const struct pevent *ev)
+{
+	return join(abs_path(ev->root, ev->path), "", ev->isdir);
+}
+
+/**
+ * Sends an appeared entry as Move if it vanished from the same root
+ * recently and has been told as deleted then.
+ *
+ * @return true if sent
+ */
+static bool
+send_reclaimed(lua_State *L, const struct pevent *ev)
+{
+	char *path = event_path(ev);
+	const char *origin = gone_claim(roots[ev->root].dev, ev->ino, 
+		ev->isdir, ev->mtime, ev->size, path);
+	const char *rp = roots[ev->root].path;
+	size_t rl = strlen(rp);
+	char *op;
+	free(path);
+	if (!origin || strncmp(origin, rp, rl)) {
+		return false;
+	}
+	/* relative to the root, without trailing slash */
+	op = s_strdup(origin + rl - 1);
+	if (ev->isdir) {
+		op[strlen(op) - 1] = 0;
+	}
+	moves_reclaimed++;
+	send_event(L, MOVE, ev->root, ev->isdir, op, ev->path, true);
+	free(op);
+	return true;
+}
+
+/**
+ * Sends the queued events to the runner.
+ *
+ * Entries in vanished directories are only told about if the
+ * directory moved and they did not move along. Entries in appeared
+ * directories are, unless they moved along.
+ */
+static void
+send_events(lua_State *L)
+{
+	int o;
+	pair_moves();
+	order_events();
+	for (o = 0; o < events_count && !hup && !term; o++) {
+		int i = order[o];
+		struct pevent *ev = &events[i];
+		if (ev->etype == DELETE) {
+			if (ev->pair >= 0) {
+				/* told by its appearing */
+				continue;
+			}
+			if (ev->parent >= 0 && events[ev->parent].pair < 0) {
+				/* the whole directory vanished */
+				continue;
+			}
+			if (ev->parent >= 0) {
+				char *p = current_path(i, i);
+				send_event(L, DELETE, ev->root, ev->isdir, p, NULL, false);
+				free(p);
+			} else {
+				/* might have moved somewhere a later scan finds it */
+				char *p = event_path(ev);
+				gone_add(roots[ev->root].dev, ev->ino, ev->isdir,
+					ev->mtime, ev->size, p);
+				free(p);
+				send_event(L, DELETE, ev->root, ev->isdir, ev->path, 
+					NULL, false);
+			}
+		} else if (ev->etype == CREATE && ev->pair >= 0) {
+			struct pevent *d = &events[ev->pair];
+			if (moved_along(ev, d)) {
+				if (!ev->isdir &&
+				    (ev->mtime != d->mtime || ev->size != d->size))
+				{
+					send_event(L, MODIFY, ev->root, false, ev->path, 
+						NULL, false);
+				}
+			} else {
+				char *p = current_path(ev->pair, i);
+				moves_paired++;
+				send_event(L, MOVE, ev->root, ev->isdir, p, ev->path, 
+					false);
+				free(p);
+			}
+		} else if (ev->etype != CREATE || ev->parent >= 0 ||
+		           !send_reclaimed(L, ev))
+		{
+			send_event(L, ev->etype, ev->root, ev->isdir, ev->path, 
+				NULL, false);
+		}
+	}
+	for (o = 0; o < events_count; o++) {
+		free(events[o].path);
+	}
+	events_count = 0;
+}
+
+/**
+ * Adds a root to poll and indexes it.
+ *
+ * @return the root number
+ */
+static int
+add_root(const char *path, int tier, struct sync_root *filters, int count)
+{
+	int r;
+	for (r = 0; r < roots_count && roots[r].used; r++);
+	if (r == roots_count) {
+		roots = s_realloc(roots, (roots_count + 1) * sizeof(struct proot));
+		roots_count++;
+	}
+	roots[r].used = true;
+	roots[r].path = s_strdup(path);
+	roots[r].tier = tier;
+	roots[r].filters = filters;
+	roots[r].filters_count = count;
+	roots[r].dirs = 0;
+	{
+		struct stat st;
+		roots[r].dev = lstat(path, &st) ? 0 : st.st_dev;
+	}
+	index_dir(r, s_strdup("/"), -1);
+	return r;
+}
+
+/**
+ * Adds a sync root to poll and indexes it.
+ *
+ * @param path     (Lua stack) absolute path of the sync root
+ * @param excludes (Lua stack) excludes userdata of the sync
+ * @return         (Lua stack) the root number events report
+ */
+static int
+l_addsync(lua_State *L)
+{
+	const char *path = luaL_checkstring(L, 1);
+	struct excludes *ex = check_excludes(L, 2);
+	struct sync_root *f = s_malloc(sizeof(struct sync_root));
+	int r;
+	/* keeps the excludes from being collected */
+	lua_pushvalue(L, 2);
+	luaL_ref(L, LUA_REGISTRYINDEX);
+	f->path = s_strdup(path);
+	f->len = strlen(path);
+	f->excludes = ex;
+	r = add_root(path, TIER_SYNC, f, 1);
+	printlogf(L, "Poll", "indexed %s, %d directories", path, roots[r].dirs);
+	lua_pushinteger(L, r);
+	return 1;
+}
+
+/**
+ * Adds a subtree of inotify watched syncs to poll and indexes it.
+ *
+ * @param path   (Lua stack) absolute path of the subtree
+ * @param syncs  (Lua stack) list of {root, excludes} of the syncs 
+ *                           concerned about the subtree.
+ * @return       (Lua stack) the root number events report
+ */
+static int
+l_addtree(lua_State *L)
+{
+	const char *path = luaL_checkstring(L, 1);
+	struct sync_root *filters;
+	int count, i, r;
+	luaL_checktype(L, 2, LUA_TTABLE);
+	count = lua_objlen(L, 2);
+	filters = s_calloc(count + 1, sizeof(struct sync_root));
+	for (i = 0; i < count; i++) {
+		lua_rawgeti(L, 2, i + 1);
+		luaL_checktype(L, -1, LUA_TTABLE);
+		lua_rawgeti(L, -1, 1);
+		filters[i].path = s_strdup(luaL_checkstring(L, -1));
+		filters[i].len = strlen(filters[i].path);
+		lua_pop(L, 1);
+		lua_rawgeti(L, -1, 2);
+		filters[i].excludes = check_excludes(L, -1);
+		/* the syncs keep their excludes */
+		lua_pop(L, 2);
+	}
+	r = add_root(path, TIER_TREE, filters, count);
+	printlogf(L, "Poll", "indexed subtree %s, %d directories", 
+		path, roots[r].dirs);
+	lua_pushinteger(L, r);
+	return 1;
+}
+
+/**
+ * Stops polling a root and drops its index.
+ *
+ * @param root  (Lua stack) the root number
+ */
+static int
+l_rmroot(lua_State *L)
+{
+	int r = luaL_checkinteger(L, 1);
+	int di, i;
+	if (r < 0 || r >= roots_count || !roots[r].used) {
+		return 0;
+	}
+	for (di = 0; di < dirs_top; di++) {
+		if (dirs[di].used && dirs[di].root == r) {
+			free_dir(di);
+		}
+	}
+	printlogf(L, "Poll", "dropped %s", roots[r].path);
+	for (i = 0; i < roots[r].filters_count; i++) {
+		free(roots[r].filters[i].path);
+	}
+	free(roots[r].filters);
+	free(roots[r].path);
+	memset(&roots[r], 0, sizeof(struct proot));
+	return 0;
+}
+
+/**
+ * Returns the number of directories indexed for a root.
+ *
+ * @param root  (Lua stack) the root number
+ * @return      (Lua stack) number of directories
+ */
+static int
+l_count(lua_State *L)
+{
+	int r = luaL_checkinteger(L, 1);
+	if (r < 0 || r >= roots_count || !roots[r].used) {
+		lua_pushinteger(L, 0);
+	} else {
+		lua_pushinteger(L, roots[r].dirs);
+	}
+	return 1;
+}
+
+/**
+ * Scans the directories of a tier, continuing where the last scan 
+ * stopped, until the budget of stat calls is used or all have been 
+ * scanned. Sends the events found to the runner.
+ *
+ * @param budget  (Lua stack) number of stat calls allowed.
+ * @param tier    (Lua stack) "sync" to scan polled syncs, 
+ *                            "tree" to scan polled subtrees.
+ */
+static int
+l_scan(lua_State *L)
+{
+	unsigned long budget = luaL_checkinteger(L, 1);
+	const char *tname = luaL_checkstring(L, 2);
+	int tier = strcmp(tname, "tree") ? TIER_SYNC : TIER_TREE;
+	int *cursor = &cursors[tier];
+	unsigned long start = stat_calls;
+	int n = 0;
+	scans++;
+	while (dirs_top && n < dirs_top && stat_calls - start < budget) {
+		if (*cursor >= dirs_top) {
+			*cursor = 0;
+		}
+		if (*cursor == 0) {
+			passes++;
+		}
+		if (dirs[*cursor].used && roots[dirs[*cursor].root].tier == tier) {
+			scan_dir(*cursor);
+		}
+		(*cursor)++;
+		n++;
+	}
+	send_events(L);
+	return 0;
+}
+
+/**
+ * Returns a table of poll core statistics.
+ */
+static int
+l_stats(lua_State *L)
+{
+	int dirs_tree = 0;
+	int trees = 0;
+	int r;
+	for (r = 0; r < roots_count; r++) {
+		if (roots[r].used && roots[r].tier == TIER_TREE) {
+			dirs_tree += roots[r].dirs;
+			trees++;
+		}
+	}
+	lua_newtable(L);
+	lua_pushnumber(L, dirs_count - dirs_tree);
+	lua_setfield(L, -2, "directories");
+	lua_pushnumber(L, dirs_tree);
+	lua_setfield(L, -2, "treeDirectories");
+	lua_pushnumber(L, trees);
+	lua_setfield(L, -2, "trees");
+	lua_pushnumber(L, entries_count);
+	lua_setfield(L, -2, "entries");
+	lua_pushnumber(L, stat_calls);
+	lua_setfield(L, -2, "stats");
+	lua_pushnumber(L, readdirs);
+	lua_setfield(L, -2, "readdirs");
+	lua_pushnumber(L, scans);
+	lua_setfield(L, -2, "scans");
+	lua_pushnumber(L, passes);
+	lua_setfield(L, -2, "passes");
+	lua_pushnumber(L, moves_paired);
+	lua_setfield(L, -2, "movesPaired");
+	lua_pushnumber(L, moves_reclaimed);
+	lua_setfield(L, -2, "movesReclaimed");
+	return 1;
+}
+
+/**
+ * Cores poll functions.
+ */
+static const luaL_reg lpolllib[] = {
+		{"addsync",    l_addsync    },
+		{"addtree",    l_addtree    },
+		{"count",      l_count      },
+		{"rmroot",     l_rmroot     },
+		{"scan",       l_scan       },
+		{"stats",      l_stats      },
+		{NULL, NULL}
+};
+
+/**
+ * registers poll functions.
+ */
+extern void
+register_poll(lua_State *L)
+{
+	lua_pushstring(L, "poll");
+	luaL_register(L, "poll", lpolllib);
+}
+
+/**
+ * Resets the index, a former run might have left one.
+ */
+extern void
+open_poll(lua_State *L)
+{
+	int i, j;
+	for (i = 0; i < dirs_top; i++) {
+		if (dirs[i].used) {
+			free_entries(dirs[i].entries, dirs[i].count);
+			free(dirs[i].path);
+		}
+	}
+	free(dirs);
+	dirs = NULL;
+	dirs_size = dirs_count = dirs_top = 0;
+	free(free_dirs);
+	free_dirs = NULL;
+	free_count = 0;
+	for (i = 0; i < TIERS; i++) {
+		cursors[i] = 0;
+	}
+	for (i = 0; i < roots_count; i++) {
+		for (j = 0; j < roots[i].filters_count; j++) {
+			free(roots[i].filters[j].path);
+		}
+		free(roots[i].filters);
+		free(roots[i].path);
+	}
+	free(roots);
+	roots = NULL;
+	roots_count = 0;
+	for (i = 0; i < events_count; i++) {
+		free(events[i].path);
+	}
+	free(events);
+	events = NULL;
+	events_count = events_size = 0;
+	stat_calls = readdirs = scans = passes = entries_count = 0;
+	moves_paired = moves_reclaimed = 0;
+}
@@ -0,0 +1,88 @@
+#!/usr/bin/lua
+-- Saves files under temporary names moved over the originals, like 
+-- editors do, rotates logs, moves a file twice and fills a directory 
+-- under a temporary name before moving it in place, with 
+-- default.direct. The temporary names must never be on the target 
+-- and all has to be mirrored.
+require("posix")
+dofile("tests/testlib.lua")
+
+cwriteln("****************************************************************")
+cwriteln(" Testing atomic saves and chains of moves                       ")
+cwriteln("****************************************************************")
+
+local tdir, srcdir, trgdir = mktemps()
+local logfile = tdir .. "log"
+local cfgfile = tdir .. "config.lua"
+
+for i = 1, 10 do
+	writefile(srcdir .. "f" .. i, "old" .. i)
+end
+writefile(srcdir .. "log", "log")
+writefile(srcdir .. "log.1", "log.1")
+writefile(srcdir .. "m", "m")
+
+writefile(cfgfile, [[
+settings = {
+	logfile = "]]..logfile..[[",
+	nodaemon = true,
+}
+
+sync {
+	default.direct,
+	source = "]]..srcdir..[[",
+	target = "]]..trgdir..[[",
+	delay = 3,
+}
+]]);
+
+local pid = spawn("./lsyncd", cfgfile, "-log", "Exec")
+
+cwriteln("waiting for Lsyncd to startup")
+posix.sleep(3)
+
+cwriteln("saving atomically")
+for i = 1, 10 do
+	writefile(srcdir .. ".f" .. i .. ".tmp", "new" .. i)
+	os.rename(srcdir .. ".f" .. i .. ".tmp", srcdir .. "f" .. i)
+end
+
+cwriteln("rotating")
+os.rename(srcdir .. "log.1", srcdir .. "log.2")
+os.rename(srcdir .. "log", srcdir .. "log.1")
+writefile(srcdir .. "log", "fresh")
+
+cwriteln("moving twice")
+os.rename(srcdir .. "m", srcdir .. "n")
+os.rename(srcdir .. "n", srcdir .. "o")
+
+cwriteln("filling a directory before moving it in place")
+posix.mkdir(srcdir .. ".d.tmp")
+for i = 1, 10 do
+	writefile(srcdir .. ".d.tmp/f" .. i, "d" .. i)
+end
+os.rename(srcdir .. ".d.tmp", srcdir .. "d")
+
+cwriteln("waiting for Lsyncd to finish its jobs.")
+posix.sleep(10)
+
+cwriteln("killing the Lsyncd daemon")
+posix.kill(pid)
+posix.wait(pid)
+
+local f = io.open(logfile, "r")
+for line in f:lines() do
+	if line:match("%.tmp") then
+		cwriteln("failure: temporary name on the target: ", line)
+		os.exit(1)
+	end
+end
+f:close()
+
+exitcode = os.execute("diff -r "..srcdir.." "..trgdir)
+cwriteln("Exitcode of diff = '", exitcode, "'")
+if exitcode ~= 0 then
+	os.exit(1)
+else
+	os.exit(0)
+end
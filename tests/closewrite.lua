@@ -0,0 +1,89 @@
+#!/usr/bin/lua
+-- Benchmarks the "CloseWrite after Modify" inotifyMode against plain
+-- "CloseWrite". Files opened for writing but closed without having been
+-- written to must not spawn any transfers.
+require("posix")
+dofile("tests/testlib.lua")
+
+cwriteln("****************************************************************")
+cwriteln(" Testing inotifyMode 'CloseWrite after Modify'                  ")
+cwriteln("****************************************************************")
+
+-- number of files opened read/write without writing
+local untouched = 100
+
+-- number of files opened and written to
+local written = 10
+
+-----
+-- Runs Lsyncd with 'imode', opens and closes the files.
+--
+-- @returns the number of spawned Modify actions
+--
+local function run(imode)
+	local tdir, srcdir, trgdir = mktemps()
+	local logfile = tdir .. "log"
+	local cfgfile = tdir .. "config.lua"
+	local modfile = tdir .. "modifies"
+
+	-- the files exist before Lsyncd starts
+	for i = 1, untouched + written do
+		writefile(srcdir .. i, "data")
+	end
+
+	writefile(cfgfile, [[
+settings = {
+	logfile = "]]..logfile..[[",
+	nodaemon = true,
+	inotifyMode = "]]..imode..[[",
+}
+
+sync {
+	source = "]]..srcdir..[[",
+	delay = 0,
+	onModify = "echo ^pathname >> ]]..modfile..[[",
+}
+]]);
+
+	cwriteln("starting Lsyncd with inotifyMode ", imode);
+	local pid = spawn("./lsyncd", cfgfile, "-log", "Inotify");
+	posix.sleep(2)
+
+	-- opens files for writing, but leaves most unchanged
+	for i = 1, untouched + written do
+		local f = io.open(srcdir .. i, "r+")
+		if i > untouched then
+			f:write("changed")
+		end
+		f:close()
+	end
+
+	posix.sleep(5)
+	cwriteln("killing started Lsyncd");
+	posix.kill(pid);
+	posix.wait(pid);
+
+	local n = 0
+	local f = io.open(modfile, "r")
+	if f then
+		for _ in f:lines() do
+			n = n + 1
+		end
+		f:close()
+	end
+	cwriteln(imode, ": ", n, " Modify actions spawned");
+	return n
+end
+
+local base = run("CloseWrite")
+local after = run("CloseWrite after Modify")
+
+cwriteln("spawned transfers reduced from ", base, " to ", after);
+if base ~= untouched + written or after ~= written then
+	cwriteln("failure: expected ", untouched + written, " and ", written);
+	os.exit(1)
+end
+cwriteln("OK");
+os.exit(0);
+
+-- TODO remove temp
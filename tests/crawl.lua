@@ -0,0 +1,71 @@
+#!/usr/bin/lua
+-- Runs default.rsync on a large tree and changes it while Lsyncd is
+-- still crawling it. The catch-up startup and the events from the
+-- directories already watched must mirror everything.
+require("posix")
+dofile("tests/testlib.lua")
+
+cwriteln("****************************************************************")
+cwriteln(" Testing default.rsync while the initial crawl is going on      ")
+cwriteln("****************************************************************")
+
+local tdir, srcdir, trgdir = mktemps()
+local logfile = tdir .. "log"
+local cfgfile = tdir .. "config.lua"
+local statusfile = tdir .. "status"
+
+-- makes a large startup tree
+churn(srcdir, 2000)
+
+writefile(cfgfile, [[
+settings = {
+	logfile = "]]..logfile..[[",
+	statusFile = "]]..statusfile..[[",
+	statusInterval = 1,
+	nodaemon = true,
+	inotifyCrawlThreads = 2,
+}
+
+sync {
+	default.rsync,
+	source = "]]..srcdir..[[",
+	target = "]]..trgdir..[[",
+	delay = 1,
+}
+]]);
+
+local pid = spawn("./lsyncd", cfgfile, "-log", "Exec")
+
+-- no waiting for the startup, changes right into the crawl
+churn(srcdir, 500)
+
+cwriteln("waiting for Lsyncd to finish its jobs.")
+posix.sleep(15)
+
+cwriteln("killing the Lsyncd daemon")
+posix.kill(pid)
+posix.wait(pid)
+
+local crawled = false
+local f = io.open(statusfile, "r")
+if f then
+	for line in f:lines() do
+		if line:match("^Inotify last crawl") then
+			cwriteln(line)
+			crawled = true
+		end
+	end
+	f:close()
+end
+if not crawled then
+	cwriteln("failure: the initial crawl did not finish")
+	os.exit(1)
+end
+
+exitcode = os.execute("diff -r "..srcdir.." "..trgdir)
+cwriteln("Exitcode of diff = '", exitcode, "'")
+if exitcode ~= 0 then
+	os.exit(1)
+else
+	os.exit(0)
+end
@@ -0,0 +1,116 @@
+#!/usr/bin/lua
+-- Benchmarks queuing many delays. Lsyncd polls a directory that
+-- gets 10k, 100k and 1M new files at once, and a user alarm tells 
+-- when all Creates are queued. The sizes to run can be given as 
+-- arguments. Tells the memory the delays take from the status file.
+require("posix")
+dofile("tests/testlib.lua")
+
+cwriteln("****************************************************************")
+cwriteln(" Benchmarking the delay queue                                   ")
+cwriteln("****************************************************************")
+
+local sizes = { 10000, 100000, 1000000 }
+if arg[1] then
+	sizes = {}
+	for _, a in ipairs(arg) do
+		table.insert(sizes, tonumber(a))
+	end
+end
+
+-----
+-- Queues 'n' delays, returns the seconds it took.
+--
+local function run(n)
+	local tdir, srcdir, trgdir = mktemps()
+	local logfile = tdir .. "log"
+	local cfgfile = tdir .. "config.lua"
+	local donefile = tdir .. "done"
+	local statusfile = tdir .. "status"
+	posix.mkdir(srcdir .. "d")
+
+	writefile(cfgfile, [[
+settings = {
+	logfile = "]]..logfile..[[",
+	statusFile = "]]..statusfile..[[",
+	statusInterval = 10,
+	nodaemon = true,
+	pollInterval = 1,
+	pollBudget = ]]..(n * 2)..[[,
+}
+
+local inlet = sync {
+	source = "]]..srcdir..[[",
+	monitor = "poll",
+	delay = 3600,
+	maxDelays = ]]..(n * 2)..[[,
+	action = function(inlet) end,
+}
+
+local function check(timestamp)
+	local count = 0
+	inlet.getEvents(function(event)
+		count = count + 1
+		return false
+	end)
+	if count >= ]]..n..[[ then
+		local f = io.open("]]..donefile..[[", "w")
+		f:write("done\n")
+		f:close()
+		return
+	end
+	alarm(timestamp + 0.2, check)
+end
+alarm(now() + 0.2, check)
+]]);
+
+	local pid = spawn("./lsyncd", cfgfile, "-log", "Normal")
+	posix.sleep(2)
+
+	cwriteln("creating ", n, " files")
+	for i = 1, n do
+		local f = io.open(srcdir .. "d/" .. i, "w")
+		f:close()
+	end
+
+	local start = os.time()
+	local took = false
+	while os.time() - start < 600 do
+		local f = io.open(donefile, "r")
+		if f then
+			f:close()
+			took = os.time() - start
+			break
+		end
+		posix.sleep(1)
+	end
+
+	-- lets the status file be written with all delays
+	posix.sleep(11)
+	local f = io.open(statusfile, "r")
+	if f then
+		for line in f:lines() do
+			if line:match("^Delays take") then
+				cwriteln(line)
+			end
+		end
+		f:close()
+	end
+
+	posix.kill(pid)
+	posix.wait(pid)
+	os.execute("rm -rf " .. tdir)
+	return took
+end
+
+local failed = false
+for _, n in ipairs(sizes) do
+	local took = run(n)
+	if took then
+		cwriteln(n, " delays queued in about ", took, " seconds")
+	else
+		cwriteln("failure: ", n, " delays not queued within 600 seconds")
+		failed = true
+	end
+end
+os.exit(failed and 1 or 0)
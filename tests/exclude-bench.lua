@@ -0,0 +1,215 @@
+#!/usr/bin/lua
+-- Benchmarks the compiled exclude patterns of the core against the
+-- Lua pattern matcher of Lsyncd 2.0.5 with a large exclude file.
+require("posix")
+dofile("tests/testlib.lua")
+
+cwriteln("****************************************************************")
+cwriteln(" Benchmarking excludes                                          ")
+cwriteln("****************************************************************")
+
+-- number of exclude patterns
+local npatterns = 2000
+
+-- number of files created
+local nfiles = 2000
+
+local tdir, srcdir, trgdir = mktemps()
+local logfile = tdir .. "log"
+local cfgfile = tdir .. "config.lua"
+local exfile = tdir .. "excludes"
+local statusfile = tdir .. "status"
+local createfile = tdir .. "creates"
+
+-- writes the excludes, literal names and some wildcards
+local patterns = {}
+for i = 1, npatterns do
+	local r = i % 4
+	if r == 0 then
+		patterns[i] = "build" .. i
+	elseif r == 1 then
+		patterns[i] = "/cache" .. i .. "/"
+	elseif r == 2 then
+		patterns[i] = "*.tmp" .. i
+	else
+		patterns[i] = "obj" .. i .. "/**.o"
+	end
+end
+writefile(exfile, table.concat(patterns, "\n"))
+
+-- half of the files are excluded
+local files = {}
+for i = 1, nfiles do
+	if i % 2 == 0 then
+		files[i] = "build" .. (math.random(npatterns / 4) * 4)
+	else
+		files[i] = "file" .. i
+	end
+end
+
+local pathfile = tdir .. "paths"
+local benchfile = tdir .. "bench"
+writefile(pathfile, "/" .. table.concat(files, "\n/"))
+
+-----
+-- Lets Lsyncd time the compiled excludes of its core against the
+-- Lua pattern matcher of Lsyncd 2.0.5 on the same patterns and paths.
+--
+writefile(cfgfile, [=[
+local core = package.loaded.lsyncd
+
+local patterns = {}
+for line in io.lines("]=]..exfile..[=[") do
+	table.insert(patterns, line)
+end
+local paths = {}
+for line in io.lines("]=]..pathfile..[=[") do
+	table.insert(paths, line)
+end
+
+local function toLuaPattern(p)
+	p = string.gsub(p, "%%", "%%%%")
+	p = string.gsub(p, "%^", "%%^")
+	p = string.gsub(p, "%$", "%%$")
+	p = string.gsub(p, "%(", "%%(")
+	p = string.gsub(p, "%)", "%%)")
+	p = string.gsub(p, "%.", "%%.")
+	p = string.gsub(p, "%[", "%%[")
+	p = string.gsub(p, "%]", "%%]")
+	p = string.gsub(p, "%+", "%%+")
+	p = string.gsub(p, "%-", "%%-")
+	p = string.gsub(p, "%?", "[^/]")
+	p = string.gsub(p, "%*", "[^/]*")
+	p = string.gsub(p, "%[%^/%]%*%[%^/%]%*", ".*")
+	p = string.gsub(p, "^/", "^/")
+	if p:sub(1,2) ~= "^/" then
+		p = "/" .. p;
+	end
+	return p
+end
+
+local list = {}
+for _, p in ipairs(patterns) do
+	list[p] = toLuaPattern(p)
+end
+
+local function luaTest(path)
+	for _, p in pairs(list) do
+		if p:byte(-1) == 36 then
+			if path:match(p) then
+				return true
+			end
+		else
+			if path:match(p.."/") or path:match(p.."$") then
+				return true
+			end
+		end
+	end
+	return false
+end
+
+local matcher = core.excludes()
+for _, p in ipairs(patterns) do
+	matcher:add(p)
+end
+
+local luaHits, coreHits = 0, 0
+local start = os.clock()
+for _, path in ipairs(paths) do
+	if luaTest(path) then
+		luaHits = luaHits + 1
+	end
+end
+local luaTime = os.clock() - start
+
+start = os.clock()
+for _, path in ipairs(paths) do
+	if matcher:test(path) then
+		coreHits = coreHits + 1
+	end
+end
+local coreTime = os.clock() - start
+
+local f = io.open("]=]..benchfile..[=[", "w")
+f:write(luaTime, " ", luaHits, " ", coreTime, " ", coreHits, "\n")
+f:close()
+terminate(0)
+]=])
+
+local pid = spawn("./lsyncd", cfgfile)
+posix.wait(pid)
+
+local f = io.open(benchfile)
+local bench = f and f:read("*a") or ""
+if f then
+	f:close()
+end
+local luatime, luahits, coretime, corehits =
+	bench:match("^(%S+) (%d+) (%S+) (%d+)")
+if not luatime then
+	cwriteln("failure: Lsyncd did not time the matchers")
+	os.exit(1)
+end
+cwriteln("Lua patterns:      ", luatime, " seconds CPU for ", nfiles,
+	" paths, ", luahits, " excluded")
+cwriteln("compiled excludes: ", coretime, " seconds CPU for ", nfiles,
+	" paths, ", corehits, " excluded")
+if luahits ~= corehits then
+	cwriteln("failure: the matchers disagree")
+	os.exit(1)
+end
+
+-----
+-- Runs Lsyncd with the excludes creating all files.
+--
+os.execute("rm -rf " .. srcdir .. "* " .. createfile)
+writefile(cfgfile, [[
+settings = {
+	logfile = "]]..logfile..[[",
+	statusFile = "]]..statusfile..[[",
+	statusInterval = 0,
+	nodaemon = true,
+}
+
+sync {
+	source = "]]..srcdir..[[",
+	delay = 1,
+	excludeFrom = "]]..exfile..[[",
+	onCreate = "echo ^pathname >> ]]..createfile..[[",
+}
+]]);
+pid = spawn("./lsyncd", cfgfile)
+posix.sleep(2)
+for _, f in ipairs(files) do
+	writefile(srcdir .. f, "data")
+end
+posix.sleep(4)
+posix.kill(pid)
+posix.wait(pid)
+
+-- the status file tells how many events the core dropped
+f = io.open(statusfile)
+local status = f and f:read("*a") or ""
+if f then
+	f:close()
+end
+local ne = tonumber(status:match("(%d+) events excluded"))
+cwriteln("core dropped ", ne, " excluded events")
+
+-- no excluded file may reach an action
+f = io.open(createfile)
+if f then
+	for line in f:lines() do
+		if line:match("^build") then
+			cwriteln("failure: ", line, " should be excluded")
+			os.exit(1)
+		end
+	end
+	f:close()
+end
+if not ne or ne == 0 then
+	cwriteln("failure: core did not drop excluded events")
+	os.exit(1)
+end
+cwriteln("OK")
+os.exit(0)
@@ -0,0 +1,117 @@
+#!/usr/bin/lua
+-- Benchmarks handing events to actions. Lsyncd polls a directory that
+-- gets 10k and 100k new files at once, when all Creates are queued a 
+-- user alarm gets them as event list a few rounds, tests each event
+-- on its sourcePath and iterates the paths of the list. Tells the 
+-- events handed per second. The sizes to run can be given as 
+-- arguments.
+require("posix")
+dofile("tests/testlib.lua")
+
+cwriteln("****************************************************************")
+cwriteln(" Benchmarking the event handoff of inlets                       ")
+cwriteln("****************************************************************")
+
+local sizes = { 10000, 100000 }
+if arg[1] then
+	sizes = {}
+	for _, a in ipairs(arg) do
+		table.insert(sizes, tonumber(a))
+	end
+end
+
+-----
+-- Hands 'n' events, returns the events per second.
+--
+local function run(n)
+	local tdir, srcdir, trgdir = mktemps()
+	local logfile = tdir .. "log"
+	local cfgfile = tdir .. "config.lua"
+	local donefile = tdir .. "done"
+	posix.mkdir(srcdir .. "d")
+
+	writefile(cfgfile, [[
+settings = {
+	logfile = "]]..logfile..[[",
+	nodaemon = true,
+	pollInterval = 1,
+	pollBudget = ]]..(n * 2)..[[,
+}
+
+local inlet = sync {
+	source = "]]..srcdir..[[",
+	monitor = "poll",
+	delay = 3600,
+	maxDelays = ]]..(n * 2)..[[,
+	action = function(inlet) end,
+}
+
+local function bench()
+	local rounds = 5
+	local events = 0
+	local start = os.clock()
+	for r = 1, rounds do
+		local elist = inlet.getEvents(function(event)
+			return event.sourcePath ~= nil
+		end)
+		for path in elist.paths() do
+			events = events + 1
+		end
+	end
+	local took = os.clock() - start
+	local f = io.open("]]..donefile..[[", "w")
+	f:write(math.floor(events / math.max(took, 0.001)), "\n")
+	f:close()
+end
+
+local function check(timestamp)
+	local elist = inlet.getEvents()
+	if elist.size() >= ]]..n..[[ then
+		bench()
+		return
+	end
+	alarm(timestamp + 0.2, check)
+end
+alarm(now() + 0.2, check)
+]]);
+
+	local pid = spawn("./lsyncd", cfgfile, "-log", "Normal")
+	posix.sleep(2)
+
+	cwriteln("creating ", n, " files")
+	for i = 1, n do
+		local f = io.open(srcdir .. "d/" .. i, "w")
+		f:close()
+	end
+
+	local start = os.time()
+	local rate = false
+	while os.time() - start < 600 do
+		local f = io.open(donefile, "r")
+		if f then
+			rate = f:read("*n")
+			f:close()
+			if rate then
+				break
+			end
+		end
+		posix.sleep(1)
+	end
+
+	posix.kill(pid)
+	posix.wait(pid)
+	os.execute("rm -rf " .. tdir)
+	return rate
+end
+
+local failed = false
+for _, n in ipairs(sizes) do
+	local rate = run(n)
+	if rate then
+		cwriteln(n, " events handed at ", rate, " events per second")
+	else
+		cwriteln("failure: ", n, " events not handed within 600 seconds")
+		failed = true
+	end
+end
+os.exit(failed and 1 or 0)
@@ -0,0 +1,81 @@
+#!/usr/bin/lua
+-- Changes a file once and then one every second for a while, with
+-- a short delay and a 'maxLatency'. The single change has to be on
+-- the target after the delay, the burst has to wait until it pauses
+-- but not longer than 'maxLatency'.
+require("posix")
+dofile("tests/testlib.lua")
+
+cwriteln("****************************************************************")
+cwriteln(" Testing the delay adapting to bursts of changes                ")
+cwriteln("****************************************************************")
+
+local tdir, srcdir, trgdir = mktemps()
+local logfile = tdir .. "log"
+local cfgfile = tdir .. "config.lua"
+local statusfile = tdir .. "status"
+
+writefile(cfgfile, [[
+settings = {
+	logfile = "]]..logfile..[[",
+	statusFile = "]]..statusfile..[[",
+	statusInterval = 1,
+	nodaemon = true,
+}
+
+sync {
+	default.rsync,
+	source = "]]..srcdir..[[",
+	target = "]]..trgdir..[[",
+	delay = 2,
+	maxLatency = 6,
+}
+]]);
+
+local pid = spawn("./lsyncd", cfgfile, "-log", "Exec")
+
+cwriteln("waiting for Lsyncd to startup")
+posix.sleep(3)
+
+local failed = false
+
+cwriteln("changing a single file")
+writefile(srcdir .. "a", "a")
+posix.sleep(4)
+if not posix.stat(trgdir .. "a") then
+	cwriteln("failure: a single change took longer than the delay")
+	failed = true
+end
+
+cwriteln("changing a file every second")
+for i = 1, 12 do
+	writefile(srcdir .. "b" .. i, "b" .. i)
+	posix.sleep(1)
+	if i == 4 and posix.stat(trgdir .. "b1") then
+		cwriteln("failure: the burst did not wait to pause")
+		failed = true
+	end
+	if i == 9 and not posix.stat(trgdir .. "b1") then
+		cwriteln("failure: the burst waited longer than maxLatency")
+		failed = true
+	end
+end
+
+cwriteln("waiting for Lsyncd to finish its jobs.")
+posix.sleep(5)
+
+cwriteln("killing the Lsyncd daemon")
+posix.kill(pid)
+posix.wait(pid)
+
+if failed then
+	os.exit(1)
+end
+
+exitcode = os.execute("diff -r "..srcdir.." "..trgdir)
+cwriteln("Exitcode of diff = '", exitcode, "'")
+if exitcode ~= 0 then
+	os.exit(1)
+else
+	os.exit(0)
+end
@@ -0,0 +1,67 @@
+#!/usr/bin/lua
+-- Runs a few hundred syncs of default.direct, each on a directory of
+-- its own, and changes some of them. Only the syncs with changes are
+-- due, all have to be mirrored nevertheless.
+require("posix")
+dofile("tests/testlib.lua")
+
+cwriteln("****************************************************************")
+cwriteln(" Testing the scheduler with many syncs                          ")
+cwriteln("****************************************************************")
+
+local tdir, srcdir, trgdir = mktemps()
+local logfile = tdir .. "log"
+local cfgfile = tdir .. "config.lua"
+local n = 300
+
+for i = 1, n do
+	posix.mkdir(srcdir .. i)
+	posix.mkdir(trgdir .. i)
+end
+
+writefile(cfgfile, [[
+settings = {
+	logfile = "]]..logfile..[[",
+	nodaemon = true,
+}
+
+for i = 1, ]]..n..[[ do
+	sync {
+		default.direct,
+		source = "]]..srcdir..[[" .. i,
+		target = "]]..trgdir..[[" .. i,
+		delay = 1,
+	}
+end
+]]);
+
+local pid = spawn("./lsyncd", cfgfile, "-log", "Exec")
+
+cwriteln("waiting for Lsyncd to startup")
+posix.sleep(10)
+
+cwriteln("changing every seventh sync")
+for i = 1, n, 7 do
+	writefile(srcdir .. i .. "/a", "a" .. i)
+	posix.mkdir(srcdir .. i .. "/d")
+	writefile(srcdir .. i .. "/d/b", "b" .. i)
+end
+posix.sleep(2)
+for i = 1, n, 14 do
+	os.rename(srcdir .. i .. "/a", srcdir .. i .. "/c")
+end
+
+cwriteln("waiting for Lsyncd to finish its jobs.")
+posix.sleep(10)
+
+cwriteln("killing the Lsyncd daemon")
+posix.kill(pid)
+posix.wait(pid)
+
+exitcode = os.execute("diff -r "..srcdir.." "..trgdir)
+cwriteln("Exitcode of diff = '", exitcode, "'")
+if exitcode ~= 0 then
+	os.exit(1)
+else
+	os.exit(0)
+end
@@ -0,0 +1,77 @@
+#!/usr/bin/lua
+-- Renames a directory tree within the watched tree and changes files
+-- below its new name. Lsyncd has to follow the rename with the
+-- watches it has and still see the changes in the subdirectories.
+require("posix")
+dofile("tests/testlib.lua")
+
+cwriteln("****************************************************************")
+cwriteln(" Testing default.rsync with a directory tree renamed            ")
+cwriteln("****************************************************************")
+
+local tdir, srcdir, trgdir = mktemps()
+local logfile = tdir .. "log"
+local cfgfile = tdir .. "config.lua"
+local statusfile = tdir .. "status"
+
+-- makes some startup data
+posix.mkdir(srcdir .. "d")
+churn(srcdir .. "d/", 50)
+
+writefile(cfgfile, [[
+settings = {
+	logfile = "]]..logfile..[[",
+	statusFile = "]]..statusfile..[[",
+	statusInterval = 1,
+	nodaemon = true,
+}
+
+sync {
+	default.rsync,
+	source = "]]..srcdir..[[",
+	target = "]]..trgdir..[[",
+	delay = 1,
+}
+]]);
+
+local pid = spawn("./lsyncd", cfgfile, "-log", "Exec")
+
+cwriteln("waiting for Lsyncd to startup")
+posix.sleep(2)
+
+cwriteln("renaming d to e")
+os.execute("mv "..srcdir.."d "..srcdir.."e")
+posix.sleep(1)
+churn(srcdir .. "e/", 50)
+
+cwriteln("waiting for Lsyncd to finish its jobs.")
+posix.sleep(10)
+
+cwriteln("killing the Lsyncd daemon")
+posix.kill(pid)
+posix.wait(pid)
+
+local followed = false
+local f = io.open(statusfile, "r")
+if f then
+	for line in f:lines() do
+		local n = line:match("^Inotify followed (%d+) moved directories")
+		if n then
+			cwriteln(line)
+			followed = tonumber(n) > 0
+		end
+	end
+	f:close()
+end
+if not followed then
+	cwriteln("failure: the rename has not been followed")
+	os.exit(1)
+end
+
+exitcode = os.execute("diff -r "..srcdir.." "..trgdir)
+cwriteln("Exitcode of diff = '", exitcode, "'")
+if exitcode ~= 0 then
+	os.exit(1)
+else
+	os.exit(0)
+end
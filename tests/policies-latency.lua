@@ -0,0 +1,94 @@
+#!/usr/bin/lua
+-- Runs default.rsync with policies and a 'maxLatency'. A change
+-- waits the delay of its policy to pause, a policy delay longer than
+-- 'maxLatency' is cut to it even while changes keep coming in.
+require("posix")
+dofile("tests/testlib.lua")
+
+cwriteln("****************************************************************")
+cwriteln(" Testing delay policies with maxLatency                         ")
+cwriteln("****************************************************************")
+
+local tdir, srcdir, trgdir = mktemps()
+local logfile = tdir .. "log"
+local cfgfile = tdir .. "config.lua"
+
+posix.mkdir(srcdir .. "hot")
+posix.mkdir(srcdir .. "cold")
+posix.mkdir(srcdir .. "plain")
+
+writefile(cfgfile, [[
+settings = {
+	logfile = "]]..logfile..[[",
+	nodaemon = true,
+}
+
+sync {
+	default.rsync,
+	source = "]]..srcdir..[[",
+	target = "]]..trgdir..[[",
+	delay = 4,
+	maxLatency = 8,
+	policies = {
+		{ path = "/hot", delay = 2 },
+		{ path = "/cold", delay = 30 },
+	},
+}
+]]);
+
+local pid = spawn("./lsyncd", cfgfile, "-log", "Exec")
+
+cwriteln("waiting for Lsyncd to startup")
+posix.sleep(3)
+
+local failed = false
+local function expect(path, there, why)
+	if (posix.stat(trgdir .. path) ~= nil) ~= there then
+		cwriteln("failure: ", why)
+		failed = true
+	end
+end
+
+cwriteln("changing a single hot file")
+writefile(srcdir .. "hot/a", "a")
+posix.sleep(3)
+expect("hot/a", true, "a change waited longer than the delay of its policy")
+
+cwriteln("changing a cold file")
+writefile(srcdir .. "cold/c", "cold")
+posix.sleep(4)
+expect("cold/c", false, "a cold change did not wait")
+
+cwriteln("changing a file every second")
+writefile(srcdir .. "hot/h", "hot")
+for i = 1, 10 do
+	writefile(srcdir .. "plain/b" .. i, "b" .. i)
+	posix.sleep(1)
+	if i == 2 and posix.stat(trgdir .. "hot/h") then
+		cwriteln("failure: the hot change did not wait the burst to pause")
+		failed = true
+	end
+	if i == 6 then
+		expect("cold/c", true, "a cold change waited longer than maxLatency")
+	end
+end
+expect("hot/h", true, "the hot change waited longer than maxLatency")
+
+cwriteln("waiting for Lsyncd to finish its jobs.")
+posix.sleep(10)
+
+cwriteln("killing the Lsyncd daemon")
+posix.kill(pid)
+posix.wait(pid)
+
+if failed then
+	os.exit(1)
+end
+
+exitcode = os.execute("diff -r "..srcdir.." "..trgdir)
+cwriteln("Exitcode of diff = '", exitcode, "'")
+if exitcode ~= 0 then
+	os.exit(1)
+else
+	os.exit(0)
+end
@@ -0,0 +1,86 @@
+#!/usr/bin/lua
+-- Runs default.rsync with a long delay and policies for a hot and
+-- a cold directory and for Deletes. Changes queued after those of
+-- the cold directory have to reach the target first.
+require("posix")
+dofile("tests/testlib.lua")
+
+cwriteln("****************************************************************")
+cwriteln(" Testing delay and priority policies                            ")
+cwriteln("****************************************************************")
+
+local tdir, srcdir, trgdir = mktemps()
+local logfile = tdir .. "log"
+local cfgfile = tdir .. "config.lua"
+
+posix.mkdir(srcdir .. "hot")
+posix.mkdir(srcdir .. "cold")
+posix.mkdir(srcdir .. "plain")
+writefile(srcdir .. "plain/gone", "gone")
+
+writefile(cfgfile, [[
+settings = {
+	logfile = "]]..logfile..[[",
+	nodaemon = true,
+}
+
+sync {
+	default.rsync,
+	source = "]]..srcdir..[[",
+	target = "]]..trgdir..[[",
+	delay = 8,
+	policies = {
+		{ path = "/hot", delay = 1, priority = 10 },
+		{ etype = "Delete", delay = 1 },
+		{ path = { "/cold", "*.iso" }, delay = 20 },
+	},
+}
+]]);
+
+local pid = spawn("./lsyncd", cfgfile, "-log", "Exec")
+
+cwriteln("waiting for Lsyncd to startup")
+posix.sleep(3)
+
+local failed = false
+local function expect(path, there, why)
+	if (posix.stat(trgdir .. path) ~= nil) ~= there then
+		cwriteln("failure: ", why)
+		failed = true
+	end
+end
+
+writefile(srcdir .. "cold/c", "cold")
+writefile(srcdir .. "plain/p.iso", "image")
+writefile(srcdir .. "hot/h", "hot")
+writefile(srcdir .. "plain/p", "plain")
+os.remove(srcdir .. "plain/gone")
+
+posix.sleep(3)
+expect("hot/h", true, "the hot directory waited")
+expect("plain/gone", false, "the Delete waited")
+expect("plain/p", false, "a change did not wait its delay")
+expect("cold/c", false, "the cold directory did not wait")
+
+posix.sleep(7)
+expect("plain/p", true, "a change waited longer than its delay")
+expect("plain/p.iso", false, "a cold file did not wait")
+
+cwriteln("waiting for Lsyncd to finish its jobs.")
+posix.sleep(12)
+
+cwriteln("killing the Lsyncd daemon")
+posix.kill(pid)
+posix.wait(pid)
+
+if failed then
+	os.exit(1)
+end
+
+exitcode = os.execute("diff -r "..srcdir.." "..trgdir)
+cwriteln("Exitcode of diff = '", exitcode, "'")
+if exitcode ~= 0 then
+	os.exit(1)
+else
+	os.exit(0)
+end
@@ -0,0 +1,78 @@
+#!/usr/bin/lua
+-- Moves a directory out of the watched tree and back under another
+-- name. The unpaired move out is told as Delete, Lsyncd has to 
+-- recognize the inode coming back and move the directory on the 
+-- target instead of deleting and copying it again.
+require("posix")
+dofile("tests/testlib.lua")
+
+cwriteln("****************************************************************")
+cwriteln(" Testing default.direct with a directory moved out and back in  ")
+cwriteln("****************************************************************")
+
+local tdir, srcdir, trgdir = mktemps()
+local logfile = tdir .. "log"
+local cfgfile = tdir .. "config.lua"
+local statusfile = tdir .. "status"
+
+-- makes some startup data
+posix.mkdir(srcdir .. "d")
+churn(srcdir .. "d/", 20)
+
+writefile(cfgfile, [[
+settings = {
+	logfile = "]]..logfile..[[",
+	statusFile = "]]..statusfile..[[",
+	statusInterval = 1,
+	nodaemon = true,
+}
+
+sync {
+	default.direct,
+	source = "]]..srcdir..[[",
+	target = "]]..trgdir..[[",
+	delay = 5,
+}
+]]);
+
+local pid = spawn("./lsyncd", cfgfile, "-log", "Exec")
+
+cwriteln("waiting for Lsyncd to startup")
+posix.sleep(2)
+
+cwriteln("moving d out of the tree and back as e")
+os.execute("mv "..srcdir.."d "..tdir.."out")
+posix.sleep(1)
+os.execute("mv "..tdir.."out "..srcdir.."e")
+
+cwriteln("waiting for Lsyncd to finish its jobs.")
+posix.sleep(10)
+
+cwriteln("killing the Lsyncd daemon")
+posix.kill(pid)
+posix.wait(pid)
+
+local reclaimed = false
+local f = io.open(statusfile, "r")
+if f then
+	for line in f:lines() do
+		local n = line:match("recognized by inode: (%d+)")
+		if n then
+			cwriteln(line)
+			reclaimed = tonumber(n) > 0
+		end
+	end
+	f:close()
+end
+if not reclaimed then
+	cwriteln("failure: the move back has not been recognized")
+	os.exit(1)
+end
+
+exitcode = os.execute("diff -r "..srcdir.." "..trgdir)
+cwriteln("Exitcode of diff = '", exitcode, "'")
+if exitcode ~= 0 then
+	os.exit(1)
+else
+	os.exit(0)
+end
@@ -0,0 +1,72 @@
+#!/usr/bin/lua
+-- Lets a sync with 'stat' log the size its events tell for files
+-- of known sizes (writefile() appends a newline).
+require("posix")
+dofile("tests/testlib.lua")
+
+cwriteln("****************************************************************")
+cwriteln(" Testing the size of events of a sync with 'stat'               ")
+cwriteln("****************************************************************")
+
+local tdir, srcdir, trgdir = mktemps()
+local logfile = tdir .. "log"
+local cfgfile = tdir .. "config.lua"
+local sizefile = tdir .. "sizes"
+
+writefile(cfgfile, [[
+settings = {
+	logfile = "]]..logfile..[[",
+	nodaemon = true,
+}
+
+sync {
+	source = "]]..srcdir..[[",
+	delay = 3,
+	stat = true,
+	action = function(inlet)
+		local event = inlet.getEvent()
+		local f = io.open("]]..sizefile..[[", "a")
+		f:write(event.pathname, " ", tostring(event.size), "\n")
+		f:close()
+		inlet.discardEvent(event)
+	end,
+}
+]]);
+
+local pid = spawn("./lsyncd", cfgfile, "-log", "Delay")
+
+cwriteln("waiting for Lsyncd to startup")
+posix.sleep(2)
+
+for i = 1, 10 do
+	writefile(srcdir .. i, string.rep("x", i * 100))
+end
+
+cwriteln("waiting for Lsyncd to finish its jobs.")
+posix.sleep(6)
+
+cwriteln("killing the Lsyncd daemon")
+posix.kill(pid)
+posix.wait(pid)
+
+local told = 0
+local f = io.open(sizefile, "r")
+if f then
+	for line in f:lines() do
+		local name, size = line:match("^(%d+) (%d+)$")
+		if name then
+			if tonumber(size) ~= tonumber(name) * 100 + 1 then
+				cwriteln("failure: wrong size ", line)
+				os.exit(1)
+			end
+			told = told + 1
+		end
+	end
+	f:close()
+end
+if told ~= 10 then
+	cwriteln("failure: ", told, " of 10 events told the size")
+	os.exit(1)
+end
+cwriteln("all events told the size")
+os.exit(0)
@@ -0,0 +1,91 @@
+#!/usr/bin/lua
+-- Writes some thousand files into a few directories, far more than
+-- 'maxDelays' lets default.rsync queue. It has to sync the directories
+-- instead, keep to its excludes and calm down after the storm.
+require("posix")
+dofile("tests/testlib.lua")
+
+cwriteln("****************************************************************")
+cwriteln(" Testing a storm of changes syncing directories                 ")
+cwriteln("****************************************************************")
+
+local tdir, srcdir, trgdir = mktemps()
+local logfile = tdir .. "log"
+local cfgfile = tdir .. "config.lua"
+local statusfile = tdir .. "status"
+
+for i = 1, 5 do
+	posix.mkdir(srcdir .. "d" .. i)
+	posix.mkdir(srcdir .. "d" .. i .. "/e")
+	writefile(srcdir .. "d" .. i .. "/e/keep", "keep" .. i)
+end
+
+writefile(cfgfile, [[
+settings = {
+	logfile = "]]..logfile..[[",
+	statusFile = "]]..statusfile..[[",
+	statusInterval = 1,
+	nodaemon = true,
+}
+
+sync {
+	default.rsync,
+	source = "]]..srcdir..[[",
+	target = "]]..trgdir..[[",
+	delay = 2,
+	maxDelays = 100,
+	stormDepth = 1,
+	exclude = { "*.x" },
+}
+]]);
+
+local pid = spawn("./lsyncd", cfgfile, "-log", "Exec")
+
+cwriteln("waiting for Lsyncd to startup")
+posix.sleep(3)
+
+cwriteln("writing files")
+for i = 1, 2000 do
+	local dir = srcdir .. "d" .. (i % 5 + 1) .. "/"
+	writefile(dir .. "e/f" .. i, "f" .. i)
+	writefile(dir .. "f" .. i .. ".x", "excluded")
+end
+os.execute("rm -rf " .. srcdir .. "d1/e")
+os.rename(srcdir .. "d2/e", srcdir .. "d2/moved")
+writefile(srcdir .. "top", "top")
+
+cwriteln("waiting for Lsyncd to finish its jobs.")
+posix.sleep(15)
+
+cwriteln("killing the Lsyncd daemon")
+posix.kill(pid)
+posix.wait(pid)
+
+local storm = false
+local f = io.open(statusfile, "r")
+if f then
+	for line in f:lines() do
+		if line:match("^Last storm") then
+			cwriteln(line)
+			storm = true
+		end
+	end
+	f:close()
+end
+if not storm then
+	cwriteln("failure: no storm calmed down")
+	os.exit(1)
+end
+
+if posix.stat(trgdir .. "d3/f2.x") then
+	cwriteln("failure: excluded files have been synced")
+	os.exit(1)
+end
+
+exitcode = os.execute("diff -r -x '*.x' "..srcdir.." "..trgdir)
+cwriteln("Exitcode of diff = '", exitcode, "'")
+if exitcode ~= 0 then
+	os.exit(1)
+else
+	os.exit(0)
+end
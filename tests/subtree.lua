@@ -0,0 +1,87 @@
+#!/usr/bin/lua
+-- Makes a tree with mkdir -p, fills and copies it, and removes 
+-- another with rm -rf, while default.rsync waits. The Creates and 
+-- Deletes of the directories cover all delays below them, only a few
+-- are to be queued and all has to be mirrored.
+require("posix")
+dofile("tests/testlib.lua")
+
+cwriteln("****************************************************************")
+cwriteln(" Testing subtrees covered by Creates and Deletes of directories ")
+cwriteln("****************************************************************")
+
+local tdir, srcdir, trgdir = mktemps()
+local logfile = tdir .. "log"
+local cfgfile = tdir .. "config.lua"
+local statusfile = tdir .. "status"
+
+-- a tree to be removed
+posix.mkdir(srcdir .. "old")
+posix.mkdir(srcdir .. "old/x")
+for i = 1, 500 do
+	writefile(srcdir .. "old/x/f" .. i, "old" .. i)
+end
+
+writefile(cfgfile, [[
+settings = {
+	logfile = "]]..logfile..[[",
+	statusFile = "]]..statusfile..[[",
+	statusInterval = 1,
+	nodaemon = true,
+}
+
+sync {
+	default.rsync,
+	source = "]]..srcdir..[[",
+	target = "]]..trgdir..[[",
+	delay = 5,
+}
+]]);
+
+local pid = spawn("./lsyncd", cfgfile, "-log", "Exec")
+
+cwriteln("waiting for Lsyncd to startup")
+posix.sleep(3)
+
+cwriteln("making, copying and removing trees")
+os.execute("mkdir -p " .. srcdir .. "new/b/c")
+for i = 1, 500 do
+	writefile(srcdir .. "new/b/c/f" .. i, "new" .. i)
+end
+os.execute("cp -r " .. srcdir .. "new/b " .. srcdir .. "new2")
+os.execute("rm -rf " .. srcdir .. "old")
+
+-- lets the status file be written before the delay is over
+posix.sleep(2)
+local queued = false
+local f = io.open(statusfile, "r")
+if f then
+	for line in f:lines() do
+		local n = line:match("^There are (%d+) delays")
+		if n then
+			queued = tonumber(n)
+		end
+	end
+	f:close()
+end
+cwriteln("queued delays: ", queued)
+
+cwriteln("waiting for Lsyncd to finish its jobs.")
+posix.sleep(10)
+
+cwriteln("killing the Lsyncd daemon")
+posix.kill(pid)
+posix.wait(pid)
+
+if not queued or queued > 20 then
+	cwriteln("failure: the directories did not cover the delays below")
+	os.exit(1)
+end
+
+exitcode = os.execute("diff -r "..srcdir.." "..trgdir)
+cwriteln("Exitcode of diff = '", exitcode, "'")
+if exitcode ~= 0 then
+	os.exit(1)
+else
+	os.exit(0)
+end
@@ -0,0 +1,87 @@
+#!/usr/bin/lua
+-- Creates and deletes a thousand temporary files and a directory 
+-- full of them, like build tools do, while default.rsync waits. As 
+-- the target never had them, their delays have to vanish.
+require("posix")
+dofile("tests/testlib.lua")
+
+cwriteln("****************************************************************")
+cwriteln(" Testing temporary files never on the target                    ")
+cwriteln("****************************************************************")
+
+local tdir, srcdir, trgdir = mktemps()
+local logfile = tdir .. "log"
+local cfgfile = tdir .. "config.lua"
+local statusfile = tdir .. "status"
+
+posix.mkdir(srcdir .. "obj")
+writefile(srcdir .. "obj/keep", "keep")
+
+writefile(cfgfile, [[
+settings = {
+	logfile = "]]..logfile..[[",
+	statusFile = "]]..statusfile..[[",
+	statusInterval = 1,
+	nodaemon = true,
+}
+
+sync {
+	default.rsync,
+	source = "]]..srcdir..[[",
+	target = "]]..trgdir..[[",
+	delay = 5,
+}
+]]);
+
+local pid = spawn("./lsyncd", cfgfile, "-log", "Exec")
+
+cwriteln("waiting for Lsyncd to startup")
+posix.sleep(3)
+
+cwriteln("making and removing temporary files")
+for i = 1, 1000 do
+	local tmp = srcdir .. "obj/t" .. i .. ".o.tmp"
+	writefile(tmp, "tmp" .. i)
+	os.remove(tmp)
+end
+posix.mkdir(srcdir .. "obj/tmpd")
+for i = 1, 100 do
+	writefile(srcdir .. "obj/tmpd/f" .. i, "tmpd" .. i)
+end
+os.execute("rm -rf " .. srcdir .. "obj/tmpd")
+writefile(srcdir .. "obj/out.o", "built")
+
+-- lets the status file be written before the delay is over
+posix.sleep(2)
+local queued = false
+local f = io.open(statusfile, "r")
+if f then
+	for line in f:lines() do
+		local n = line:match("^There are (%d+) delays")
+		if n then
+			queued = tonumber(n)
+		end
+	end
+	f:close()
+end
+cwriteln("queued delays: ", queued)
+
+cwriteln("waiting for Lsyncd to finish its jobs.")
+posix.sleep(8)
+
+cwriteln("killing the Lsyncd daemon")
+posix.kill(pid)
+posix.wait(pid)
+
+if not queued or queued > 5 then
+	cwriteln("failure: delays of temporary files are still queued")
+	os.exit(1)
+end
+
+exitcode = os.execute("diff -r "..srcdir.." "..trgdir)
+cwriteln("Exitcode of diff = '", exitcode, "'")
+if exitcode ~= 0 then
+	os.exit(1)
+else
+	os.exit(0)
+end
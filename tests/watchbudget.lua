@@ -0,0 +1,74 @@
+#!/usr/bin/lua
+-- Runs default.direct with a watch budget far below the size of the
+-- tree. Lsyncd has to poll the subtrees it cannot watch and must
+-- still mirror all changes.
+require("posix")
+dofile("tests/testlib.lua")
+
+cwriteln("****************************************************************")
+cwriteln(" Testing default.direct with a small inotify watch budget       ")
+cwriteln("****************************************************************")
+
+local tdir, srcdir, trgdir = mktemps()
+local logfile = tdir .. "log"
+local cfgfile = tdir .. "config.lua"
+local statusfile = tdir .. "status"
+
+-- makes some startup data
+churn(srcdir, 100)
+
+writefile(cfgfile, [[
+settings = {
+	logfile = "]]..logfile..[[",
+	statusFile = "]]..statusfile..[[",
+	statusInterval = 1,
+	nodaemon = true,
+	inotifyMaxWatches = 10,
+	inotifyPollInterval = 1,
+}
+
+sync {
+	default.direct,
+	source = "]]..srcdir..[[",
+	target = "]]..trgdir..[[",
+	delay = 1,
+}
+]]);
+
+local pid = spawn("./lsyncd", cfgfile, "-log", "Exec")
+
+cwriteln("waiting for Lsyncd to startup")
+posix.sleep(2)
+
+churn(srcdir, 500)
+
+cwriteln("waiting for Lsyncd to finish its jobs.")
+posix.sleep(15)
+
+cwriteln("killing the Lsyncd daemon")
+posix.kill(pid)
+posix.wait(pid)
+
+local polling = false
+local f = io.open(statusfile, "r")
+if f then
+	for line in f:lines() do
+		if line:match("^Inotify polling") then
+			cwriteln(line)
+			polling = true
+		end
+	end
+	f:close()
+end
+if not polling then
+	cwriteln("failure: no subtree has been polled")
+	os.exit(1)
+end
+
+exitcode = os.execute("diff -r "..srcdir.." "..trgdir)
+cwriteln("Exitcode of diff = '", exitcode, "'")
+if exitcode ~= 0 then
+	os.exit(1)
+else
+	os.exit(0)
+end